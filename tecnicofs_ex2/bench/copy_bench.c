@@ -0,0 +1,189 @@
+#include "client/tecnicofs_client_api.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*  Compares moving a multi-megabyte file between TecnicoFS and the client
+    with one request per chunk (tfs_read/tfs_write loops) against the
+    streaming copy requests (COPY_OUT through a FIFO the client reads,
+    COPY_IN from a file). The file is transferred 'rounds' times each way.
+    The server needs room for a file of 'file_bytes', e.g. with 16 KiB
+    blocks: tfs_server -b 16384 -B 1024 pipe.
+    Usage: copy_bench client_pipe_path server_pipe_path [file_bytes [rounds]] */
+
+#define DEFAULT_FILE_SIZE (8 * 1024 * 1024)
+#define DEFAULT_ROUNDS (3)
+/* how long the FIFO's reader waits for the server to start writing */
+#define COPY_START_TIMEOUT_MS (5000)
+
+static char const *path = "/copy_bench";
+static char chunk[TFS_MAX_PAYLOAD];
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void report(char const *method, size_t bytes, size_t requests, double seconds) {
+    printf("%-12s %10zu bytes %8zu requests %8.3f s %9.2f MiB/s\n", method, bytes, requests, seconds,
+           (double)bytes / (1024.0 * 1024.0) / seconds);
+}
+
+static void fail(char const *what) {
+    fprintf(stderr, "copy_bench: %s failed\n", what);
+    exit(1);
+}
+
+/*
+ * Streams the file out through the FIFO: the FIFO is open for reading
+ * before the request is sent, as the server does not wait for a reader.
+ * Returns the number of bytes read from it
+ */
+static size_t copy_out_through(tfs_client_t *client, char const *fifo, size_t file_size) {
+    int fd = open(fifo, O_RDONLY | O_NONBLOCK);
+    tfs_ticket_t ticket = fd == -1 ? -1 : tfs_submit_copy_out(client, path, fifo, NULL, NULL);
+    /* a FIFO no writer opened yet reads as empty: wait for the server */
+    struct pollfd data = {.fd = fd, .events = POLLIN};
+    if (ticket == -1 || poll(&data, 1, COPY_START_TIMEOUT_MS) != 1 ||
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) == -1) {
+        fail("copy out");
+    }
+    size_t bytes = 0;
+    ssize_t r;
+    while ((r = read(fd, chunk, sizeof(chunk))) > 0) {
+        bytes += (size_t)r;
+    }
+    if (r == -1 || close(fd) == -1 || tfs_wait(client, ticket) != (ssize_t)file_size || bytes != file_size) {
+        fail("copy out");
+    }
+    return bytes;
+}
+
+int main(int argc, char **argv) {
+    char fifo[40];
+    char external[40];
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path [file_bytes [rounds]]'\n");
+        return 1;
+    }
+    size_t file_size = argc > 3 ? (size_t)strtoull(argv[3], NULL, 10) : DEFAULT_FILE_SIZE;
+    size_t rounds = argc > 4 ? (size_t)strtoull(argv[4], NULL, 10) : DEFAULT_ROUNDS;
+    snprintf(fifo, sizeof(fifo), "/tmp/tfs_copy_bench.%d", (int)getpid());
+    snprintf(external, sizeof(external), "/tmp/tfs_copy_bench.%d.f", (int)getpid());
+
+    tfs_client_t *client = tfs_client_mount(argv[1], argv[2]);
+    if (client == NULL) {
+        fail("mount");
+    }
+
+    /* one file of file_size bytes */
+    memset(chunk, 'x', sizeof(chunk));
+    int f = tfs_client_open(client, path, TFS_O_CREAT | TFS_O_TRUNC);
+    for (size_t left = file_size; f != -1 && left > 0;) {
+        ssize_t w = tfs_client_write(client, f, chunk, left < sizeof(chunk) ? left : sizeof(chunk));
+        if (w <= 0) {
+            fprintf(stderr, "copy_bench: the server has no room for a file of %zu bytes\n", file_size);
+            exit(1);
+        }
+        left -= (size_t)w;
+    }
+    if (f == -1 || tfs_client_close(client, f) == -1) {
+        fail("setup");
+    }
+    printf("file size %zu bytes, %zu transfers\n", file_size, rounds);
+
+    /* out, one request per chunk */
+    size_t bytes = 0, requests = 0;
+    double start = now();
+    for (size_t i = 0; i < rounds; i++) {
+        f = tfs_client_open(client, path, 0);
+        ssize_t r;
+        while ((r = tfs_client_read(client, f, chunk, sizeof(chunk))) > 0) {
+            bytes += (size_t)r;
+            requests++;
+        }
+        if (f == -1 || r == -1 || tfs_client_close(client, f) == -1) {
+            fail("read loop");
+        }
+        requests += 3;
+    }
+    report("read-loop", bytes, requests, now() - start);
+
+    /* out, streamed through a FIFO */
+    unlink(fifo);
+    if (mkfifo(fifo, 0600) == -1) {
+        fail("mkfifo");
+    }
+    bytes = 0;
+    requests = 0;
+    start = now();
+    for (size_t i = 0; i < rounds; i++) {
+        bytes += copy_out_through(client, fifo, file_size);
+        requests++;
+    }
+    report("copy-out", bytes, requests, now() - start);
+    unlink(fifo);
+
+    /* in, one request per chunk */
+    bytes = 0;
+    requests = 0;
+    memset(chunk, 'y', sizeof(chunk));
+    start = now();
+    for (size_t i = 0; i < rounds; i++) {
+        f = tfs_client_open(client, path, TFS_O_TRUNC);
+        size_t left = file_size;
+        while (f != -1 && left > 0) {
+            ssize_t w = tfs_client_write(client, f, chunk, left < sizeof(chunk) ? left : sizeof(chunk));
+            if (w <= 0) {
+                fail("write loop");
+            }
+            left -= (size_t)w;
+            bytes += (size_t)w;
+            requests++;
+        }
+        if (f == -1 || tfs_client_close(client, f) == -1) {
+            fail("write loop");
+        }
+        requests += 2;
+    }
+    report("write-loop", bytes, requests, now() - start);
+
+    /* in, streamed from a file */
+    int fd = open(external, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    for (size_t left = file_size; fd != -1 && left > 0;) {
+        ssize_t w = write(fd, chunk, left < sizeof(chunk) ? left : sizeof(chunk));
+        if (w <= 0) {
+            fail("setup");
+        }
+        left -= (size_t)w;
+    }
+    if (fd == -1 || close(fd) == -1) {
+        fail("setup");
+    }
+    bytes = 0;
+    requests = 0;
+    start = now();
+    for (size_t i = 0; i < rounds; i++) {
+        ssize_t r = tfs_client_copy_in(client, external, path);
+        if (r != (ssize_t)file_size) {
+            fail("copy in");
+        }
+        bytes += (size_t)r;
+        requests++;
+    }
+    report("copy-in", bytes, requests, now() - start);
+    unlink(external);
+
+    if (tfs_client_unmount(client) == -1) {
+        fail("unmount");
+    }
+    return 0;
+}
@@ -0,0 +1,489 @@
+#include "fs/operations.h"
+#include "fs/metrics.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*  Microbenchmarks of the FS used as a library (no server involved).
+    Each benchmark runs for a fixed time on every requested number of
+    threads and reports the throughput, one line (CSV) or object (JSON) per
+    run, so that two runs can be compared mechanically:
+     - open:        tfs_open of an existing file (plus the tfs_close)
+     - lookup:      tfs_lookup of an existing file
+     - write:       64-byte tfs_write calls on a per-thread file (of one
+                   block, rewritten from the start when it is full)
+     - read:        64-byte tfs_read calls on a per-thread one-block file
+     - hole_read:   64-byte tfs_read calls on a per-thread sparse file of
+                   the largest size, holding a single block (at its end)
+     - inode_create: inode_create (plus the inode_delete)
+     - block_alloc: data_block_alloc (plus the data_block_free)
+     - create_write: tfs_open of a per-thread file with TFS_O_TRUNC, a
+                   256-byte tfs_write and a tfs_close (allocates and frees
+                   a block every time)
+     - block_write: like create_write, but writing BLOCK_WRITE_BLOCKS full
+                   blocks, with the same contents in every file (run with
+                   and without -d to see the cost and gain of deduplication)
+     - big_read:    whole-block tfs_read calls on a per-thread file of text,
+                   of BIG_READ_BLOCKS blocks (more than the block cache
+                   holds: run with and without -z to see the cost of
+                   decompressing)
+     - dir_hit:     tfs_lookup of the files of a directory filled with as
+                   many as fit (see -b and -I), named with a common prefix
+     - dir_miss:    tfs_lookup of names absent from that directory
+    The state functions are not thread-safe on their own, so their
+    benchmarks serialize calls with a mutex, as operations.c does.
+    Usage: fs_bench [-t threads,...] [-s seconds] [-D delay] [-d] [-z store_bytes]
+                    [-b block_size] [-I inodes] [-f csv|json] [benchmark ...]
+    where delay is the number of iterations of the storage delay loop
+    (0 disables it, the default is DELAY), -d turns on deduplication, -z
+    keeps the blocks compressed, in a store of that many bytes, and -b and
+    -I change the geometry (a directory has a block of entries, e.g.
+    -b 262144 -I 6000 for directories of thousands of files).
+    Each benchmark can be run alone under perf to look at the cache
+    behaviour, e.g.
+        perf stat -e cache-misses,cache-references ./bench/fs_bench -D 0 -t 4 create_write */
+
+#define MAX_BENCH_THREADS (16)
+#define OP_SIZE (64)
+/* how many operations run between checks of the clock */
+#define BATCH (16)
+#define BLOCK_WRITE_BLOCKS (4)
+#define BIG_READ_BLOCKS (2 * BLOCK_CACHE_FRAMES)
+
+typedef struct {
+    char const *name;
+    /* sets up thread 'id' (before the clock starts); returns 0 if successful */
+    int (*prepare)(int id);
+    /* runs one operation; returns 0 if successful */
+    int (*run)(int id);
+    /* cleans up thread 'id' (after the clock stops); returns 0 if successful */
+    int (*finish)(int id);
+} benchmark_t;
+
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_barrier_t start_barrier;
+static atomic_bool stop;
+static atomic_uint_least64_t errors;
+
+static int handles[MAX_BENCH_THREADS];
+static size_t offsets[MAX_BENCH_THREADS];
+static char data[BLOCK_SIZE];
+
+static void file_name(char *path, size_t len, int id) { snprintf(path, len, "/bench%d", id); }
+
+static int prepare_shared(int id) {
+    (void)id;
+    int f = tfs_open("/bench", TFS_O_CREAT);
+    return f == -1 ? -1 : tfs_close(f);
+}
+
+static int run_open(int id) {
+    (void)id;
+    int f = tfs_open("/bench", 0);
+    return f == -1 ? -1 : tfs_close(f);
+}
+
+static int run_lookup(int id) {
+    (void)id;
+    return tfs_lookup("/bench") == -1 ? -1 : 0;
+}
+
+static int prepare_write(int id) {
+    char path[MAX_FILE_NAME];
+    file_name(path, sizeof(path), id);
+    handles[id] = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    offsets[id] = 0;
+    return handles[id] == -1 ? -1 : 0;
+}
+
+/* when the block is full, writing restarts at 0 */
+static int run_write(int id) {
+    if (offsets[id] + OP_SIZE > sizeof(data)) {
+        if (tfs_seek(handles[id], 0) == -1) {
+            return -1;
+        }
+        offsets[id] = 0;
+    }
+    ssize_t w = tfs_write(handles[id], data, OP_SIZE);
+    offsets[id] += OP_SIZE;
+    return w == OP_SIZE ? 0 : -1;
+}
+
+static int prepare_read(int id) {
+    if (prepare_write(id) == -1) {
+        return -1;
+    }
+    if (tfs_write(handles[id], data, sizeof(data)) != sizeof(data) || tfs_close(handles[id]) == -1) {
+        return -1;
+    }
+    char path[MAX_FILE_NAME];
+    file_name(path, sizeof(path), id);
+    handles[id] = tfs_open(path, 0);
+    return handles[id] == -1 ? -1 : 0;
+}
+
+static int prepare_hole_read(int id) {
+    if (prepare_write(id) == -1) {
+        return -1;
+    }
+    if (tfs_seek(handles[id], state_max_file_size() - 1) == -1 || tfs_write(handles[id], data, 1) != 1 ||
+        tfs_seek(handles[id], 0) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/* at the end of the file, reading restarts at 0 */
+static int run_read(int id) {
+    char buffer[OP_SIZE];
+    ssize_t r = tfs_read(handles[id], buffer, sizeof(buffer));
+    if (r > 0) {
+        return 0;
+    }
+    return r == -1 ? -1 : tfs_seek(handles[id], 0);
+}
+
+static int prepare_big_read(int id) {
+    if (prepare_write(id) == -1) {
+        return -1;
+    }
+    char block[BLOCK_SIZE];
+    for (size_t i = 0; i < BIG_READ_BLOCKS; i++) {
+        size_t used = 0;
+        for (size_t line = 0; used < sizeof(block); line++) {
+            char text[64];
+            int n = snprintf(text, sizeof(text), "thread %d, block %zu, line %zu\n", id, i, line);
+            size_t len = (size_t)n < sizeof(block) - used ? (size_t)n : sizeof(block) - used;
+            memcpy(block + used, text, len);
+            used += len;
+        }
+        if (tfs_write(handles[id], block, sizeof(block)) != sizeof(block)) {
+            return -1;
+        }
+    }
+    return tfs_seek(handles[id], 0);
+}
+
+/* at the end of the file, reading restarts at 0 */
+static int run_big_read(int id) {
+    char buffer[BLOCK_SIZE];
+    ssize_t r = tfs_read(handles[id], buffer, sizeof(buffer));
+    if (r > 0) {
+        return 0;
+    }
+    return r == -1 ? -1 : tfs_seek(handles[id], 0);
+}
+
+/* names of the files in the directory (the first dir_files), and of as
+ * many absent ones; kept from run to run */
+static char (*dir_names)[MAX_FILE_NAME];
+static size_t dir_files;
+static bool dir_filled;
+static pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* fills the directory once per run, before any thread runs */
+static int prepare_dir(int id) {
+    (void)id;
+    pthread_mutex_lock(&dir_lock);
+    int r = 0;
+    if (dir_names == NULL) {
+        dir_names = malloc(2 * MAX_DIR_ENTRIES * sizeof(*dir_names));
+        for (size_t i = 0; dir_names != NULL && i < 2 * MAX_DIR_ENTRIES; i++) {
+            snprintf(dir_names[i], sizeof(*dir_names), "/file_%06zu", i);
+        }
+    }
+    if (dir_names == NULL) {
+        r = -1;
+    } else if (!dir_filled) {
+        /* as many files as there are entries or i-nodes for */
+        int f;
+        for (dir_files = 0; dir_files < MAX_DIR_ENTRIES && (f = tfs_open(dir_names[dir_files], TFS_O_CREAT)) != -1;
+             dir_files++) {
+            tfs_close(f);
+        }
+        dir_filled = true;
+        r = dir_files == 0 ? -1 : 0;
+    }
+    pthread_mutex_unlock(&dir_lock);
+    return r;
+}
+
+static int finish_dir(int id) {
+    (void)id;
+    pthread_mutex_lock(&dir_lock);
+    dir_filled = false;
+    pthread_mutex_unlock(&dir_lock);
+    return 0;
+}
+
+static int run_dir_lookup(int id, size_t first) {
+    offsets[id] = (offsets[id] + 1) % dir_files;
+    return tfs_lookup(dir_names[first + offsets[id]]) == -1 ? -1 : 0;
+}
+
+static int run_dir_hit(int id) { return run_dir_lookup(id, 0); }
+
+static int run_dir_miss(int id) { return run_dir_lookup(id, dir_files) == -1 ? 0 : -1; }
+
+static int run_create_write(int id) {
+    char path[MAX_FILE_NAME];
+    file_name(path, sizeof(path), id);
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    if (f == -1) {
+        return -1;
+    }
+    ssize_t w = tfs_write(f, data, 256);
+    return tfs_close(f) == -1 || w != 256 ? -1 : 0;
+}
+
+static int run_block_write(int id) {
+    char path[MAX_FILE_NAME];
+    file_name(path, sizeof(path), id);
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    if (f == -1) {
+        return -1;
+    }
+    ssize_t w = 0;
+    for (int i = 0; i < BLOCK_WRITE_BLOCKS && w != -1; i++) {
+        w = tfs_write(f, data, sizeof(data)) == sizeof(data) ? w + 1 : -1;
+    }
+    return tfs_close(f) == -1 || w == -1 ? -1 : 0;
+}
+
+static int close_handle(int id) { return tfs_close(handles[id]); }
+
+static int run_inode_create(int id) {
+    (void)id;
+    pthread_mutex_lock(&state_lock);
+    int inumber = inode_create(T_FILE);
+    int r = inumber == -1 ? -1 : inode_delete(inumber);
+    pthread_mutex_unlock(&state_lock);
+    return r;
+}
+
+static int run_block_alloc(int id) {
+    (void)id;
+    pthread_mutex_lock(&state_lock);
+    int block = data_block_alloc();
+    int r = block == -1 ? -1 : data_block_free(block);
+    pthread_mutex_unlock(&state_lock);
+    return r;
+}
+
+static benchmark_t const benchmarks[] = {
+    {"open", prepare_shared, run_open, NULL},
+    {"lookup", prepare_shared, run_lookup, NULL},
+    {"write", prepare_write, run_write, close_handle},
+    {"read", prepare_read, run_read, close_handle},
+    {"hole_read", prepare_hole_read, run_read, close_handle},
+    {"inode_create", NULL, run_inode_create, NULL},
+    {"block_alloc", NULL, run_block_alloc, NULL},
+    {"create_write", NULL, run_create_write, NULL},
+    {"block_write", NULL, run_block_write, NULL},
+    {"big_read", prepare_big_read, run_big_read, close_handle},
+    {"dir_hit", prepare_dir, run_dir_hit, finish_dir},
+    {"dir_miss", prepare_dir, run_dir_miss, finish_dir},
+};
+#define N_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+typedef struct {
+    benchmark_t const *benchmark;
+    int id;
+    uint64_t ops;
+} worker_t;
+
+static void *run_worker(void *arg) {
+    worker_t *worker = arg;
+    benchmark_t const *b = worker->benchmark;
+
+    if (b->prepare != NULL && b->prepare(worker->id) == -1) {
+        atomic_fetch_add(&errors, 1);
+    }
+    pthread_barrier_wait(&start_barrier);
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        for (int i = 0; i < BATCH; i++) {
+            if (b->run(worker->id) == -1) {
+                atomic_fetch_add(&errors, 1);
+            }
+        }
+        worker->ops += BATCH;
+    }
+    if (b->finish != NULL && b->finish(worker->id) == -1) {
+        atomic_fetch_add(&errors, 1);
+    }
+    return NULL;
+}
+
+static void sleep_for(double seconds) {
+    struct timespec ts = {(time_t)seconds, (long)((seconds - (double)(time_t)seconds) * 1e9)};
+    while (nanosleep(&ts, &ts) == -1) {
+    }
+}
+
+static int parse_threads(char const *spec, int *counts, int *n) {
+    char copy[128];
+    if (strlen(spec) >= sizeof(copy)) {
+        return -1;
+    }
+    strcpy(copy, spec);
+    *n = 0;
+    char *saveptr;
+    for (char *item = strtok_r(copy, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+        int t = atoi(item);
+        if (t < 1 || t > MAX_BENCH_THREADS || *n == MAX_BENCH_THREADS) {
+            return -1;
+        }
+        counts[(*n)++] = t;
+    }
+    return *n > 0 ? 0 : -1;
+}
+
+static void usage(char const *argv0) {
+    fprintf(stderr, "Usage: %s [-t threads,...] [-s seconds] [-D delay] [-d] [-z store_bytes] [-b block_size] "
+                    "[-I inodes] [-f csv|json] [benchmark ...]\n",
+            argv0);
+    fprintf(stderr, "benchmarks:");
+    for (size_t b = 0; b < N_BENCHMARKS; b++) {
+        fprintf(stderr, " %s", benchmarks[b].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv) {
+    int thread_counts[MAX_BENCH_THREADS] = {1, 2, 4};
+    int n_counts = 3;
+    double seconds = 1.0;
+    int delay = DELAY;
+    bool json = false;
+    tfs_params params = tfs_default_params();
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:s:D:dz:b:I:f:")) != -1) {
+        switch (opt) {
+            case 't':
+                if (parse_threads(optarg, thread_counts, &n_counts) == -1) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 's':
+                seconds = strtod(optarg, NULL);
+                break;
+            case 'D':
+                delay = atoi(optarg);
+                break;
+            case 'd':
+                params.dedup = true;
+                break;
+            case 'z':
+                params.store_size = (size_t)strtoull(optarg, NULL, 10);
+                break;
+            case 'b':
+                params.block_size = (size_t)strtoull(optarg, NULL, 10);
+                break;
+            case 'I':
+                params.max_inode_count = (size_t)strtoull(optarg, NULL, 10);
+                break;
+            case 'f':
+                if (strcmp(optarg, "json") != 0 && strcmp(optarg, "csv") != 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                json = strcmp(optarg, "json") == 0;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (seconds <= 0 || delay < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    bool selected[N_BENCHMARKS];
+    for (size_t b = 0; b < N_BENCHMARKS; b++) {
+        selected[b] = optind == argc;
+    }
+    for (int a = optind; a < argc; a++) {
+        size_t b = 0;
+        while (b < N_BENCHMARKS && strcmp(argv[a], benchmarks[b].name) != 0) {
+            b++;
+        }
+        if (b == N_BENCHMARKS) {
+            usage(argv[0]);
+            return 1;
+        }
+        selected[b] = true;
+    }
+
+    memset(data, 'x', sizeof(data));
+    if (json) {
+        printf("[\n");
+    } else {
+        printf("benchmark,threads,delay,dedup,store,ops,seconds,ops_per_sec,ns_per_op,errors\n");
+    }
+
+    bool first = true;
+    int failed = 0;
+    for (size_t b = 0; b < N_BENCHMARKS; b++) {
+        if (!selected[b]) {
+            continue;
+        }
+        for (int c = 0; c < n_counts; c++) {
+            int threads = thread_counts[c];
+            pthread_t tids[MAX_BENCH_THREADS];
+            worker_t workers[MAX_BENCH_THREADS];
+
+            /* every run starts from an empty FS */
+            if (tfs_init(&params) == -1) {
+                fprintf(stderr, "fs_bench: tfs_init failed\n");
+                return 1;
+            }
+            state_set_delay(delay);
+            atomic_store(&stop, false);
+            atomic_store(&errors, 0);
+            pthread_barrier_init(&start_barrier, NULL, (unsigned int)threads + 1);
+            for (int t = 0; t < threads; t++) {
+                workers[t] = (worker_t){&benchmarks[b], t, 0};
+                pthread_create(&tids[t], NULL, run_worker, &workers[t]);
+            }
+            pthread_barrier_wait(&start_barrier);
+            uint64_t start = metrics_now();
+            sleep_for(seconds);
+            atomic_store(&stop, true);
+            uint64_t ops = 0;
+            for (int t = 0; t < threads; t++) {
+                pthread_join(tids[t], NULL);
+                ops += workers[t].ops;
+            }
+            double elapsed = (double)(metrics_now() - start) / 1e9;
+            pthread_barrier_destroy(&start_barrier);
+            tfs_destroy();
+
+            uint64_t errs = atomic_load(&errors);
+            failed |= errs > 0;
+            double rate = (double)ops / elapsed;
+            if (json) {
+                printf("%s  {\"benchmark\": \"%s\", \"threads\": %d, \"delay\": %d, \"dedup\": %d, "
+                       "\"store\": %zu, \"ops\": %llu, \"seconds\": %.3f, \"ops_per_sec\": %.1f, "
+                       "\"ns_per_op\": %.1f, \"errors\": %llu}",
+                       first ? "" : ",\n", benchmarks[b].name, threads, delay, params.dedup, params.store_size,
+                       (unsigned long long)ops, elapsed, rate, 1e9 / rate, (unsigned long long)errs);
+            } else {
+                printf("%s,%d,%d,%d,%zu,%llu,%.3f,%.1f,%.1f,%llu\n", benchmarks[b].name, threads, delay,
+                       params.dedup, params.store_size, (unsigned long long)ops, elapsed, rate, 1e9 / rate, (unsigned long long)errs);
+            }
+            first = false;
+            fflush(stdout);
+        }
+    }
+    if (json) {
+        printf("\n]\n");
+    }
+    return failed ? 1 : 0;
+}
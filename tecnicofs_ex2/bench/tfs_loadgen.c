@@ -0,0 +1,369 @@
+#include "client/tecnicofs_client_api.h"
+#include "fs/metrics.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*  Load generator for a running tfs_server.
+    Each client (a thread, or a process with -p) mounts its own session and
+    runs transactions drawn from a workload mix for a fixed duration:
+     - open:  open an existing file and close it
+     - write: open a file, write 16 to 256 bytes and close it (TecnicoFS has
+              no seek, so small writes land at the start of a random file)
+     - read:  open a file of FILE_SIZE bytes, read it sequentially in large
+              chunks, close it
+     - churn: create a scratch file, write to it, close it and unlink it
+    It reports transactions/s and, per operation, ops/s and latency
+    percentiles. With -c, the clients cache what they read (see
+    tfs_client_mount_with).
+    Usage: tfs_loadgen [-n clients] [-p] [-c] [-d seconds] [-m mix]
+                       [-w weights] [-s seed] client_pipe_prefix
+                       server_pipe_path
+    where mix is one of open-heavy, small-writes, large-reads, churn or mixed
+    and weights overrides it, e.g. -w open=50,write=20,read=20,churn=10 */
+
+#define MAX_LOAD_CLIENTS (64)
+#define FILES_PER_CLIENT (3)
+#define CHURN_FILES (2)
+/* size of the client's files (one block of the default geometry) */
+#define FILE_SIZE (1024)
+
+enum { T_OPEN, T_WRITE, T_READ, T_CHURN, TRANSACTION_TYPES };
+
+static char const *const transaction_names[TRANSACTION_TYPES] = {"open", "write", "read", "churn"};
+
+static char const *const op_names[METRICS_OPS] = {
+    [TFS_OP_CODE_OPEN] = "open",
+    [TFS_OP_CODE_CLOSE] = "close",
+    [TFS_OP_CODE_WRITE] = "write",
+    [TFS_OP_CODE_READ] = "read",
+    [TFS_OP_CODE_UNLINK] = "unlink",
+};
+
+typedef struct {
+    char const *name;
+    unsigned int weights[TRANSACTION_TYPES];
+} mix_t;
+
+static mix_t const mixes[] = {
+    {"open-heavy", {80, 10, 10, 0}}, {"small-writes", {10, 80, 10, 0}}, {"large-reads", {10, 0, 90, 0}},
+    {"churn", {20, 0, 0, 80}},       {"mixed", {25, 25, 25, 25}},
+};
+
+/* results of one client, in memory shared with the parent */
+typedef struct {
+    metrics_histogram_t latency[METRICS_OPS];
+    atomic_uint_least64_t transactions;
+    atomic_uint_least64_t errors;
+    atomic_int failed;
+} client_stats_t;
+
+static struct {
+    int clients;
+    bool processes;
+    bool read_cache;
+    unsigned int duration;
+    unsigned int weights[TRANSACTION_TYPES];
+    unsigned int weight_total;
+    unsigned int seed;
+    char const *client_prefix;
+    char const *server_pipe;
+} config = {2, false, false, 10, {25, 25, 25, 25}, 100, 1, NULL, NULL};
+
+static client_stats_t *stats;
+
+static char chunk[TFS_MAX_PAYLOAD];
+
+/* xorshift32: cheap and independent per client */
+static unsigned int next_random(unsigned int *state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/*
+ * Times a request and records its latency (or counts the error).
+ */
+#define TIMED(st, op_code, result, call)                                                                    \
+    do {                                                                                                     \
+        uint64_t start_ = metrics_now();                                                                     \
+        result = (call);                                                                                     \
+        metrics_histogram_record(&(st)->latency[op_code], metrics_now() - start_);                          \
+        if (result == -1) {                                                                                  \
+            atomic_fetch_add(&(st)->errors, 1);                                                              \
+        }                                                                                                    \
+    } while (0)
+
+static void run_transaction(tfs_client_t *client, client_stats_t *st, int id, unsigned int *rng, int type) {
+    char path[40];
+    ssize_t r;
+    int f;
+
+    if (type == T_CHURN) {
+        snprintf(path, sizeof(path), "/lg%dc%u", id, next_random(rng) % CHURN_FILES);
+    } else {
+        snprintf(path, sizeof(path), "/lg%d_%u", id, next_random(rng) % FILES_PER_CLIENT);
+    }
+
+    int flags = type == T_CHURN ? TFS_O_CREAT | TFS_O_TRUNC : 0;
+    TIMED(st, TFS_OP_CODE_OPEN, f, tfs_client_open(client, path, flags));
+    if (f == -1) {
+        return;
+    }
+
+    switch (type) {
+        case T_WRITE:
+        case T_CHURN:
+            TIMED(st, TFS_OP_CODE_WRITE, r, tfs_client_write(client, f, chunk, 16 + next_random(rng) % 241));
+            break;
+        case T_READ:
+            do {
+                TIMED(st, TFS_OP_CODE_READ, r, tfs_client_read(client, f, chunk, sizeof(chunk)));
+            } while (r > 0);
+            break;
+        default:
+            break;
+    }
+
+    TIMED(st, TFS_OP_CODE_CLOSE, r, tfs_client_close(client, f));
+    if (type == T_CHURN) {
+        TIMED(st, TFS_OP_CODE_UNLINK, r, tfs_client_unlink(client, path));
+    }
+    atomic_fetch_add(&st->transactions, 1);
+}
+
+static int pick_transaction(unsigned int *rng) {
+    unsigned int x = next_random(rng) % config.weight_total;
+    for (int t = 0; t < TRANSACTION_TYPES; t++) {
+        if (x < config.weights[t]) {
+            return t;
+        }
+        x -= config.weights[t];
+    }
+    return T_OPEN;
+}
+
+/*
+ * Creates the client's files, FILE_SIZE bytes each.
+ * Returns 0 if successful, -1 otherwise
+ */
+static int setup_files(tfs_client_t *client, int id) {
+    char path[40];
+    for (int k = 0; k < FILES_PER_CLIENT; k++) {
+        snprintf(path, sizeof(path), "/lg%d_%d", id, k);
+        int f = tfs_client_open(client, path, TFS_O_CREAT | TFS_O_TRUNC);
+        if (f == -1) {
+            return -1;
+        }
+        ssize_t w = tfs_client_write(client, f, chunk, FILE_SIZE);
+        if (tfs_client_close(client, f) == -1 || w != FILE_SIZE) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void *run_client(void *arg) {
+    int id = (int)(intptr_t)arg;
+    client_stats_t *st = &stats[id];
+    char client_pipe[40];
+    unsigned int rng = config.seed * 2654435761u + (unsigned int)id + 1;
+
+    snprintf(client_pipe, sizeof(client_pipe), "%s.%d", config.client_prefix, id);
+    tfs_session_options_t options = {.service_class = TFS_CLASS_NORMAL, .weight = 1, .read_cache = config.read_cache};
+    tfs_client_t *client = tfs_client_mount_with(client_pipe, config.server_pipe, &options);
+    if (client == NULL) {
+        fprintf(stderr, "tfs_loadgen: client %d could not mount\n", id);
+        atomic_store(&st->failed, 1);
+        return NULL;
+    }
+    if (setup_files(client, id) == -1) {
+        fprintf(stderr, "tfs_loadgen: client %d could not create its files\n", id);
+        atomic_store(&st->failed, 1);
+        tfs_client_unmount(client);
+        return NULL;
+    }
+
+    uint64_t end = metrics_now() + (uint64_t)config.duration * 1000000000ULL;
+    while (metrics_now() < end) {
+        run_transaction(client, st, id, &rng, pick_transaction(&rng));
+    }
+
+    if (tfs_client_unmount(client) == -1) {
+        atomic_store(&st->failed, 1);
+    }
+    return NULL;
+}
+
+static int parse_weights(char const *spec) {
+    char copy[128];
+    unsigned int weights[TRANSACTION_TYPES] = {0};
+
+    if (strlen(spec) >= sizeof(copy)) {
+        return -1;
+    }
+    strcpy(copy, spec);
+    char *saveptr;
+    for (char *item = strtok_r(copy, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+        char *eq = strchr(item, '=');
+        if (eq == NULL) {
+            return -1;
+        }
+        *eq = '\0';
+        int t = 0;
+        while (t < TRANSACTION_TYPES && strcmp(item, transaction_names[t]) != 0) {
+            t++;
+        }
+        if (t == TRANSACTION_TYPES) {
+            return -1;
+        }
+        weights[t] = (unsigned int)strtoul(eq + 1, NULL, 10);
+    }
+    memcpy(config.weights, weights, sizeof(weights));
+    return 0;
+}
+
+static int parse_mix(char const *name) {
+    for (size_t m = 0; m < sizeof(mixes) / sizeof(mixes[0]); m++) {
+        if (strcmp(name, mixes[m].name) == 0) {
+            memcpy(config.weights, mixes[m].weights, sizeof(config.weights));
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void usage(char const *argv0) {
+    fprintf(stderr,
+            "Usage: %s [-n clients] [-p] [-c] [-d seconds] [-m open-heavy|small-writes|large-reads|churn|mixed]\n"
+            "          [-w open=W,write=W,read=W,churn=W] [-s seed] client_pipe_prefix server_pipe_path\n",
+            argv0);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:pcd:m:w:s:")) != -1) {
+        switch (opt) {
+            case 'n':
+                config.clients = atoi(optarg);
+                break;
+            case 'p':
+                config.processes = true;
+                break;
+            case 'c':
+                config.read_cache = true;
+                break;
+            case 'd':
+                config.duration = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                if (parse_mix(optarg) == -1) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'w':
+                if (parse_weights(optarg) == -1) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 's':
+                config.seed = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind < 2 || config.clients < 1 || config.clients > MAX_LOAD_CLIENTS) {
+        usage(argv[0]);
+        return 1;
+    }
+    config.client_prefix = argv[optind];
+    config.server_pipe = argv[optind + 1];
+    config.weight_total = 0;
+    for (int t = 0; t < TRANSACTION_TYPES; t++) {
+        config.weight_total += config.weights[t];
+    }
+    if (config.weight_total == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    memset(chunk, 'x', sizeof(chunk));
+
+    /* shared with the clients, whether they are threads or processes */
+    int zero = open("/dev/zero", O_RDWR);
+    stats = mmap(NULL, sizeof(client_stats_t) * (size_t)config.clients, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 zero, 0);
+    close(zero);
+    if (stats == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    uint64_t start = metrics_now();
+    if (config.processes) {
+        for (int i = 0; i < config.clients; i++) {
+            pid_t pid = fork();
+            if (pid == -1) {
+                perror("fork");
+                return 1;
+            }
+            if (pid == 0) {
+                run_client((void *)(intptr_t)i);
+                _exit(0);
+            }
+        }
+        while (wait(NULL) > 0) {
+        }
+    } else {
+        pthread_t threads[MAX_LOAD_CLIENTS];
+        for (int i = 0; i < config.clients; i++) {
+            pthread_create(&threads[i], NULL, run_client, (void *)(intptr_t)i);
+        }
+        for (int i = 0; i < config.clients; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    double elapsed = (double)(metrics_now() - start) / 1e9;
+
+    static metrics_histogram_t total[METRICS_OPS];
+    uint64_t transactions = 0, errors = 0;
+    int failed = 0;
+    for (int i = 0; i < config.clients; i++) {
+        for (int op = 0; op < METRICS_OPS; op++) {
+            metrics_histogram_merge(&total[op], &stats[i].latency[op]);
+        }
+        transactions += atomic_load(&stats[i].transactions);
+        errors += atomic_load(&stats[i].errors);
+        failed += atomic_load(&stats[i].failed);
+    }
+
+    printf("clients %d (%s), %.2f s, weights open=%u write=%u read=%u churn=%u\n", config.clients,
+           config.processes ? "processes" : "threads", elapsed, config.weights[T_OPEN], config.weights[T_WRITE],
+           config.weights[T_READ], config.weights[T_CHURN]);
+    printf("transactions %llu (%.1f/s), errors %llu, failed clients %d\n", (unsigned long long)transactions,
+           (double)transactions / elapsed, (unsigned long long)errors, failed);
+    printf("%-8s %10s %10s %10s %10s %10s\n", "op", "count", "ops/s", "p50_us", "p99_us", "p999_us");
+    for (int op = 0; op < METRICS_OPS; op++) {
+        uint64_t n = metrics_histogram_samples(&total[op]);
+        if (n == 0) {
+            continue;
+        }
+        printf("%-8s %10llu %10.1f %10.1f %10.1f %10.1f\n", op_names[op] != NULL ? op_names[op] : "?",
+               (unsigned long long)n, (double)n / elapsed,
+               (double)metrics_histogram_percentile(&total[op], 0.5) / 1e3,
+               (double)metrics_histogram_percentile(&total[op], 0.99) / 1e3,
+               (double)metrics_histogram_percentile(&total[op], 0.999) / 1e3);
+    }
+    return failed > 0 ? 1 : 0;
+}
@@ -2,192 +2,1091 @@
 #include "fcntl.h"
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #define MAX_FILE_NAME (40)
 
-char const* server_pipe_name;
-char client_pipe_name[40];
-unsigned int client_session;
-int server_pipe;
-int client_pipe;
-void* message_buffer;
-int success;
+/*
+ * Outstanding request
+ * Its slot in the context is seq % TFS_MAX_INFLIGHT, so replies are matched
+ * in constant time; the rest of seq is a generation count that tells apart
+ * successive uses of the slot.
+ */
+typedef struct {
+    bool in_use;
+    bool done;
+    unsigned int seq;
+    unsigned int generation;
+    void *read_buffer;
+    size_t read_len;
+    tfs_callback_t callback;
+    void *arg;
+    ssize_t result;
+    LeaseGrant opened; /* the file opened, in a session caching reads */
+} pending_t;
 
-int tfs_mount(char const *client_pipe_path, char const *server_pipe_path) {
-    char op_code = '1';
+/*
+ * Read cache (see tfs_client_mount_with)
+ * Blocks of leased files, direct-mapped by file and index, and the handles
+ * read through it. A cached read does not move the server's offset of the
+ * handle, so the offset is kept here, and the server's is set (by a seek)
+ * before the handle is next used otherwise. A lease request outstanding
+ * while a recall arrives may carry data older than the recall, which is
+ * then not cached: recalls are counted to tell.
+ */
+#define CACHE_BLOCKS (64)
+#define CACHE_HANDLES (32)
+
+typedef struct {
+    bool valid;
+    int inumber;
+    unsigned int generation;
+    size_t index;
+    size_t len; /* less than a whole block if the file ended there */
+    char data[TFS_LEASE_BLOCK_SIZE];
+} cached_block_t;
+
+typedef struct {
+    bool in_use;
+    int fhandle;
+    size_t offset;
+    bool synced; /* whether the server's offset is the same */
+    int inumber; /* of the file */
+    unsigned int generation;
+} cached_handle_t;
+
+typedef struct {
+    unsigned long recalls;
+    cached_handle_t handles[CACHE_HANDLES];
+    cached_block_t blocks[CACHE_BLOCKS];
+} read_cache_t;
+
+/*
+ * Session context
+ * The lock protects the pending table and the request frame; requests are
+ * written to the server pipe with it held, so frames never interleave.
+ * Replies are read by a single thread at a time (the one that set
+ * 'reading'), without the lock; the others wait on 'progress' for it to
+ * complete their requests. The lock also protects the read cache.
+ */
+struct tfs_client {
+    unsigned int session_id;
+    int server_pipe;
+    int client_pipe;
+    char client_pipe_name[MAX_FILE_NAME];
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+    bool reading;
+    bool broken;
+    pending_t pending[TFS_MAX_INFLIGHT];
+    read_cache_t *cache; /* NULL if reads are not cached */
+    /* reusable request frame, large enough for any request */
+    char frame[TFS_MAX_FRAME_SIZE];
+};
+
+static tfs_client_t default_client;
+
+/* offset of the arguments in a request frame */
+#define FRAME_ARGS (sizeof(char) + 2 * sizeof(unsigned int))
+
+/*
+ * Reads exactly len bytes from a pipe.
+ * Returns 0 if successful, -1 otherwise
+ */
+static int read_all(int fd, void *buffer, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = read(fd, (char *)buffer + done, len - done);
+        if (r <= 0) {
+            return -1;
+        }
+        done += (size_t)r;
+    }
+    return 0;
+}
+
+static int client_mount(tfs_client_t *client, char const *client_pipe_path, char const *server_pipe_path,
+                        tfs_session_options_t const *options) {
+    char op_code = TFS_OP_CODE_MOUNT;
     struct Mount message;
-    message_buffer = (void*) malloc(sizeof(char) * (MAX_FILE_NAME + 1));
+    tfs_session_options_t defaults = {.service_class = TFS_CLASS_NORMAL, .weight = 1, .rate = 0};
+    Reply reply;
 
-    memset(client_pipe_name, '\0', MAX_FILE_NAME);
-    strcpy(client_pipe_name, client_pipe_path);
-    server_pipe_name = server_pipe_path;
+    if (strlen(client_pipe_path) >= MAX_FILE_NAME) {
+        return -1;
+    }
+    memset(client->client_pipe_name, '\0', MAX_FILE_NAME);
+    strcpy(client->client_pipe_name, client_pipe_path);
+    memset(client->pending, 0, sizeof(client->pending));
+    client->reading = false;
+    client->broken = false;
+    client->cache = NULL;
+    if (options != NULL && options->read_cache && (client->cache = calloc(1, sizeof(read_cache_t))) == NULL) {
+        return -1;
+    }
+    if (pthread_mutex_init(&client->lock, NULL) != 0 || pthread_cond_init(&client->progress, NULL) != 0) {
+        return -1;
+    }
 
     unlink(client_pipe_path);
     if (mkfifo(client_pipe_path, 0777) == -1) {
         return -1;
     }
-    strcpy(message.client_pipe_path, client_pipe_name);
-    memcpy(message_buffer, &op_code, sizeof(char));
-    memcpy(message_buffer + sizeof(char), &message.client_pipe_path, MAX_FILE_NAME);
+    memset(message.client_pipe_path, '\0', MAX_FILE_NAME);
+    strcpy(message.client_pipe_path, client->client_pipe_name);
+    memcpy(client->frame, &op_code, sizeof(char));
+    memcpy(client->frame + sizeof(char), &message.client_pipe_path, MAX_FILE_NAME);
+    memcpy(client->frame + sizeof(char) + MAX_FILE_NAME, options != NULL ? options : &defaults,
+           sizeof(tfs_session_options_t));
 
-    if ((server_pipe = open(server_pipe_name, O_WRONLY)) == -1) {
+    if ((client->server_pipe = open(server_pipe_path, O_WRONLY)) == -1) {
         return -1;
     }
-    if (write(server_pipe, message_buffer, MAX_FILE_NAME + 1) == -1) {
+    if (write(client->server_pipe, client->frame, sizeof(char) + MAX_FILE_NAME + sizeof(tfs_session_options_t)) ==
+        -1) {
+        close(client->server_pipe);
         return -1;
     }
-    free(message_buffer);
-    if ((client_pipe = open(client_pipe_path, O_RDONLY)) == -1) {
+    if ((client->client_pipe = open(client_pipe_path, O_RDONLY)) == -1) {
+        close(client->server_pipe);
         return -1;
     }
-    if (read(client_pipe, &client_session, sizeof(int)) == -1) {
+    if (read_all(client->client_pipe, &reply, sizeof(Reply)) == -1 || reply.result == -1) {
+        close(client->server_pipe);
+        close(client->client_pipe);
+        unlink(client_pipe_path);
         return -1;
     }
-    if (client_session == -1) { 
+    client->session_id = (unsigned int)reply.result;
+    return 0;
+}
+
+/*
+ * Drops what is cached of a file, whose lease was recalled.
+ * Must be called with the context's lock held.
+ */
+static void recall(read_cache_t *cache, int inumber) {
+    cache->recalls++;
+    for (size_t i = 0; i < CACHE_BLOCKS; i++) {
+        if (cache->blocks[i].inumber == inumber) {
+            cache->blocks[i].valid = false;
+        }
+    }
+}
+
+/*
+ * Reads one reply and completes the request it answers (or applies a lease
+ * recall).
+ * Must be called with the context's lock held, by the reading thread; the
+ * lock is released while blocked on the pipe and while running a callback.
+ * Returns 0 if successful, -1 otherwise
+ */
+static int dispatch_reply(tfs_client_t *client) {
+    Reply reply;
+
+    pthread_mutex_unlock(&client->lock);
+    int r = read_all(client->client_pipe, &reply, sizeof(Reply));
+    pthread_mutex_lock(&client->lock);
+    if (r == -1) {
         return -1;
     }
+    if (reply.seq == 0) {
+        if (client->cache != NULL) {
+            recall(client->cache, (int)reply.result);
+        }
+        return 0;
+    }
+
+    pending_t *p = &client->pending[reply.seq % TFS_MAX_INFLIGHT];
+    if (!p->in_use || p->done || p->seq != reply.seq) {
+        return -1;
+    }
+    /* the data of a read is as long as its result; that of an open is a
+     * LeaseGrant */
+    size_t data_len = 0;
+    if (p->read_buffer == &p->opened) {
+        data_len = reply.result != -1 ? sizeof(LeaseGrant) : 0;
+    } else if (p->read_buffer != NULL && reply.result > 0) {
+        data_len = (size_t)reply.result;
+    }
+    if (data_len > 0) {
+        if (data_len > p->read_len) {
+            return -1;
+        }
+        /* the slot is not reused before it completes, so it is safe to fill
+         * its buffer without the lock */
+        pthread_mutex_unlock(&client->lock);
+        r = read_all(client->client_pipe, p->read_buffer, data_len);
+        pthread_mutex_lock(&client->lock);
+        if (r == -1) {
+            return -1;
+        }
+    }
+
+    if (p->callback != NULL) {
+        tfs_callback_t callback = p->callback;
+        void *arg = p->arg;
+        p->in_use = false;
+        pthread_mutex_unlock(&client->lock);
+        callback((tfs_ticket_t)reply.seq, reply.result, arg);
+        pthread_mutex_lock(&client->lock);
+    } else {
+        p->result = reply.result;
+        p->done = true;
+    }
     return 0;
 }
 
-int tfs_unmount() { 
-    char op_code = '2';
-    struct Unmount message;
-    message_buffer = (void*)malloc(sizeof(char) + sizeof(int));
+/*
+ * Makes progress on the context's outstanding requests: either reads one
+ * reply or, if another thread is reading, waits for it to complete one.
+ * Must be called with the context's lock held.
+ * Returns 0 if successful, -1 if the session is broken
+ */
+static int make_progress(tfs_client_t *client) {
+    if (client->broken) {
+        return -1;
+    }
+    if (client->reading) {
+        pthread_cond_wait(&client->progress, &client->lock);
+        return client->broken ? -1 : 0;
+    }
+
+    client->reading = true;
+    if (dispatch_reply(client) == -1) {
+        client->broken = true;
+    }
+    client->reading = false;
+    pthread_cond_broadcast(&client->progress);
+    return client->broken ? -1 : 0;
+}
 
-    memcpy(message_buffer, &op_code, sizeof(op_code));
-    message.session_id = client_session;
-    memcpy(message_buffer + sizeof(char), &message.session_id, sizeof(int));
+/*
+ * Takes a free slot, waiting for replies if every slot is outstanding.
+ * Must be called with the context's lock held.
+ * Returns the slot's index, or -1 if every slot holds a completed request
+ * that was never collected (or in case of error)
+ */
+static int take_slot(tfs_client_t *client) {
+    while (1) {
+        bool waiting = false;
+        for (int i = 0; i < TFS_MAX_INFLIGHT; i++) {
+            if (!client->pending[i].in_use) {
+                return i;
+            }
+            waiting = waiting || !client->pending[i].done;
+        }
+        if (!waiting || make_progress(client) == -1) {
+            return -1;
+        }
+    }
+}
 
-    if (write(server_pipe, message_buffer, 1 + sizeof(int)) == -1 || close(server_pipe) == -1) {
+/*
+ * Sends a request and registers it as outstanding.
+ * Input:
+ *  - client: the session's context
+ *  - op_code: the request's op code
+ *  - args, args_len: the request's arguments
+ *  - data, data_len: data following the arguments (for a write)
+ *  - read_buffer, read_len: where the data of the reply goes (for a read)
+ *  - callback, arg: completion callback
+ * Returns the request's ticket, or -1 in case of error
+ */
+static tfs_ticket_t submit(tfs_client_t *client, char op_code, void const *args, size_t args_len,
+                           void const *data, size_t data_len, void *read_buffer, size_t read_len,
+                           tfs_callback_t callback, void *arg) {
+    pthread_mutex_lock(&client->lock);
+    int slot = take_slot(client);
+    if (slot == -1) {
+        pthread_mutex_unlock(&client->lock);
         return -1;
     }
-    if (read(client_pipe, &success, sizeof(int)) == -1) {
-        return -1;
+    pending_t *p = &client->pending[slot];
+
+    /* seq is kept within the range of a ticket and is never 0 (mount) */
+    p->generation = p->generation % ((unsigned int)INT_MAX / TFS_MAX_INFLIGHT - 1) + 1;
+    p->seq = p->generation * TFS_MAX_INFLIGHT + (unsigned int)slot;
+    p->read_buffer = read_buffer;
+    p->read_len = read_len;
+    p->callback = callback;
+    p->arg = arg;
+    p->done = false;
+    if (op_code == TFS_OP_CODE_OPEN && client->cache != NULL) {
+        p->read_buffer = &p->opened;
+        p->read_len = sizeof(LeaseGrant);
     }
-    if (success == -1 || close(client_pipe) == -1 || unlink(client_pipe_name) == -1) {
+
+    memcpy(client->frame, &op_code, sizeof(char));
+    memcpy(client->frame + sizeof(char), &client->session_id, sizeof(unsigned int));
+    memcpy(client->frame + sizeof(char) + sizeof(unsigned int), &p->seq, sizeof(unsigned int));
+    if (args_len > 0) {
+        memcpy(client->frame + FRAME_ARGS, args, args_len);
+    }
+    if (data_len > 0) {
+        memcpy(client->frame + FRAME_ARGS + args_len, data, data_len);
+    }
+    if (write(client->server_pipe, client->frame, FRAME_ARGS + args_len + data_len) == -1) {
+        pthread_mutex_unlock(&client->lock);
         return -1;
     }
-    free(message_buffer);
-    return success;
+    p->in_use = true;
+    tfs_ticket_t ticket = (tfs_ticket_t)p->seq;
+    pthread_mutex_unlock(&client->lock);
+    return ticket;
 }
 
-int tfs_open(char const *name, int flags) {
-    char op_code = '3';
-    struct Open message;
-    message_buffer = (void*)malloc(sizeof(char) + 2 * sizeof(int) + MAX_FILE_NAME);
+tfs_client_t *tfs_client_mount(char const *client_pipe_path, char const *server_pipe_path) {
+    return tfs_client_mount_with(client_pipe_path, server_pipe_path, NULL);
+}
 
-    memcpy(message_buffer, &op_code, sizeof(char));
-    message.session_id = client_session;
-    memset(message.name, '\0', MAX_FILE_NAME);
-    strcpy(message.name, name);
-    message.flags = flags;
-    memcpy(message_buffer + sizeof(char), &message.session_id, sizeof(int));
-    memcpy(message_buffer + sizeof(char) + sizeof(int), &message.name, MAX_FILE_NAME);
-    memcpy(message_buffer + sizeof(char) + sizeof(int) + MAX_FILE_NAME, &message.flags, sizeof(int));
+tfs_client_t *tfs_client_mount_with(char const *client_pipe_path, char const *server_pipe_path,
+                                    tfs_session_options_t const *options) {
+    tfs_client_t *client = malloc(sizeof(tfs_client_t));
+    if (client == NULL) {
+        return NULL;
+    }
+    if (client_mount(client, client_pipe_path, server_pipe_path, options) == -1) {
+        free(client->cache);
+        free(client);
+        return NULL;
+    }
+    return client;
+}
 
-    if (write(server_pipe, message_buffer, 1 + 2 * sizeof(int) + MAX_FILE_NAME) == -1) {
+static int client_unmount(tfs_client_t *client) {
+    /* every outstanding request is answered before the session ends */
+    pthread_mutex_lock(&client->lock);
+    for (int i = 0; i < TFS_MAX_INFLIGHT; i++) {
+        while (client->pending[i].in_use && !client->pending[i].done) {
+            if (make_progress(client) == -1) {
+                pthread_mutex_unlock(&client->lock);
+                return -1;
+            }
+        }
+        client->pending[i].in_use = false;
+    }
+    pthread_mutex_unlock(&client->lock);
+
+    tfs_ticket_t ticket = submit(client, TFS_OP_CODE_UNMOUNT, NULL, 0, NULL, 0, NULL, 0, NULL, NULL);
+    if (ticket == -1 || tfs_wait(client, ticket) == -1) {
         return -1;
     }
-    //here success equals the file handle returned by the tfs_open in operations.c
-    if (read(client_pipe, &success, sizeof(int)) == -1) {
+    if (close(client->server_pipe) == -1 || close(client->client_pipe) == -1 ||
+        unlink(client->client_pipe_name) == -1) {
         return -1;
     }
-    free(message_buffer);
-    return success;
+    pthread_mutex_destroy(&client->lock);
+    pthread_cond_destroy(&client->progress);
+    return 0;
 }
 
-int tfs_close(int fhandle) {
-    char op_code = '4';
-    struct Close message;
-    message_buffer = (void*)malloc(sizeof(char) + 2 * sizeof(int));
+int tfs_client_unmount(tfs_client_t *client) {
+    int r = client_unmount(client);
+    free(client->cache);
+    free(client);
+    return r;
+}
+
+static tfs_ticket_t submit_seek(tfs_client_t *client, int fhandle, size_t offset, tfs_callback_t callback,
+                                void *arg) {
+    struct Seek message;
+    char args[sizeof(int) + sizeof(size_t)];
 
-    memcpy(message_buffer, &op_code, sizeof(op_code));
-    message.session_id = client_session;
     message.fhandle = fhandle;
-    memcpy(message_buffer + sizeof(char), &message.session_id, sizeof(int));
-    memcpy(message_buffer + sizeof(char) + sizeof(int), &message.fhandle, sizeof(int));
+    message.offset = offset;
+    memcpy(args, &message.fhandle, sizeof(int));
+    memcpy(args + sizeof(int), &message.offset, sizeof(size_t));
+    return submit(client, TFS_OP_CODE_SEEK, args, sizeof(args), NULL, 0, NULL, 0, callback, arg);
+}
 
-    if (write(server_pipe, message_buffer, sizeof(char) + 2 * sizeof(int)) == -1) {
-        return -1;
+/*
+ * Returns the read cache's entry of a handle, or NULL if the handle is not
+ * read through the cache.
+ * Must be called with the context's lock held.
+ */
+static cached_handle_t *cached_handle(tfs_client_t *client, int fhandle) {
+    if (client->cache == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < CACHE_HANDLES; i++) {
+        cached_handle_t *h = &client->cache->handles[i];
+        if (h->in_use && h->fhandle == fhandle) {
+            return h;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Starts reading a handle just opened, of a file, through the cache, if
+ * there is room for it (otherwise it is read from the server).
+ */
+static void track_handle(tfs_client_t *client, int fhandle, LeaseGrant const *file) {
+    pthread_mutex_lock(&client->lock);
+    cached_handle_t *h = cached_handle(client, fhandle);
+    for (size_t i = 0; h == NULL && i < CACHE_HANDLES; i++) {
+        if (!client->cache->handles[i].in_use) {
+            h = &client->cache->handles[i];
+        }
+    }
+    if (h != NULL) {
+        *h = (cached_handle_t){.in_use = true,
+                               .fhandle = fhandle,
+                               .synced = true,
+                               .inumber = file->inumber,
+                               .generation = file->generation};
     }
-    //success checks that this operation succeeded
-    if (read(client_pipe, &success, sizeof(int)) == -1 || success == -1) {
+    pthread_mutex_unlock(&client->lock);
+}
+
+/*
+ * Sets the server's offset of a handle read through the cache, if it is
+ * behind, and stops reading the handle through the cache if forget is set.
+ * Returns 0 if successful, -1 otherwise
+ */
+static int sync_handle(tfs_client_t *client, int fhandle, bool forget) {
+    pthread_mutex_lock(&client->lock);
+    cached_handle_t *h = cached_handle(client, fhandle);
+    bool seek = h != NULL && !h->synced;
+    size_t offset = h != NULL ? h->offset : 0;
+    if (h != NULL) {
+        h->synced = true;
+        h->in_use = !forget;
+    }
+    pthread_mutex_unlock(&client->lock);
+    if (seek && tfs_wait(client, submit_seek(client, fhandle, offset, NULL, NULL)) == -1) {
         return -1;
     }
-    free(message_buffer);
     return 0;
 }
 
-ssize_t tfs_write(int fhandle, void const *buffer, size_t len) {
-    char op_code = '5';
+/*
+ * Stops reading a handle through the cache, leaving the server's offset as
+ * it is (the handle is being closed or moved).
+ */
+static void forget_handle(tfs_client_t *client, int fhandle) {
+    pthread_mutex_lock(&client->lock);
+    cached_handle_t *h = cached_handle(client, fhandle);
+    if (h != NULL) {
+        h->in_use = false;
+    }
+    pthread_mutex_unlock(&client->lock);
+}
+
+tfs_ticket_t tfs_submit_open(tfs_client_t *client, char const *name, int flags, tfs_callback_t callback, void *arg) {
+    struct Open message;
+    char args[MAX_FILE_NAME + sizeof(int)];
+
+    if (strlen(name) >= MAX_FILE_NAME) {
+        return -1;
+    }
+    memset(message.name, '\0', MAX_FILE_NAME);
+    strcpy(message.name, name);
+    message.flags = flags;
+    memcpy(args, &message.name, MAX_FILE_NAME);
+    memcpy(args + MAX_FILE_NAME, &message.flags, sizeof(int));
+    return submit(client, TFS_OP_CODE_OPEN, args, sizeof(args), NULL, 0, NULL, 0, callback, arg);
+}
+
+tfs_ticket_t tfs_submit_close(tfs_client_t *client, int fhandle, tfs_callback_t callback, void *arg) {
+    forget_handle(client, fhandle);
+    return submit(client, TFS_OP_CODE_CLOSE, &fhandle, sizeof(int), NULL, 0, NULL, 0, callback, arg);
+}
+
+static tfs_ticket_t submit_write(tfs_client_t *client, int fhandle, void const *buffer, size_t len,
+                                 tfs_callback_t callback, void *arg) {
     struct Write message;
-    ssize_t count;
-    message_buffer = (void*)malloc(sizeof(char) + 2 * sizeof(int) + len);
+    char args[sizeof(int) + sizeof(size_t)];
 
-    char* temp_buffer = (char*)malloc(len);
-    memcpy(message_buffer, &op_code, sizeof(op_code));
-    message.session_id = client_session;
+    /* a request must fit in a single frame; the rest is a short write */
+    if (len > TFS_MAX_PAYLOAD) {
+        len = TFS_MAX_PAYLOAD;
+    }
     message.fhandle = fhandle;
     message.len = len;
+    memcpy(args, &message.fhandle, sizeof(int));
+    memcpy(args + sizeof(int), &message.len, sizeof(size_t));
+    return submit(client, TFS_OP_CODE_WRITE, args, sizeof(args), buffer, len, NULL, 0, callback, arg);
+}
+
+static tfs_ticket_t submit_read(tfs_client_t *client, int fhandle, void *buffer, size_t len,
+                                tfs_callback_t callback, void *arg) {
+    struct Read message;
+    char args[sizeof(int) + sizeof(size_t)];
 
-    memcpy(message_buffer + sizeof(char), &message.session_id, sizeof(int));
-    memcpy(message_buffer + sizeof(char) + sizeof(int), &message.fhandle, sizeof(int));
-    memcpy(message_buffer + sizeof(char) + 2 * sizeof(int), &message.len, sizeof(size_t));
-    memcpy(temp_buffer, buffer, len);
-    memcpy(message_buffer + sizeof(char) + 2 * sizeof(int) + sizeof(size_t), temp_buffer, len);
+    if (len > TFS_MAX_PAYLOAD) {
+        len = TFS_MAX_PAYLOAD;
+    }
+    message.fhandle = fhandle;
+    message.len = len;
+    memcpy(args, &message.fhandle, sizeof(int));
+    memcpy(args + sizeof(int), &message.len, sizeof(size_t));
+    return submit(client, TFS_OP_CODE_READ, args, sizeof(args), NULL, 0, buffer, len, callback, arg);
+}
 
-    if (write(server_pipe, message_buffer, len + 1 + 2 * sizeof(int) + sizeof(size_t)) == -1) {
+/* an async request on a handle read through the cache takes it out of it */
+
+tfs_ticket_t tfs_submit_write(tfs_client_t *client, int fhandle, void const *buffer, size_t len,
+                              tfs_callback_t callback, void *arg) {
+    if (sync_handle(client, fhandle, true) == -1) {
         return -1;
     }
-    if (read(client_pipe, &count, sizeof(ssize_t)) == -1) {
+    return submit_write(client, fhandle, buffer, len, callback, arg);
+}
+
+tfs_ticket_t tfs_submit_read(tfs_client_t *client, int fhandle, void *buffer, size_t len,
+                             tfs_callback_t callback, void *arg) {
+    if (sync_handle(client, fhandle, true) == -1) {
         return -1;
     }
-    free(message_buffer);
-    free(temp_buffer);
-    return count;
+    return submit_read(client, fhandle, buffer, len, callback, arg);
 }
 
-ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
-    char op_code = '6';
-    struct Read message;
-    message_buffer = (void*)malloc(sizeof(char) + 2 * sizeof(int) + sizeof(size_t));
+tfs_ticket_t tfs_submit_seek(tfs_client_t *client, int fhandle, size_t offset, tfs_callback_t callback, void *arg) {
+    forget_handle(client, fhandle);
+    return submit_seek(client, fhandle, offset, callback, arg);
+}
 
-    memcpy(message_buffer, &op_code, sizeof(op_code));
-    message.session_id = client_session;
-    message.fhandle = fhandle;
-    message.len = len;
-    memcpy(message_buffer + sizeof(char), &message.session_id, sizeof(int));
-    memcpy(message_buffer + sizeof(char) + sizeof(int), &message.fhandle, sizeof(int));
-    memcpy(message_buffer + sizeof(char) + 2 * sizeof(int), &message.len, sizeof(size_t));
+/*
+ * Submits a request on a range of an open file (a punch hole, a fallocate
+ * or an unlock).
+ */
+static tfs_ticket_t submit_range(tfs_client_t *client, char op_code, int fhandle, size_t offset, size_t len,
+                                 tfs_callback_t callback, void *arg) {
+    char args[sizeof(int) + 2 * sizeof(size_t)];
 
-    if (write(server_pipe, message_buffer, sizeof(char) + 2 * sizeof(int) + sizeof(size_t)) == -1) {
+    memcpy(args, &fhandle, sizeof(int));
+    memcpy(args + sizeof(int), &offset, sizeof(size_t));
+    memcpy(args + sizeof(int) + sizeof(size_t), &len, sizeof(size_t));
+    return submit(client, op_code, args, sizeof(args), NULL, 0, NULL, 0, callback, arg);
+}
+
+tfs_ticket_t tfs_submit_punch_hole(tfs_client_t *client, int fhandle, size_t offset, size_t len,
+                                   tfs_callback_t callback, void *arg) {
+    return submit_range(client, TFS_OP_CODE_PUNCH_HOLE, fhandle, offset, len, callback, arg);
+}
+
+tfs_ticket_t tfs_submit_fallocate(tfs_client_t *client, int fhandle, size_t offset, size_t len,
+                                  tfs_callback_t callback, void *arg) {
+    return submit_range(client, TFS_OP_CODE_FALLOCATE, fhandle, offset, len, callback, arg);
+}
+
+tfs_ticket_t tfs_submit_lock(tfs_client_t *client, int fhandle, size_t offset, size_t len, int flags,
+                             tfs_callback_t callback, void *arg) {
+    char args[2 * sizeof(int) + 2 * sizeof(size_t)];
+
+    memcpy(args, &fhandle, sizeof(int));
+    memcpy(args + sizeof(int), &offset, sizeof(size_t));
+    memcpy(args + sizeof(int) + sizeof(size_t), &len, sizeof(size_t));
+    memcpy(args + sizeof(int) + 2 * sizeof(size_t), &flags, sizeof(int));
+    return submit(client, TFS_OP_CODE_LOCK, args, sizeof(args), NULL, 0, NULL, 0, callback, arg);
+}
+
+tfs_ticket_t tfs_submit_unlock(tfs_client_t *client, int fhandle, size_t offset, size_t len,
+                               tfs_callback_t callback, void *arg) {
+    return submit_range(client, TFS_OP_CODE_UNLOCK, fhandle, offset, len, callback, arg);
+}
+
+/*
+ * Submits a request on two paths, which travel as fixed-size names: a
+ * rename, or a copy (TecnicoFS path first for a copy out and external path
+ * first for a copy in).
+ */
+static tfs_ticket_t submit_names(tfs_client_t *client, char op_code, char const *first, char const *second,
+                                tfs_callback_t callback, void *arg) {
+    char args[2 * MAX_FILE_NAME];
+
+    if (strlen(first) >= MAX_FILE_NAME || strlen(second) >= MAX_FILE_NAME) {
         return -1;
     }
-    if (read(client_pipe, buffer, len) == -1) {
+    memset(args, '\0', sizeof(args));
+    strcpy(args, first);
+    strcpy(args + MAX_FILE_NAME, second);
+    return submit(client, op_code, args, sizeof(args), NULL, 0, NULL, 0, callback, arg);
+}
+
+tfs_ticket_t tfs_submit_copy_out(tfs_client_t *client, char const *source_path, char const *dest_path,
+                                 tfs_callback_t callback, void *arg) {
+    return submit_names(client, TFS_OP_CODE_COPY_OUT, source_path, dest_path, callback, arg);
+}
+
+tfs_ticket_t tfs_submit_copy_in(tfs_client_t *client, char const *source_path, char const *dest_path,
+                                tfs_callback_t callback, void *arg) {
+    return submit_names(client, TFS_OP_CODE_COPY_IN, source_path, dest_path, callback, arg);
+}
+
+tfs_ticket_t tfs_submit_unlink(tfs_client_t *client, char const *name, tfs_callback_t callback, void *arg) {
+    struct Unlink message;
+
+    if (strlen(name) >= MAX_FILE_NAME) {
         return -1;
     }
-    free(message_buffer);
-    return (ssize_t)strlen(buffer);
+    memset(message.name, '\0', MAX_FILE_NAME);
+    strcpy(message.name, name);
+    return submit(client, TFS_OP_CODE_UNLINK, message.name, MAX_FILE_NAME, NULL, 0, NULL, 0, callback, arg);
 }
 
-int tfs_shutdown_after_all_closed() {
-    char op_code = '7';
-    struct Shutdown message;
-    message_buffer = (void*)malloc(sizeof(char) + sizeof(int));
+tfs_ticket_t tfs_submit_rename(tfs_client_t *client, char const *old_name, char const *new_name,
+                               tfs_callback_t callback, void *arg) {
+    return submit_names(client, TFS_OP_CODE_RENAME, old_name, new_name, callback, arg);
+}
 
-    memcpy(message_buffer, &op_code, sizeof(op_code));
-    message.session_id = client_session;
-    memcpy(message_buffer + sizeof(char), &message.session_id, sizeof(int));
+tfs_ticket_t tfs_submit_snapshot(tfs_client_t *client, char const *dest_path, tfs_callback_t callback, void *arg) {
+    struct Snapshot message;
 
-    if (write(server_pipe, message_buffer, sizeof(char) + sizeof(int)) == -1) {
+    if (strlen(dest_path) >= MAX_FILE_NAME) {
         return -1;
     }
-    if (read(client_pipe, &success, sizeof(int)) == -1 || success == -1) {
+    memset(message.external_path, '\0', MAX_FILE_NAME);
+    strcpy(message.external_path, dest_path);
+    return submit(client, TFS_OP_CODE_SNAPSHOT, message.external_path, MAX_FILE_NAME, NULL, 0, NULL, 0, callback,
+                  arg);
+}
+
+tfs_ticket_t tfs_submit_stats(tfs_client_t *client, char *buffer, size_t len, tfs_callback_t callback, void *arg) {
+    if (len > TFS_MAX_PAYLOAD) {
+        len = TFS_MAX_PAYLOAD;
+    }
+    return submit(client, TFS_OP_CODE_STATS, &len, sizeof(size_t), NULL, 0, buffer, len, callback, arg);
+}
+
+int tfs_poll(tfs_client_t *client) {
+    struct pollfd fd = {.fd = client->client_pipe, .events = POLLIN};
+    int completed = 0;
+
+    pthread_mutex_lock(&client->lock);
+    /* if another thread is reading, it will complete the ready replies */
+    while (!client->reading && poll(&fd, 1, 0) > 0 && (fd.revents & POLLIN)) {
+        if (make_progress(client) == -1) {
+            pthread_mutex_unlock(&client->lock);
+            return -1;
+        }
+        completed++;
+    }
+    pthread_mutex_unlock(&client->lock);
+    return completed;
+}
+
+/*
+ * Waits for a request submitted without a callback (see tfs_wait), giving
+ * the file it opened too if opened is not NULL.
+ */
+static ssize_t collect(tfs_client_t *client, tfs_ticket_t ticket, LeaseGrant *opened) {
+    if (ticket < 0) {
         return -1;
     }
-    free(message_buffer);
+    pthread_mutex_lock(&client->lock);
+    pending_t *p = &client->pending[(unsigned int)ticket % TFS_MAX_INFLIGHT];
+    if (!p->in_use || p->seq != (unsigned int)ticket || p->callback != NULL) {
+        pthread_mutex_unlock(&client->lock);
+        return -1;
+    }
+    while (!p->done) {
+        if (make_progress(client) == -1) {
+            pthread_mutex_unlock(&client->lock);
+            return -1;
+        }
+    }
+    p->in_use = false;
+    ssize_t result = p->result;
+    if (opened != NULL) {
+        *opened = p->opened;
+    }
+    pthread_mutex_unlock(&client->lock);
+    return result;
+}
+
+ssize_t tfs_wait(tfs_client_t *client, tfs_ticket_t ticket) { return collect(client, ticket, NULL); }
+
+/*
+ * Applies the lease recalls the server already sent, without blocking.
+ * Must be called with the context's lock held, while no thread is reading.
+ * Returns 0 if successful, -1 if the session is broken
+ */
+static int apply_recalls(tfs_client_t *client) {
+    struct pollfd fd = {.fd = client->client_pipe, .events = POLLIN};
+    while (poll(&fd, 1, 0) > 0 && (fd.revents & POLLIN)) {
+        if (make_progress(client) == -1) {
+            return -1;
+        }
+    }
     return 0;
 }
+
+static inline size_t block_slot(int inumber, size_t index) { return ((size_t)inumber * 31 + index) % CACHE_BLOCKS; }
+
+/*
+ * Reads a handle through the cache, a block at a time: a block cached is
+ * copied once the recalls already sent are applied (if another thread is
+ * reading replies, they cannot be, and it is leased again), and one not
+ * cached is leased and cached. A block shorter than TFS_LEASE_BLOCK_SIZE
+ * is where the file ends.
+ * Returns as tfs_client_read
+ */
+static ssize_t cached_read(tfs_client_t *client, int fhandle, char *buffer, size_t len) {
+    char reply[sizeof(LeaseGrant) + TFS_LEASE_BLOCK_SIZE];
+    read_cache_t *cache = client->cache;
+    size_t done = 0;
+
+    while (done < len) {
+        pthread_mutex_lock(&client->lock);
+        bool fresh = !client->reading;
+        if (fresh && apply_recalls(client) == -1) {
+            pthread_mutex_unlock(&client->lock);
+            return -1;
+        }
+        cached_handle_t *h = cached_handle(client, fhandle);
+        if (h == NULL) {
+            /* taken out of the cache meanwhile */
+            pthread_mutex_unlock(&client->lock);
+            ssize_t r = tfs_wait(client, submit_read(client, fhandle, buffer + done, len - done, NULL, NULL));
+            return r == -1 ? (done > 0 ? (ssize_t)done : -1) : (ssize_t)done + r;
+        }
+        size_t offset = h->offset;
+        size_t index = offset / TFS_LEASE_BLOCK_SIZE;
+        size_t within = offset % TFS_LEASE_BLOCK_SIZE;
+        cached_block_t *b = &cache->blocks[block_slot(h->inumber, index)];
+        if (fresh && b->valid && b->inumber == h->inumber && b->generation == h->generation && b->index == index) {
+            size_t n = within < b->len ? b->len - within : 0;
+            n = n < len - done ? n : len - done;
+            memcpy(buffer + done, b->data + within, n);
+            done += n;
+            h->offset += n;
+            h->synced = h->synced && n == 0;
+            bool end = b->len < TFS_LEASE_BLOCK_SIZE && within + n >= b->len;
+            pthread_mutex_unlock(&client->lock);
+            if (end) {
+                break;
+            }
+            continue;
+        }
+        unsigned long recalls = cache->recalls;
+        pthread_mutex_unlock(&client->lock);
+
+        struct Lease message = {.fhandle = fhandle, .offset = index * TFS_LEASE_BLOCK_SIZE};
+        char args[sizeof(int) + sizeof(size_t)];
+        memcpy(args, &message.fhandle, sizeof(int));
+        memcpy(args + sizeof(int), &message.offset, sizeof(size_t));
+        ssize_t r = tfs_wait(client, submit(client, TFS_OP_CODE_LEASE, args, sizeof(args), NULL, 0, reply,
+                                            sizeof(reply), NULL, NULL));
+        if (r < (ssize_t)sizeof(LeaseGrant)) {
+            return done > 0 ? (ssize_t)done : -1;
+        }
+        LeaseGrant grant;
+        memcpy(&grant, reply, sizeof(LeaseGrant));
+        char const *data = reply + sizeof(LeaseGrant);
+        size_t block_len = (size_t)r - sizeof(LeaseGrant);
+        size_t n = within < block_len ? block_len - within : 0;
+        n = n < len - done ? n : len - done;
+        memcpy(buffer + done, data + within, n);
+        done += n;
+
+        pthread_mutex_lock(&client->lock);
+        /* data leased before the last recall arrived may be older than it */
+        if (grant.leased && cache->recalls == recalls) {
+            b = &cache->blocks[block_slot(grant.inumber, index)];
+            *b = (cached_block_t){.valid = true, .inumber = grant.inumber, .generation = grant.generation,
+                                  .index = index, .len = block_len};
+            memcpy(b->data, data, block_len);
+        }
+        h = cached_handle(client, fhandle);
+        if (h != NULL) {
+            h->inumber = grant.inumber;
+            h->generation = grant.generation;
+            h->offset = offset + n;
+            h->synced = h->synced && n == 0;
+        }
+        pthread_mutex_unlock(&client->lock);
+        if (block_len < TFS_LEASE_BLOCK_SIZE && within + n >= block_len) {
+            break;
+        }
+    }
+    return (ssize_t)done;
+}
+
+int tfs_client_open(tfs_client_t *client, char const *name, int flags) {
+    LeaseGrant opened;
+    int fhandle = (int)collect(client, tfs_submit_open(client, name, flags, NULL, NULL), &opened);
+    /* the offset of a handle appending is not known */
+    if (fhandle != -1 && client->cache != NULL && !(flags & TFS_O_APPEND)) {
+        track_handle(client, fhandle, &opened);
+    }
+    return fhandle;
+}
+
+int tfs_client_close(tfs_client_t *client, int fhandle) {
+    return (int)tfs_wait(client, tfs_submit_close(client, fhandle, NULL, NULL));
+}
+
+ssize_t tfs_client_write(tfs_client_t *client, int fhandle, void const *buffer, size_t len) {
+    if (sync_handle(client, fhandle, false) == -1) {
+        return -1;
+    }
+    ssize_t r = tfs_wait(client, submit_write(client, fhandle, buffer, len, NULL, NULL));
+    if (r > 0 && client->cache != NULL) {
+        pthread_mutex_lock(&client->lock);
+        cached_handle_t *h = cached_handle(client, fhandle);
+        if (h != NULL) {
+            h->offset += (size_t)r;
+        }
+        pthread_mutex_unlock(&client->lock);
+    }
+    return r;
+}
+
+ssize_t tfs_client_read(tfs_client_t *client, int fhandle, void *buffer, size_t len) {
+    if (client->cache != NULL) {
+        return cached_read(client, fhandle, buffer, len);
+    }
+    return tfs_wait(client, submit_read(client, fhandle, buffer, len, NULL, NULL));
+}
+
+int tfs_client_shutdown_after_all_closed(tfs_client_t *client) {
+    tfs_ticket_t ticket =
+        submit(client, TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED, NULL, 0, NULL, 0, NULL, 0, NULL, NULL);
+    return (int)tfs_wait(client, ticket);
+}
+
+int tfs_client_seek(tfs_client_t *client, int fhandle, size_t offset) {
+    int r = (int)tfs_wait(client, submit_seek(client, fhandle, offset, NULL, NULL));
+    if (r != -1 && client->cache != NULL) {
+        pthread_mutex_lock(&client->lock);
+        cached_handle_t *h = cached_handle(client, fhandle);
+        if (h != NULL) {
+            h->offset = offset;
+            h->synced = true;
+        }
+        pthread_mutex_unlock(&client->lock);
+    }
+    return r;
+}
+
+int tfs_client_punch_hole(tfs_client_t *client, int fhandle, size_t offset, size_t len) {
+    return (int)tfs_wait(client, tfs_submit_punch_hole(client, fhandle, offset, len, NULL, NULL));
+}
+
+int tfs_client_fallocate(tfs_client_t *client, int fhandle, size_t offset, size_t len) {
+    return (int)tfs_wait(client, tfs_submit_fallocate(client, fhandle, offset, len, NULL, NULL));
+}
+
+int tfs_client_unlink(tfs_client_t *client, char const *name) {
+    return (int)tfs_wait(client, tfs_submit_unlink(client, name, NULL, NULL));
+}
+
+int tfs_client_rename(tfs_client_t *client, char const *old_name, char const *new_name) {
+    return (int)tfs_wait(client, tfs_submit_rename(client, old_name, new_name, NULL, NULL));
+}
+
+ssize_t tfs_client_copy_out(tfs_client_t *client, char const *source_path, char const *dest_path) {
+    return tfs_wait(client, tfs_submit_copy_out(client, source_path, dest_path, NULL, NULL));
+}
+
+ssize_t tfs_client_copy_in(tfs_client_t *client, char const *source_path, char const *dest_path) {
+    return tfs_wait(client, tfs_submit_copy_in(client, source_path, dest_path, NULL, NULL));
+}
+
+int tfs_client_snapshot(tfs_client_t *client, char const *dest_path) {
+    return (int)tfs_wait(client, tfs_submit_snapshot(client, dest_path, NULL, NULL));
+}
+
+int tfs_client_stat(tfs_client_t *client, char const *name, tfs_stat_t *st) {
+    struct Stat message;
+
+    if (strlen(name) >= MAX_FILE_NAME) {
+        return -1;
+    }
+    memset(message.name, '\0', MAX_FILE_NAME);
+    strcpy(message.name, name);
+    tfs_ticket_t ticket =
+        submit(client, TFS_OP_CODE_STAT, message.name, MAX_FILE_NAME, NULL, 0, st, sizeof(tfs_stat_t), NULL, NULL);
+    return tfs_wait(client, ticket) == sizeof(tfs_stat_t) ? 0 : -1;
+}
+
+int tfs_client_fstat(tfs_client_t *client, int fhandle, tfs_stat_t *st) {
+    tfs_ticket_t ticket =
+        submit(client, TFS_OP_CODE_FSTAT, &fhandle, sizeof(int), NULL, 0, st, sizeof(tfs_stat_t), NULL, NULL);
+    return tfs_wait(client, ticket) == sizeof(tfs_stat_t) ? 0 : -1;
+}
+
+/* a window of the directory, as answered (see DirChunk) */
+#define CHUNK_SIZE (sizeof(DirChunk) + TFS_READDIR_SLOTS * sizeof(tfs_dirent_t))
+
+/*
+ * Submits the listing of a window of the directory, answered in chunk.
+ */
+static tfs_ticket_t submit_readdir(tfs_client_t *client, size_t window, char *chunk) {
+    size_t first = window * TFS_READDIR_SLOTS;
+    return submit(client, TFS_OP_CODE_READDIR, &first, sizeof(size_t), NULL, 0, chunk, CHUNK_SIZE, NULL, NULL);
+}
+
+/*
+ * Appends the files of an answered window to a listing, up to max files.
+ * Returns the number of files listed, or -1 if the answer is malformed
+ */
+static ssize_t take_chunk(char const *chunk, ssize_t len, tfs_dirent_t *entries, size_t listed, size_t max) {
+    DirChunk header;
+    if (len < (ssize_t)sizeof(DirChunk)) {
+        return -1;
+    }
+    memcpy(&header, chunk, sizeof(DirChunk));
+    if (header.count > TFS_READDIR_SLOTS || (size_t)len != sizeof(DirChunk) + header.count * sizeof(tfs_dirent_t)) {
+        return -1;
+    }
+    size_t n = header.count < max - listed ? header.count : max - listed;
+    memcpy(entries + listed, chunk + sizeof(DirChunk), n * sizeof(tfs_dirent_t));
+    return (ssize_t)(listed + n);
+}
+
+ssize_t tfs_client_readdir_plus(tfs_client_t *client, tfs_dirent_t *entries, size_t max) {
+    /* the first window tells how many there are; the others are then asked
+     * for all at once */
+    char *chunk = malloc(CHUNK_SIZE);
+    if (chunk == NULL) {
+        return -1;
+    }
+    ssize_t len = tfs_wait(client, submit_readdir(client, 0, chunk));
+    ssize_t listed = take_chunk(chunk, len, entries, 0, max);
+    DirChunk header;
+    if (listed != -1) {
+        memcpy(&header, chunk, sizeof(DirChunk));
+    }
+    free(chunk);
+    if (listed == -1) {
+        return -1;
+    }
+    size_t windows = (header.slots + TFS_READDIR_SLOTS - 1) / TFS_READDIR_SLOTS;
+    if (windows <= 1) {
+        return listed;
+    }
+
+    char *chunks = malloc((windows - 1) * CHUNK_SIZE);
+    tfs_ticket_t *tickets = malloc((windows - 1) * sizeof(tfs_ticket_t));
+    size_t submitted = 0;
+    if (chunks == NULL || tickets == NULL) {
+        listed = -1;
+    }
+    for (; listed != -1 && submitted < windows - 1; submitted++) {
+        if ((tickets[submitted] = submit_readdir(client, submitted + 1, chunks + submitted * CHUNK_SIZE)) == -1) {
+            listed = -1;
+        }
+    }
+    /* every window submitted is waited for, as it is answered in chunks */
+    for (size_t w = 0; w < submitted; w++) {
+        len = tfs_wait(client, tickets[w]);
+        if (listed != -1) {
+            listed = take_chunk(chunks + w * CHUNK_SIZE, len, entries, (size_t)listed, max);
+        }
+    }
+    free(chunks);
+    free(tickets);
+    return listed;
+}
+
+int tfs_client_lock(tfs_client_t *client, int fhandle, size_t offset, size_t len, int flags) {
+    return (int)tfs_wait(client, tfs_submit_lock(client, fhandle, offset, len, flags, NULL, NULL));
+}
+
+int tfs_client_unlock(tfs_client_t *client, int fhandle, size_t offset, size_t len) {
+    return (int)tfs_wait(client, tfs_submit_unlock(client, fhandle, offset, len, NULL, NULL));
+}
+
+ssize_t tfs_client_stats(tfs_client_t *client, char *buffer, size_t len) {
+    if (len == 0) {
+        return -1;
+    }
+    ssize_t r = tfs_wait(client, tfs_submit_stats(client, buffer, len - 1, NULL, NULL));
+    if (r >= 0) {
+        buffer[r] = '\0';
+    }
+    return r;
+}
+
+/* The original API, on the default context */
+
+int tfs_mount(char const *client_pipe_path, char const *server_pipe_path) {
+    return client_mount(&default_client, client_pipe_path, server_pipe_path, NULL);
+}
+
+int tfs_unmount() {
+    return client_unmount(&default_client);
+}
+
+int tfs_open(char const *name, int flags) {
+    return tfs_client_open(&default_client, name, flags);
+}
+
+int tfs_close(int fhandle) {
+    return tfs_client_close(&default_client, fhandle);
+}
+
+ssize_t tfs_write(int fhandle, void const *buffer, size_t len) {
+    return tfs_client_write(&default_client, fhandle, buffer, len);
+}
+
+ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+    return tfs_client_read(&default_client, fhandle, buffer, len);
+}
+
+int tfs_seek(int fhandle, size_t offset) {
+    return tfs_client_seek(&default_client, fhandle, offset);
+}
+
+int tfs_punch_hole(int fhandle, size_t offset, size_t len) {
+    return tfs_client_punch_hole(&default_client, fhandle, offset, len);
+}
+
+int tfs_fallocate(int fhandle, size_t offset, size_t len) {
+    return tfs_client_fallocate(&default_client, fhandle, offset, len);
+}
+
+int tfs_unlink(char const *name) {
+    return tfs_client_unlink(&default_client, name);
+}
+
+int tfs_rename(char const *old_name, char const *new_name) {
+    return tfs_client_rename(&default_client, old_name, new_name);
+}
+
+int tfs_shutdown_after_all_closed() {
+    return tfs_client_shutdown_after_all_closed(&default_client);
+}
+
+int tfs_copy_to_external_fs(char const *source_path, char const *dest_path) {
+    return tfs_client_copy_out(&default_client, source_path, dest_path) == -1 ? -1 : 0;
+}
+
+int tfs_copy_from_external_fs(char const *source_path, char const *dest_path) {
+    return tfs_client_copy_in(&default_client, source_path, dest_path) == -1 ? -1 : 0;
+}
+
+int tfs_snapshot_to_external_fs(char const *dest_path) {
+    return tfs_client_snapshot(&default_client, dest_path);
+}
+
+int tfs_stat(char const *name, tfs_stat_t *st) {
+    return tfs_client_stat(&default_client, name, st);
+}
+
+int tfs_fstat(int fhandle, tfs_stat_t *st) {
+    return tfs_client_fstat(&default_client, fhandle, st);
+}
+
+ssize_t tfs_readdir_plus(tfs_dirent_t *entries, size_t max) {
+    return tfs_client_readdir_plus(&default_client, entries, max);
+}
+
+int tfs_lock(int fhandle, size_t offset, size_t len, int flags) {
+    return tfs_client_lock(&default_client, fhandle, offset, len, flags);
+}
+
+int tfs_unlock(int fhandle, size_t offset, size_t len) {
+    return tfs_client_unlock(&default_client, fhandle, offset, len);
+}
+
+ssize_t tfs_stats(char *buffer, size_t len) {
+    return tfs_client_stats(&default_client, buffer, len);
+}
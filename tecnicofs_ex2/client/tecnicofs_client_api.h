@@ -73,10 +73,313 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/* Moves the offset of an open file, possibly past its end: writing there
+ * leaves a hole, which reads as zeros and takes no storage.
+ * Input:
+ *  - fhandle: file handle (obtained from a previous call to tfs_open)
+ *  - offset: the new offset
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_seek(int fhandle, size_t offset);
+
+/* Releases the storage of a range of an open file, which then reads as
+ * zeros; the file's size does not change.
+ * Input:
+ *  - fhandle: file handle (obtained from a previous call to tfs_open)
+ *  - offset, len: the range (in bytes)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_punch_hole(int fhandle, size_t offset, size_t len);
+
+/* Preallocates storage for a range of an open file (extending the file if
+ * the range goes past its end), so that writes to it cannot run out of
+ * space.
+ * Input:
+ *  - fhandle: file handle (obtained from a previous call to tfs_open)
+ *  - offset, len: the range (in bytes)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fallocate(int fhandle, size_t offset, size_t len);
+
+/* Removes a file. Its contents remain available through the file handles
+ * already open (in any session) and are freed when the last one is closed.
+ * Input:
+ *  - name: absolute path name
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_unlink(char const *name);
+
+/* Renames a file; another file that already has the new name is replaced
+ * (as if unlinked first).
+ * Input:
+ *  - old_name: absolute path name of the file
+ *  - new_name: its new absolute path name
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_rename(char const *old_name, char const *new_name);
+
 /*
  * Orders TecnicoFS server to wait until no file is open and then shutdown
  * Returns 0 if successful, -1 otherwise.
  */
 int tfs_shutdown_after_all_closed();
 
+/* Paths outside TecnicoFS are opened by the server, with its privileges but
+ * on the client's behalf: only in a directory owned by the owner of the
+ * client's pipe, and only files of that user (or created by the request).
+ * Symbolic links are not followed, and relative paths are resolved by the
+ * server. */
+
+/* Copies a whole file from TecnicoFS to a file outside TecnicoFS, in a
+ * single request: the server opens dest_path (creating or truncating a
+ * regular file) and streams the contents into it. dest_path may be a FIFO
+ * created by the client, which must then be open for reading by the time
+ * the server opens it, and read concurrently (e.g. by submitting the request
+ * asynchronously, see below); a reader that stalls for COPY_STALL_TIMEOUT_MS
+ * (see fs/config.h) fails the copy.
+ * Input:
+ *  - source_path: path name of the source file (in TecnicoFS)
+ *  - dest_path: path name of the destination (outside TecnicoFS)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_copy_to_external_fs(char const *source_path, char const *dest_path);
+
+/* Copies a whole file from outside TecnicoFS into a file in TecnicoFS (which
+ * is created if needed, and truncated if it already exists), in a single
+ * request: the server opens source_path, which must be a regular file, and
+ * reads it until end of file.
+ * Input:
+ *  - source_path: path name of the source (outside TecnicoFS)
+ *  - dest_path: path name of the destination file (in TecnicoFS)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_copy_from_external_fs(char const *source_path, char const *dest_path);
+
+/* Takes a copy-on-write snapshot of the whole TecnicoFS, which the server
+ * then writes in the background as an image (see tfs_snapshot_export in
+ * fs/operations.h) to a regular file outside TecnicoFS, without holding
+ * back other requests. Returns as soon as the snapshot is taken: the image is complete
+ * once a new snapshot can be taken.
+ * Input:
+ *  - dest_path: path name of the image (outside TecnicoFS)
+ * Returns 0 if successful, -1 otherwise (including while the previous
+ * snapshot is still being written).
+ */
+int tfs_snapshot_to_external_fs(char const *dest_path);
+
+/* Gets the attributes of a file: its i-node number, size and the data
+ * blocks it takes (see tfs_stat_t).
+ * Input:
+ *  - name: absolute path name
+ *  - st: filled with the attributes
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_stat(char const *name, tfs_stat_t *st);
+
+/* Gets the attributes of an open file (see tfs_stat).
+ * Input:
+ *  - fhandle: file handle (obtained from a previous call to tfs_open)
+ *  - st: filled with the attributes
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fstat(int fhandle, tfs_stat_t *st);
+
+/* Lists the files with their names and attributes (see tfs_stat), taking
+ * two round trips to the server whatever the size of the directory. Files
+ * created, unlinked or renamed meanwhile may be listed or not.
+ * Input:
+ *  - entries: filled with the files
+ *  - max: the most files to list
+ * Returns the number of files listed, or -1 in case of error.
+ */
+ssize_t tfs_readdir_plus(tfs_dirent_t *entries, size_t max);
+
+/* Locks a range of an open file, waiting while it conflicts with the locks
+ * of other handles (see tfs_lock in fs/operations.h). Locks are advisory,
+ * and are released by tfs_unlock or when the handle is closed. No thread
+ * of the server waits meanwhile: the session's other requests, submitted
+ * by other threads, are served.
+ * Input:
+ *  - fhandle: file handle (obtained from a previous call to tfs_open)
+ *  - offset, len: the range (a len of 0 for every byte from offset on)
+ *  - flags: TFS_LOCK_SHARED or TFS_LOCK_EXCLUSIVE, and TFS_LOCK_NOWAIT to
+ *    fail rather than wait
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_lock(int fhandle, size_t offset, size_t len, int flags);
+
+/* Unlocks a range of an open file, named as it was locked (see tfs_lock).
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_unlock(int fhandle, size_t offset, size_t len);
+
+/*
+ * Gets the server's metrics report: event counters and, per operation,
+ * latency percentiles of queueing, execution and reply.
+ * Input:
+ *  - buffer: destination of the report (as text, null-terminated)
+ *  - len: length of the buffer
+ * Returns the length of the report (truncated to fit), or -1 in case of
+ * error.
+ */
+ssize_t tfs_stats(char *buffer, size_t len);
+
+/*
+ * Session contexts
+ * Each mounted session is a tfs_client_t context, holding the session id,
+ * both pipes and the buffers used to talk to the server. A process may mount
+ * several sessions, and every function taking a context is thread-safe, so
+ * N threads can either share one session or drive N sessions in parallel.
+ * The functions above are equivalent to the ones below on a default context.
+ *
+ * Requests may also be submitted without waiting for the server; each is
+ * identified by a ticket, and up to TFS_MAX_INFLIGHT requests may be
+ * outstanding per context. Replies are matched to tickets by sequence
+ * number whenever the context is polled or waited on (submitting also
+ * consumes replies when the context is full). A request completes either by
+ * invoking its callback (if one was given) or by being collected with
+ * tfs_wait, never both.
+ */
+typedef struct tfs_client tfs_client_t;
+typedef int tfs_ticket_t;
+
+/*
+ * Completion callback
+ * Input:
+ *  - ticket: the ticket of the completed request
+ *  - result: what the synchronous version of the request would return
+ *  - arg: the argument given at submission
+ */
+typedef void (*tfs_callback_t)(tfs_ticket_t ticket, ssize_t result, void *arg);
+
+/*
+ * Establishes a new session with a TecnicoFS server (see tfs_mount).
+ * Returns the session's context if successful, NULL otherwise.
+ */
+tfs_client_t *tfs_client_mount(char const *client_pipe_path, char const *server_pipe_path);
+
+/*
+ * Like tfs_client_mount, giving the session's options (its scheduling
+ * class, weight and rate limit, and whether reads are cached; see
+ * tfs_session_options_t), or NULL for the default ones (normal class,
+ * weight 1, no limit, no cache).
+ *
+ * With read_cache set, tfs_client_read keeps the blocks it reads (of
+ * TFS_LEASE_BLOCK_SIZE bytes), under a lease from the server on their
+ * file, and reads them again without asking the server until the lease is
+ * recalled, which happens before the file changes (through any session):
+ * a read sees every write completed before it started, as without the
+ * cache. Only handles opened with tfs_client_open (not appending) are read
+ * through the cache, until submitted an asynchronous write, read or seek.
+ */
+tfs_client_t *tfs_client_mount_with(char const *client_pipe_path, char const *server_pipe_path,
+                                    tfs_session_options_t const *options);
+
+/*
+ * Waits for every outstanding request of the context, ends its session (see
+ * tfs_unmount) and frees the context.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_client_unmount(tfs_client_t *client);
+
+/*
+ * Synchronous operations on a context (see tfs_open, tfs_close, tfs_write,
+ * tfs_read, tfs_seek, tfs_punch_hole, tfs_fallocate, tfs_unlink, tfs_rename,
+ * tfs_shutdown_after_all_closed and tfs_snapshot_to_external_fs).
+ */
+int tfs_client_open(tfs_client_t *client, char const *name, int flags);
+int tfs_client_close(tfs_client_t *client, int fhandle);
+ssize_t tfs_client_write(tfs_client_t *client, int fhandle, void const *buffer, size_t len);
+ssize_t tfs_client_read(tfs_client_t *client, int fhandle, void *buffer, size_t len);
+int tfs_client_seek(tfs_client_t *client, int fhandle, size_t offset);
+int tfs_client_punch_hole(tfs_client_t *client, int fhandle, size_t offset, size_t len);
+int tfs_client_fallocate(tfs_client_t *client, int fhandle, size_t offset, size_t len);
+int tfs_client_unlink(tfs_client_t *client, char const *name);
+int tfs_client_rename(tfs_client_t *client, char const *old_name, char const *new_name);
+int tfs_client_shutdown_after_all_closed(tfs_client_t *client);
+int tfs_client_snapshot(tfs_client_t *client, char const *dest_path);
+
+/*
+ * Copies on a context (see tfs_copy_to_external_fs and
+ * tfs_copy_from_external_fs).
+ * Returns the number of bytes copied, or -1 in case of error.
+ */
+ssize_t tfs_client_copy_out(tfs_client_t *client, char const *source_path, char const *dest_path);
+ssize_t tfs_client_copy_in(tfs_client_t *client, char const *source_path, char const *dest_path);
+
+/*
+ * Attributes and listing on a context (see tfs_stat, tfs_fstat and
+ * tfs_readdir_plus).
+ */
+int tfs_client_stat(tfs_client_t *client, char const *name, tfs_stat_t *st);
+int tfs_client_fstat(tfs_client_t *client, int fhandle, tfs_stat_t *st);
+ssize_t tfs_client_readdir_plus(tfs_client_t *client, tfs_dirent_t *entries, size_t max);
+
+/*
+ * Locks on a context (see tfs_lock and tfs_unlock).
+ */
+int tfs_client_lock(tfs_client_t *client, int fhandle, size_t offset, size_t len, int flags);
+int tfs_client_unlock(tfs_client_t *client, int fhandle, size_t offset, size_t len);
+
+/*
+ * Metrics report on a context (see tfs_stats).
+ */
+ssize_t tfs_client_stats(tfs_client_t *client, char *buffer, size_t len);
+
+/*
+ * Submits an open/close/write/read/seek/punch hole/fallocate/unlink/rename/
+ * copy/snapshot/lock/unlock request (see the synchronous versions); a lock
+ * completes once granted.
+ * The data of a write is copied before returning; the destination buffer of
+ * a read must remain valid until the request completes.
+ * Input (besides the arguments of the synchronous version):
+ *  - client: the session's context
+ *  - callback: function called on completion, or NULL to use tfs_wait
+ *  - arg: argument passed to the callback
+ * Returns the request's ticket, or -1 in case of error.
+ */
+tfs_ticket_t tfs_submit_open(tfs_client_t *client, char const *name, int flags, tfs_callback_t callback, void *arg);
+tfs_ticket_t tfs_submit_close(tfs_client_t *client, int fhandle, tfs_callback_t callback, void *arg);
+tfs_ticket_t tfs_submit_write(tfs_client_t *client, int fhandle, void const *buffer, size_t len,
+                              tfs_callback_t callback, void *arg);
+tfs_ticket_t tfs_submit_read(tfs_client_t *client, int fhandle, void *buffer, size_t len,
+                             tfs_callback_t callback, void *arg);
+tfs_ticket_t tfs_submit_seek(tfs_client_t *client, int fhandle, size_t offset, tfs_callback_t callback, void *arg);
+tfs_ticket_t tfs_submit_punch_hole(tfs_client_t *client, int fhandle, size_t offset, size_t len,
+                                   tfs_callback_t callback, void *arg);
+tfs_ticket_t tfs_submit_fallocate(tfs_client_t *client, int fhandle, size_t offset, size_t len,
+                                  tfs_callback_t callback, void *arg);
+tfs_ticket_t tfs_submit_unlink(tfs_client_t *client, char const *name, tfs_callback_t callback, void *arg);
+tfs_ticket_t tfs_submit_rename(tfs_client_t *client, char const *old_name, char const *new_name,
+                               tfs_callback_t callback, void *arg);
+tfs_ticket_t tfs_submit_copy_out(tfs_client_t *client, char const *source_path, char const *dest_path,
+                                 tfs_callback_t callback, void *arg);
+tfs_ticket_t tfs_submit_copy_in(tfs_client_t *client, char const *source_path, char const *dest_path,
+                                tfs_callback_t callback, void *arg);
+
+tfs_ticket_t tfs_submit_snapshot(tfs_client_t *client, char const *dest_path, tfs_callback_t callback, void *arg);
+tfs_ticket_t tfs_submit_lock(tfs_client_t *client, int fhandle, size_t offset, size_t len, int flags,
+                             tfs_callback_t callback, void *arg);
+tfs_ticket_t tfs_submit_unlock(tfs_client_t *client, int fhandle, size_t offset, size_t len,
+                               tfs_callback_t callback, void *arg);
+
+/*
+ * Submits a request for the metrics report; up to len bytes of it are
+ * written to buffer, which is not null-terminated.
+ */
+tfs_ticket_t tfs_submit_stats(tfs_client_t *client, char *buffer, size_t len, tfs_callback_t callback, void *arg);
+
+/*
+ * Processes every reply already sent by the server, without blocking.
+ * Returns the number of requests completed, or -1 in case of error.
+ */
+int tfs_poll(tfs_client_t *client);
+
+/*
+ * Waits for a request submitted without a callback.
+ * Returns the request's result (see the synchronous versions), or -1 in case
+ * of error.
+ */
+ssize_t tfs_wait(tfs_client_t *client, tfs_ticket_t ticket);
+
 #endif /* CLIENT_API_H */
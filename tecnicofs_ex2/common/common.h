@@ -1,6 +1,13 @@
 #ifndef COMMON_H
+#define COMMON_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <sys/types.h>
+
 /* tfs_open flags */
 
 enum {
@@ -9,42 +16,202 @@ enum {
     TFS_O_APPEND = 0b100,
 };
 
+/* tfs_lock flags: a lock is shared unless exclusive; one that conflicts
+ * fails at once instead of waiting if TFS_LOCK_NOWAIT is given */
+enum {
+    TFS_LOCK_SHARED = 0b00,
+    TFS_LOCK_EXCLUSIVE = 0b01,
+    TFS_LOCK_NOWAIT = 0b10,
+};
+
+/* service classes of a session: while requests of a class are waiting to
+ * be served, those of the classes after it wait */
+enum {
+    TFS_CLASS_INTERACTIVE = 0,
+    TFS_CLASS_NORMAL = 1,
+    TFS_CLASS_BATCH = 2,
+    TFS_CLASSES = 3,
+};
+
+/*
+ * Options of a session, given when mounting it
+ *  - service_class: one of the classes above
+ *  - weight: its share of the bytes served in its class, relative to the
+ *    other sessions' (0 counts as 1)
+ *  - rate: the bytes per second it may be served at most (0 for no limit)
+ *    (see the server's scheduler.h for these three)
+ *  - read_cache: whether the client caches what it reads, under leases
+ *    (see tfs_client_mount_with)
+ */
+typedef struct {
+    int service_class;
+    unsigned int weight;
+    size_t rate;
+    bool read_cache;
+} tfs_session_options_t;
+
+/*
+ * Attributes of a file (see tfs_stat)
+ *  - inumber: its i-node number
+ *  - size: its size, in bytes
+ *  - blocks: the data blocks it takes (none if its contents are kept in the
+ *    i-node; holes take none either)
+ */
+typedef struct {
+    int inumber;
+    size_t size;
+    size_t blocks;
+} tfs_stat_t;
+
+/*
+ * A file listed with its attributes (see tfs_readdir_plus)
+ */
+typedef struct {
+    char name[40];
+    tfs_stat_t stat;
+} tfs_dirent_t;
+
 typedef struct Mount {
     unsigned int session_id;
     char client_pipe_path[40];
+    tfs_session_options_t options;
 } Mount;
 
 typedef struct Unmount {
     unsigned int session_id;
+    unsigned int seq;
 }  Unmount;
 
 typedef struct Open {
     unsigned int session_id;
+    unsigned int seq;
     char name[40];
     int flags;
 } Open;
 
 typedef struct Close {
     unsigned int session_id;
+    unsigned int seq;
     int fhandle;
 } Close;
 
 typedef struct Write {
     unsigned int session_id;
+    unsigned int seq;
     int fhandle;
     size_t len;
 } Write;
 
 typedef struct Read {
     unsigned int session_id;
+    unsigned int seq;
     int fhandle;
     size_t len;
 } Read;
 
 typedef struct Shutdown {
     unsigned int session_id;
+    unsigned int seq;
 } Shutdown;
 
+typedef struct CopyOut {
+    unsigned int session_id;
+    unsigned int seq;
+    char name[40];
+    char external_path[40];
+} CopyOut;
+
+typedef struct CopyIn {
+    unsigned int session_id;
+    unsigned int seq;
+    char external_path[40];
+    char name[40];
+} CopyIn;
+
+typedef struct Unlink {
+    unsigned int session_id;
+    unsigned int seq;
+    char name[40];
+} Unlink;
+
+typedef struct Rename {
+    unsigned int session_id;
+    unsigned int seq;
+    char old_name[40];
+    char new_name[40];
+} Rename;
+
+typedef struct Seek {
+    unsigned int session_id;
+    unsigned int seq;
+    int fhandle;
+    size_t offset;
+} Seek;
+
+typedef struct PunchHole {
+    unsigned int session_id;
+    unsigned int seq;
+    int fhandle;
+    size_t offset;
+    size_t len;
+} PunchHole;
+
+typedef struct Fallocate {
+    unsigned int session_id;
+    unsigned int seq;
+    int fhandle;
+    size_t offset;
+    size_t len;
+} Fallocate;
+
+typedef struct Snapshot {
+    unsigned int session_id;
+    unsigned int seq;
+    char external_path[40];
+} Snapshot;
+
+typedef struct Lease {
+    unsigned int session_id;
+    unsigned int seq;
+    int fhandle;
+    size_t offset;
+} Lease;
+
+typedef struct Stat {
+    unsigned int session_id;
+    unsigned int seq;
+    char name[40];
+} Stat;
+
+typedef struct Fstat {
+    unsigned int session_id;
+    unsigned int seq;
+    int fhandle;
+} Fstat;
+
+typedef struct Readdir {
+    unsigned int session_id;
+    unsigned int seq;
+    size_t first;
+} Readdir;
+
+typedef struct Lock {
+    unsigned int session_id;
+    unsigned int seq;
+    int fhandle;
+    size_t offset;
+    size_t len;
+    int flags;
+} Lock;
+
+typedef struct Unlock {
+    unsigned int session_id;
+    unsigned int seq;
+    int fhandle;
+    size_t offset;
+    size_t len;
+} Unlock;
+
 union Message {
     struct Mount m_message;
     struct Unmount u_message;
@@ -53,16 +220,129 @@ union Message {
     struct Write w_message;
     struct Read r_message;
     struct Shutdown s_message;
+    struct CopyOut co_message;
+    struct CopyIn ci_message;
+    struct Unlink ul_message;
+    struct Rename rn_message;
+    struct Seek sk_message;
+    struct PunchHole ph_message;
+    struct Fallocate fa_message;
+    struct Snapshot sn_message;
+    struct Lease ls_message;
+    struct Stat st_message;
+    struct Fstat fs_message;
+    struct Readdir rd_message;
+    struct Lock lk_message;
+    struct Unlock uk_message;
 };
 
+/*
+ * Wire framing
+ * A request is an op code, the session id, a sequence number chosen by the
+ * client and the op's arguments (a mount carries only the client pipe path
+ * and the session's options).
+ * Every request is sent with a single write() no larger than PIPE_BUF, so
+ * that requests from different clients never interleave in the server pipe.
+ * The fixed part of a request always fits in TFS_REQUEST_HEADER_MAX bytes;
+ * the only variable part is the data of a write, which is capped at
+ * TFS_MAX_PAYLOAD bytes (as is the data returned by a read).
+ *
+ * Every reply starts with a Reply header echoing the request's sequence
+ * number (0 for a mount), followed by the data of a read. A session may have
+ * up to TFS_MAX_INFLIGHT requests outstanding; they are served in order, and
+ * a session with more is expired.
+ *
+ * A session caching reads asks for a block of TFS_LEASE_BLOCK_SIZE bytes of
+ * an open file with a lease request, answered by a LeaseGrant followed by
+ * the data (the result counting both); its successful opens are answered
+ * by the handle followed by a LeaseGrant (not leased) naming the file.
+ * While leased, the file's contents may be cached; before they change, the
+ * server sends a recall: a Reply with seq 0 whose result is the file's
+ * i-node number, after which nothing cached of that file may be used.
+ * Leases are granted and recalled for whole files.
+ *
+ * A stat (by name or by handle) is answered by a tfs_stat_t, the result
+ * being its size. The directory is listed a window of TFS_READDIR_SLOTS
+ * entry slots at a time, each request answered by a DirChunk followed by
+ * the files in the window (the result counting both), so a client asks
+ * for every window at once and gets the whole directory in one round trip.
+ *
+ * A lock request that has to wait is answered once the lock is granted (or
+ * the request is cancelled, by its handle being closed); the session's
+ * later requests are served meanwhile, and may be answered before it.
+ */
+#define TFS_MAX_FRAME_SIZE (PIPE_BUF)
+#define TFS_REQUEST_HEADER_MAX (128)
+#define TFS_MAX_PAYLOAD (TFS_MAX_FRAME_SIZE - TFS_REQUEST_HEADER_MAX)
+#define TFS_MAX_INFLIGHT (32)
+#define TFS_LEASE_BLOCK_SIZE (1024)
+
+typedef struct Reply {
+    unsigned int seq;
+    ssize_t result;
+} Reply;
+
+/*
+ * Answer to a listing of the directory: how many entry slots it has (so
+ * how many windows to ask for) and how many files follow, as tfs_dirent_t.
+ */
+typedef struct DirChunk {
+    size_t slots;
+    size_t count;
+} DirChunk;
+
+#define TFS_READDIR_SLOTS ((TFS_MAX_PAYLOAD - sizeof(DirChunk)) / sizeof(tfs_dirent_t))
+
+/*
+ * Answer to a lease request: which file the block is of (its i-node number
+ * and the i-node's generation, as i-nodes are reused), and whether it is
+ * leased (it is not to a session that did not ask for a read cache when
+ * mounted; the data must then not be cached).
+ */
+typedef struct LeaseGrant {
+    int inumber;
+    unsigned int generation;
+    bool leased;
+} LeaseGrant;
+
+/*
+ * Request queued in a session
+ * The frame holds the op code, the sequence number and the arguments;
+ * enqueued is when the server queued it (for metrics).
+ */
+typedef struct {
+    char buffer[TFS_REQUEST_HEADER_MAX];
+    char *payload;
+    uint64_t enqueued;
+} Request;
+
 /*
  * Session
+ * The request frames are preallocated with the session, so that queueing a
+ * request does not touch the allocator; write data and read replies are
+ * taken from the server's buffer pool.
+ * There is a frame more than the requests a client may have in flight, as
+ * the request being served keeps its frame until after it is replied to;
+ * a client sending more than that broke the protocol, and is expired.
+ * A session with requests queued is scheduled on the server's executor
+ * (see executor.h) until a worker has served them all.
+ * A session whose client went away (or was idle for too long) is expired,
+ * and then ended by the worker serving it; last_active is when its last
+ * request was queued.
  */
+#define SESSION_SLOTS (TFS_MAX_INFLIGHT + 1)
+
 typedef struct {
     int tid;
     int pipe;
-    pthread_cond_t sent_all;
-    char* buffer;
+    int lease_pipe; /* for lease recalls, which must not block (-1 if none) */
+    uid_t owner;    /* of the client's pipe: the user the client acts as */
+    bool scheduled;
+    Request requests[SESSION_SLOTS];
+    unsigned int head;
+    unsigned int count;
+    bool expired;
+    uint64_t last_active;
 } Session;
 
 /* operation codes (for client-server requests) */
@@ -73,7 +353,22 @@ enum {
     TFS_OP_CODE_CLOSE = 4,
     TFS_OP_CODE_WRITE = 5,
     TFS_OP_CODE_READ = 6,
-    TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED = 7
+    TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED = 7,
+    TFS_OP_CODE_COPY_OUT = 8,
+    TFS_OP_CODE_COPY_IN = 9,
+    TFS_OP_CODE_STATS = 10,
+    TFS_OP_CODE_UNLINK = 11,
+    TFS_OP_CODE_RENAME = 12,
+    TFS_OP_CODE_SEEK = 13,
+    TFS_OP_CODE_PUNCH_HOLE = 14,
+    TFS_OP_CODE_FALLOCATE = 15,
+    TFS_OP_CODE_SNAPSHOT = 16,
+    TFS_OP_CODE_LEASE = 17,
+    TFS_OP_CODE_STAT = 18,
+    TFS_OP_CODE_FSTAT = 19,
+    TFS_OP_CODE_READDIR = 20,
+    TFS_OP_CODE_LOCK = 21,
+    TFS_OP_CODE_UNLOCK = 22
 };
 
 #endif /* COMMON_H */
\ No newline at end of file
@@ -0,0 +1,329 @@
+#include "block_cache.h"
+#include "codec.h"
+#include "config.h"
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    int block; /* -1 if the frame is free */
+    int pins;
+    bool dirty;      /* changed since it was stored */
+    bool referenced; /* used since the clock hand last passed */
+    size_t reserved; /* segments set aside for storing it, while dirty */
+} frame_t;
+
+/*
+ * Everything is serialized by one lock, which is never held while taking
+ * another.
+ */
+static struct {
+    pthread_mutex_t lock;
+    size_t block_size;
+    size_t max_block_count;
+    /* the store: segments, chained through next_segment (as is the list of
+     * free ones) */
+    char *store;
+    int *next_segment;
+    int free_segments;
+    size_t n_segments;
+    size_t n_free;
+    size_t reserved; /* free segments set aside for the dirty frames */
+    /* each block's first segment (-1 if none) and stored length (0 if
+     * never written; block_size if stored as it is) */
+    int *first_segment;
+    uint32_t *stored_len;
+    size_t stored_blocks;
+    /* the cache */
+    frame_t frames[BLOCK_CACHE_FRAMES];
+    char *frame_data;
+    int *frame_of; /* each block's frame, -1 if not cached */
+    size_t hand;
+    char *scratch; /* compressed contents, on their way in or out */
+} cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static inline size_t segments_for(size_t len) { return (len + STORE_SEGMENT_SIZE - 1) / STORE_SEGMENT_SIZE; }
+
+static inline char *frame_data(size_t f) { return cache.frame_data + f * cache.block_size; }
+
+int block_cache_init(size_t block_size, size_t max_block_count, size_t store_size) {
+    block_cache_destroy();
+    cache.block_size = block_size;
+    cache.max_block_count = max_block_count;
+    cache.n_segments = store_size / STORE_SEGMENT_SIZE;
+    if (cache.n_segments == 0 || cache.n_segments > INT32_MAX || block_size > UINT32_MAX) {
+        return -1;
+    }
+    cache.store = malloc(cache.n_segments * STORE_SEGMENT_SIZE);
+    cache.next_segment = malloc(cache.n_segments * sizeof(int));
+    cache.first_segment = malloc(max_block_count * sizeof(int));
+    cache.stored_len = calloc(max_block_count, sizeof(uint32_t));
+    cache.frame_of = malloc(max_block_count * sizeof(int));
+    cache.frame_data = malloc(BLOCK_CACHE_FRAMES * block_size);
+    cache.scratch = malloc(block_size);
+    if (cache.store == NULL || cache.next_segment == NULL || cache.first_segment == NULL ||
+        cache.stored_len == NULL || cache.frame_of == NULL || cache.frame_data == NULL || cache.scratch == NULL) {
+        block_cache_destroy();
+        return -1;
+    }
+    for (size_t s = 0; s < cache.n_segments; s++) {
+        cache.next_segment[s] = s + 1 < cache.n_segments ? (int)s + 1 : -1;
+    }
+    cache.free_segments = 0;
+    cache.n_free = cache.n_segments;
+    cache.reserved = 0;
+    for (size_t b = 0; b < max_block_count; b++) {
+        cache.first_segment[b] = -1;
+        cache.frame_of[b] = -1;
+    }
+    cache.stored_blocks = 0;
+    for (size_t f = 0; f < BLOCK_CACHE_FRAMES; f++) {
+        cache.frames[f] = (frame_t){.block = -1};
+    }
+    cache.hand = 0;
+    return 0;
+}
+
+void block_cache_destroy() {
+    free(cache.store);
+    free(cache.next_segment);
+    free(cache.first_segment);
+    free(cache.stored_len);
+    free(cache.frame_of);
+    free(cache.frame_data);
+    free(cache.scratch);
+    cache.store = NULL;
+    cache.next_segment = NULL;
+    cache.first_segment = NULL;
+    cache.stored_len = NULL;
+    cache.frame_of = NULL;
+    cache.frame_data = NULL;
+    cache.scratch = NULL;
+}
+
+bool block_cache_enabled() { return cache.store != NULL; }
+
+/*
+ * Gives the segments of a block back to the free list.
+ * The caller holds the cache's lock.
+ */
+static void free_segments(int block) {
+    int s = cache.first_segment[block];
+    while (s != -1) {
+        int next = cache.next_segment[s];
+        cache.next_segment[s] = cache.free_segments;
+        cache.free_segments = s;
+        cache.n_free++;
+        s = next;
+    }
+    cache.first_segment[block] = -1;
+    if (cache.stored_len[block] != 0) {
+        cache.stored_len[block] = 0;
+        cache.stored_blocks--;
+    }
+}
+
+/*
+ * Returns how many more segments a block may need once changed: as many as
+ * it takes stored as it is, less those it has.
+ * The caller holds the cache's lock.
+ */
+static size_t worst_case(int block) {
+    return segments_for(cache.block_size) - segments_for(cache.stored_len[block]);
+}
+
+/*
+ * Stores the contents of a frame, compressed if that makes them smaller.
+ * A dirty frame with its worst case reserved (see block_cache_put) always
+ * fits.
+ * The caller holds the cache's lock.
+ * Returns 0 if successful, -1 if the store has no room for them
+ */
+static int write_back(size_t f) {
+    frame_t *frame = &cache.frames[f];
+    int block = frame->block;
+    char const *from = cache.scratch;
+    size_t len = codec_compress(frame_data(f), cache.block_size, cache.scratch, cache.block_size - 1);
+    if (len == 0) {
+        from = frame_data(f);
+        len = cache.block_size;
+    }
+    metrics_count(METRIC_BLOCK_COMPRESS, 1);
+    size_t needed = segments_for(len);
+    size_t available = cache.n_free - (cache.reserved - frame->reserved) + segments_for(cache.stored_len[block]);
+    if (needed > available) {
+        return -1;
+    }
+
+    cache.reserved -= frame->reserved;
+    frame->reserved = 0;
+    free_segments(block);
+    int *link = &cache.first_segment[block];
+    for (size_t done = 0; done < len; done += STORE_SEGMENT_SIZE) {
+        int s = cache.free_segments;
+        cache.free_segments = cache.next_segment[s];
+        cache.n_free--;
+        size_t chunk = len - done < STORE_SEGMENT_SIZE ? len - done : STORE_SEGMENT_SIZE;
+        memcpy(cache.store + (size_t)s * STORE_SEGMENT_SIZE, from + done, chunk);
+        *link = s;
+        link = &cache.next_segment[s];
+    }
+    *link = -1;
+    cache.stored_len[block] = (uint32_t)len;
+    cache.stored_blocks++;
+    frame->dirty = false;
+    return 0;
+}
+
+/*
+ * Stores changed frames (not pinned) until the free segments not set aside
+ * number at least needed, giving back the room set aside for them.
+ * The caller holds the cache's lock.
+ */
+static void flush_dirty(size_t needed) {
+    for (size_t f = 0; f < BLOCK_CACHE_FRAMES && cache.n_free - cache.reserved < needed; f++) {
+        if (cache.frames[f].dirty && cache.frames[f].pins == 0) {
+            write_back(f);
+        }
+    }
+}
+
+/*
+ * Loads the stored contents of a block into a frame.
+ * The caller holds the cache's lock.
+ * Returns 0 if successful, -1 if they are corrupt
+ */
+static int load(int block, size_t f) {
+    size_t len = cache.stored_len[block];
+    if (len == 0) {
+        memset(frame_data(f), 0, cache.block_size);
+        return 0;
+    }
+    char *to = len == cache.block_size ? frame_data(f) : cache.scratch;
+    size_t done = 0;
+    for (int s = cache.first_segment[block]; s != -1 && done < len; s = cache.next_segment[s]) {
+        size_t chunk = len - done < STORE_SEGMENT_SIZE ? len - done : STORE_SEGMENT_SIZE;
+        memcpy(to + done, cache.store + (size_t)s * STORE_SEGMENT_SIZE, chunk);
+        done += chunk;
+    }
+    if (done < len) {
+        return -1;
+    }
+    if (to == frame_data(f)) {
+        return 0;
+    }
+    metrics_count(METRIC_BLOCK_DECOMPRESS, 1);
+    return codec_decompress(cache.scratch, len, frame_data(f), cache.block_size);
+}
+
+/*
+ * Finds a frame to reuse (clock order): a free one, or one neither pinned
+ * nor recently used, whose contents are stored first if changed.
+ * The caller holds the cache's lock.
+ * Returns: the frame, or -1 if none can be reused
+ */
+static int victim() {
+    for (size_t step = 0; step < 2 * BLOCK_CACHE_FRAMES; step++) {
+        size_t f = cache.hand;
+        cache.hand = (cache.hand + 1) % BLOCK_CACHE_FRAMES;
+        frame_t *frame = &cache.frames[f];
+        if (frame->block == -1) {
+            return (int)f;
+        }
+        if (frame->pins > 0) {
+            continue;
+        }
+        if (frame->referenced) {
+            frame->referenced = false;
+            continue;
+        }
+        if (frame->dirty && write_back(f) == -1) {
+            continue;
+        }
+        cache.frame_of[frame->block] = -1;
+        frame->block = -1;
+        return (int)f;
+    }
+    return -1;
+}
+
+void *block_cache_get(int block) {
+    pthread_mutex_lock(&cache.lock);
+    int f = cache.frame_of[block];
+    if (f == -1) {
+        f = victim();
+        if (f == -1 || load(block, (size_t)f) == -1) {
+            pthread_mutex_unlock(&cache.lock);
+            return NULL;
+        }
+        cache.frames[f] = (frame_t){.block = block};
+        cache.frame_of[block] = f;
+    }
+    cache.frames[f].pins++;
+    cache.frames[f].referenced = true;
+    pthread_mutex_unlock(&cache.lock);
+    return frame_data((size_t)f);
+}
+
+int block_cache_put(int block, bool written) {
+    int r = 0;
+    pthread_mutex_lock(&cache.lock);
+    int f = cache.frame_of[block];
+    frame_t *frame = f == -1 ? NULL : &cache.frames[f];
+    if (frame != NULL && frame->pins > 0) {
+        frame->pins--;
+        if (written) {
+            frame->dirty = true;
+            /* room to store it later is set aside now (storing other
+             * changed frames to make it), or it is stored right away
+             * (compressed) */
+            size_t needed = worst_case(block) - frame->reserved;
+            flush_dirty(needed);
+            if (needed <= cache.n_free - cache.reserved) {
+                frame->reserved += needed;
+                cache.reserved += needed;
+            } else if (write_back((size_t)f) == -1) {
+                /* kept (dirty) in the cache until there is room */
+                r = -1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return r;
+}
+
+void block_cache_flush() {
+    pthread_mutex_lock(&cache.lock);
+    if (cache.store != NULL) {
+        flush_dirty(SIZE_MAX);
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void block_cache_discard(int block) {
+    pthread_mutex_lock(&cache.lock);
+    free_segments(block);
+    int f = cache.frame_of[block];
+    if (f != -1) {
+        /* a frame still pinned (by a reader of the freed block) is left
+         * cached until reused */
+        cache.reserved -= cache.frames[f].reserved;
+        cache.frames[f].reserved = 0;
+        cache.frames[f].dirty = false;
+        if (cache.frames[f].pins == 0) {
+            cache.frames[f].block = -1;
+            cache.frame_of[block] = -1;
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void block_cache_usage(size_t *logical, size_t *physical) {
+    pthread_mutex_lock(&cache.lock);
+    *logical = cache.stored_blocks * cache.block_size;
+    *physical = (cache.n_segments - cache.n_free) * STORE_SEGMENT_SIZE;
+    pthread_mutex_unlock(&cache.lock);
+}
@@ -0,0 +1,70 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Compressed block store
+ * Backs the data blocks when compression is on (see tfs_params): each block
+ * is kept compressed (see codec.h), or as it is if it does not compress, in
+ * a chain of STORE_SEGMENT_SIZE segments of a fixed-size store, so a block
+ * takes only the segments its compressed length needs. Blocks are used
+ * decompressed, in the BLOCK_CACHE_FRAMES frames of a cache: a block is
+ * pinned to its frame while used (block_cache_get / block_cache_put), and
+ * changed frames are compressed back when evicted (clock order), so
+ * repeated accesses to a block cost neither a decompression nor a
+ * compression. Room for storing a changed frame is set aside when it is
+ * changed, so running out of it is reported to the writer and does not
+ * keep frames from being evicted. A block never written reads as zeros.
+ */
+
+/*
+ * Initializes an empty store of store_size bytes, for max_block_count
+ * blocks of block_size bytes.
+ * Returns 0 if successful, -1 otherwise
+ */
+int block_cache_init(size_t block_size, size_t max_block_count, size_t store_size);
+
+/*
+ * Frees the store and the cache (compression is then off).
+ */
+void block_cache_destroy();
+
+/*
+ * Returns whether the store exists (compression is on).
+ */
+bool block_cache_enabled();
+
+/*
+ * Pins a block to a frame of the cache, decompressing it there if needed.
+ * Returns: the block's contents, or NULL if every frame is pinned or holds
+ * a changed block with no room left in the store
+ */
+void *block_cache_get(int block);
+
+/*
+ * Unpins a block; written tells whether its contents were changed.
+ * Returns: 0 if successful, -1 if there is no room left to store the
+ * changed block (it then stays in the cache until there is)
+ */
+int block_cache_put(int block, bool written);
+
+/*
+ * Stores every changed block in the cache (not pinned), so that the store
+ * holds all that was written.
+ */
+void block_cache_flush();
+
+/*
+ * Drops the contents of a freed block, giving its segments back.
+ */
+void block_cache_discard(int block);
+
+/*
+ * Returns the bytes of blocks stored (logical) and of segments taken by
+ * them (physical); the blocks only in the cache are not counted.
+ */
+void block_cache_usage(size_t *logical, size_t *physical);
+
+#endif // BLOCK_CACHE_H
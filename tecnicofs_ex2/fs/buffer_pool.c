@@ -0,0 +1,152 @@
+#include "buffer_pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#define POOL_CLASSES (7) /* 64, 128, ..., 4096 */
+#define OVERSIZED_CLASS (POOL_CLASSES)
+
+/*
+ * Every buffer is preceded by a chunk header, which links it in the free list
+ * of its class while it is not in use.
+ */
+typedef union chunk {
+    struct {
+        union chunk *next;
+        size_t class_index;
+    } h;
+    max_align_t align;
+} chunk_t;
+
+typedef union slab {
+    union slab *next;
+    max_align_t align;
+} slab_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    chunk_t *free_list;
+    slab_t *slabs;
+} size_class_t;
+
+static size_class_t classes[POOL_CLASSES];
+static atomic_size_t malloc_count;
+
+static inline size_t class_size(size_t class_index) {
+    return (size_t)BUFFER_POOL_MIN_SIZE << class_index;
+}
+
+static inline size_t class_of(size_t size) {
+    size_t class_index = 0;
+    while (class_index < POOL_CLASSES && class_size(class_index) < size) {
+        class_index++;
+    }
+    return class_index;
+}
+
+/*
+ * Allocates a new slab for a class and threads its chunks in the free list.
+ * Must be called with the class lock held.
+ * Returns 0 if successful, -1 otherwise
+ */
+static int grow_class(size_t class_index) {
+    size_class_t *c = &classes[class_index];
+    size_t stride = sizeof(chunk_t) + class_size(class_index);
+
+    slab_t *slab = malloc(sizeof(slab_t) + BUFFER_POOL_SLAB_CHUNKS * stride);
+    if (slab == NULL) {
+        return -1;
+    }
+    atomic_fetch_add(&malloc_count, 1);
+
+    slab->next = c->slabs;
+    c->slabs = slab;
+
+    char *chunks = (char *)(slab + 1);
+    for (size_t i = 0; i < BUFFER_POOL_SLAB_CHUNKS; i++) {
+        chunk_t *chunk = (chunk_t *)(void *)(chunks + i * stride);
+        chunk->h.class_index = class_index;
+        chunk->h.next = c->free_list;
+        c->free_list = chunk;
+    }
+    return 0;
+}
+
+int buffer_pool_init() {
+    atomic_store(&malloc_count, 0);
+    for (size_t i = 0; i < POOL_CLASSES; i++) {
+        if (pthread_mutex_init(&classes[i].lock, NULL) != 0) {
+            return -1;
+        }
+        classes[i].free_list = NULL;
+        classes[i].slabs = NULL;
+        if (grow_class(i) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void buffer_pool_destroy() {
+    for (size_t i = 0; i < POOL_CLASSES; i++) {
+        slab_t *slab = classes[i].slabs;
+        while (slab != NULL) {
+            slab_t *next = slab->next;
+            free(slab);
+            slab = next;
+        }
+        classes[i].slabs = NULL;
+        classes[i].free_list = NULL;
+        pthread_mutex_destroy(&classes[i].lock);
+    }
+}
+
+void *buffer_pool_get(size_t size) {
+    size_t class_index = class_of(size);
+
+    if (class_index == OVERSIZED_CLASS) {
+        chunk_t *chunk = malloc(sizeof(chunk_t) + size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        atomic_fetch_add(&malloc_count, 1);
+        chunk->h.class_index = OVERSIZED_CLASS;
+        return chunk + 1;
+    }
+
+    size_class_t *c = &classes[class_index];
+    if (pthread_mutex_lock(&c->lock) != 0) {
+        return NULL;
+    }
+    if (c->free_list == NULL && grow_class(class_index) == -1) {
+        pthread_mutex_unlock(&c->lock);
+        return NULL;
+    }
+    chunk_t *chunk = c->free_list;
+    c->free_list = chunk->h.next;
+    pthread_mutex_unlock(&c->lock);
+
+    return chunk + 1;
+}
+
+void buffer_pool_put(void *buffer) {
+    if (buffer == NULL) {
+        return;
+    }
+
+    chunk_t *chunk = (chunk_t *)buffer - 1;
+    if (chunk->h.class_index == OVERSIZED_CLASS) {
+        free(chunk);
+        return;
+    }
+
+    size_class_t *c = &classes[chunk->h.class_index];
+    pthread_mutex_lock(&c->lock);
+    chunk->h.next = c->free_list;
+    c->free_list = chunk;
+    pthread_mutex_unlock(&c->lock);
+}
+
+size_t buffer_pool_malloc_count() { return atomic_load(&malloc_count); }
@@ -0,0 +1,52 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+
+/*
+ * Size-classed pool of reusable buffers.
+ * Buffers are carved out of slabs of BUFFER_POOL_SLAB_CHUNKS chunks each and
+ * are never returned to the allocator while the pool is alive, so once every
+ * class has been warmed up, getting and putting buffers does not call malloc.
+ */
+
+/* smallest and largest size classes (powers of two) */
+#define BUFFER_POOL_MIN_SIZE (64)
+#define BUFFER_POOL_MAX_SIZE (4096)
+#define BUFFER_POOL_SLAB_CHUNKS (8)
+
+/*
+ * Initializes the pool, preallocating one slab per size class.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int buffer_pool_init();
+
+/*
+ * Releases every slab owned by the pool.
+ * Buffers still in use must not be accessed afterwards.
+ */
+void buffer_pool_destroy();
+
+/*
+ * Gets a buffer able to hold at least 'size' bytes.
+ * Requests larger than BUFFER_POOL_MAX_SIZE are served directly by malloc.
+ * Returns a pointer to the buffer, NULL if failed
+ */
+void *buffer_pool_get(size_t size);
+
+/*
+ * Gives a buffer obtained with buffer_pool_get back to the pool.
+ * Input:
+ *  - buffer: the buffer (NULL is ignored)
+ */
+void buffer_pool_put(void *buffer);
+
+/*
+ * Allocation-count instrumentation hook.
+ * Returns the number of calls the pool has made to malloc since it was
+ * initialized (slabs and oversized buffers); in steady state it stays
+ * constant.
+ */
+size_t buffer_pool_malloc_count();
+
+#endif // BUFFER_POOL_H
@@ -0,0 +1,171 @@
+#include "codec.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH (4)
+#define MAX_OFFSET (65535)
+/* a length nibble of 15 is continued in the following bytes */
+#define NIBBLE_MAX (15)
+#define HASH_LOG (10)
+
+static inline uint32_t read32(unsigned char const *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash(uint32_t sequence) { return (sequence * 2654435761U) >> (32 - HASH_LOG); }
+
+/*
+ * Writes what a length exceeds NIBBLE_MAX by, as bytes of 255 and a last
+ * smaller one.
+ * Returns: the end of the output, or NULL if it does not fit
+ */
+static unsigned char *put_length(unsigned char *op, unsigned char const *end, size_t n) {
+    for (; n >= 255; n -= 255) {
+        if (op == end) {
+            return NULL;
+        }
+        *op++ = 255;
+    }
+    if (op == end) {
+        return NULL;
+    }
+    *op++ = (unsigned char)n;
+    return op;
+}
+
+/*
+ * Writes a sequence: literals followed by a match (none, for the last one).
+ * Returns: the end of the output, or NULL if it does not fit
+ */
+static unsigned char *put_sequence(unsigned char *op, unsigned char const *end, unsigned char const *literals,
+                                   size_t n_literals, size_t offset, size_t match) {
+    if (op == end) {
+        return NULL;
+    }
+    size_t match_code = match == 0 ? 0 : match - MIN_MATCH;
+    unsigned char *token = op++;
+    *token = (unsigned char)((n_literals < NIBBLE_MAX ? n_literals : NIBBLE_MAX) << 4 |
+                             (match_code < NIBBLE_MAX ? match_code : NIBBLE_MAX));
+    if (n_literals >= NIBBLE_MAX && (op = put_length(op, end, n_literals - NIBBLE_MAX)) == NULL) {
+        return NULL;
+    }
+    if ((size_t)(end - op) < n_literals) {
+        return NULL;
+    }
+    memcpy(op, literals, n_literals);
+    op += n_literals;
+    if (match == 0) {
+        return op;
+    }
+    if (end - op < 2) {
+        return NULL;
+    }
+    *op++ = (unsigned char)(offset & 0xFF);
+    *op++ = (unsigned char)(offset >> 8);
+    if (match_code >= NIBBLE_MAX && (op = put_length(op, end, match_code - NIBBLE_MAX)) == NULL) {
+        return NULL;
+    }
+    return op;
+}
+
+size_t codec_compress(void const *src, size_t len, void *dst, size_t capacity) {
+    unsigned char const *in = src;
+    unsigned char *out = dst;
+    unsigned char const *end = out + capacity;
+    unsigned char *op = out;
+    /* last position (plus one) of each hashed 4-byte sequence */
+    uint32_t table[1 << HASH_LOG] = {0};
+
+    size_t anchor = 0;
+    size_t ip = 0;
+    while (ip + MIN_MATCH <= len) {
+        uint32_t sequence = read32(in + ip);
+        uint32_t h = hash(sequence);
+        size_t ref = table[h];
+        table[h] = (uint32_t)(ip + 1);
+        if (ref == 0 || ip - (ref - 1) > MAX_OFFSET || read32(in + ref - 1) != sequence) {
+            ip++;
+            continue;
+        }
+        ref--;
+        size_t match = MIN_MATCH;
+        while (ip + match < len && in[ref + match] == in[ip + match]) {
+            match++;
+        }
+        op = put_sequence(op, end, in + anchor, ip - anchor, ip - ref, match);
+        if (op == NULL) {
+            return 0;
+        }
+        ip += match;
+        anchor = ip;
+    }
+    op = put_sequence(op, end, in + anchor, len - anchor, 0, 0);
+    return op == NULL ? 0 : (size_t)(op - out);
+}
+
+/*
+ * Reads the bytes continuing a length nibble, adding them to *n.
+ * Returns: 0 if successful, -1 if the input ends first
+ */
+static int get_length(unsigned char const *in, size_t *ip, size_t len, size_t *n) {
+    unsigned char b;
+    do {
+        if (*ip == len) {
+            return -1;
+        }
+        b = in[(*ip)++];
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+int codec_decompress(void const *src, size_t compressed_len, void *dst, size_t len) {
+    unsigned char const *in = src;
+    unsigned char *out = dst;
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < compressed_len) {
+        unsigned char token = in[ip++];
+        size_t n_literals = (size_t)(token >> 4);
+        if (n_literals == NIBBLE_MAX && get_length(in, &ip, compressed_len, &n_literals) == -1) {
+            return -1;
+        }
+        if (n_literals > compressed_len - ip || n_literals > len - op) {
+            return -1;
+        }
+        memcpy(out + op, in + ip, n_literals);
+        ip += n_literals;
+        op += n_literals;
+        if (ip == compressed_len) {
+            break; /* the last sequence has no match */
+        }
+
+        if (compressed_len - ip < 2) {
+            return -1;
+        }
+        size_t offset = (size_t)in[ip] | (size_t)in[ip + 1] << 8;
+        ip += 2;
+        size_t match = (size_t)(token & NIBBLE_MAX);
+        if (match == NIBBLE_MAX && get_length(in, &ip, compressed_len, &match) == -1) {
+            return -1;
+        }
+        match += MIN_MATCH;
+        if (offset == 0 || offset > op || match > len - op) {
+            return -1;
+        }
+        if (offset >= match) {
+            memcpy(out + op, out + op - offset, match);
+        } else {
+            /* the match overlaps what it produces (a repetition) */
+            for (size_t i = 0; i < match; i++) {
+                out[op + i] = out[op - offset + i];
+            }
+        }
+        op += match;
+    }
+    return op == len ? 0 : -1;
+}
@@ -0,0 +1,28 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+
+/*
+ * Block compression codec
+ * An LZ77 byte codec in the format of LZ4 blocks: a sequence is a token
+ * (literal length and match length, 4 bits each, extended by bytes of 255),
+ * the literals, and a match as a 2-byte offset back into the output. There
+ * is no entropy stage, so decompressing costs little more than a memcpy.
+ */
+
+/*
+ * Compresses len bytes of src into dst.
+ * Returns: the compressed length, or 0 if it would not fit in capacity
+ * bytes (the data is then better stored as it is)
+ */
+size_t codec_compress(void const *src, size_t len, void *dst, size_t capacity);
+
+/*
+ * Decompresses compressed_len bytes of src, which must expand to exactly
+ * len bytes, into dst.
+ * Returns: 0 if successful, -1 if the input is corrupt
+ */
+int codec_decompress(void const *src, size_t compressed_len, void *dst, size_t len);
+
+#endif // CODEC_H
@@ -4,12 +4,54 @@
 /* FS root inode number */
 #define ROOT_DIR_INUM (0)
 
+/* default geometry (see tfs_params); tfs_server can override it */
 #define BLOCK_SIZE (1024)
 #define DATA_BLOCKS (1024)
 #define INODE_TABLE_SIZE (50)
 #define MAX_OPEN_FILES (20)
 #define MAX_FILE_NAME (40)
 #define MAX_CLIENTS (3)
+/* seconds between checks for clients gone away (see tfs_server) */
+#define SESSION_PROBE_INTERVAL (1)
+/* how long a copy to a non-blocking descriptor (a client's FIFO) waits for
+ * room before it fails (see tfs_copy_to_fd) */
+#define COPY_STALL_TIMEOUT_MS (1000)
+/* byte-range locks held or waited for at once, per open file entry (all of
+ * them share the room; see range_lock.h) */
+#define RANGE_LOCKS_PER_FILE (16)
+/* fair scheduling of requests (see scheduler.h): the credit a session gets
+ * per turn (times its weight), and what a request moving no data costs */
+#define SCHED_QUANTUM (4096)
+#define SCHED_REQUEST_COST (256)
+/* requests a worker serves from a session before moving on to another one
+ * (see tfs_server) */
+#define SESSION_BATCH (16)
+#define INLINE_DATA_SIZE (192)
+/* blocks named by the i-node itself; the rest are in an indirect block */
+#define INODE_DIRECT_BLOCKS (10)
+
+#define CACHE_LINE_SIZE (64)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* small sequential writes to an open file are gathered (see tfs_params):
+ * those of up to WRITE_COALESCE_MAX bytes, in a buffer of WRITE_BUFFER_SIZE
+ * (the server's default), which the server writes WRITE_BUFFER_AGE_MS after
+ * the first one at the latest */
+#define WRITE_COALESCE_MAX (512)
+#define WRITE_BUFFER_SIZE (4096)
+#define WRITE_BUFFER_AGE_MS (50)
+
+/* largest chunk moved at once by the copy operations */
+#define COPY_CHUNK_SIZE (16 * 1024)
+/* directory entries a listing reads from the directory's block at once */
+#define LIST_DIR_BATCH (32)
+
+/* compressed block store (see block_cache.h) */
+#define STORE_SEGMENT_SIZE (64)
+#define BLOCK_CACHE_FRAMES (64)
+
+/* first line of a snapshot image (see tfs_snapshot_export) */
+#define SNAPSHOT_MAGIC "tfs-snapshot 1\n"
 
 #define DELAY (5000)
 
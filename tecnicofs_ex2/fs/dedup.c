@@ -0,0 +1,236 @@
+#include "dedup.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C
+#endif
+
+#define PRIME1 (0x9E3779B185EBCA87ULL)
+#define PRIME2 (0xC2B2AE3D27D4EB4FULL)
+#define PRIME3 (0x165667B19E3779F9ULL)
+
+/* block field of an index slot that names no block */
+#define EMPTY (-1)
+#define TOMBSTONE (-2)
+
+typedef struct {
+    uint64_t hash;
+    int block;
+} dedup_slot_t;
+
+/*
+ * Open-addressing hash table, at most half full of blocks. Forgotten
+ * blocks leave tombstones (so that probing goes past them), which are
+ * cleared by rebuilding the table into a spare one once they fill a
+ * quarter of it.
+ */
+static struct {
+    pthread_mutex_t lock;
+    dedup_slot_t *table;
+    dedup_slot_t *spare;
+    size_t capacity; /* a power of two */
+    size_t tombstones;
+    atomic_int *slot_of; /* each block's slot, -1 if not in the index */
+    size_t max_block_count;
+    uint64_t (*hash)(void const *data, size_t len);
+} dedup_index = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static inline uint64_t avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+/*
+ * Four independent lanes of 64-bit words, so that the multiplications of
+ * consecutive words overlap.
+ */
+static uint64_t hash_portable(void const *data, size_t len) {
+    unsigned char const *p = data;
+    uint64_t lane[4] = {PRIME1 + PRIME2, PRIME2, 0, 0 - PRIME1};
+    size_t i = 0;
+    for (; i + 4 * sizeof(uint64_t) <= len; i += 4 * sizeof(uint64_t)) {
+        for (int l = 0; l < 4; l++) {
+            uint64_t word;
+            memcpy(&word, p + i + (size_t)l * sizeof(uint64_t), sizeof(word));
+            lane[l] = rotl(lane[l] + word * PRIME2, 31) * PRIME1;
+        }
+    }
+    uint64_t h = rotl(lane[0], 1) + rotl(lane[1], 7) + rotl(lane[2], 12) + rotl(lane[3], 18) + len;
+    for (; i < len; i++) {
+        h = rotl(h ^ ((uint64_t)p[i] * PRIME3), 11) * PRIME1;
+    }
+    return avalanche(h);
+}
+
+#ifdef HAVE_CRC32C
+/*
+ * Three independent CRC32C chains (the instruction has a latency of three
+ * cycles and a throughput of one), combined into 64 bits.
+ */
+__attribute__((target("sse4.2"))) static uint64_t hash_crc32c(void const *data, size_t len) {
+    unsigned char const *p = data;
+    uint64_t a = 0, b = PRIME1, c = PRIME2;
+    uint64_t word[3];
+    size_t i = 0;
+    for (; i + sizeof(word) <= len; i += sizeof(word)) {
+        memcpy(word, p + i, sizeof(word));
+        a = _mm_crc32_u64(a, word[0]);
+        b = _mm_crc32_u64(b, word[1]);
+        c = _mm_crc32_u64(c, word[2]);
+    }
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        memcpy(word, p + i, sizeof(uint64_t));
+        a = _mm_crc32_u64(a, word[0]);
+    }
+    for (; i < len; i++) {
+        a = _mm_crc32_u8((uint32_t)a, p[i]);
+    }
+    return avalanche(((a << 32) | (b & 0xFFFFFFFF)) ^ rotl(c, 17) ^ len);
+}
+#endif
+
+int dedup_init(size_t max_block_count) {
+    dedup_destroy();
+    size_t capacity = 1;
+    while (capacity < 2 * max_block_count) {
+        capacity *= 2;
+    }
+    dedup_index.table = malloc(capacity * sizeof(dedup_slot_t));
+    dedup_index.spare = malloc(capacity * sizeof(dedup_slot_t));
+    dedup_index.slot_of = malloc(max_block_count * sizeof(atomic_int));
+    if (dedup_index.table == NULL || dedup_index.spare == NULL || dedup_index.slot_of == NULL) {
+        dedup_destroy();
+        return -1;
+    }
+    for (size_t s = 0; s < capacity; s++) {
+        dedup_index.table[s].block = EMPTY;
+    }
+    for (size_t b = 0; b < max_block_count; b++) {
+        atomic_init(&dedup_index.slot_of[b], -1);
+    }
+    dedup_index.capacity = capacity;
+    dedup_index.tombstones = 0;
+    dedup_index.max_block_count = max_block_count;
+    dedup_index.hash = hash_portable;
+#ifdef HAVE_CRC32C
+    if (__builtin_cpu_supports("sse4.2")) {
+        dedup_index.hash = hash_crc32c;
+    }
+#endif
+    return 0;
+}
+
+void dedup_destroy() {
+    free(dedup_index.table);
+    free(dedup_index.spare);
+    free(dedup_index.slot_of);
+    dedup_index.table = NULL;
+    dedup_index.spare = NULL;
+    dedup_index.slot_of = NULL;
+}
+
+bool dedup_enabled() { return dedup_index.table != NULL; }
+
+uint64_t dedup_hash(void const *data, size_t len) { return dedup_index.hash(data, len); }
+
+/*
+ * Places a block in the first free slot of its probe sequence.
+ * The caller holds the index's lock.
+ */
+static void place(dedup_slot_t *table, uint64_t hash, int block) {
+    size_t mask = dedup_index.capacity - 1;
+    size_t s = (size_t)hash & mask;
+    while (table[s].block >= 0) {
+        s = (s + 1) & mask;
+    }
+    table[s].hash = hash;
+    table[s].block = block;
+    atomic_store_explicit(&dedup_index.slot_of[block], (int)s, memory_order_relaxed);
+}
+
+/*
+ * Rebuilds the table without tombstones.
+ * The caller holds the index's lock.
+ */
+static void rebuild() {
+    dedup_slot_t *old = dedup_index.table;
+    for (size_t s = 0; s < dedup_index.capacity; s++) {
+        dedup_index.spare[s].block = EMPTY;
+    }
+    for (size_t s = 0; s < dedup_index.capacity; s++) {
+        if (old[s].block >= 0) {
+            place(dedup_index.spare, old[s].hash, old[s].block);
+        }
+    }
+    dedup_index.table = dedup_index.spare;
+    dedup_index.spare = old;
+    dedup_index.tombstones = 0;
+}
+
+int dedup_find(uint64_t hash, bool (*claim)(int block, void *arg), void *arg) {
+    pthread_mutex_lock(&dedup_index.lock);
+    size_t mask = dedup_index.capacity - 1;
+    int found = -1;
+    for (size_t s = (size_t)hash & mask; dedup_index.table[s].block != EMPTY; s = (s + 1) & mask) {
+        int block = dedup_index.table[s].block;
+        if (block >= 0 && dedup_index.table[s].hash == hash && claim(block, arg)) {
+            found = block;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&dedup_index.lock);
+    return found;
+}
+
+void dedup_insert(uint64_t hash, int block) {
+    pthread_mutex_lock(&dedup_index.lock);
+    if (dedup_index.tombstones > dedup_index.capacity / 4) {
+        rebuild();
+    }
+    size_t mask = dedup_index.capacity - 1;
+    size_t s = (size_t)hash & mask;
+    while (dedup_index.table[s].block >= 0) {
+        s = (s + 1) & mask;
+    }
+    if (dedup_index.table[s].block == TOMBSTONE) {
+        dedup_index.tombstones--;
+    }
+    dedup_index.table[s].hash = hash;
+    dedup_index.table[s].block = block;
+    atomic_store_explicit(&dedup_index.slot_of[block], (int)s, memory_order_relaxed);
+    pthread_mutex_unlock(&dedup_index.lock);
+}
+
+void dedup_forget(int block) {
+    /* only a holder of the block changes its slot, so a block found out of
+     * the index without the lock is not in it */
+    if (!dedup_enabled() || atomic_load_explicit(&dedup_index.slot_of[block], memory_order_relaxed) == -1) {
+        return;
+    }
+    pthread_mutex_lock(&dedup_index.lock);
+    int s = atomic_load_explicit(&dedup_index.slot_of[block], memory_order_relaxed);
+    if (s != -1) {
+        dedup_index.table[s].block = TOMBSTONE;
+        dedup_index.tombstones++;
+        atomic_store_explicit(&dedup_index.slot_of[block], -1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&dedup_index.lock);
+}
+
+size_t dedup_memory() {
+    if (!dedup_enabled()) {
+        return 0;
+    }
+    return 2 * dedup_index.capacity * sizeof(dedup_slot_t) + dedup_index.max_block_count * sizeof(atomic_int);
+}
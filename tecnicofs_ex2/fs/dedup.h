@@ -0,0 +1,64 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Deduplication index
+ * Maps the content hash of a full data block to the block holding it, so
+ * that a block written with the same contents can be shared instead of
+ * stored again. The index only names blocks that are not changed in place:
+ * a block must be forgotten before its owner writes to it, and when it is
+ * freed. Hashes may collide, so a candidate is always compared in full (by
+ * the claim function given to dedup_find).
+ */
+
+/*
+ * Initializes an empty index for a FS of max_block_count blocks.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int dedup_init(size_t max_block_count);
+
+/*
+ * Frees the index (deduplication is then off).
+ */
+void dedup_destroy();
+
+/*
+ * Returns whether the index exists (deduplication is on).
+ */
+bool dedup_enabled();
+
+/*
+ * Hashes a block's contents (with SSE4.2 CRC32C instructions where the CPU
+ * has them).
+ */
+uint64_t dedup_hash(void const *data, size_t len);
+
+/*
+ * Looks for a block with the given hash. claim is called, holding the
+ * index's lock (so the candidate can be neither forgotten nor freed), on
+ * each candidate until it returns true.
+ * Returns: the block claimed, or -1 if none
+ */
+int dedup_find(uint64_t hash, bool (*claim)(int block, void *arg), void *arg);
+
+/*
+ * Adds a block, not yet in the index, with the given hash.
+ */
+void dedup_insert(uint64_t hash, int block);
+
+/*
+ * Removes a block from the index, if there; once it returns, dedup_find no
+ * longer claims the block.
+ */
+void dedup_forget(int block);
+
+/*
+ * Returns the memory taken by the index, in bytes.
+ */
+size_t dedup_memory();
+
+#endif // DEDUP_H
@@ -0,0 +1,184 @@
+#include "executor.h"
+#include "config.h"
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/*
+ * Deque of items, in a ring (it never holds more than max_items); each has
+ * a lock of its own, in a cache line of its own.
+ */
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+    int *items;
+    size_t top;
+    size_t count;
+    pthread_cond_t wake; /* its worker, waiting for items (with the pool's lock) */
+    bool sleeping;
+} deque_t;
+
+static struct {
+    deque_t *deques;
+    size_t n_workers;
+    size_t capacity;
+    bool shared; /* every worker uses deques[0] */
+    atomic_size_t pending; /* items in the deques */
+    atomic_size_t idle;    /* workers about to wait or waiting */
+    /* taken only to wait for items and to wake up waiting workers */
+    pthread_mutex_t lock;
+    bool stopped;
+} pool = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+int executor_init(size_t workers, size_t max_items, bool shared) {
+    pool.deques = aligned_alloc(CACHE_LINE_SIZE, workers * sizeof(deque_t));
+    if (pool.deques == NULL || workers == 0) {
+        free(pool.deques);
+        return -1;
+    }
+    pool.n_workers = workers;
+    pool.capacity = max_items;
+    pool.shared = shared;
+    for (size_t w = 0; w < workers; w++) {
+        deque_t *d = &pool.deques[w];
+        pthread_mutex_init(&d->lock, NULL);
+        pthread_cond_init(&d->wake, NULL);
+        d->items = malloc(max_items * sizeof(int));
+        d->top = 0;
+        d->count = 0;
+        d->sleeping = false;
+        if (d->items == NULL) {
+            pool.n_workers = w + 1;
+            executor_destroy();
+            return -1;
+        }
+    }
+    atomic_store(&pool.pending, 0);
+    atomic_store(&pool.idle, 0);
+    pool.stopped = false;
+    return 0;
+}
+
+void executor_destroy() {
+    for (size_t w = 0; w < pool.n_workers; w++) {
+        pthread_mutex_destroy(&pool.deques[w].lock);
+        pthread_cond_destroy(&pool.deques[w].wake);
+        free(pool.deques[w].items);
+    }
+    free(pool.deques);
+    pool.deques = NULL;
+    pool.n_workers = 0;
+}
+
+static inline deque_t *deque_of(size_t worker) { return &pool.deques[pool.shared ? 0 : worker % pool.n_workers]; }
+
+/*
+ * Wakes up a waiting worker (the given one, if it is waiting) to take an
+ * item just queued.
+ */
+static void wake_worker(size_t worker) {
+    if (atomic_load(&pool.idle) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&pool.lock);
+    deque_t *d = &pool.deques[worker % pool.n_workers];
+    for (size_t i = 0; !d->sleeping && i < pool.n_workers; i++) {
+        d = &pool.deques[(worker + i) % pool.n_workers];
+    }
+    if (d->sleeping) {
+        pthread_cond_signal(&d->wake);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void executor_submit(int item, size_t home) {
+    deque_t *d = deque_of(home);
+    pthread_mutex_lock(&d->lock);
+    d->items[(d->top + d->count) % pool.capacity] = item;
+    d->count++;
+    pthread_mutex_unlock(&d->lock);
+    atomic_fetch_add(&pool.pending, 1);
+    wake_worker(home);
+}
+
+void executor_yield(size_t worker, int item) {
+    deque_t *d = deque_of(worker);
+    pthread_mutex_lock(&d->lock);
+    if (pool.shared) {
+        /* to the back of the queue */
+        d->items[(d->top + d->count) % pool.capacity] = item;
+    } else {
+        /* to the top, as the worker takes from the bottom */
+        d->top = (d->top + pool.capacity - 1) % pool.capacity;
+        d->items[d->top] = item;
+    }
+    d->count++;
+    pthread_mutex_unlock(&d->lock);
+    atomic_fetch_add(&pool.pending, 1);
+    wake_worker(worker);
+}
+
+/*
+ * Takes the item at the top (oldest) or the bottom (newest) of a deque.
+ * Returns: the item, or -1 if it is empty
+ */
+static int take(deque_t *d, bool top) {
+    int item = -1;
+    pthread_mutex_lock(&d->lock);
+    if (d->count > 0) {
+        d->count--;
+        if (top) {
+            item = d->items[d->top];
+            d->top = (d->top + 1) % pool.capacity;
+        } else {
+            item = d->items[(d->top + d->count) % pool.capacity];
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+    if (item != -1) {
+        atomic_fetch_sub(&pool.pending, 1);
+    }
+    return item;
+}
+
+int executor_next(size_t worker) {
+    while (1) {
+        int item = take(deque_of(worker), pool.shared);
+        if (item != -1) {
+            metrics_count(METRIC_EXEC_LOCAL, 1);
+            return item;
+        }
+        for (size_t i = 1; !pool.shared && i < pool.n_workers; i++) {
+            item = take(&pool.deques[(worker + i) % pool.n_workers], true);
+            if (item != -1) {
+                metrics_count(METRIC_EXEC_STEAL, 1);
+                return item;
+            }
+        }
+
+        deque_t *d = &pool.deques[worker % pool.n_workers];
+        pthread_mutex_lock(&pool.lock);
+        atomic_fetch_add(&pool.idle, 1);
+        while (atomic_load(&pool.pending) == 0 && !pool.stopped) {
+            d->sleeping = true;
+            pthread_cond_wait(&d->wake, &pool.lock);
+            d->sleeping = false;
+        }
+        atomic_fetch_sub(&pool.idle, 1);
+        bool done = pool.stopped && atomic_load(&pool.pending) == 0;
+        pthread_mutex_unlock(&pool.lock);
+        if (done) {
+            return -1;
+        }
+    }
+}
+
+void executor_stop() {
+    pthread_mutex_lock(&pool.lock);
+    pool.stopped = true;
+    for (size_t w = 0; w < pool.n_workers; w++) {
+        pthread_cond_signal(&pool.deques[w].wake);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
@@ -0,0 +1,54 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Executor of the server's sessions
+ * A fixed pool of workers runs the items (sessions) handed to it, each
+ * item being queued at most once at a time. Every worker has a deque of
+ * items: an item is pushed to the bottom of its home worker's, so that the
+ * requests of a session keep running on the same worker (and what they use
+ * stays in that processor's cache); a worker takes the item at the bottom
+ * of its own deque, and only when it has none steals the one at the top of
+ * another's. With a shared queue instead, every worker takes items in order
+ * from a single locked queue (for comparison).
+ */
+
+/*
+ * Initializes the executor for the given number of workers and items 0 to
+ * max_items - 1.
+ * Returns 0 if successful, -1 otherwise
+ */
+int executor_init(size_t workers, size_t max_items, bool shared);
+
+/*
+ * Frees the executor; no worker may be using it.
+ */
+void executor_destroy();
+
+/*
+ * Queues an item on its home worker, waking a worker up if there is one
+ * waiting.
+ */
+void executor_submit(int item, size_t home);
+
+/*
+ * Queues an item a worker is done with for now, behind the others it has.
+ */
+void executor_yield(size_t worker, int item);
+
+/*
+ * Takes the next item for a worker: one of its own, or else one stolen
+ * from another worker; waits for one if there is none.
+ * Returns: the item, or -1 once the executor is stopped and no item is left
+ */
+int executor_next(size_t worker);
+
+/*
+ * Stops the executor: the workers take what is left, and then stop waiting.
+ */
+void executor_stop();
+
+#endif // EXECUTOR_H
@@ -0,0 +1,82 @@
+#include "fingerprint.h"
+#include "config.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_SSE2
+#endif
+
+#define FNV_OFFSET (2166136261U)
+#define FNV_PRIME (16777619U)
+
+uint32_t name_fingerprint(char const *name) {
+    size_t len = strnlen(name, MAX_FILE_NAME);
+    uint32_t h = FNV_OFFSET;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)name[i]) * FNV_PRIME;
+    }
+    h = (h ^ (uint32_t)len) * FNV_PRIME;
+    h ^= h >> 15;
+    return h == 0 ? 1 : h;
+}
+
+#ifdef HAVE_SSE2
+/*
+ * Compares whole groups of lanes (the array is padded), starting with the
+ * one holding from, whose lanes below it are masked off.
+ */
+static int find_sse2(uint32_t const *prints, size_t count, uint32_t print, size_t from) {
+    __m128i key = _mm_set1_epi32((int)print);
+    for (size_t i = from & ~(size_t)3; i < count; i += 4) {
+        __m128i lanes = _mm_loadu_si128((__m128i const *)(void const *)(prints + i));
+        unsigned int hits = (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(lanes, key)));
+        if (i < from) {
+            hits &= ~0U << (from - i);
+        }
+        if (hits != 0) {
+            size_t e = i + (size_t)__builtin_ctz(hits);
+            return e < count ? (int)e : -1;
+        }
+    }
+    return -1;
+}
+
+__attribute__((target("avx2"))) static int find_avx2(uint32_t const *prints, size_t count, uint32_t print,
+                                                     size_t from) {
+    __m256i key = _mm256_set1_epi32((int)print);
+    for (size_t i = from & ~(size_t)7; i < count; i += 8) {
+        __m256i lanes = _mm256_loadu_si256((__m256i const *)(void const *)(prints + i));
+        unsigned int hits = (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(lanes, key)));
+        if (i < from) {
+            hits &= ~0U << (from - i);
+        }
+        if (hits != 0) {
+            size_t e = i + (size_t)__builtin_ctz(hits);
+            return e < count ? (int)e : -1;
+        }
+    }
+    return -1;
+}
+#else
+static int find_portable(uint32_t const *prints, size_t count, uint32_t print, size_t from) {
+    for (size_t i = from; i < count; i++) {
+        if (prints[i] == print) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+#endif
+
+int fingerprint_find(uint32_t const *prints, size_t count, uint32_t print, size_t from) {
+#ifdef HAVE_SSE2
+    if (__builtin_cpu_supports("avx2")) {
+        return find_avx2(prints, count, print, from);
+    }
+    return find_sse2(prints, count, print, from);
+#else
+    return find_portable(prints, count, print, from);
+#endif
+}
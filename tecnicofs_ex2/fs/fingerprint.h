@@ -0,0 +1,32 @@
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Directory name fingerprints
+ * A directory keeps, besides its entries, a fingerprint of each entry's
+ * name (a 32-bit hash of its bytes and length; 0 for an empty entry) in a
+ * contiguous array, so that a lookup scans FINGERPRINT_LANES fingerprints
+ * per compare (with AVX2 where the CPU has it, SSE2 otherwise) and compares
+ * names in full only where the fingerprints match.
+ */
+
+/* fingerprints compared at once; arrays are padded to a multiple of it */
+#define FINGERPRINT_LANES (8)
+
+/*
+ * Returns the fingerprint of a name (of at most MAX_FILE_NAME bytes), which
+ * is never 0.
+ */
+uint32_t name_fingerprint(char const *name);
+
+/*
+ * Looks for a fingerprint in an array of count of them (padded with zeros
+ * to a multiple of FINGERPRINT_LANES), from index from on.
+ * Returns: the index of the first match, or -1 if none
+ */
+int fingerprint_find(uint32_t const *prints, size_t count, uint32_t print, size_t from);
+
+#endif // FINGERPRINT_H
@@ -0,0 +1,91 @@
+#include "lease.h"
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define WORD_BITS (64)
+
+/*
+ * Everything is serialized by one lock, which is held while recalling (so
+ * no lease on the file is granted meanwhile).
+ */
+static struct {
+    pthread_mutex_t lock;
+    uint64_t *holders; /* words per i-node, a bit per session */
+    size_t words;
+    size_t n_inodes;
+    size_t n_sessions;
+    size_t held; /* leases held, by any session on any file */
+} leases = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+int lease_init(size_t inodes, size_t sessions) {
+    leases.words = (sessions + WORD_BITS - 1) / WORD_BITS;
+    leases.holders = calloc(inodes * leases.words, sizeof(uint64_t));
+    if (leases.holders == NULL) {
+        return -1;
+    }
+    leases.n_inodes = inodes;
+    leases.n_sessions = sessions;
+    leases.held = 0;
+    return 0;
+}
+
+void lease_destroy() {
+    free(leases.holders);
+    leases.holders = NULL;
+}
+
+static inline bool valid(int inumber, unsigned int session) {
+    return inumber >= 0 && (size_t)inumber < leases.n_inodes && session < leases.n_sessions;
+}
+
+void lease_grant(int inumber, unsigned int session) {
+    if (!valid(inumber, session)) {
+        return;
+    }
+    pthread_mutex_lock(&leases.lock);
+    uint64_t *word = &leases.holders[(size_t)inumber * leases.words + session / WORD_BITS];
+    uint64_t bit = (uint64_t)1 << (session % WORD_BITS);
+    if ((*word & bit) == 0) {
+        *word |= bit;
+        leases.held++;
+        metrics_count(METRIC_LEASE_GRANT, 1);
+    }
+    pthread_mutex_unlock(&leases.lock);
+}
+
+void lease_recall(int inumber, void (*recall)(unsigned int session, int inumber)) {
+    if (!valid(inumber, 0)) {
+        return;
+    }
+    pthread_mutex_lock(&leases.lock);
+    uint64_t *words = &leases.holders[(size_t)inumber * leases.words];
+    for (size_t w = 0; leases.held > 0 && w < leases.words; w++) {
+        while (words[w] != 0) {
+            unsigned int bit = (unsigned int)__builtin_ctzll(words[w]);
+            words[w] &= words[w] - 1;
+            leases.held--;
+            metrics_count(METRIC_LEASE_RECALL, 1);
+            recall((unsigned int)(w * WORD_BITS + bit), inumber);
+        }
+    }
+    pthread_mutex_unlock(&leases.lock);
+}
+
+void lease_drop(unsigned int session) {
+    if (!valid(0, session)) {
+        return;
+    }
+    pthread_mutex_lock(&leases.lock);
+    uint64_t bit = (uint64_t)1 << (session % WORD_BITS);
+    for (size_t i = 0; leases.held > 0 && i < leases.n_inodes; i++) {
+        uint64_t *word = &leases.holders[i * leases.words + session / WORD_BITS];
+        if (*word & bit) {
+            *word &= ~bit;
+            leases.held--;
+        }
+    }
+    pthread_mutex_unlock(&leases.lock);
+}
@@ -0,0 +1,45 @@
+#ifndef LEASE_H
+#define LEASE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Read leases of the server's sessions
+ * A session caching what it reads (see tfs_session_options_t) holds a lease
+ * on each file it caches blocks of. Before a file changes, every lease on
+ * it is recalled: each holder is told to drop what it cached of the file,
+ * and no longer holds a lease on it. The holders of each i-node are a
+ * bitmap of sessions.
+ */
+
+/*
+ * Initializes the leases of i-nodes 0 to inodes - 1, for sessions 0 to
+ * sessions - 1.
+ * Returns 0 if successful, -1 otherwise
+ */
+int lease_init(size_t inodes, size_t sessions);
+
+/*
+ * Frees the leases.
+ */
+void lease_destroy();
+
+/*
+ * Leases a file to a session. The contents read from it afterwards may be
+ * cached until the lease is recalled.
+ */
+void lease_grant(int inumber, unsigned int session);
+
+/*
+ * Recalls the leases on a file (about to change), calling recall for each
+ * of the sessions holding one.
+ */
+void lease_recall(int inumber, void (*recall)(unsigned int session, int inumber));
+
+/*
+ * Drops every lease of a session (being ended).
+ */
+void lease_drop(unsigned int session);
+
+#endif // LEASE_H
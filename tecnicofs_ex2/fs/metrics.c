@@ -0,0 +1,255 @@
+#include "metrics.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef struct {
+    atomic_uint_least64_t counters[METRIC_COUNTERS];
+    metrics_histogram_t histograms[METRICS_OPS][METRICS_PHASES];
+} metrics_thread_t;
+
+/* the last set is shared by every thread beyond METRICS_MAX_THREADS - 1,
+ * which is still correct since all updates are atomic */
+static metrics_thread_t threads[METRICS_MAX_THREADS];
+static atomic_int n_threads;
+static _Thread_local metrics_thread_t *self;
+
+static char const *const counter_names[METRIC_COUNTERS] = {
+    "insert_delay", "block_alloc", "block_free", "lock_acquire", "lock_contended", "lock_wait_ns", "block_cow",
+    "dedup_hit", "dedup_store", "block_compress", "block_decompress", "exec_local", "exec_steal",
+    "write_coalesced", "write_flush", "lease_grant", "lease_recall", "range_lock_park",
+};
+
+static char const *const phase_names[METRICS_PHASES] = {"queue", "exec", "reply"};
+
+static inline metrics_thread_t *get_self() {
+    if (self == NULL) {
+        int i = atomic_fetch_add(&n_threads, 1);
+        self = &threads[i < METRICS_MAX_THREADS ? i : METRICS_MAX_THREADS - 1];
+    }
+    return self;
+}
+
+static inline void add(atomic_uint_least64_t *value, uint64_t n) {
+    atomic_fetch_add_explicit(value, n, memory_order_relaxed);
+}
+
+static inline uint64_t get(atomic_uint_least64_t *value) {
+    return atomic_load_explicit(value, memory_order_relaxed);
+}
+
+static size_t bucket_of(uint64_t ns) {
+    if (ns < METRICS_SUB_BUCKETS) {
+        return (size_t)ns;
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    if (exponent > METRICS_MAX_EXPONENT) {
+        return METRICS_BUCKETS - 1;
+    }
+    int shift = exponent - METRICS_SUB_BUCKET_BITS;
+    return (size_t)(exponent - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS +
+           (size_t)((ns >> shift) - METRICS_SUB_BUCKETS);
+}
+
+/* midpoint of the range of values that fall in a bucket */
+static uint64_t bucket_value(size_t bucket) {
+    if (bucket < METRICS_SUB_BUCKETS) {
+        return bucket;
+    }
+    int exponent = (int)(bucket / METRICS_SUB_BUCKETS) + METRICS_SUB_BUCKET_BITS - 1;
+    int shift = exponent - METRICS_SUB_BUCKET_BITS;
+    uint64_t low = (uint64_t)(METRICS_SUB_BUCKETS + bucket % METRICS_SUB_BUCKETS) << shift;
+    return low + ((1ULL << shift) >> 1);
+}
+
+uint64_t metrics_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void metrics_count(metrics_counter_t counter, uint64_t n) { add(&get_self()->counters[counter], n); }
+
+static void raise_max(atomic_uint_least64_t *max, uint64_t value) {
+    uint64_t current = get(max);
+    while (value > current && !atomic_compare_exchange_weak(max, &current, value)) {
+    }
+}
+
+void metrics_histogram_record(metrics_histogram_t *histogram, uint64_t ns) {
+    add(&histogram->buckets[bucket_of(ns)], 1);
+    add(&histogram->sum, ns);
+    raise_max(&histogram->max, ns);
+}
+
+void metrics_histogram_merge(metrics_histogram_t *into, metrics_histogram_t *from) {
+    for (size_t b = 0; b < METRICS_BUCKETS; b++) {
+        add(&into->buckets[b], get(&from->buckets[b]));
+    }
+    add(&into->sum, get(&from->sum));
+    raise_max(&into->max, get(&from->max));
+}
+
+void metrics_record(int op_code, metrics_phase_t phase, uint64_t ns) {
+    if (op_code < 0 || op_code >= METRICS_OPS) {
+        return;
+    }
+    metrics_histogram_record(&get_self()->histograms[op_code][phase], ns);
+}
+
+uint64_t metrics_counter(metrics_counter_t counter) {
+    uint64_t total = 0;
+    for (int t = 0; t < METRICS_MAX_THREADS; t++) {
+        total += get(&threads[t].counters[counter]);
+    }
+    return total;
+}
+
+/*
+ * Adds up the histograms of every thread.
+ * Returns the number of samples
+ */
+static uint64_t merge(int op_code, metrics_phase_t phase, uint64_t buckets[METRICS_BUCKETS], uint64_t *sum,
+                      uint64_t *max) {
+    uint64_t samples = 0;
+    *sum = 0;
+    *max = 0;
+    for (size_t b = 0; b < METRICS_BUCKETS; b++) {
+        buckets[b] = 0;
+    }
+    for (int t = 0; t < METRICS_MAX_THREADS; t++) {
+        metrics_histogram_t *h = &threads[t].histograms[op_code][phase];
+        for (size_t b = 0; b < METRICS_BUCKETS; b++) {
+            uint64_t n = get(&h->buckets[b]);
+            buckets[b] += n;
+            samples += n;
+        }
+        *sum += get(&h->sum);
+        uint64_t m = get(&h->max);
+        if (m > *max) {
+            *max = m;
+        }
+    }
+    return samples;
+}
+
+/* the estimate never exceeds the largest value actually recorded */
+static uint64_t percentile(uint64_t const buckets[METRICS_BUCKETS], uint64_t samples, uint64_t max, double q) {
+    if (samples == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * (double)samples);
+    if (rank >= samples) {
+        rank = samples - 1;
+    }
+    uint64_t seen = 0;
+    for (size_t b = 0; b < METRICS_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen > rank) {
+            uint64_t value = bucket_value(b);
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
+
+/*
+ * Copies a single histogram in the form used by merge.
+ * Returns the number of samples
+ */
+static uint64_t snapshot(metrics_histogram_t *histogram, uint64_t buckets[METRICS_BUCKETS], uint64_t *sum,
+                         uint64_t *max) {
+    uint64_t samples = 0;
+    for (size_t b = 0; b < METRICS_BUCKETS; b++) {
+        buckets[b] = get(&histogram->buckets[b]);
+        samples += buckets[b];
+    }
+    *sum = get(&histogram->sum);
+    *max = get(&histogram->max);
+    return samples;
+}
+
+uint64_t metrics_histogram_samples(metrics_histogram_t *histogram) {
+    uint64_t buckets[METRICS_BUCKETS], sum, max;
+    return snapshot(histogram, buckets, &sum, &max);
+}
+
+uint64_t metrics_histogram_mean(metrics_histogram_t *histogram) {
+    uint64_t buckets[METRICS_BUCKETS], sum, max;
+    uint64_t samples = snapshot(histogram, buckets, &sum, &max);
+    return samples == 0 ? 0 : sum / samples;
+}
+
+uint64_t metrics_histogram_percentile(metrics_histogram_t *histogram, double q) {
+    uint64_t buckets[METRICS_BUCKETS], sum, max;
+    uint64_t samples = snapshot(histogram, buckets, &sum, &max);
+    return percentile(buckets, samples, max, q);
+}
+
+uint64_t metrics_samples(int op_code, metrics_phase_t phase) {
+    uint64_t buckets[METRICS_BUCKETS], sum, max;
+    if (op_code < 0 || op_code >= METRICS_OPS) {
+        return 0;
+    }
+    return merge(op_code, phase, buckets, &sum, &max);
+}
+
+uint64_t metrics_percentile(int op_code, metrics_phase_t phase, double q) {
+    uint64_t buckets[METRICS_BUCKETS], sum, max;
+    if (op_code < 0 || op_code >= METRICS_OPS) {
+        return 0;
+    }
+    uint64_t samples = merge(op_code, phase, buckets, &sum, &max);
+    return percentile(buckets, samples, max, q);
+}
+
+/*
+ * Appends formatted text to a buffer, never past its end.
+ */
+static void append(char *buffer, size_t len, size_t *used, char const *format, ...) {
+    if (*used + 1 >= len) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(buffer + *used, len - *used, format, ap);
+    va_end(ap);
+    if (n > 0) {
+        *used += (size_t)n < len - *used ? (size_t)n : len - *used - 1;
+    }
+}
+
+size_t metrics_report(char *buffer, size_t len, char const *const *op_names) {
+    uint64_t buckets[METRICS_BUCKETS], sum, max;
+    size_t used = 0;
+
+    if (len == 0) {
+        return 0;
+    }
+    buffer[0] = '\0';
+
+    for (int c = 0; c < METRIC_COUNTERS; c++) {
+        append(buffer, len, &used, "%s %llu\n", counter_names[c], (unsigned long long)metrics_counter(c));
+    }
+
+    for (int op = 0; op < METRICS_OPS; op++) {
+        for (int phase = 0; phase < METRICS_PHASES; phase++) {
+            uint64_t samples = merge(op, phase, buckets, &sum, &max);
+            if (samples == 0) {
+                continue;
+            }
+            if (op_names != NULL && op_names[op] != NULL) {
+                append(buffer, len, &used, "%s", op_names[op]);
+            } else {
+                append(buffer, len, &used, "op%d", op);
+            }
+            append(buffer, len, &used, " %s n=%llu mean=%llu p50=%llu p99=%llu p999=%llu max=%llu\n",
+                   phase_names[phase], (unsigned long long)samples, (unsigned long long)(sum / samples),
+                   (unsigned long long)percentile(buckets, samples, max, 0.5),
+                   (unsigned long long)percentile(buckets, samples, max, 0.99),
+                   (unsigned long long)percentile(buckets, samples, max, 0.999), (unsigned long long)max);
+        }
+    }
+    return used;
+}
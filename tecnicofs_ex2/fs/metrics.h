@@ -0,0 +1,143 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Server and FS metrics
+ * Every thread updates its own set of counters and latency histograms
+ * (claimed on first use), so recording never takes a lock; readers add up
+ * the sets of all threads. Histograms are log-linear (HDR-style): each power
+ * of two is split in METRICS_SUB_BUCKETS buckets, giving a relative error
+ * below 1/METRICS_SUB_BUCKETS over the whole range.
+ */
+
+#define METRICS_MAX_THREADS (32)
+#define METRICS_OPS (32)
+#define METRICS_SUB_BUCKET_BITS (3)
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+/* values up to 2^METRICS_MAX_EXPONENT ns (~73 minutes) are told apart */
+#define METRICS_MAX_EXPONENT (42)
+#define METRICS_BUCKETS ((METRICS_MAX_EXPONENT - METRICS_SUB_BUCKET_BITS + 2) * METRICS_SUB_BUCKETS)
+
+/* phases of a request whose latency is recorded, per op code */
+typedef enum {
+    METRICS_QUEUE_WAIT, /* from being queued until a worker takes it */
+    METRICS_EXEC,       /* executing the FS operation */
+    METRICS_REPLY,      /* writing the reply to the client */
+    METRICS_PHASES
+} metrics_phase_t;
+
+/* event counters */
+typedef enum {
+    METRIC_INSERT_DELAY,
+    METRIC_BLOCK_ALLOC,
+    METRIC_BLOCK_FREE,
+    METRIC_LOCK_ACQUIRE,
+    METRIC_LOCK_CONTENDED,
+    METRIC_LOCK_WAIT_NS,
+    METRIC_BLOCK_COW,
+    METRIC_DEDUP_HIT,
+    METRIC_DEDUP_STORE,
+    METRIC_BLOCK_COMPRESS,
+    METRIC_BLOCK_DECOMPRESS,
+    METRIC_EXEC_LOCAL,
+    METRIC_EXEC_STEAL,
+    METRIC_WRITE_COALESCED,
+    METRIC_WRITE_FLUSH,
+    METRIC_LEASE_GRANT,
+    METRIC_LEASE_RECALL,
+    METRIC_RANGE_LOCK_PARK,
+    METRIC_COUNTERS
+} metrics_counter_t;
+
+/*
+ * Latency histogram
+ * Besides the ones kept per thread by this module, histograms can be placed
+ * anywhere (including memory shared between processes) and used with the
+ * metrics_histogram_* functions; all updates are atomic.
+ */
+typedef struct {
+    atomic_uint_least64_t buckets[METRICS_BUCKETS];
+    atomic_uint_least64_t sum;
+    atomic_uint_least64_t max;
+} metrics_histogram_t;
+
+/*
+ * Records a value (in nanoseconds) in a histogram.
+ */
+void metrics_histogram_record(metrics_histogram_t *histogram, uint64_t ns);
+
+/*
+ * Adds every sample of 'from' to 'into'.
+ */
+void metrics_histogram_merge(metrics_histogram_t *into, metrics_histogram_t *from);
+
+/*
+ * Returns the number of samples in a histogram.
+ */
+uint64_t metrics_histogram_samples(metrics_histogram_t *histogram);
+
+/*
+ * Returns the mean of the samples in a histogram (0 if there are none).
+ */
+uint64_t metrics_histogram_mean(metrics_histogram_t *histogram);
+
+/*
+ * Estimates a percentile of a histogram (q between 0 and 1).
+ * Returns the estimate, in nanoseconds (0 if there are no samples)
+ */
+uint64_t metrics_histogram_percentile(metrics_histogram_t *histogram, double q);
+
+/*
+ * Returns a monotonic timestamp, in nanoseconds
+ */
+uint64_t metrics_now();
+
+/*
+ * Adds n to an event counter.
+ */
+void metrics_count(metrics_counter_t counter, uint64_t n);
+
+/*
+ * Records the latency of a phase of a request.
+ * Input:
+ *  - op_code: the request's op code (ignored if not below METRICS_OPS)
+ *  - phase: the phase
+ *  - ns: its duration, in nanoseconds
+ */
+void metrics_record(int op_code, metrics_phase_t phase, uint64_t ns);
+
+/*
+ * Returns the current value of an event counter (over all threads).
+ */
+uint64_t metrics_counter(metrics_counter_t counter);
+
+/*
+ * Returns the number of latencies recorded for a phase of an op code.
+ */
+uint64_t metrics_samples(int op_code, metrics_phase_t phase);
+
+/*
+ * Estimates a latency percentile.
+ * Input:
+ *  - op_code, phase: which histogram
+ *  - q: the quantile, between 0 and 1 (e.g. 0.99)
+ * Returns the estimate, in nanoseconds (0 if there are no samples)
+ */
+uint64_t metrics_percentile(int op_code, metrics_phase_t phase, double q);
+
+/*
+ * Writes a text summary (counters, and per op code and phase the sample
+ * count, mean, p50/p99/p999 and max) to a buffer, truncated if needed.
+ * Input:
+ *  - buffer, len: where to write (always null-terminated if len > 0)
+ *  - op_names: name of each op code below METRICS_OPS (NULL entries are
+ *    printed as numbers); may be NULL
+ * Returns the length of the summary written (without the terminator)
+ */
+size_t metrics_report(char *buffer, size_t len, char const *const *op_names);
+
+#endif // METRICS_H
@@ -1,23 +1,119 @@
 #include "operations.h"
+#include "metrics.h"
+#include "range_lock.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 static pthread_mutex_t single_global_lock;
 static pthread_cond_t cond;
 int number_open_files;
 
-int tfs_init() {
-    state_init();
+/* called before a file changes (see tfs_set_change_hook) */
+static void (*change_hook)(int inumber);
 
-    if (pthread_mutex_init(&single_global_lock, 0) != 0 || pthread_cond_init(&cond, 0) != 0)
+/*
+ * Write buffer of an open file (see tfs_write): the small writes through
+ * the handle, gathered until they are written together. An i-node has at
+ * most one handle with writes pending (any other use of the i-node writes
+ * them first), so they are always applied in order.
+ * Guarded by the lock of the handle's i-node.
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t offset;  /* in the file, of data */
+    uint64_t since; /* when the first of them was gathered */
+    bool failed;    /* they could not all be written (not yet reported) */
+} write_buffer_t;
+
+static size_t write_buffer_size;
+static size_t max_open_files;
+static write_buffer_t *write_buffers; /* per file handle, NULL if none */
+static char *write_buffer_data;
+static int *buffered_handle; /* per i-node: the handle with writes pending, or -1 */
+
+static int flush_writes(int inumber);
+static void discard_writes(int inumber);
+static int close_write_buffer(int fhandle, int inumber);
+
+/*
+ * Allocates the write buffers of the open files (none if their size is 0).
+ * Returns 0 if successful, -1 otherwise
+ */
+static int write_buffers_init(tfs_params const *params) {
+    write_buffer_size = params->write_buffer_size;
+    max_open_files = params->max_open_files_count;
+    if (write_buffer_size == 0) {
+        return 0;
+    }
+    write_buffers = calloc(max_open_files, sizeof(write_buffer_t));
+    write_buffer_data = malloc(max_open_files * write_buffer_size);
+    buffered_handle = malloc(params->max_inode_count * sizeof(int));
+    if (write_buffers == NULL || write_buffer_data == NULL || buffered_handle == NULL) {
+        return -1;
+    }
+    for (size_t h = 0; h < max_open_files; h++) {
+        write_buffers[h].data = write_buffer_data + h * write_buffer_size;
+    }
+    for (size_t i = 0; i < params->max_inode_count; i++) {
+        buffered_handle[i] = -1;
+    }
+    return 0;
+}
+
+static void write_buffers_destroy() {
+    free(write_buffers);
+    free(write_buffer_data);
+    free(buffered_handle);
+    write_buffers = NULL;
+    write_buffer_data = NULL;
+    buffered_handle = NULL;
+    write_buffer_size = 0;
+}
+
+/*
+ * Frees the tables tfs_init sets up, in the reverse order.
+ */
+static void destroy_tables() {
+    range_lock_destroy();
+    write_buffers_destroy();
+    state_destroy();
+}
+
+int tfs_init(tfs_params const *params) {
+    tfs_params p = params != NULL ? *params : tfs_default_params();
+    if (state_init(p) != 0) {
+        return -1;
+    }
+    if (write_buffers_init(&p) != 0 ||
+        range_lock_init(p.max_inode_count, p.max_open_files_count * RANGE_LOCKS_PER_FILE) != 0) {
+        destroy_tables();
         return -1;
+    }
+
+    if (pthread_mutex_init(&single_global_lock, 0) != 0) {
+        destroy_tables();
+        return -1;
+    }
+    if (pthread_cond_init(&cond, 0) != 0) {
+        pthread_mutex_destroy(&single_global_lock);
+        destroy_tables();
+        return -1;
+    }
 
     /* create root inode */
     int root = inode_create(T_DIRECTORY);
     if (root != ROOT_DIR_INUM) {
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&single_global_lock);
+        destroy_tables();
         return -1;
     }
 
@@ -25,7 +121,7 @@ int tfs_init() {
 }
 
 int tfs_destroy() {
-    state_destroy();
+    destroy_tables();
     if (pthread_mutex_destroy(&single_global_lock) != 0) {
         return -1;
     }
@@ -35,22 +131,62 @@ int tfs_destroy() {
     return 0;
 }
 
+/*
+ * Takes the global lock, accounting for the time spent waiting for it
+ * (only measured when the lock is contended).
+ * Returns 0 if successful, -1 otherwise
+ */
+static int fs_lock() {
+    metrics_count(METRIC_LOCK_ACQUIRE, 1);
+    if (pthread_mutex_trylock(&single_global_lock) == 0) {
+        return 0;
+    }
+    uint64_t start = metrics_now();
+    if (pthread_mutex_lock(&single_global_lock) != 0) {
+        return -1;
+    }
+    metrics_count(METRIC_LOCK_CONTENDED, 1);
+    metrics_count(METRIC_LOCK_WAIT_NS, metrics_now() - start);
+    return 0;
+}
+
 static bool valid_pathname(char const *name) {
     return name != NULL && strlen(name) > 1 && name[0] == '/';
 }
 
+int tfs_fsck(fsck_report_t *report) {
+    if (fs_lock() != 0)
+        return -1;
+    int ret = state_fsck(report);
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
+    return ret;
+}
+
 int tfs_destroy_after_all_closed() {
-    if (pthread_mutex_lock(&single_global_lock) != 0) {
+    if (tfs_wait_all_closed(NULL) == -1) {
+        return -1;
+    }
+    tfs_destroy();
+    return 0;
+}
+
+int tfs_wait_all_closed(struct timespec const *deadline) {
+    if (fs_lock() != 0) {
         return -1;
     }
     while (number_open_files != 0) {
-        pthread_cond_wait(&cond, &single_global_lock);
+        if (deadline == NULL) {
+            pthread_cond_wait(&cond, &single_global_lock);
+        } else if (pthread_cond_timedwait(&cond, &single_global_lock, deadline) == ETIMEDOUT) {
+            break;
+        }
     }
+    int r = number_open_files == 0 ? 0 : -1;
     if (pthread_mutex_unlock(&single_global_lock) != 0) {
         return -1;
     }
-    tfs_destroy();
-    return 0;
+    return r;
 }
 
 int _tfs_lookup_unsynchronized(char const *name) {
@@ -64,8 +200,20 @@ int _tfs_lookup_unsynchronized(char const *name) {
     return find_in_dir(ROOT_DIR_INUM, name);
 }
 
+/*
+ * Looks a file up as _tfs_lookup_unsynchronized, also telling which entry
+ * of the root directory names it.
+ * Returns the file's i-number, or -1 if not found
+ */
+static int lookup_entry(char const *name, int *entry) {
+    if (!valid_pathname(name)) {
+        return -1;
+    }
+    return find_entry_in_dir(ROOT_DIR_INUM, name + 1, entry);
+}
+
 int tfs_lookup(char const *name) {
-    if (pthread_mutex_lock(&single_global_lock) != 0)
+    if (fs_lock() != 0)
         return -1;
     int ret = _tfs_lookup_unsynchronized(name);
     if (pthread_mutex_unlock(&single_global_lock) != 0)
@@ -85,14 +233,23 @@ static int _tfs_open_unsynchronized(char const *name, int flags) {
             return -1;
         }
 
-        /* Trucate (if requested) */
+        /* Trucate (if requested), dropping the writes pending on the file;
+         * appending starts after them, once written */
+        bool locked = (flags & TFS_O_TRUNC) || ((flags & TFS_O_APPEND) && write_buffers != NULL);
+        if (locked && inode_lock(inum) != 0) {
+            return -1;
+        }
         if (flags & TFS_O_TRUNC) {
-            if (inode->i_size > 0) {
-                if (data_block_free(inode->i_data_block) == -1) {
-                    return -1;
-                }
-                inode->i_size = 0;
+            discard_writes(inum);
+            if (change_hook != NULL) {
+                change_hook(inum);
+            }
+            if (inode_truncate(inum) == -1) {
+                inode_unlock(inum);
+                return -1;
             }
+        } else if (locked) {
+            flush_writes(inum);
         }
         /* Determine initial offset */
         if (flags & TFS_O_APPEND) {
@@ -100,6 +257,9 @@ static int _tfs_open_unsynchronized(char const *name, int flags) {
         } else {
             offset = 0;
         }
+        if (locked) {
+            inode_unlock(inum);
+        }
     } else if (flags & TFS_O_CREAT) {
         /* The file doesn't exist; the flags specify that it should be created*/
         /* Create inode */
@@ -118,7 +278,16 @@ static int _tfs_open_unsynchronized(char const *name, int flags) {
     }
 
     /* Finally, add entry to the open file table and return the corresponding handle */
-    return add_to_open_file_table(inum, offset);
+    int fhandle = add_to_open_file_table(inum, offset);
+    if (fhandle != -1) {
+        inode_opened(inum);
+        if (write_buffers != NULL) {
+            /* nothing left from the handle's previous use */
+            write_buffers[fhandle].len = 0;
+            write_buffers[fhandle].failed = false;
+        }
+    }
+    return fhandle;
 
     /* Note: for simplification, if file was created with TFS_O_CREAT and there
      * is an error adding an entry to the open file table, the file is not
@@ -126,7 +295,7 @@ static int _tfs_open_unsynchronized(char const *name, int flags) {
 }
 
 int tfs_open(char const *name, int flags) {
-    if (pthread_mutex_lock(&single_global_lock) != 0)
+    if (fs_lock() != 0)
         return -1;
     int ret = _tfs_open_unsynchronized(name, flags);
     if (ret != -1) {
@@ -139,113 +308,920 @@ int tfs_open(char const *name, int flags) {
 }
 
 int tfs_close(int fhandle) {
-    if (pthread_mutex_lock(&single_global_lock) != 0)
+    if (fs_lock() != 0)
         return -1;
+    open_file_entry_t *file = open_file_in_use(fhandle) ? get_open_file_entry(fhandle) : NULL;
+    int inumber = file == NULL ? -1 : file->of_inumber;
+    int flushed = 0;
+    if (inumber != -1) {
+        if (write_buffers != NULL) {
+            flushed = close_write_buffer(fhandle, inumber);
+        }
+        range_lock_release_owner(inumber, fhandle);
+    }
     int r = remove_from_open_file_table(fhandle);
     if (r != -1) {
         number_open_files--;
+        /* the last close of an unlinked file deletes it */
+        r = inode_closed(inumber);
     }
     if (number_open_files == 0) {
         pthread_cond_broadcast(&cond); 
     }
     if (pthread_mutex_unlock(&single_global_lock) != 0)
         return -1;
+    /* the requests of other handles its locks were in the way of */
+    range_lock_notify();
 
-    return r;
+    return r == -1 ? -1 : flushed;
 }
 
-static ssize_t _tfs_write_unsynchronized(int fhandle, void const *buffer, size_t to_write) {
-    open_file_entry_t *file = get_open_file_entry(fhandle);
-    if (file == NULL) {
+static int _tfs_unlink_unsynchronized(char const *name) {
+    int entry;
+    int inum = lookup_entry(name, &entry);
+    if (inum == -1) {
+        return -1;
+    }
+    if (clear_dir_entry(ROOT_DIR_INUM, entry) == -1) {
         return -1;
     }
+    return inode_unlink(inum);
+}
 
-    /* From the open file table entry, we get the inode */
-    inode_t *inode = inode_get(file->of_inumber);
+int tfs_unlink(char const *name) {
+    if (fs_lock() != 0)
+        return -1;
+    int ret = _tfs_unlink_unsynchronized(name);
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
+    return ret;
+}
+
+static int _tfs_rename_unsynchronized(char const *old_name, char const *new_name) {
+    int entry;
+    int inum = lookup_entry(old_name, &entry);
+    if (inum == -1 || !valid_pathname(new_name)) {
+        return -1;
+    }
+    int target_entry;
+    int target = lookup_entry(new_name, &target_entry);
+    if (target == inum) {
+        return 0;
+    }
+    /* an existing file with the new name is replaced (its entry freed, the
+     * renamed one's stays where it is) */
+    if (target != -1 &&
+        (clear_dir_entry(ROOT_DIR_INUM, target_entry) == -1 || inode_unlink(target) == -1)) {
+        return -1;
+    }
+    return rename_dir_entry(ROOT_DIR_INUM, entry, new_name + 1);
+}
+
+int tfs_rename(char const *old_name, char const *new_name) {
+    if (fs_lock() != 0)
+        return -1;
+    int ret = _tfs_rename_unsynchronized(old_name, new_name);
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
+    return ret;
+}
+
+/*
+ * Moves the inline contents of a file to its first block, which the file
+ * needs when it grows past the inline size (or gets a block elsewhere).
+ * A file with no blocks keeps its first bytes inline whatever its size (it
+ * may be larger, with the rest a hole, once its blocks are punched out).
+ * Returns 0 if successful, -1 otherwise
+ */
+static int move_inline_data(int inumber, inode_t *inode) {
+    if (inode->i_block_count > 0 || inode->i_size == 0 || state_inline_size() == 0) {
+        return 0;
+    }
+    size_t len = inode->i_size < state_inline_size() ? inode->i_size : state_inline_size();
+    int b = inode_block_alloc(inumber, 0);
+    void *data = data_block_get(b);
+    if (data == NULL) {
+        return -1;
+    }
+    memcpy(data, inode_inline_data(inumber), len);
+    /* the inline data of a file with blocks is all zeros (see inode_t) */
+    memset(inode_inline_data(inumber), 0, state_inline_size());
+    return data_block_put(b, true);
+}
+
+/*
+ * Writes to a file at an offset, growing it if the write ends past its end.
+ * The caller holds the i-node's lock.
+ * Returns the number of bytes written, or -1 in case of error
+ */
+static ssize_t write_at(int inumber, size_t offset, void const *buffer, size_t to_write) {
+    inode_t *inode = inode_get(inumber);
     if (inode == NULL) {
         return -1;
     }
 
     /* Determine how many bytes to write */
-    if (to_write + file->of_offset > BLOCK_SIZE) {
-        to_write = BLOCK_SIZE - file->of_offset;
+    size_t max_size = state_max_file_size();
+    if (offset >= max_size) {
+        return 0;
+    }
+    if (to_write > max_size - offset) {
+        to_write = max_size - offset;
+    }
+    if (to_write == 0) {
+        return 0;
     }
 
-    if (to_write > 0) {
-        if (inode->i_size == 0) {
-            /* If empty file, allocate new block */
-            inode->i_data_block = data_block_alloc();
+    if (inode->i_block_count == 0 && offset + to_write <= state_inline_size()) {
+        /* Small files live in the i-node: no block to allocate or access */
+        memcpy((char *)inode_inline_data(inumber) + offset, buffer, to_write);
+    } else {
+        if (move_inline_data(inumber, inode) == -1) {
+            return -1;
         }
 
-        void *block = data_block_get(inode->i_data_block);
-        if (block == NULL) {
-            return -1;
+        /* Perform the actual write, block by block (writing past the end
+         * of the file leaves a hole in between) */
+        size_t block_size = state_block_size();
+        size_t written = 0;
+        while (written < to_write) {
+            size_t at = offset + written;
+            size_t in_block = at % block_size;
+            size_t chunk = block_size - in_block;
+            if (chunk > to_write - written) {
+                chunk = to_write - written;
+            }
+            char const *from = (char const *)buffer + written;
+            int r;
+            if (chunk == block_size) {
+                /* a whole block (which may be deduplicated) */
+                r = inode_block_write(inumber, at / block_size, from);
+            } else {
+                int b = inode_block_alloc(inumber, at / block_size);
+                void *data = data_block_get(b);
+                r = -1;
+                if (data != NULL) {
+                    memcpy((char *)data + in_block, from, chunk);
+                    r = data_block_put(b, true);
+                }
+            }
+            if (r == -1) {
+                /* the FS is full: a short write, if anything was written */
+                if (written == 0) {
+                    return -1;
+                }
+                break;
+            }
+            written += chunk;
         }
+        to_write = written;
+    }
 
-        /* Perform the actual write */
-        memcpy(block + file->of_offset, buffer, to_write);
+    if (offset + to_write > inode->i_size) {
+        inode->i_size = offset + to_write;
+    }
+    return (ssize_t)to_write;
+}
 
-        /* The offset associated with the file handle is
-         * incremented accordingly */
-        file->of_offset += to_write;
-        if (file->of_offset > inode->i_size) {
-            inode->i_size = file->of_offset;
+/*
+ * Writes the writes pending on an i-node, if any; failing that, their
+ * handle is told on its next write or close.
+ * The caller holds the i-node's lock.
+ * Returns 0 if successful, -1 if they could not all be written
+ */
+static int flush_writes(int inumber) {
+    int fhandle = buffered_handle == NULL ? -1 : buffered_handle[inumber];
+    if (fhandle == -1) {
+        return 0;
+    }
+    write_buffer_t *buffer = &write_buffers[fhandle];
+    buffered_handle[inumber] = -1;
+    size_t len = buffer->len;
+    buffer->len = 0;
+    metrics_count(METRIC_WRITE_FLUSH, 1);
+    if (write_at(inumber, buffer->offset, buffer->data, len) != (ssize_t)len) {
+        buffer->failed = true;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Drops the writes pending on an i-node, if any (as it is truncated).
+ * The caller holds the i-node's lock.
+ */
+static void discard_writes(int inumber) {
+    int fhandle = buffered_handle == NULL ? -1 : buffered_handle[inumber];
+    if (fhandle != -1) {
+        buffered_handle[inumber] = -1;
+        write_buffers[fhandle].len = 0;
+    }
+}
+
+static ssize_t _tfs_write_unsynchronized(int fhandle, void const *buffer, size_t to_write) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+    int inumber = file->of_inumber;
+    if (change_hook != NULL) {
+        change_hook(inumber);
+    }
+
+    if (write_buffers != NULL) {
+        write_buffer_t *pending = &write_buffers[fhandle];
+        if (pending->failed) {
+            pending->failed = false;
+            return -1;
+        }
+        /* a small write following those pending through this handle joins
+         * them; anything else writes them first */
+        int owner = buffered_handle[inumber];
+        bool small = to_write > 0 && to_write <= WRITE_COALESCE_MAX && to_write <= write_buffer_size &&
+                     file->of_offset + to_write <= state_max_file_size();
+        bool follows = owner == fhandle && file->of_offset == pending->offset + pending->len &&
+                       pending->len + to_write <= write_buffer_size;
+        if (owner != -1 && !(small && follows) && flush_writes(inumber) == -1 && owner == fhandle) {
+            pending->failed = false;
+            return -1;
+        }
+        if (small) {
+            if (pending->len == 0) {
+                pending->offset = file->of_offset;
+                pending->since = metrics_now();
+                buffered_handle[inumber] = fhandle;
+            }
+            memcpy(pending->data + pending->len, buffer, to_write);
+            pending->len += to_write;
+            file->of_offset += to_write;
+            metrics_count(METRIC_WRITE_COALESCED, 1);
+            return (ssize_t)to_write;
         }
     }
 
-    return (ssize_t)to_write;
+    ssize_t written = write_at(inumber, file->of_offset, buffer, to_write);
+
+    /* The offset associated with the file handle is
+     * incremented accordingly */
+    if (written > 0) {
+        file->of_offset += (size_t)written;
+    }
+    return written;
+}
+
+/*
+ * Locks the i-node of an open file, going through the global lock only to
+ * find it: the data is then accessed holding just the i-node's lock, so
+ * reads and writes of different files run in parallel.
+ * Returns the i-node number, or -1 if the handle is invalid (or not open)
+ */
+static int lock_open_file(int fhandle) {
+    if (fs_lock() != 0)
+        return -1;
+    open_file_entry_t *file = open_file_in_use(fhandle) ? get_open_file_entry(fhandle) : NULL;
+    int inumber = file == NULL ? -1 : file->of_inumber;
+    if (inumber != -1 && inode_lock(inumber) != 0) {
+        inumber = -1;
+    }
+    if (pthread_mutex_unlock(&single_global_lock) != 0) {
+        if (inumber != -1) {
+            inode_unlock(inumber);
+        }
+        return -1;
+    }
+    return inumber;
 }
 
 ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
-    if (pthread_mutex_lock(&single_global_lock) != 0)
+    int inumber = lock_open_file(fhandle);
+    if (inumber == -1)
         return -1;
     ssize_t ret = _tfs_write_unsynchronized(fhandle, buffer, to_write);
-    if (pthread_mutex_unlock(&single_global_lock) != 0)
-        return -1;
+    inode_unlock(inumber);
 
     return ret;
 }
 
+/*
+ * Writes what is pending in the buffer of a handle about to be closed, and
+ * empties it. The caller holds the global lock until the handle is removed,
+ * so no write through it is gathered meanwhile.
+ * Returns 0 if successful, -1 if some of its writes could not be written
+ */
+static int close_write_buffer(int fhandle, int inumber) {
+    if (inode_lock(inumber) != 0) {
+        return -1;
+    }
+    write_buffer_t *pending = &write_buffers[fhandle];
+    if (buffered_handle[inumber] == fhandle) {
+        flush_writes(inumber);
+    }
+    int r = pending->failed ? -1 : 0;
+    pending->len = 0;
+    pending->failed = false;
+    inode_unlock(inumber);
+    return r;
+}
+
+int tfs_flush_writes(uint64_t age_ns) {
+    int r = 0;
+    for (size_t h = 0; write_buffers != NULL && h < max_open_files; h++) {
+        int inumber = lock_open_file((int)h);
+        if (inumber == -1) {
+            continue;
+        }
+        if (buffered_handle[inumber] == (int)h && metrics_now() - write_buffers[h].since >= age_ns &&
+            flush_writes(inumber) == -1) {
+            r = -1;
+        }
+        inode_unlock(inumber);
+    }
+    return r;
+}
+
 static ssize_t _tfs_read_unsynchronized(int fhandle, void *buffer, size_t len) {
     open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) {
         return -1;
     }
 
+    /* The writes pending on the file are read as written */
+    flush_writes(file->of_inumber);
+
     /* From the open file table entry, we get the inode */
     inode_t *inode = inode_get(file->of_inumber);
     if (inode == NULL) {
         return -1;
     }
 
-    /* Determine how many bytes to read */
+    /* Determine how many bytes to read (the offset may be past the end) */
+    if (file->of_offset >= inode->i_size) {
+        return 0;
+    }
     size_t to_read = inode->i_size - file->of_offset;
     if (to_read > len) {
         to_read = len;
     }
 
-    if (to_read > 0) {
-        void *block = data_block_get(inode->i_data_block);
-        if (block == NULL) {
-            return -1;
+    if (inode->i_block_count == 0) {
+        /* Inline contents, followed by zeros if the file is all holes */
+        size_t inline_size = state_inline_size();
+        size_t from_inline = file->of_offset < inline_size ? inline_size - file->of_offset : 0;
+        if (from_inline > to_read) {
+            from_inline = to_read;
+        }
+        if (from_inline > 0) {
+            memcpy(buffer, (char *)inode_inline_data(file->of_inumber) + file->of_offset, from_inline);
+        }
+        memset((char *)buffer + from_inline, 0, to_read - from_inline);
+    } else {
+        /* Perform the actual read, block by block; holes are read as zeros
+         * without accessing any block */
+        size_t block_size = state_block_size();
+        for (size_t done = 0; done < to_read;) {
+            size_t offset = file->of_offset + done;
+            size_t in_block = offset % block_size;
+            size_t chunk = block_size - in_block;
+            if (chunk > to_read - done) {
+                chunk = to_read - done;
+            }
+            int b = inode_block(file->of_inumber, offset / block_size);
+            if (b == -1) {
+                memset((char *)buffer + done, 0, chunk);
+            } else {
+                void *data = data_block_get(b);
+                if (data == NULL) {
+                    return -1;
+                }
+                memcpy((char *)buffer + done, (char *)data + in_block, chunk);
+                data_block_put(b, false);
+            }
+            done += chunk;
         }
-
-        /* Perform the actual read */
-        memcpy(buffer, block + file->of_offset, to_read);
-        /* The offset associated with the file handle is incremented accordingly */
-        file->of_offset += to_read;
     }
 
+    /* The offset associated with the file handle is incremented accordingly */
+    file->of_offset += to_read;
+
     return (ssize_t)to_read;
 }
 
 ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
-    if (pthread_mutex_lock(&single_global_lock) != 0)
+    int inumber = lock_open_file(fhandle);
+    if (inumber == -1)
         return -1;
     ssize_t ret = _tfs_read_unsynchronized(fhandle, buffer, len);
+    inode_unlock(inumber);
+
+    return ret;
+}
+
+ssize_t tfs_read_at(int fhandle, size_t offset, void *buffer, size_t len, int *inumber, unsigned int *generation) {
+    int locked = lock_open_file(fhandle);
+    if (locked == -1)
+        return -1;
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    size_t saved = file->of_offset;
+    file->of_offset = offset;
+    ssize_t ret = _tfs_read_unsynchronized(fhandle, buffer, len);
+    file->of_offset = saved;
+    inode_t *inode = inode_get(locked);
+    *inumber = locked;
+    *generation = inode == NULL ? 0 : inode->i_generation;
+    inode_unlock(locked);
+
+    return ret;
+}
+
+int tfs_handle_inumber(int fhandle, unsigned int *generation) {
+    if (fs_lock() != 0)
+        return -1;
+    /* an i-node is only created again once no handle has it open */
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    int inumber = file == NULL ? -1 : file->of_inumber;
+    inode_t *inode = file == NULL ? NULL : inode_get(inumber);
+    *generation = inode == NULL ? 0 : inode->i_generation;
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
+    return inumber;
+}
+
+void tfs_set_change_hook(void (*hook)(int inumber)) { change_hook = hook; }
+
+int tfs_seek(int fhandle, size_t offset) {
+    if (offset > state_max_file_size()) {
+        return -1;
+    }
+    int inumber = lock_open_file(fhandle);
+    if (inumber == -1)
+        return -1;
+    get_open_file_entry(fhandle)->of_offset = offset;
+    inode_unlock(inumber);
+
+    return 0;
+}
+
+/*
+ * Zeroes a range of a file in the blocks that hold it (holes are zeros
+ * already).
+ * Returns 0 if successful, -1 otherwise
+ */
+static int zero_range(int inumber, size_t from, size_t to) {
+    size_t block_size = state_block_size();
+    while (from < to) {
+        size_t in_block = from % block_size;
+        size_t chunk = block_size - in_block;
+        if (chunk > to - from) {
+            chunk = to - from;
+        }
+        int b = inode_block(inumber, from / block_size);
+        if (b != -1) {
+            void *data = data_block_get(b);
+            if (data == NULL) {
+                return -1;
+            }
+            memset((char *)data + in_block, 0, chunk);
+            if (data_block_put(b, true) == -1) {
+                return -1;
+            }
+        }
+        from += chunk;
+    }
+    return 0;
+}
+
+static int _tfs_punch_hole_unsynchronized(int inumber, size_t offset, size_t len) {
+    flush_writes(inumber);
+    if (change_hook != NULL) {
+        change_hook(inumber);
+    }
+    inode_t *inode = inode_get(inumber);
+    if (inode == NULL) {
+        return -1;
+    }
+
+    /* Only the range inside the file is punched; its size does not change */
+    if (offset >= inode->i_size) {
+        return 0;
+    }
+    if (len > inode->i_size - offset) {
+        len = inode->i_size - offset;
+    }
+    size_t end = offset + len;
+
+    if (inode->i_block_count == 0) {
+        size_t inline_size = state_inline_size();
+        if (offset < inline_size) {
+            memset((char *)inode_inline_data(inumber) + offset, 0, (end < inline_size ? end : inline_size) - offset);
+        }
+        return 0;
+    }
+
+    /* Whole blocks are freed (the last one also when the range reaches the
+     * end of the file, since nothing past the end is ever read); the parts
+     * of blocks at either end are zeroed */
+    size_t block_size = state_block_size();
+    size_t first = (offset + block_size - 1) / block_size;
+    size_t last = end == inode->i_size ? (end + block_size - 1) / block_size : end / block_size;
+    if (first >= last) {
+        return zero_range(inumber, offset, end);
+    }
+    if (zero_range(inumber, offset, first * block_size) == -1 ||
+        zero_range(inumber, last * block_size, end) == -1) {
+        return -1;
+    }
+    return inode_punch_blocks(inumber, first, last);
+}
+
+int tfs_punch_hole(int fhandle, size_t offset, size_t len) {
+    int inumber = lock_open_file(fhandle);
+    if (inumber == -1)
+        return -1;
+    int ret = _tfs_punch_hole_unsynchronized(inumber, offset, len);
+    inode_unlock(inumber);
+
+    return ret;
+}
+
+static int _tfs_fallocate_unsynchronized(int inumber, size_t offset, size_t len) {
+    flush_writes(inumber);
+    if (change_hook != NULL) {
+        change_hook(inumber);
+    }
+    inode_t *inode = inode_get(inumber);
+    size_t max_size = state_max_file_size();
+    if (inode == NULL || len == 0 || offset > max_size || len > max_size - offset) {
+        return -1;
+    }
+    size_t end = offset + len;
+
+    /* A range that fits inline needs no block */
+    if (inode->i_block_count > 0 || end > state_inline_size()) {
+        if (move_inline_data(inumber, inode) == -1) {
+            return -1;
+        }
+        size_t block_size = state_block_size();
+        for (size_t i = offset / block_size; i < (end + block_size - 1) / block_size; i++) {
+            if (inode_block_alloc(inumber, i) == -1) {
+                return -1;
+            }
+        }
+    }
+    if (end > inode->i_size) {
+        inode->i_size = end;
+    }
+    return 0;
+}
+
+int tfs_fallocate(int fhandle, size_t offset, size_t len) {
+    int inumber = lock_open_file(fhandle);
+    if (inumber == -1)
+        return -1;
+    int ret = _tfs_fallocate_unsynchronized(inumber, offset, len);
+    inode_unlock(inumber);
+
+    return ret;
+}
+
+/*
+ * Returns the end of the range of len bytes from offset (see tfs_lock).
+ */
+static inline size_t range_end(size_t offset, size_t len) {
+    return len == 0 || len > SIZE_MAX - offset ? SIZE_MAX : offset + len;
+}
+
+int tfs_lock_async(int fhandle, size_t offset, size_t len, int flags, void (*granted)(int result, void *arg),
+                   void *arg) {
+    if (fs_lock() != 0)
+        return -1;
+    /* holding the global lock, so the handle is not closed meanwhile (and
+     * a lock is never left on a closed one) */
+    open_file_entry_t *file = open_file_in_use(fhandle) ? get_open_file_entry(fhandle) : NULL;
+    int ret = -1;
+    if (file != NULL) {
+        ret = range_lock_acquire(file->of_inumber, fhandle, offset, range_end(offset, len),
+                                 (flags & TFS_LOCK_EXCLUSIVE) != 0, (flags & TFS_LOCK_NOWAIT) == 0, granted, arg);
+    }
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
+    return ret;
+}
+
+/* a thread waiting in tfs_lock */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t granted;
+    bool done;
+    int result;
+} lock_waiter_t;
+
+static void wake_lock_waiter(int result, void *arg) {
+    lock_waiter_t *waiter = arg;
+    pthread_mutex_lock(&waiter->lock);
+    waiter->result = result;
+    waiter->done = true;
+    pthread_cond_signal(&waiter->granted);
+    pthread_mutex_unlock(&waiter->lock);
+}
+
+int tfs_lock(int fhandle, size_t offset, size_t len, int flags) {
+    lock_waiter_t waiter = {.lock = PTHREAD_MUTEX_INITIALIZER, .granted = PTHREAD_COND_INITIALIZER, .done = false};
+    int ret = tfs_lock_async(fhandle, offset, len, flags, wake_lock_waiter, &waiter);
+    if (ret == 1) {
+        pthread_mutex_lock(&waiter.lock);
+        while (!waiter.done) {
+            pthread_cond_wait(&waiter.granted, &waiter.lock);
+        }
+        ret = waiter.result;
+        pthread_mutex_unlock(&waiter.lock);
+    }
+    pthread_cond_destroy(&waiter.granted);
+    pthread_mutex_destroy(&waiter.lock);
+    return ret;
+}
+
+int tfs_unlock(int fhandle, size_t offset, size_t len) {
+    if (fs_lock() != 0)
+        return -1;
+    open_file_entry_t *file = open_file_in_use(fhandle) ? get_open_file_entry(fhandle) : NULL;
+    int ret = file == NULL ? -1 : range_lock_release(file->of_inumber, fhandle, offset, range_end(offset, len));
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
+    range_lock_notify();
+    return ret;
+}
+
+
+/*
+ * Fills the attributes of a file, writing the writes gathered for it first.
+ * The caller holds the i-node's lock.
+ * Returns 0 if successful, -1 otherwise
+ */
+static int stat_inode(int inumber, tfs_stat_t *st) {
+    flush_writes(inumber);
+    inode_t *inode = inode_get(inumber);
+    if (inode == NULL) {
+        return -1;
+    }
+    st->inumber = inumber;
+    st->size = inode->i_size;
+    st->blocks = inode->i_block_count;
+    return 0;
+}
+
+int tfs_stat(char const *name, tfs_stat_t *st) {
+    if (fs_lock() != 0)
+        return -1;
+    int inumber = _tfs_lookup_unsynchronized(name);
+    int ret = -1;
+    if (inumber != -1 && inode_lock(inumber) == 0) {
+        ret = stat_inode(inumber, st);
+        inode_unlock(inumber);
+    }
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
+    return ret;
+}
+
+int tfs_fstat(int fhandle, tfs_stat_t *st) {
+    int inumber = lock_open_file(fhandle);
+    if (inumber == -1)
+        return -1;
+    int ret = stat_inode(inumber, st);
+    inode_unlock(inumber);
+
+    return ret;
+}
+
+/*
+ * Lists the files named by a window of the directory's entry slots, up to
+ * max of them (see tfs_readdir_slots). Only the slots in the window are
+ * read, a few at a time.
+ */
+static ssize_t list_dir(size_t first, size_t count, tfs_dirent_t *entries, size_t max, size_t *slots) {
+    dir_entry_t dir_entry[LIST_DIR_BATCH];
+    if (fs_lock() != 0) {
+        return -1;
+    }
+    *slots = MAX_DIR_ENTRIES;
+    ssize_t listed = 0;
+    size_t end = first + (count < MAX_DIR_ENTRIES ? count : MAX_DIR_ENTRIES);
+    for (size_t e = first; listed != -1 && (size_t)listed < max && e < end;) {
+        ssize_t n = read_dir(ROOT_DIR_INUM, e, end - e < LIST_DIR_BATCH ? end - e : LIST_DIR_BATCH, dir_entry);
+        if (n <= 0) {
+            listed = n == 0 ? listed : -1;
+            break;
+        }
+        for (ssize_t i = 0; i < n && (size_t)listed < max; i++) {
+            int inumber = dir_entry[i].d_inumber;
+            if (inumber == -1 || inode_lock(inumber) != 0) {
+                continue;
+            }
+            tfs_dirent_t *listing = &entries[listed];
+            if (stat_inode(inumber, &listing->stat) == 0) {
+                memcpy(listing->name, dir_entry[i].d_name, sizeof(listing->name));
+                listing->name[sizeof(listing->name) - 1] = '\0';
+                listed++;
+            }
+            inode_unlock(inumber);
+        }
+        e += (size_t)n;
+    }
     if (pthread_mutex_unlock(&single_global_lock) != 0)
+        listed = -1;
+    return listed;
+}
+
+ssize_t tfs_readdir_plus(tfs_dirent_t *entries, size_t max) {
+    size_t slots;
+    return list_dir(0, SIZE_MAX, entries, max, &slots);
+}
+
+ssize_t tfs_readdir_slots(size_t first, size_t count, tfs_dirent_t *entries, size_t *slots) {
+    return list_dir(first, count, entries, count, slots);
+}
+
+/*
+ * Writes a whole buffer to a file descriptor. A non-blocking one is waited
+ * on while full, for COPY_STALL_TIMEOUT_MS at most each time.
+ * Returns 0 if successful, -1 otherwise
+ */
+static int write_all(int fd, char const *buffer, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buffer, len);
+        if (w == -1 && errno == EAGAIN) {
+            struct pollfd room = {.fd = fd, .events = POLLOUT};
+            if (poll(&room, 1, COPY_STALL_TIMEOUT_MS) != 1) {
+                return -1;
+            }
+            continue;
+        }
+        if (w <= 0) {
+            return -1;
+        }
+        buffer += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+ssize_t tfs_copy_to_fd(char const *source_path, int fd) {
+    char chunk[COPY_CHUNK_SIZE];
+    ssize_t total = 0;
+
+    int fhandle = tfs_open(source_path, 0);
+    if (fhandle == -1) {
+        return -1;
+    }
+
+    /* the lock is only held while a chunk is taken from the file, never
+     * while writing it out (to a FIFO, whose reader is only waited on for
+     * so long) */
+    ssize_t r;
+    while ((r = tfs_read(fhandle, chunk, COPY_CHUNK_SIZE)) > 0) {
+        if (write_all(fd, chunk, (size_t)r) == -1) {
+            r = -1;
+            break;
+        }
+        total += r;
+    }
+
+    if (tfs_close(fhandle) == -1 || r == -1) {
         return -1;
+    }
+    return total;
+}
+
+ssize_t tfs_copy_from_fd(int fd, char const *dest_path) {
+    char chunk[COPY_CHUNK_SIZE];
+    ssize_t total = 0;
 
+    int fhandle = tfs_open(dest_path, TFS_O_CREAT | TFS_O_TRUNC);
+    if (fhandle == -1) {
+        return -1;
+    }
+
+    ssize_t r;
+    while ((r = read(fd, chunk, COPY_CHUNK_SIZE)) > 0) {
+        ssize_t w = tfs_write(fhandle, chunk, (size_t)r);
+        if (w != r) {
+            /* the file is full (or the write failed) */
+            r = -1;
+            break;
+        }
+        total += w;
+    }
+
+    if (tfs_close(fhandle) == -1 || r == -1) {
+        return -1;
+    }
+    return total;
+}
+
+int tfs_copy_to_external_fs(char const *source_path, char const *dest_path) {
+    int fd = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t r = tfs_copy_to_fd(source_path, fd);
+    if (close(fd) == -1 || r == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+int tfs_copy_from_external_fs(char const *source_path, char const *dest_path) {
+    int fd = open(source_path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t r = tfs_copy_from_fd(fd, dest_path);
+    if (close(fd) == -1 || r == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+int tfs_snapshot() {
+    tfs_flush_writes(0);
+    if (fs_lock() != 0)
+        return -1;
+    int ret = state_snapshot();
+    if (pthread_mutex_unlock(&single_global_lock) != 0)
+        return -1;
     return ret;
 }
 
+int tfs_snapshot_release() {
+    return state_snapshot_release();
+}
+
+ssize_t tfs_snapshot_read(char const *name, size_t offset, void *buffer, size_t len) {
+    if (!valid_pathname(name) || snapshot_get() == -1) {
+        return -1;
+    }
+    ssize_t r = snapshot_read(snapshot_find(name + 1), offset, buffer, len);
+    snapshot_put();
+    return r;
+}
+
+/*
+ * Writes one file of the snapshot to an image (see tfs_snapshot_export).
+ * Returns the number of bytes written, or -1 in case of error
+ */
+static ssize_t export_file(int fd, dir_entry_t const *entry) {
+    char chunk[COPY_CHUNK_SIZE];
+    ssize_t size = snapshot_size(entry->d_inumber);
+    if (size == -1) {
+        return -1;
+    }
+    int n = snprintf(chunk, sizeof(chunk), "/%.*s %zd\n", MAX_FILE_NAME, entry->d_name, size);
+    if (write_all(fd, chunk, (size_t)n) == -1) {
+        return -1;
+    }
+    ssize_t total = n;
+    ssize_t r;
+    while ((r = snapshot_read(entry->d_inumber, (size_t)(total - n), chunk, COPY_CHUNK_SIZE)) > 0) {
+        if (write_all(fd, chunk, (size_t)r) == -1) {
+            return -1;
+        }
+        total += r;
+    }
+    return r == -1 ? -1 : total;
+}
+
+ssize_t tfs_snapshot_export(char const *dest_path) {
+    int fd = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t total = tfs_snapshot_export_to_fd(fd);
+    if (close(fd) == -1) {
+        return -1;
+    }
+    return total;
+}
+
+ssize_t tfs_snapshot_export_to_fd(int fd) {
+    if (snapshot_get() == -1) {
+        return -1;
+    }
+
+    ssize_t total = (ssize_t)strlen(SNAPSHOT_MAGIC);
+    if (write_all(fd, SNAPSHOT_MAGIC, (size_t)total) == -1) {
+        total = -1;
+    }
+    dir_entry_t *dir_entry = malloc(MAX_DIR_ENTRIES * sizeof(dir_entry_t));
+    if (dir_entry == NULL || snapshot_dir(dir_entry) == -1) {
+        total = -1;
+    }
+    for (size_t e = 0; total != -1 && e < MAX_DIR_ENTRIES; e++) {
+        if (dir_entry[e].d_inumber != -1) {
+            ssize_t w = export_file(fd, &dir_entry[e]);
+            total = w == -1 ? -1 : total + w;
+        }
+    }
+    snapshot_put();
+    free(dir_entry);
+    return total;
+}
@@ -5,12 +5,16 @@
 #include "config.h"
 #include "state.h"
 #include <sys/types.h>
+#include <time.h>
 
 /*
  * Initializes tecnicofs
+ * Input:
+ *  - params: the geometry of the FS (block size and sizes of the tables), or
+ *    NULL for the default one (see tfs_default_params)
  * Returns 0 if successful, -1 otherwise.
  */
-int tfs_init();
+int tfs_init(tfs_params const *params);
 
 /*
  * Destroy tecnicofs
@@ -24,6 +28,16 @@ int tfs_destroy();
  */
 int tfs_destroy_after_all_closed();
 
+/*
+ * Waits until no file is open, without destroying tecnicofs.
+ * Input:
+ *  - deadline: when to stop waiting (CLOCK_REALTIME), or NULL to wait for
+ *    as long as it takes
+ * Returns 0 if no file is open, -1 if some still are at the deadline (or
+ * on error).
+ */
+int tfs_wait_all_closed(struct timespec const *deadline);
+
 /*
  * Looks for a file
  * Note: as a simplification, only a plain directory space (root directory only)
@@ -44,23 +58,83 @@ int tfs_lookup(char const *name);
  */
 int tfs_open(char const *name, int flags);
 
-/* Closes a file
+/* Closes a file, first writing the small writes gathered for it (see
+ * tfs_write)
  * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
- * Returns 0 if successful, -1 otherwise.
+ * Returns 0 if successful, -1 otherwise (including when gathered writes
+ * could not be written; the file is closed anyway).
  */
 int tfs_close(int fhandle);
 
+/* Removes a file from the directory. Its contents are freed right away if
+ * it is not open, or when the last file handle referring to it is closed
+ * (which can still read and write it until then).
+ * Input:
+ * 	- name: absolute path name
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_unlink(char const *name);
+
+/* Renames a file, replacing (as if unlinked) any other file that already
+ * has the new name. Open file handles are not affected.
+ * Input:
+ * 	- old_name: absolute path name of the file
+ * 	- new_name: its new absolute path name
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_rename(char const *old_name, char const *new_name);
+
 /* Writes to an open file, starting at the current offset
+ * With a write buffer (see tfs_params), writes of up to WRITE_COALESCE_MAX
+ * bytes that follow one another are gathered and written together, when
+ * the buffer fills up, when anything else uses the file, when the file
+ * handle is closed or by tfs_flush_writes; the file only grows then. A
+ * gathered write that then fails (as the FS is full) makes the next write or
+ * close through the same file handle fail.
  * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
  * 	- buffer containing the contents to write
  * 	- length of the contents (in bytes)
  * Returns the number of bytes that were written (can be lower than
- * 'len' if the maximum file size is exceeded), or -1 in case of error
+ * 'len' if the maximum file size is exceeded or the FS is full), or -1 in
+ * case of error
  */
 ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
 
+/* Reads from an open file at a given offset, without moving the file
+ * handle's offset, and tells which file it is
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- offset to read from
+ * 	- destination buffer
+ * 	- length of the buffer
+ * 	- inumber, generation: filled with the file's i-node number and the
+ * 	  i-node's generation (see inode_t)
+ * Returns the number of bytes read, or -1 in case of error
+ */
+ssize_t tfs_read_at(int fhandle, size_t offset, void *buffer, size_t len, int *inumber, unsigned int *generation);
+
+/* Returns the i-node number of an open file, or -1 if the file handle is
+ * invalid; the i-node's generation goes to generation.
+ */
+int tfs_handle_inumber(int fhandle, unsigned int *generation);
+
+/* Sets a function to call before the contents or the size of a file change
+ * (by a write, a truncation when opened, a punch hole or a fallocate), with
+ * the file's i-node number; it is called holding the i-node's lock, so no
+ * read of the file runs meanwhile. NULL for none.
+ */
+void tfs_set_change_hook(void (*hook)(int inumber));
+
+/* Writes the writes gathered in the open files (see tfs_write) that have
+ * waited for at least a given time.
+ * Input:
+ * 	- age_ns: how long the first of them waited, in nanoseconds (0 for all)
+ * Returns 0 if successful, -1 if some could not be written.
+ */
+int tfs_flush_writes(uint64_t age_ns);
+
 /* Reads from an open file, starting at the current offset
  * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
@@ -72,6 +146,104 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/* Moves the offset of an open file. It may be moved past the end of the
+ * file: a write there leaves a hole in between, which reads as zeros and
+ * takes no storage.
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- the new offset (up to the largest file size)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_seek(int fhandle, size_t offset);
+
+/* Releases the storage of a range of an open file, which then reads as
+ * zeros; the file's size does not change.
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- offset and length (in bytes) of the range
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_punch_hole(int fhandle, size_t offset, size_t len);
+
+/* Preallocates (zeroed) storage for a range of an open file, extending the
+ * file if the range goes past its end, so that later writes to the range
+ * do not run out of space.
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- offset and length (in bytes) of the range
+ * Returns 0 if successful, -1 otherwise (the blocks already allocated when
+ * the FS runs out of space are kept).
+ */
+int tfs_fallocate(int fhandle, size_t offset, size_t len);
+
+/* Locks a range of an open file. Locks are advisory: reads and writes do
+ * not check them. A shared lock conflicts with the exclusive locks of other
+ * handles that overlap it, an exclusive one with any lock of other handles
+ * that overlaps it. A request that conflicts waits until the locks in its
+ * way are released, as well as the conflicting ones requested before it.
+ * A handle's locks are released by tfs_unlock, or when it is closed.
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- offset and length (in bytes) of the range (a length of 0 for every
+ * 	  byte from the offset on)
+ * 	- flags: TFS_LOCK_SHARED or TFS_LOCK_EXCLUSIVE, and TFS_LOCK_NOWAIT to
+ * 	  fail rather than wait
+ * Returns 0 if successful, -1 otherwise. Handles waiting for each other's
+ * locks are not detected, and wait forever.
+ */
+int tfs_lock(int fhandle, size_t offset, size_t len, int flags);
+
+/* Locks a range of an open file (see tfs_lock), without waiting: a request
+ * that conflicts is parked, and granted is called with arg once it is done
+ * (with 0, or -1 if the handle was closed first), by the thread releasing
+ * what was in its way.
+ * Returns 0 if the lock is held, 1 if the request was parked, -1 otherwise.
+ */
+int tfs_lock_async(int fhandle, size_t offset, size_t len, int flags, void (*granted)(int result, void *arg),
+                   void *arg);
+
+/* Unlocks a range of an open file, named as it was locked (see tfs_lock).
+ * Returns 0 if successful, -1 otherwise (the handle holds no lock on
+ * exactly that range).
+ */
+int tfs_unlock(int fhandle, size_t offset, size_t len);
+
+/* Gets the attributes of a file (with the writes gathered for it written
+ * first, so its size counts them).
+ * Input:
+ * 	- path name of the file
+ * 	- st: filled with the attributes
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_stat(char const *name, tfs_stat_t *st);
+
+/* Gets the attributes of an open file (see tfs_stat).
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- st: filled with the attributes
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fstat(int fhandle, tfs_stat_t *st);
+
+/* Lists the files of the directory with their attributes (see tfs_stat),
+ * in the order of its entry slots.
+ * Input:
+ * 	- entries: filled with the files
+ * 	- max: the most files to list
+ * Returns the number of files listed, or -1 in case of error
+ */
+ssize_t tfs_readdir_plus(tfs_dirent_t *entries, size_t max);
+
+/* Lists the files named by a window of the directory's entry slots (see
+ * tfs_readdir_plus), so a large directory can be listed in parts.
+ * Input:
+ * 	- first, count: the window (it may go past the last slot)
+ * 	- entries: filled with the files (at most count)
+ * 	- slots: filled with the number of slots of the directory
+ * Returns the number of files listed, or -1 in case of error
+ */
+ssize_t tfs_readdir_slots(size_t first, size_t count, tfs_dirent_t *entries, size_t *slots);
+
 /* Copies the contents of a file that exists in TecnicoFS to the contents
  * of another file in the OS' file system tree (outside TecnicoFS).
  * Input:
@@ -82,4 +254,85 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len);
  */
 int tfs_copy_to_external_fs(char const *source_path, char const *dest_path);
 
+/* Copies the contents of a file in the OS' file system tree (outside
+ * TecnicoFS) to a file in TecnicoFS.
+ * Input:
+ *      - path name of the source file (in the main file system)
+ *      - path name of the destination file (in TecnicoFS), which is created
+ *        if needed, and truncated if it already exists
+ * Returns 0 if successful, -1 otherwise (including when the source does not
+ * fit in a TecnicoFS file).
+ */
+int tfs_copy_from_external_fs(char const *source_path, char const *dest_path);
+
+/* Streams the contents of a file that exists in TecnicoFS to a file
+ * descriptor (a file, pipe or FIFO), in chunks of up to COPY_CHUNK_SIZE
+ * bytes. The copy fails if a non-blocking descriptor has no room for
+ * COPY_STALL_TIMEOUT_MS (its reader stalled).
+ * Input:
+ *      - path name of the source file (from TecnicoFS)
+ *      - file descriptor open for writing
+ * Returns the number of bytes copied, or -1 in case of error
+ */
+ssize_t tfs_copy_to_fd(char const *source_path, int fd);
+
+/* Ingests everything that can be read from a file descriptor into a file in
+ * TecnicoFS, which is created if needed, and truncated if it already exists.
+ * Input:
+ *      - file descriptor open for reading (read until end of file)
+ *      - path name of the destination file (in TecnicoFS)
+ * Returns the number of bytes copied, or -1 in case of error (including when
+ * the data does not fit in a TecnicoFS file)
+ */
+ssize_t tfs_copy_from_fd(int fd, char const *dest_path);
+
+/* Checks the consistency of TecnicoFS while it is in use, freeing orphaned
+ * blocks and i-nodes and repairing the allocation state (see fsck_report_t).
+ * Operations are held back while it runs.
+ * Input:
+ *      - report: filled with what was found and fixed
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fsck(fsck_report_t *report);
+
+/* Takes a copy-on-write snapshot of TecnicoFS (with the gathered writes
+ * written first): the files, as they are now,
+ * stay readable through the snapshot while the FS keeps changing, without
+ * copying their data up front (a block is only copied when it is first
+ * changed afterwards). There is at most one snapshot at a time.
+ * Returns 0 if successful, -1 otherwise (including when a snapshot exists).
+ */
+int tfs_snapshot();
+
+/* Drops the snapshot, freeing the blocks only it still uses (it waits for
+ * any read of the snapshot in progress).
+ * Returns 0 if successful, -1 if there is no snapshot.
+ */
+int tfs_snapshot_release();
+
+/* Reads a file as it was when the snapshot was taken.
+ * Input:
+ *      - path name of the file (from TecnicoFS)
+ *      - offset to read from, and the destination buffer and its length
+ * Returns the number of bytes read (0 at the end of the file), or -1 in
+ * case of error (including when there is no snapshot or no such file)
+ */
+ssize_t tfs_snapshot_read(char const *name, size_t offset, void *buffer, size_t len);
+
+/* Writes the snapshot as an image file in the OS' file system tree: a line
+ * with SNAPSHOT_MAGIC, then, for each file, a line with its path name and
+ * size followed by its contents.
+ * Input:
+ *      - path name of the image (in the main file system), which is
+ *        created if needed, and overwritten if it already exists
+ * Returns the number of bytes written, or -1 in case of error
+ */
+ssize_t tfs_snapshot_export(char const *dest_path);
+
+/* Writes the snapshot as an image (see tfs_snapshot_export) to a file
+ * descriptor open for writing, which is left open.
+ * Returns the number of bytes written, or -1 in case of error
+ */
+ssize_t tfs_snapshot_export_to_fd(int fd);
+
 #endif // OPERATIONS_H
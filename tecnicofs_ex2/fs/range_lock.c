@@ -0,0 +1,434 @@
+#include "range_lock.h"
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * A lock held, or a request parked
+ * A held lock is a node of its i-node's tree; a parked request is in its
+ * i-node's queue. Either is also in the list to notify while its callback
+ * is pending, and a node released meanwhile is only freed once notified.
+ * Nodes are named by their index in the table (-1 for none), and next
+ * links the queue, the list to notify or the free list, whichever the node
+ * is in.
+ */
+typedef struct {
+    int owner;
+    size_t start;
+    size_t end;
+    bool exclusive;
+    int left, right;
+    uint32_t priority;
+    size_t max_end; /* the largest end in the subtree */
+    int next;
+    range_lock_callback_t callback;
+    void *arg;
+    int result;
+    bool notifying;
+    bool released;
+} range_node_t;
+
+/*
+ * Everything is serialized by one lock; callbacks are called without it,
+ * holding only the one that keeps them one at a time.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_mutex_t notifying;
+    range_node_t *nodes;
+    int free_nodes;
+    size_t taken; /* nodes not free, so files never locked are closed quickly */
+    /* each i-node's tree of locks and queue of parked requests */
+    int *root;
+    int *queue_head;
+    int *queue_tail;
+    size_t n_inodes;
+    int notify_head;
+    int notify_tail;
+    uint32_t seed;
+} locks = {.lock = PTHREAD_MUTEX_INITIALIZER,
+           .notifying = PTHREAD_MUTEX_INITIALIZER,
+           .notify_head = -1,
+           .notify_tail = -1};
+
+int range_lock_init(size_t inodes, size_t max_locks) {
+    range_lock_destroy();
+    if (max_locks == 0 || max_locks > INT32_MAX) {
+        return -1;
+    }
+    locks.nodes = malloc(max_locks * sizeof(range_node_t));
+    locks.root = malloc(inodes * sizeof(int));
+    locks.queue_head = malloc(inodes * sizeof(int));
+    locks.queue_tail = malloc(inodes * sizeof(int));
+    if (locks.nodes == NULL || locks.root == NULL || locks.queue_head == NULL || locks.queue_tail == NULL) {
+        range_lock_destroy();
+        return -1;
+    }
+    for (size_t n = 0; n < max_locks; n++) {
+        locks.nodes[n].next = n + 1 < max_locks ? (int)n + 1 : -1;
+    }
+    locks.free_nodes = 0;
+    locks.taken = 0;
+    for (size_t i = 0; i < inodes; i++) {
+        locks.root[i] = -1;
+        locks.queue_head[i] = -1;
+        locks.queue_tail[i] = -1;
+    }
+    locks.n_inodes = inodes;
+    locks.notify_head = -1;
+    locks.notify_tail = -1;
+    locks.seed = 2463534242u;
+    return 0;
+}
+
+void range_lock_destroy() {
+    free(locks.nodes);
+    free(locks.root);
+    free(locks.queue_head);
+    free(locks.queue_tail);
+    locks.nodes = NULL;
+    locks.root = NULL;
+    locks.queue_head = NULL;
+    locks.queue_tail = NULL;
+    locks.n_inodes = 0;
+    locks.notify_head = -1;
+    locks.notify_tail = -1;
+}
+
+static inline bool valid(int inumber) { return inumber >= 0 && (size_t)inumber < locks.n_inodes; }
+
+static inline bool overlaps(range_node_t const *n, size_t start, size_t end) {
+    return n->start < end && start < n->end;
+}
+
+/*
+ * Returns whether a node is in the way of a request (see range_lock.h).
+ */
+static inline bool in_way(range_node_t const *n, int owner, size_t start, size_t end, bool exclusive) {
+    return n->owner != owner && (exclusive || n->exclusive) && overlaps(n, start, end);
+}
+
+/*
+ * Takes a node from the free list.
+ * The caller holds the lock.
+ * Returns the node, or -1 if there is none left
+ */
+static int take_node() {
+    int n = locks.free_nodes;
+    if (n != -1) {
+        locks.free_nodes = locks.nodes[n].next;
+        locks.taken++;
+        locks.seed ^= locks.seed << 13;
+        locks.seed ^= locks.seed >> 17;
+        locks.seed ^= locks.seed << 5;
+        locks.nodes[n] = (range_node_t){.left = -1, .right = -1, .priority = locks.seed, .next = -1};
+    }
+    return n;
+}
+
+/*
+ * Frees a node no longer held nor parked, or marks it to be freed once
+ * notified.
+ * The caller holds the lock.
+ */
+static void put_node(int n) {
+    if (locks.nodes[n].notifying) {
+        /* a lock granted and released before being notified was not held */
+        locks.nodes[n].released = true;
+        locks.nodes[n].result = -1;
+        return;
+    }
+    locks.nodes[n].next = locks.free_nodes;
+    locks.free_nodes = n;
+    locks.taken--;
+}
+
+/*
+ * Appends a node to the list to notify, with the result of its request.
+ * The caller holds the lock.
+ */
+static void to_notify(int n, int result) {
+    locks.nodes[n].result = result;
+    locks.nodes[n].notifying = true;
+    locks.nodes[n].next = -1;
+    if (locks.notify_tail == -1) {
+        locks.notify_head = n;
+    } else {
+        locks.nodes[locks.notify_tail].next = n;
+    }
+    locks.notify_tail = n;
+}
+
+/*
+ * Interval tree (treap) of an i-node's locks
+ * Nodes are ordered by start (then by index), and are heaps by priority.
+ * The caller holds the lock.
+ */
+
+static void update(int t) {
+    range_node_t *n = &locks.nodes[t];
+    n->max_end = n->end;
+    if (n->left != -1 && locks.nodes[n->left].max_end > n->max_end) {
+        n->max_end = locks.nodes[n->left].max_end;
+    }
+    if (n->right != -1 && locks.nodes[n->right].max_end > n->max_end) {
+        n->max_end = locks.nodes[n->right].max_end;
+    }
+}
+
+static inline bool before(int a, int b) {
+    return locks.nodes[a].start < locks.nodes[b].start || (locks.nodes[a].start == locks.nodes[b].start && a < b);
+}
+
+/*
+ * Joins two trees, every node of the first coming before those of the
+ * second.
+ */
+static int merge(int a, int b) {
+    if (a == -1) {
+        return b;
+    }
+    if (b == -1) {
+        return a;
+    }
+    if (locks.nodes[a].priority > locks.nodes[b].priority) {
+        locks.nodes[a].right = merge(locks.nodes[a].right, b);
+        update(a);
+        return a;
+    }
+    locks.nodes[b].left = merge(a, locks.nodes[b].left);
+    update(b);
+    return b;
+}
+
+/*
+ * Splits a tree into the nodes before a node (left) and the rest (right).
+ */
+static void split(int t, int key, int *left, int *right) {
+    if (t == -1) {
+        *left = *right = -1;
+    } else if (before(t, key)) {
+        split(locks.nodes[t].right, key, &locks.nodes[t].right, right);
+        update(t);
+        *left = t;
+    } else {
+        split(locks.nodes[t].left, key, left, &locks.nodes[t].left);
+        update(t);
+        *right = t;
+    }
+}
+
+static void insert(int inumber, int n) {
+    int left, right;
+    update(n);
+    split(locks.root[inumber], n, &left, &right);
+    locks.root[inumber] = merge(merge(left, n), right);
+}
+
+static int remove_node(int t, int n) {
+    if (t == n) {
+        return merge(locks.nodes[t].left, locks.nodes[t].right);
+    }
+    if (before(n, t)) {
+        locks.nodes[t].left = remove_node(locks.nodes[t].left, n);
+    } else {
+        locks.nodes[t].right = remove_node(locks.nodes[t].right, n);
+    }
+    update(t);
+    return t;
+}
+
+/*
+ * Returns whether a lock of the tree is in the way of a request; subtrees
+ * ending before the range, or starting after it, are skipped.
+ */
+static bool tree_conflicts(int t, int owner, size_t start, size_t end, bool exclusive) {
+    while (t != -1 && locks.nodes[t].max_end > start) {
+        range_node_t const *n = &locks.nodes[t];
+        if (tree_conflicts(n->left, owner, start, end, exclusive) || in_way(n, owner, start, end, exclusive)) {
+            return true;
+        }
+        if (n->start >= end) {
+            return false;
+        }
+        t = n->right;
+    }
+    return false;
+}
+
+/*
+ * Returns the lock of an owner on exactly [start, end), or -1 if none.
+ */
+static int find(int t, int owner, size_t start, size_t end) {
+    while (t != -1 && start != locks.nodes[t].start) {
+        t = start < locks.nodes[t].start ? locks.nodes[t].left : locks.nodes[t].right;
+    }
+    if (t == -1) {
+        return -1;
+    }
+    /* nodes with the same start may be on either side */
+    range_node_t const *n = &locks.nodes[t];
+    if (n->owner == owner && n->end == end) {
+        return t;
+    }
+    int found = find(n->left, owner, start, end);
+    return found != -1 ? found : find(n->right, owner, start, end);
+}
+
+/*
+ * Releases every lock of an owner in a tree.
+ * Returns the tree left
+ */
+static int drop_owner(int t, int owner) {
+    if (t == -1) {
+        return -1;
+    }
+    locks.nodes[t].left = drop_owner(locks.nodes[t].left, owner);
+    locks.nodes[t].right = drop_owner(locks.nodes[t].right, owner);
+    if (locks.nodes[t].owner == owner) {
+        int rest = merge(locks.nodes[t].left, locks.nodes[t].right);
+        put_node(t);
+        return rest;
+    }
+    update(t);
+    return t;
+}
+
+/*
+ * Returns whether a request queued on an i-node before until (-1 for any)
+ * is in the way of a request.
+ * The caller holds the lock.
+ */
+static bool queue_conflicts(int inumber, int until, int owner, size_t start, size_t end, bool exclusive) {
+    for (int w = locks.queue_head[inumber]; w != -1 && w != until; w = locks.nodes[w].next) {
+        if (in_way(&locks.nodes[w], owner, start, end, exclusive)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Grants, in queue order, the requests parked on an i-node that nothing is
+ * in the way of any more.
+ * The caller holds the lock.
+ */
+static void grant_parked(int inumber) {
+    int *link = &locks.queue_head[inumber];
+    int last = -1;
+    while (*link != -1) {
+        int w = *link;
+        range_node_t *n = &locks.nodes[w];
+        if (tree_conflicts(locks.root[inumber], n->owner, n->start, n->end, n->exclusive) ||
+            queue_conflicts(inumber, w, n->owner, n->start, n->end, n->exclusive)) {
+            last = w;
+            link = &n->next;
+            continue;
+        }
+        *link = n->next;
+        insert(inumber, w);
+        to_notify(w, 0);
+    }
+    locks.queue_tail[inumber] = last;
+}
+
+int range_lock_acquire(int inumber, int owner, size_t start, size_t end, bool exclusive, bool wait,
+                       range_lock_callback_t callback, void *arg) {
+    if (!valid(inumber) || start >= end) {
+        return -1;
+    }
+    pthread_mutex_lock(&locks.lock);
+    bool blocked = tree_conflicts(locks.root[inumber], owner, start, end, exclusive) ||
+                   queue_conflicts(inumber, -1, owner, start, end, exclusive);
+    int n = blocked && !wait ? -1 : take_node();
+    if (n == -1) {
+        pthread_mutex_unlock(&locks.lock);
+        return -1;
+    }
+    range_node_t *node = &locks.nodes[n];
+    node->owner = owner;
+    node->start = start;
+    node->end = end;
+    node->exclusive = exclusive;
+    if (!blocked) {
+        insert(inumber, n);
+        pthread_mutex_unlock(&locks.lock);
+        return 0;
+    }
+    node->callback = callback;
+    node->arg = arg;
+    if (locks.queue_tail[inumber] == -1) {
+        locks.queue_head[inumber] = n;
+    } else {
+        locks.nodes[locks.queue_tail[inumber]].next = n;
+    }
+    locks.queue_tail[inumber] = n;
+    metrics_count(METRIC_RANGE_LOCK_PARK, 1);
+    pthread_mutex_unlock(&locks.lock);
+    return 1;
+}
+
+int range_lock_release(int inumber, int owner, size_t start, size_t end) {
+    if (!valid(inumber)) {
+        return -1;
+    }
+    pthread_mutex_lock(&locks.lock);
+    int n = find(locks.root[inumber], owner, start, end);
+    if (n != -1) {
+        locks.root[inumber] = remove_node(locks.root[inumber], n);
+        put_node(n);
+        grant_parked(inumber);
+    }
+    pthread_mutex_unlock(&locks.lock);
+    return n == -1 ? -1 : 0;
+}
+
+void range_lock_release_owner(int inumber, int owner) {
+    if (!valid(inumber)) {
+        return;
+    }
+    pthread_mutex_lock(&locks.lock);
+    if (locks.taken > 0) {
+        locks.root[inumber] = drop_owner(locks.root[inumber], owner);
+        int *link = &locks.queue_head[inumber];
+        while (*link != -1) {
+            int w = *link;
+            if (locks.nodes[w].owner != owner) {
+                link = &locks.nodes[w].next;
+                continue;
+            }
+            *link = locks.nodes[w].next;
+            to_notify(w, -1);
+            locks.nodes[w].released = true;
+        }
+        grant_parked(inumber);
+    }
+    pthread_mutex_unlock(&locks.lock);
+}
+
+void range_lock_notify() {
+    pthread_mutex_lock(&locks.notifying);
+    pthread_mutex_lock(&locks.lock);
+    while (locks.notify_head != -1) {
+        int n = locks.notify_head;
+        range_node_t *node = &locks.nodes[n];
+        locks.notify_head = node->next;
+        if (locks.notify_head == -1) {
+            locks.notify_tail = -1;
+        }
+        range_lock_callback_t callback = node->callback;
+        void *arg = node->arg;
+        int result = node->result;
+        node->notifying = false;
+        if (node->released) {
+            put_node(n);
+        }
+        pthread_mutex_unlock(&locks.lock);
+        callback(result, arg);
+        pthread_mutex_lock(&locks.lock);
+    }
+    pthread_mutex_unlock(&locks.lock);
+    pthread_mutex_unlock(&locks.notifying);
+}
@@ -0,0 +1,75 @@
+#ifndef RANGE_LOCK_H
+#define RANGE_LOCK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Advisory byte-range locks
+ * A lock covers the bytes [start, end) of a file and is owned by an open
+ * file handle; it is shared or exclusive, and conflicts with the locks of
+ * other owners that overlap it when either of them is exclusive (an owner
+ * never conflicts with itself). The locks held on each i-node are kept in
+ * an interval tree (a treap ordered by start, each node knowing the largest
+ * end below it), so a conflict is found without looking at the locks that
+ * end before the range.
+ * A request that conflicts is parked in its i-node's queue with a callback,
+ * instead of blocking the thread that made it; it also waits behind the
+ * requests queued before it that it conflicts with, so a writer is not
+ * starved by a stream of readers. Requests are granted, in queue order, as
+ * the locks in their way are released, and their callbacks are called by
+ * range_lock_notify.
+ * Locks are not merged nor split: a lock is released by naming its range
+ * as locked. Waits that form a cycle are not detected.
+ */
+
+/*
+ * Called when a parked request is done: result is 0 if the lock was
+ * granted, -1 if the request was cancelled (its owner released everything)
+ */
+typedef void (*range_lock_callback_t)(int result, void *arg);
+
+/*
+ * Initializes the locks of i-nodes 0 to inodes - 1, with room for
+ * max_locks locks and parked requests in all.
+ * Returns 0 if successful, -1 otherwise
+ */
+int range_lock_init(size_t inodes, size_t max_locks);
+
+/*
+ * Frees the locks (parked requests are dropped, their callbacks not called).
+ */
+void range_lock_destroy();
+
+/*
+ * Locks [start, end) of a file for an owner, or parks the request if it
+ * conflicts and wait is true (callback is then called with arg once it is
+ * done, see range_lock_notify).
+ * Returns: 0 if the lock is held, 1 if the request was parked, -1 if it
+ * conflicts and wait is false, or if there is no room for it
+ */
+int range_lock_acquire(int inumber, int owner, size_t start, size_t end, bool exclusive, bool wait,
+                       range_lock_callback_t callback, void *arg);
+
+/*
+ * Releases the lock an owner holds on exactly [start, end) of a file,
+ * granting the parked requests it was in the way of.
+ * Returns 0 if successful, -1 if the owner holds no such lock
+ */
+int range_lock_release(int inumber, int owner, size_t start, size_t end);
+
+/*
+ * Releases every lock an owner holds on a file and cancels its parked
+ * requests (as when it is closed), granting those of others in their way.
+ */
+void range_lock_release_owner(int inumber, int owner);
+
+/*
+ * Calls the callbacks of the requests granted or cancelled so far. To be
+ * called after releasing, without holding locks the callbacks may need;
+ * callbacks are called one at a time, so once it returns, those of every
+ * request done before it was called have returned too.
+ */
+void range_lock_notify();
+
+#endif // RANGE_LOCK_H
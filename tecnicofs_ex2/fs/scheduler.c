@@ -0,0 +1,227 @@
+#include "scheduler.h"
+#include "config.h"
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct {
+    pthread_cond_t admitted;
+    bool queued;  /* its request is in line, or let in and not yet taken */
+    bool granted;
+    size_t cost;       /* of the request waiting, if any */
+    size_t deficit;    /* credit left from its turns */
+    int next;          /* in the line of its class (-1 for the last) */
+    int service_class;
+    size_t quantum;    /* SCHED_QUANTUM times its weight */
+    size_t rate;       /* 0 for no limit */
+    double bucket;     /* rate credit (negative while in debt) */
+    uint64_t refilled; /* when the bucket was last refilled */
+} sched_session_t;
+
+/*
+ * Everything is serialized by one lock.
+ */
+static struct {
+    pthread_mutex_t lock;
+    sched_session_t *sessions;
+    size_t n_sessions;
+    size_t slots;
+    size_t running;
+    /* the sessions waiting for a slot, a line per class */
+    int first[TFS_CLASSES];
+    int last[TFS_CLASSES];
+} sched = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+int scheduler_init(size_t sessions, size_t slots) {
+    sched.sessions = calloc(sessions, sizeof(sched_session_t));
+    if (sched.sessions == NULL || slots == 0) {
+        free(sched.sessions);
+        return -1;
+    }
+    sched.n_sessions = sessions;
+    sched.slots = slots;
+    sched.running = 0;
+    for (int c = 0; c < TFS_CLASSES; c++) {
+        sched.first[c] = sched.last[c] = -1;
+    }
+    tfs_session_options_t defaults = {.service_class = TFS_CLASS_NORMAL, .weight = 1, .rate = 0};
+    for (size_t s = 0; s < sessions; s++) {
+        pthread_cond_init(&sched.sessions[s].admitted, NULL);
+        scheduler_configure((unsigned int)s, &defaults);
+    }
+    return 0;
+}
+
+void scheduler_destroy() {
+    for (size_t s = 0; s < sched.n_sessions; s++) {
+        pthread_cond_destroy(&sched.sessions[s].admitted);
+    }
+    free(sched.sessions);
+    sched.sessions = NULL;
+    sched.n_sessions = 0;
+}
+
+void scheduler_configure(unsigned int session, tfs_session_options_t const *options) {
+    pthread_mutex_lock(&sched.lock);
+    sched_session_t *s = &sched.sessions[session];
+    s->service_class = options->service_class >= 0 && options->service_class < TFS_CLASSES ? options->service_class
+                                                                                          : TFS_CLASS_NORMAL;
+    s->quantum = (size_t)SCHED_QUANTUM * (options->weight == 0 ? 1 : options->weight);
+    s->rate = options->rate;
+    s->bucket = (double)options->rate;
+    s->refilled = metrics_now();
+    s->deficit = 0;
+    pthread_mutex_unlock(&sched.lock);
+}
+
+/*
+ * Lets waiting requests in while there are free slots: the first of the
+ * line of the first class waiting, if its credit covers it; otherwise it is
+ * credited a quantum and goes to the back.
+ * The caller holds the scheduler's lock.
+ */
+static void dispatch() {
+    while (sched.running < sched.slots) {
+        int c = 0;
+        while (c < TFS_CLASSES && sched.first[c] == -1) {
+            c++;
+        }
+        if (c == TFS_CLASSES) {
+            return;
+        }
+        int id = sched.first[c];
+        sched_session_t *s = &sched.sessions[id];
+        sched.first[c] = s->next;
+        if (sched.first[c] == -1) {
+            sched.last[c] = -1;
+        }
+        if (s->deficit < s->cost) {
+            s->deficit += s->quantum;
+            if (s->deficit < s->cost) {
+                /* back of the line */
+                s->next = -1;
+                if (sched.last[c] == -1) {
+                    sched.first[c] = id;
+                } else {
+                    sched.sessions[sched.last[c]].next = id;
+                }
+                sched.last[c] = id;
+                continue;
+            }
+        }
+        s->deficit -= s->cost;
+        s->granted = true;
+        sched.running++;
+        pthread_cond_signal(&s->admitted);
+    }
+}
+
+/*
+ * Puts a session's request at the back of the line of its class.
+ * The caller holds the scheduler's lock.
+ */
+static void enqueue(unsigned int session, size_t cost) {
+    sched_session_t *s = &sched.sessions[session];
+    s->cost = cost;
+    s->queued = true;
+    s->granted = false;
+    s->next = -1;
+    int c = s->service_class;
+    if (sched.last[c] == -1) {
+        sched.first[c] = (int)session;
+    } else {
+        sched.sessions[sched.last[c]].next = (int)session;
+    }
+    sched.last[c] = (int)session;
+}
+
+/*
+ * Charges a request to a session's rate bucket (refilled for the time
+ * passed), if the bucket is not in debt; a request larger than what is
+ * left puts it in debt.
+ * The caller holds the scheduler's lock.
+ * Returns whether the request was charged
+ */
+static bool charge(sched_session_t *s, size_t cost) {
+    if (s->rate == 0) {
+        return true;
+    }
+    uint64_t now = metrics_now();
+    s->bucket += (double)(now - s->refilled) * (double)s->rate / 1e9;
+    if (s->bucket > (double)s->rate) {
+        s->bucket = (double)s->rate;
+    }
+    s->refilled = now;
+    if (s->bucket < 0) {
+        return false;
+    }
+    s->bucket -= (double)cost;
+    return true;
+}
+
+void scheduler_acquire(unsigned int session, size_t cost) {
+    sched_session_t *s = &sched.sessions[session];
+    pthread_mutex_lock(&sched.lock);
+    while (!s->queued && !charge(s, cost)) {
+        double wait = -s->bucket / (double)s->rate;
+        struct timespec pause = {.tv_sec = (time_t)wait, .tv_nsec = (long)((wait - (double)(time_t)wait) * 1e9)};
+        pthread_mutex_unlock(&sched.lock);
+        nanosleep(&pause, NULL);
+        pthread_mutex_lock(&sched.lock);
+    }
+
+    if (!s->queued) {
+        enqueue(session, cost);
+        dispatch();
+    }
+    while (!s->granted) {
+        pthread_cond_wait(&s->admitted, &sched.lock);
+    }
+    s->queued = false;
+    s->granted = false;
+    pthread_mutex_unlock(&sched.lock);
+}
+
+void scheduler_release(unsigned int session, size_t next_cost) {
+    sched_session_t *s = &sched.sessions[session];
+    pthread_mutex_lock(&sched.lock);
+    sched.running--;
+    if (next_cost == 0) {
+        s->deficit = 0;
+    } else if (charge(s, next_cost)) {
+        /* (one held back by its rate waits in scheduler_acquire) */
+        enqueue(session, next_cost);
+    }
+    dispatch();
+    pthread_mutex_unlock(&sched.lock);
+}
+
+void scheduler_cancel(unsigned int session) {
+    sched_session_t *s = &sched.sessions[session];
+    pthread_mutex_lock(&sched.lock);
+    if (s->granted) {
+        sched.running--;
+    } else if (s->queued) {
+        int c = s->service_class;
+        int prev = -1;
+        int id = sched.first[c];
+        while (id != (int)session) {
+            prev = id;
+            id = sched.sessions[id].next;
+        }
+        if (prev == -1) {
+            sched.first[c] = s->next;
+        } else {
+            sched.sessions[prev].next = s->next;
+        }
+        if (sched.last[c] == (int)session) {
+            sched.last[c] = prev;
+        }
+    }
+    s->queued = false;
+    s->granted = false;
+    dispatch();
+    pthread_mutex_unlock(&sched.lock);
+}
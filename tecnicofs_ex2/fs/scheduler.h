@@ -0,0 +1,65 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "common/common.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Fair scheduler of the server's requests
+ * Each session's worker asks for a slot before executing a request and
+ * gives it back afterwards; at most as many requests as there are slots are
+ * executed at once. When requests are left waiting, those of the first
+ * class with any (see tfs_session_options_t) are let in by deficit round
+ * robin: the waiting sessions take turns, and a session whose credit does
+ * not cover its request's cost (the bytes it moves) is credited
+ * SCHED_QUANTUM times its weight and goes to the back of the line. So the
+ * bytes served to sessions that keep busy follow their weights, and a
+ * session sending small requests is let in between the large ones of the
+ * others. A session with more requests queued keeps its place in line
+ * while its worker moves on to the next one. A session may also be held to
+ * a rate, by a bucket of credit refilled at that rate and holding up to a
+ * second's worth.
+ */
+
+/*
+ * Initializes the scheduler for sessions 0 to sessions - 1, with the given
+ * number of slots (at least 1).
+ * Returns 0 if successful, -1 otherwise
+ */
+int scheduler_init(size_t sessions, size_t slots);
+
+/*
+ * Frees the scheduler; no request may be waiting or executing.
+ */
+void scheduler_destroy();
+
+/*
+ * Gives a session (being mounted) its options, starting it with no credit.
+ */
+void scheduler_configure(unsigned int session, tfs_session_options_t const *options);
+
+/*
+ * Waits until a request of a session costing cost may be executed: until
+ * the session's rate allows it, and then until it is given a slot (unless
+ * it was put in line by scheduler_release).
+ */
+void scheduler_acquire(unsigned int session, size_t cost);
+
+/*
+ * Gives back the slot of a session's request, putting the session's next
+ * request in line right away.
+ * Input:
+ *  - session: the session
+ *  - next_cost: the cost of its next request, or 0 if it has none queued
+ *    (its unused credit is then lost, as it does not need its turns)
+ */
+void scheduler_release(unsigned int session, size_t next_cost);
+
+/*
+ * Takes a session's request put in line by scheduler_release back out of
+ * it, when its worker is not executing it after all (if there is one).
+ */
+void scheduler_cancel(unsigned int session);
+
+#endif // SCHEDULER_H
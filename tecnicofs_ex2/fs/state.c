@@ -1,339 +1,1867 @@
-#include "state.h"
-
-#include <stdbool.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-
-/* Persistent FS state  (in reality, it should be maintained in secondary
- * memory; for simplicity, this project maintains it in primary memory) */
-
-/* I-node table */
-static inode_t inode_table[INODE_TABLE_SIZE];
-static char freeinode_ts[INODE_TABLE_SIZE];
-
-/* Data blocks */
-static char fs_data[BLOCK_SIZE * DATA_BLOCKS];
-static char free_blocks[DATA_BLOCKS];
-
-/* Volatile FS state */
-
-static open_file_entry_t open_file_table[MAX_OPEN_FILES];
-static char free_open_file_entries[MAX_OPEN_FILES];
-
-static inline bool valid_inumber(int inumber) {
-    return inumber >= 0 && inumber < INODE_TABLE_SIZE;
-}
-
-static inline bool valid_block_number(int block_number) {
-    return block_number >= 0 && block_number < DATA_BLOCKS;
-}
-
-static inline bool valid_file_handle(int file_handle) {
-    return file_handle >= 0 && file_handle < MAX_OPEN_FILES;
-}
-
-/**
- * We need to defeat the optimizer for the insert_delay() function.
- * Under optimization, the empty loop would be completely optimized away.
- * This function tells the compiler that the assembly code being run (which is
- * none) might potentially change *all memory in the process*.
- *
- * This prevents the optimizer from optimizing this code away, because it does
- * not know what it does and it may have side effects.
- *
- * Reference with more information: https://youtu.be/nXaxk27zwlk?t=2775
- *
- * Exercise: try removing this function and look at the assembly generated to
- * compare.
- */
-static void touch_all_memory() { __asm volatile("" : : : "memory"); }
-
-/*
- * Auxiliary function to insert a delay.
- * Used in accesses to persistent FS state as a way of emulating access
- * latencies as if such data structures were really stored in secondary memory.
- */
-static void insert_delay() {
-    for (int i = 0; i < DELAY; i++) {
-        touch_all_memory();
-    }
-}
-
-/*
- * Initializes FS state
- */
-void state_init() {
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        freeinode_ts[i] = FREE;
-    }
-
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        free_blocks[i] = FREE;
-    }
-
-    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        free_open_file_entries[i] = FREE;
-    }
-}
-
-void state_destroy() { /* nothing to do */
-}
-
-/*
- * Creates a new i-node in the i-node table.
- * Input:
- *  - n_type: the type of the node (file or directory)
- * Returns:
- *  new i-node's number if successfully created, -1 otherwise
- */
-int inode_create(inode_type n_type) {
-    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if ((inumber * (int)sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-            insert_delay(); // simulate storage access delay (to freeinode_ts)
-        }
-
-        /* Finds first free entry in i-node table */
-        if (freeinode_ts[inumber] == FREE) {
-            /* Found a free entry, so takes it for the new i-node*/
-            freeinode_ts[inumber] = TAKEN;
-            insert_delay(); // simulate storage access delay (to i-node)
-            inode_table[inumber].i_node_type = n_type;
-
-            if (n_type == T_DIRECTORY) {
-                /* Initializes directory (filling its block with empty
-                 * entries, labeled with inumber==-1) */
-                int b = data_block_alloc();
-                if (b == -1) {
-                    freeinode_ts[inumber] = FREE;
-                    return -1;
-                }
-
-                inode_table[inumber].i_size = BLOCK_SIZE;
-                inode_table[inumber].i_data_block = b;
-
-                dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
-                if (dir_entry == NULL) {
-                    freeinode_ts[inumber] = FREE;
-                    return -1;
-                }
-
-                for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-                    dir_entry[i].d_inumber = -1;
-                }
-            } else {
-                /* In case of a new file, simply sets its size to 0 */
-                inode_table[inumber].i_size = 0;
-                inode_table[inumber].i_data_block = -1;
-            }
-            return inumber;
-        }
-    }
-    return -1;
-}
-
-/*
- * Deletes the i-node.
- * Input:
- *  - inumber: i-node's number
- * Returns: 0 if successful, -1 if failed
- */
-int inode_delete(int inumber) {
-    // simulate storage access delay (to i-node and freeinode_ts)
-    insert_delay();
-    insert_delay();
-
-    if (!valid_inumber(inumber) || freeinode_ts[inumber] == FREE) {
-        return -1;
-    }
-
-    freeinode_ts[inumber] = FREE;
-
-    if (inode_table[inumber].i_size > 0) {
-        if (data_block_free(inode_table[inumber].i_data_block) == -1) {
-            return -1;
-        }
-    }
-
-    return 0;
-}
-
-/*
- * Returns a pointer to an existing i-node.
- * Input:
- *  - inumber: identifier of the i-node
- * Returns: pointer if successful, NULL if failed
- */
-inode_t *inode_get(int inumber) {
-    if (!valid_inumber(inumber)) {
-        return NULL;
-    }
-
-    insert_delay(); // simulate storage access delay to i-node
-    return &inode_table[inumber];
-}
-
-/*
- * Adds an entry to the i-node directory data.
- * Input:
- *  - inumber: identifier of the i-node
- *  - sub_inumber: identifier of the sub i-node entry
- *  - sub_name: name of the sub i-node entry
- * Returns: SUCCESS or FAIL
- */
-int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
-    if (!valid_inumber(inumber) || !valid_inumber(sub_inumber)) {
-        return -1;
-    }
-
-    insert_delay(); // simulate storage access delay to i-node with inumber
-    if (inode_table[inumber].i_node_type != T_DIRECTORY) {
-        return -1;
-    }
-
-    if (strlen(sub_name) == 0) {
-        return -1;
-    }
-
-    /* Locates the block containing the directory's entries */
-    dir_entry_t *dir_entry =
-        (dir_entry_t *)data_block_get(inode_table[inumber].i_data_block);
-    if (dir_entry == NULL) {
-        return -1;
-    }
-
-    /* Finds and fills the first empty entry */
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_entry[i].d_inumber == -1) {
-            dir_entry[i].d_inumber = sub_inumber;
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = 0;
-            return 0;
-        }
-    }
-
-    return -1;
-}
-
-/* Looks for a given name inside a directory
- * Input:
- * 	- parent directory's i-node number
- * 	- name to search
- * 	Returns i-number linked to the target name, -1 if not found
- */
-int find_in_dir(int inumber, char const *sub_name) {
-    insert_delay(); // simulate storage access delay to i-node with inumber
-    if (!valid_inumber(inumber) ||
-        inode_table[inumber].i_node_type != T_DIRECTORY) {
-        return -1;
-    }
-
-    /* Locates the block containing the directory's entries */
-    dir_entry_t *dir_entry =
-        (dir_entry_t *)data_block_get(inode_table[inumber].i_data_block);
-    if (dir_entry == NULL) {
-        return -1;
-    }
-
-    /* Iterates over the directory entries looking for one that has the target
-     * name */
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
-            return dir_entry[i].d_inumber;
-        }
-
-    return -1;
-}
-
-/*
- * Allocated a new data block
- * Returns: block index if successful, -1 otherwise
- */
-int data_block_alloc() {
-    for (int i = 0; i < DATA_BLOCKS; i++) {
-        if (i * (int)sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-            insert_delay(); // simulate storage access delay to free_blocks
-        }
-
-        if (free_blocks[i] == FREE) {
-            free_blocks[i] = TAKEN;
-            return i;
-        }
-    }
-    return -1;
-}
-
-/* Frees a data block
- * Input
- * 	- the block index
- * Returns: 0 if success, -1 otherwise
- */
-int data_block_free(int block_number) {
-    if (!valid_block_number(block_number)) {
-        return -1;
-    }
-
-    insert_delay(); // simulate storage access delay to free_blocks
-    free_blocks[block_number] = FREE;
-    return 0;
-}
-
-/* Returns a pointer to the contents of a given block
- * Input:
- * 	- Block's index
- * Returns: pointer to the first byte of the block, NULL otherwise
- */
-void *data_block_get(int block_number) {
-    if (!valid_block_number(block_number)) {
-        return NULL;
-    }
-
-    insert_delay(); // simulate storage access delay to block
-    return &fs_data[block_number * BLOCK_SIZE];
-}
-
-/* Add new entry to the open file table
- * Inputs:
- * 	- I-node number of the file to open
- * 	- Initial offset
- * Returns: file handle if successful, -1 otherwise
- */
-int add_to_open_file_table(int inumber, size_t offset) {
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (free_open_file_entries[i] == FREE) {
-            free_open_file_entries[i] = TAKEN;
-            open_file_table[i].of_inumber = inumber;
-            open_file_table[i].of_offset = offset;
-            return i;
-        }
-    }
-    return -1;
-}
-
-/* Frees an entry from the open file table
- * Inputs:
- * 	- file handle to free/close
- * Returns 0 is success, -1 otherwise
- */
-int remove_from_open_file_table(int fhandle) {
-    if (!valid_file_handle(fhandle) ||
-        free_open_file_entries[fhandle] != TAKEN) {
-        return -1;
-    }
-    free_open_file_entries[fhandle] = FREE;
-    return 0;
-}
-
-/* Returns pointer to a given entry in the open file table
- * Inputs:
- * 	 - file handle
- * Returns: pointer to the entry if sucessful, NULL otherwise
- */
-open_file_entry_t *get_open_file_entry(int fhandle) {
-    if (!valid_file_handle(fhandle)) {
-        return NULL;
-    }
-    return &open_file_table[fhandle];
-}
+/* MAP_ANONYMOUS, MAP_HUGETLB, MADV_HUGEPAGE and sched_getcpu are not POSIX */
+#define _GNU_SOURCE
+
+#include "state.h"
+#include "block_cache.h"
+#include "dedup.h"
+#include "fingerprint.h"
+#include "metrics.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Persistent FS state  (in reality, it should be maintained in secondary
+ * memory; for simplicity, this project maintains it in primary memory) */
+
+/* geometry of the FS (see state_init) */
+static tfs_params params;
+
+/*
+ * I-node table
+ * Each i-node takes whole cache lines of its own, so that threads working
+ * on different files never write to the same line: the lock and the
+ * i-node's size come first, then its block map, allocation state and open
+ * count, then the inline data (if any).
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    inode_t inode;
+    char state;     /* FREE or TAKEN */
+    bool unlinked;  /* named by no directory: deleted on its last close */
+    int open_count; /* open file entries */
+    int dir_free;   /* directories: first empty entry, -1 if full */
+    uint32_t *dir_prints; /* directories: fingerprint of each entry's name */
+} inode_slot_t;
+
+static char *inode_table;
+static size_t inode_slot_size;
+
+static inline inode_slot_t *slot_of(int inumber) {
+    return (inode_slot_t *)(void *)(inode_table + (size_t)inumber * inode_slot_size);
+}
+
+/*
+ * Allocation of i-nodes and data blocks
+ * A bitmap says which entries are free, but threads allocate from and free
+ * to per-CPU caches, which refill from (or spill to) the bitmap ALLOC_BATCH
+ * entries at a time. Entries held by a cache are marked TAKEN in the bitmap.
+ */
+#define ALLOC_CACHE_SIZE (2 * ALLOC_BATCH)
+#define ALLOC_BATCH (16)
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+    int count;
+    int entries[ALLOC_CACHE_SIZE]; /* a stack, lowest entry on top */
+} alloc_cache_t;
+
+typedef struct {
+    pthread_mutex_t lock; /* protects the bitmap (taken after a cache's) */
+    char *bitmap;
+    size_t size;
+    size_t first_free; /* no entry below it is FREE */
+    alloc_cache_t *caches;
+} allocator_t;
+
+static allocator_t inode_allocator;
+static allocator_t block_allocator;
+static size_t n_caches;
+
+/*
+ * Deferred block frees
+ * data_block_free only queues the block; a background thread hands queued
+ * blocks back to the bitmap RECLAIM_BATCH at a time (one bitmap access per
+ * batch), or every RECLAIM_INTERVAL_MS, or at once when allocation runs out
+ * of blocks.
+ */
+#define RECLAIM_BATCH (64)
+#define RECLAIM_INTERVAL_MS (100)
+
+static struct {
+    pthread_mutex_t lock; /* taken before the block allocator's */
+    pthread_cond_t work;
+    int *queue; /* ring with room for every block */
+    size_t head;
+    size_t count;
+    bool stop;
+    bool running;
+    pthread_t thread;
+} reclaim;
+
+/* Data blocks */
+static char *fs_data;
+static size_t fs_data_size;
+
+/*
+ * Block reference counts
+ * A block is named by one block map (or directory) entry unless it is
+ * shared with the snapshot (see state_snapshot) or by files written with
+ * the same contents (see inode_block_write); a block with more than one
+ * reference is never changed in place, but copied first (copy-on-write).
+ */
+static atomic_uint *block_refs;
+
+/* Volatile FS state */
+
+static int allocator_init(allocator_t *allocator, size_t size);
+static void allocator_destroy(allocator_t *allocator);
+static int reclaim_start();
+static void reclaim_stop();
+static void flush_deferred_frees();
+static int release_block(int block_number);
+static int drop_ref(int block_number);
+
+static open_file_entry_t *open_file_table;
+static char *free_open_file_entries;
+
+/* iterations of the storage delay loop (DELAY unless changed) */
+static int delay_iterations = DELAY;
+
+static inline bool valid_inumber(int inumber) {
+    return inumber >= 0 && (size_t)inumber < params.max_inode_count;
+}
+
+static inline bool valid_block_number(int block_number) {
+    return block_number >= 0 && (size_t)block_number < params.max_block_count;
+}
+
+static inline bool valid_file_handle(int file_handle) {
+    return file_handle >= 0 && (size_t)file_handle < params.max_open_files_count;
+}
+
+/**
+ * We need to defeat the optimizer for the insert_delay() function.
+ * Under optimization, the empty loop would be completely optimized away.
+ * This function tells the compiler that the assembly code being run (which is
+ * none) might potentially change *all memory in the process*.
+ *
+ * This prevents the optimizer from optimizing this code away, because it does
+ * not know what it does and it may have side effects.
+ *
+ * Reference with more information: https://youtu.be/nXaxk27zwlk?t=2775
+ *
+ * Exercise: try removing this function and look at the assembly generated to
+ * compare.
+ */
+static void touch_all_memory() { __asm volatile("" : : : "memory"); }
+
+/*
+ * Auxiliary function to insert a delay.
+ * Used in accesses to persistent FS state as a way of emulating access
+ * latencies as if such data structures were really stored in secondary memory.
+ */
+static void insert_delay() {
+    metrics_count(METRIC_INSERT_DELAY, 1);
+    for (int i = 0; i < delay_iterations; i++) {
+        touch_all_memory();
+    }
+}
+
+/*
+ * Sets the length of the emulated storage access delay (0 disables it).
+ * Input:
+ *  - iterations: iterations of the delay loop (DELAY by default)
+ */
+void state_set_delay(int iterations) { delay_iterations = iterations; }
+
+tfs_params tfs_default_params() {
+    tfs_params defaults = {
+        .max_inode_count = INODE_TABLE_SIZE,
+        .max_block_count = DATA_BLOCKS,
+        .max_open_files_count = MAX_OPEN_FILES,
+        .block_size = BLOCK_SIZE,
+        .max_inline_size = INLINE_DATA_SIZE,
+    };
+    return defaults;
+}
+
+static size_t round_up(size_t n, size_t multiple) { return (n + multiple - 1) / multiple * multiple; }
+
+/*
+ * Allocates a table starting at a cache line, so that it shares no line with
+ * other data.
+ */
+static void *alloc_table(size_t count, size_t size) {
+    return aligned_alloc(CACHE_LINE_SIZE, round_up(count * size, CACHE_LINE_SIZE));
+}
+
+/*
+ * Allocates the data blocks (zeroed). Large volumes are backed by huge
+ * pages when possible: reserved ones if there are any, transparent ones
+ * otherwise. Sets fs_data_size to the length mapped.
+ * Returns the blocks, or NULL if they could not be allocated
+ */
+static char *alloc_data(size_t len) {
+    void *data = MAP_FAILED;
+    if (len >= HUGE_PAGE_SIZE) {
+        fs_data_size = round_up(len, HUGE_PAGE_SIZE);
+        data = mmap(NULL, fs_data_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (data == MAP_FAILED) {
+        fs_data_size = len;
+        data = mmap(NULL, fs_data_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED) {
+            return NULL;
+        }
+        if (len >= HUGE_PAGE_SIZE) {
+            madvise(data, fs_data_size, MADV_HUGEPAGE); /* only a hint */
+        }
+    }
+    return data;
+}
+
+static bool valid_params(tfs_params p) {
+    return p.max_inode_count > 0 && p.max_inode_count <= INT_MAX && p.max_block_count > 0 &&
+           p.max_block_count <= INT_MAX && p.max_open_files_count > 0 && p.max_open_files_count <= INT_MAX &&
+           p.block_size >= sizeof(dir_entry_t) && p.block_size <= SSIZE_MAX && p.max_inline_size <= p.block_size &&
+           p.max_block_count <= SIZE_MAX / p.block_size && (p.store_size == 0 || p.store_size >= STORE_SEGMENT_SIZE);
+}
+
+/*
+ * Initializes FS state
+ * Input:
+ *  - params: the geometry of the FS
+ * Returns 0 if successful, -1 otherwise
+ */
+int state_init(tfs_params p) {
+    if (!valid_params(p)) {
+        return -1;
+    }
+    params = p;
+
+    inode_slot_size = round_up(sizeof(inode_slot_t) + params.max_inline_size, CACHE_LINE_SIZE);
+    inode_table = alloc_table(params.max_inode_count, inode_slot_size);
+    if (inode_table != NULL) {
+        for (int i = 0; (size_t)i < params.max_inode_count; i++) {
+            pthread_mutex_init(&slot_of(i)->lock, NULL);
+            slot_of(i)->state = FREE;
+            slot_of(i)->dir_prints = NULL;
+            slot_of(i)->inode.i_generation = 0;
+        }
+    }
+    open_file_table = alloc_table(params.max_open_files_count, sizeof(open_file_entry_t));
+    free_open_file_entries = alloc_table(params.max_open_files_count, sizeof(char));
+    /* compressed blocks are kept in the block cache's store instead */
+    fs_data = params.store_size > 0 ? NULL : alloc_data(params.max_block_count * params.block_size);
+    block_refs = alloc_table(params.max_block_count, sizeof(atomic_uint));
+    if (block_refs != NULL) {
+        for (size_t b = 0; b < params.max_block_count; b++) {
+            atomic_init(&block_refs[b], 0);
+        }
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    n_caches = cpus > 0 ? (size_t)cpus : 1;
+    if (inode_table == NULL || open_file_table == NULL || free_open_file_entries == NULL ||
+        (params.store_size > 0 ? block_cache_init(params.block_size, params.max_block_count, params.store_size)
+                               : (fs_data == NULL ? -1 : 0)) == -1 ||
+        block_refs == NULL ||
+        allocator_init(&inode_allocator, params.max_inode_count) == -1 ||
+        allocator_init(&block_allocator, params.max_block_count) == -1 || reclaim_start() == -1 ||
+        (params.dedup && dedup_init(params.max_block_count) == -1)) {
+        state_destroy();
+        return -1;
+    }
+
+    for (size_t i = 0; i < params.max_open_files_count; i++) {
+        free_open_file_entries[i] = FREE;
+    }
+    return 0;
+}
+
+void state_destroy() {
+    /* waits for a snapshot still being read (e.g. exported) */
+    state_snapshot_release();
+    reclaim_stop();
+    dedup_destroy();
+    block_cache_destroy();
+    if (inode_table != NULL) {
+        for (int i = 0; (size_t)i < params.max_inode_count; i++) {
+            pthread_mutex_destroy(&slot_of(i)->lock);
+            free(slot_of(i)->dir_prints);
+        }
+    }
+    free(inode_table);
+    allocator_destroy(&inode_allocator);
+    allocator_destroy(&block_allocator);
+    free(open_file_table);
+    free(free_open_file_entries);
+    if (fs_data != NULL) {
+        munmap(fs_data, fs_data_size);
+    }
+    free(block_refs);
+    block_refs = NULL;
+    inode_table = NULL;
+    open_file_table = NULL;
+    free_open_file_entries = NULL;
+    fs_data = NULL;
+}
+
+size_t state_block_size() { return params.block_size; }
+
+size_t state_inline_size() { return params.max_inline_size; }
+
+/* number of block numbers held by an indirect block */
+static inline size_t indirect_entries() { return params.block_size / sizeof(int); }
+
+size_t state_max_file_size() { return (INODE_DIRECT_BLOCKS + indirect_entries()) * params.block_size; }
+
+/*
+ * Initializes an allocator with every entry free.
+ * Returns 0 if successful, -1 otherwise
+ */
+static int allocator_init(allocator_t *allocator, size_t size) {
+    allocator->size = size;
+    allocator->first_free = 0;
+    allocator->bitmap = alloc_table(size, sizeof(char));
+    allocator->caches = alloc_table(n_caches, sizeof(alloc_cache_t));
+    if (allocator->bitmap == NULL || allocator->caches == NULL || pthread_mutex_init(&allocator->lock, NULL) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++) {
+        allocator->bitmap[i] = FREE;
+    }
+    for (size_t c = 0; c < n_caches; c++) {
+        pthread_mutex_init(&allocator->caches[c].lock, NULL);
+        allocator->caches[c].count = 0;
+    }
+    return 0;
+}
+
+static void allocator_destroy(allocator_t *allocator) {
+    if (allocator->caches != NULL) {
+        for (size_t c = 0; c < n_caches; c++) {
+            pthread_mutex_destroy(&allocator->caches[c].lock);
+        }
+        pthread_mutex_destroy(&allocator->lock);
+    }
+    free(allocator->bitmap);
+    free(allocator->caches);
+    allocator->bitmap = NULL;
+    allocator->caches = NULL;
+}
+
+static alloc_cache_t *my_cache(allocator_t *allocator) {
+    int cpu = sched_getcpu();
+    return &allocator->caches[(cpu < 0 ? 0 : (size_t)cpu) % n_caches];
+}
+
+/*
+ * Takes free entries from the bitmap, lowest first.
+ * Input:
+ *  - entries, n: where to put them and how many to take at most
+ * Returns the number of entries taken
+ */
+static int take_from_bitmap(allocator_t *allocator, int *entries, int n) {
+    int taken = 0;
+    pthread_mutex_lock(&allocator->lock);
+    size_t start = allocator->first_free;
+    size_t i;
+    for (i = start; i < allocator->size && taken < n; i++) {
+        if (i == start || i * sizeof(allocation_state_t) % params.block_size == 0) {
+            insert_delay(); // simulate storage access delay to the bitmap
+        }
+        if (allocator->bitmap[i] == FREE) {
+            allocator->bitmap[i] = TAKEN;
+            entries[taken++] = (int)i;
+        }
+    }
+    allocator->first_free = i;
+    pthread_mutex_unlock(&allocator->lock);
+    return taken;
+}
+
+/*
+ * Marks entries free in the bitmap. The caller holds the allocator's lock.
+ */
+static void return_to_bitmap(allocator_t *allocator, int const *entries, int n) {
+    insert_delay(); // simulate storage access delay to the bitmap
+    for (int k = 0; k < n; k++) {
+        allocator->bitmap[entries[k]] = FREE;
+        if ((size_t)entries[k] < allocator->first_free) {
+            allocator->first_free = (size_t)entries[k];
+        }
+    }
+}
+
+/*
+ * Returns the entries held by every cache to the bitmap.
+ */
+static void drain_caches(allocator_t *allocator) {
+    for (size_t c = 0; c < n_caches; c++) {
+        alloc_cache_t *cache = &allocator->caches[c];
+        pthread_mutex_lock(&cache->lock);
+        pthread_mutex_lock(&allocator->lock);
+        return_to_bitmap(allocator, cache->entries, cache->count);
+        cache->count = 0;
+        pthread_mutex_unlock(&allocator->lock);
+        pthread_mutex_unlock(&cache->lock);
+    }
+}
+
+/*
+ * Takes an entry from any cache (used when the bitmap runs out, as other
+ * CPUs' caches may still hold free entries).
+ * Returns the entry, or -1 if every cache is empty
+ */
+static int steal_from_caches(allocator_t *allocator) {
+    for (size_t c = 0; c < n_caches; c++) {
+        alloc_cache_t *cache = &allocator->caches[c];
+        pthread_mutex_lock(&cache->lock);
+        int entry = cache->count > 0 ? cache->entries[--cache->count] : -1;
+        pthread_mutex_unlock(&cache->lock);
+        if (entry != -1) {
+            return entry;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Allocates an entry.
+ * Returns the entry, or -1 if none is free
+ */
+static int allocator_take(allocator_t *allocator) {
+    alloc_cache_t *cache = my_cache(allocator);
+    pthread_mutex_lock(&cache->lock);
+    if (cache->count == 0) {
+        int batch[ALLOC_BATCH];
+        int taken = take_from_bitmap(allocator, batch, ALLOC_BATCH);
+        if (taken == 0) {
+            pthread_mutex_unlock(&cache->lock);
+            /* free entries may be held elsewhere: bring them back */
+            if (allocator == &block_allocator) {
+                flush_deferred_frees();
+            }
+            int entry;
+            return take_from_bitmap(allocator, &entry, 1) == 1 ? entry : steal_from_caches(allocator);
+        }
+        for (int k = taken - 1; k >= 0; k--) {
+            cache->entries[cache->count++] = batch[k];
+        }
+    }
+    int entry = cache->entries[--cache->count];
+    pthread_mutex_unlock(&cache->lock);
+    return entry;
+}
+
+/*
+ * Frees an entry. When the cache is full, its bottom half goes back to the
+ * bitmap.
+ */
+static void allocator_put(allocator_t *allocator, int entry) {
+    alloc_cache_t *cache = my_cache(allocator);
+    pthread_mutex_lock(&cache->lock);
+    if (cache->count == ALLOC_CACHE_SIZE) {
+        pthread_mutex_lock(&allocator->lock);
+        return_to_bitmap(allocator, cache->entries, ALLOC_BATCH);
+        pthread_mutex_unlock(&allocator->lock);
+        memmove(cache->entries, cache->entries + ALLOC_BATCH, (ALLOC_CACHE_SIZE - ALLOC_BATCH) * sizeof(int));
+        cache->count -= ALLOC_BATCH;
+    }
+    cache->entries[cache->count++] = entry;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Hands up to RECLAIM_BATCH queued blocks back to the bitmap. The caller
+ * holds reclaim.lock, which is released while the bitmap is updated.
+ * Returns the number of blocks reclaimed
+ */
+static int reclaim_batch() {
+    int blocks[RECLAIM_BATCH];
+    int n = 0;
+    while (reclaim.count > 0 && n < RECLAIM_BATCH) {
+        blocks[n++] = reclaim.queue[reclaim.head];
+        reclaim.head = (reclaim.head + 1) % params.max_block_count;
+        reclaim.count--;
+    }
+    if (n > 0) {
+        pthread_mutex_unlock(&reclaim.lock);
+        pthread_mutex_lock(&block_allocator.lock);
+        return_to_bitmap(&block_allocator, blocks, n);
+        pthread_mutex_unlock(&block_allocator.lock);
+        pthread_mutex_lock(&reclaim.lock);
+    }
+    return n;
+}
+
+static void flush_deferred_frees() {
+    pthread_mutex_lock(&reclaim.lock);
+    while (reclaim_batch() > 0) {
+    }
+    pthread_mutex_unlock(&reclaim.lock);
+}
+
+static void *reclaimer(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&reclaim.lock);
+    while (!reclaim.stop) {
+        if (reclaim.count < RECLAIM_BATCH) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += RECLAIM_INTERVAL_MS * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&reclaim.work, &reclaim.lock, &deadline);
+        }
+        while (reclaim_batch() > 0) {
+        }
+    }
+    pthread_mutex_unlock(&reclaim.lock);
+    return NULL;
+}
+
+/*
+ * Starts the reclaimer thread.
+ * Returns 0 if successful, -1 otherwise
+ */
+static int reclaim_start() {
+    reclaim.queue = malloc(params.max_block_count * sizeof(int));
+    reclaim.head = 0;
+    reclaim.count = 0;
+    reclaim.stop = false;
+    if (reclaim.queue == NULL || pthread_mutex_init(&reclaim.lock, NULL) != 0 ||
+        pthread_cond_init(&reclaim.work, NULL) != 0 ||
+        pthread_create(&reclaim.thread, NULL, reclaimer, NULL) != 0) {
+        return -1;
+    }
+    reclaim.running = true;
+    return 0;
+}
+
+static void reclaim_stop() {
+    if (reclaim.running) {
+        pthread_mutex_lock(&reclaim.lock);
+        reclaim.stop = true;
+        pthread_cond_signal(&reclaim.work);
+        pthread_mutex_unlock(&reclaim.lock);
+        pthread_join(reclaim.thread, NULL);
+        pthread_cond_destroy(&reclaim.work);
+        pthread_mutex_destroy(&reclaim.lock);
+        reclaim.running = false;
+    }
+    free(reclaim.queue);
+    reclaim.queue = NULL;
+}
+
+/*
+ * Empties a directory entry, pushing it on the directory's list of empty
+ * entries (linked through their unused names), so that adding and removing
+ * entries take constant time.
+ */
+static void free_dir_entry(int inumber, dir_entry_t *dir_entry, int e) {
+    slot_of(inumber)->dir_prints[e] = 0;
+    dir_entry[e].d_inumber = -1;
+    memcpy(dir_entry[e].d_name, &slot_of(inumber)->dir_free, sizeof(int));
+    slot_of(inumber)->dir_free = e;
+}
+
+/*
+ * Creates a new i-node in the i-node table.
+ * Input:
+ *  - n_type: the type of the node (file or directory)
+ * Returns:
+ *  new i-node's number if successfully created, -1 otherwise
+ */
+int inode_create(inode_type n_type) {
+    int inumber = allocator_take(&inode_allocator);
+    if (inumber == -1) {
+        return -1;
+    }
+
+    insert_delay(); // simulate storage access delay (to i-node)
+    inode_t *inode = &slot_of(inumber)->inode;
+    inode->i_node_type = n_type;
+    inode->i_generation++;
+    inode->i_block_count = 0;
+    for (int i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+        inode->i_data_blocks[i] = -1;
+    }
+    inode->i_indirect_block = -1;
+    memset(inode_inline_data(inumber), 0, params.max_inline_size);
+
+    if (n_type == T_DIRECTORY) {
+        /* Initializes directory (filling its block with empty
+         * entries, labeled with inumber==-1) */
+        int b = data_block_alloc();
+        if (b == -1) {
+            allocator_put(&inode_allocator, inumber);
+            return -1;
+        }
+
+        inode->i_size = params.block_size;
+        inode->i_block_count = 1;
+        inode->i_data_blocks[0] = b;
+
+        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
+        uint32_t *prints = calloc(round_up(MAX_DIR_ENTRIES, FINGERPRINT_LANES), sizeof(uint32_t));
+        if (dir_entry == NULL || prints == NULL) {
+            if (dir_entry != NULL) {
+                data_block_put(b, false);
+            }
+            free(prints);
+            data_block_free(b);
+            allocator_put(&inode_allocator, inumber);
+            return -1;
+        }
+
+        slot_of(inumber)->dir_prints = prints;
+        slot_of(inumber)->dir_free = -1;
+        for (int i = (int)MAX_DIR_ENTRIES - 1; i >= 0; i--) {
+            free_dir_entry(inumber, dir_entry, i);
+        }
+        data_block_put(b, true);
+    } else {
+        /* In case of a new file, simply sets its size to 0 */
+        inode->i_size = 0;
+    }
+    slot_of(inumber)->state = TAKEN;
+    slot_of(inumber)->unlinked = false;
+    slot_of(inumber)->open_count = 0;
+    return inumber;
+}
+
+/*
+ * Deletes the i-node.
+ * Input:
+ *  - inumber: i-node's number
+ * Returns: 0 if successful, -1 if failed
+ */
+int inode_delete(int inumber) {
+    insert_delay(); // simulate storage access delay (to i-node)
+
+    if (!valid_inumber(inumber) || slot_of(inumber)->state == FREE) {
+        return -1;
+    }
+
+    /* waits for a read or write of the i-node still in progress */
+    pthread_mutex_lock(&slot_of(inumber)->lock);
+    slot_of(inumber)->state = FREE;
+    free(slot_of(inumber)->dir_prints);
+    slot_of(inumber)->dir_prints = NULL;
+    int r = inode_truncate(inumber);
+    pthread_mutex_unlock(&slot_of(inumber)->lock);
+    if (r == -1) {
+        return -1;
+    }
+
+    allocator_put(&inode_allocator, inumber);
+    return 0;
+}
+
+/*
+ * Accounts for a new open file entry of an i-node.
+ */
+void inode_opened(int inumber) {
+    if (valid_inumber(inumber)) {
+        slot_of(inumber)->open_count++;
+    }
+}
+
+/*
+ * Accounts for a closed file entry of an i-node; an unlinked i-node is
+ * deleted with its last entry.
+ * Returns: 0 if successful, -1 if failed
+ */
+int inode_closed(int inumber) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+    inode_slot_t *slot = slot_of(inumber);
+    if (--slot->open_count == 0 && slot->unlinked) {
+        return inode_delete(inumber);
+    }
+    return 0;
+}
+
+/*
+ * Deletes an i-node no directory names any more: right away if no entry of
+ * the open file table refers to it, when the last one is closed otherwise.
+ * Returns: 0 if successful, -1 if failed
+ */
+int inode_unlink(int inumber) {
+    if (!valid_inumber(inumber) || slot_of(inumber)->state == FREE) {
+        return -1;
+    }
+    if (slot_of(inumber)->open_count > 0) {
+        slot_of(inumber)->unlinked = true;
+        return 0;
+    }
+    return inode_delete(inumber);
+}
+
+/*
+ * Returns a pointer to an existing i-node.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: pointer if successful, NULL if failed
+ */
+inode_t *inode_get(int inumber) {
+    if (!valid_inumber(inumber)) {
+        return NULL;
+    }
+
+    insert_delay(); // simulate storage access delay to i-node
+    return &slot_of(inumber)->inode;
+}
+
+/*
+ * Returns a pointer to the inline data of an existing i-node, which has room
+ * for state_inline_size() bytes (see inode_t).
+ */
+void *inode_inline_data(int inumber) {
+    if (!valid_inumber(inumber)) {
+        return NULL;
+    }
+    return (char *)slot_of(inumber) + sizeof(inode_slot_t);
+}
+
+/*
+ * Returns the block named by the entry of an i-node's block map for its
+ * index-th block, or -1 if there is none (a hole, past the largest file, or
+ * in an indirect block that is not allocated).
+ */
+static int block_entry(inode_t *inode, size_t index) {
+    if (index < INODE_DIRECT_BLOCKS) {
+        return inode->i_data_blocks[index];
+    }
+    index -= INODE_DIRECT_BLOCKS;
+    int *map = index < indirect_entries() ? data_block_get(inode->i_indirect_block) : NULL;
+    if (map == NULL) {
+        return -1;
+    }
+    int b = map[index];
+    data_block_put(inode->i_indirect_block, false);
+    return b;
+}
+
+/*
+ * Returns the block holding the index-th block of a file, or -1 if it is a
+ * hole (or past the largest file).
+ * The caller holds the i-node's lock (or the global lock, for directories).
+ */
+int inode_block(int inumber, size_t index) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+    return block_entry(&slot_of(inumber)->inode, index);
+}
+
+/*
+ * Makes the block named by an entry of a block map private before it is
+ * changed: a shared block is copied, and the entry made to name the copy.
+ * Returns: the private block, or -1 if no block could be allocated
+ */
+static int unshare_block(int *entry) {
+    int b = *entry;
+    if (!valid_block_number(b)) {
+        return b;
+    }
+    if (atomic_load(&block_refs[b]) == 1) {
+        /* changed in place: no reference can be taken through the
+         * deduplication index once it is forgotten */
+        dedup_forget(b);
+        if (atomic_load(&block_refs[b]) == 1) {
+            return b;
+        }
+    }
+    int copy = data_block_alloc();
+    void *to = data_block_get(copy);
+    void *from = data_block_get(b);
+    if (to != NULL && from != NULL) {
+        memcpy(to, from, params.block_size);
+    }
+    if (from != NULL) {
+        data_block_put(b, false);
+    }
+    if (to != NULL) {
+        data_block_put(copy, true);
+    }
+    if (to == NULL || from == NULL) {
+        data_block_free(copy);
+        return -1;
+    }
+    *entry = copy;
+    data_block_free(b);
+    metrics_count(METRIC_BLOCK_COW, 1);
+    return copy;
+}
+
+/*
+ * Makes the indirect block of an i-node private (see unshare_block) so
+ * that its entries can be changed: a copy takes a reference to every block
+ * it names.
+ * Returns: the indirect block, or -1 if there is none or failed
+ */
+static int writable_map(inode_t *inode) {
+    int ib = inode->i_indirect_block;
+    if (ib == -1 || unshare_block(&inode->i_indirect_block) == -1) {
+        return -1;
+    }
+    if (inode->i_indirect_block != ib) {
+        int *map = data_block_get(inode->i_indirect_block);
+        if (map == NULL) {
+            return -1;
+        }
+        for (size_t e = 0; e < indirect_entries(); e++) {
+            if (map[e] != -1) {
+                atomic_fetch_add(&block_refs[map[e]], 1);
+            }
+        }
+        data_block_put(inode->i_indirect_block, false);
+    }
+    return inode->i_indirect_block;
+}
+
+/*
+ * Drops a reference to an indirect block; the blocks it names are dropped
+ * along with its last reference.
+ * Returns: the number of blocks it names
+ */
+static size_t drop_indirect(int ib) {
+    int *map = data_block_get(ib);
+    if (map == NULL) {
+        return 0;
+    }
+    size_t named = 0;
+    for (size_t e = 0; e < indirect_entries(); e++) {
+        named += map[e] != -1;
+    }
+    if (drop_ref(ib) == 1) {
+        for (size_t e = 0; e < indirect_entries(); e++) {
+            if (map[e] != -1) {
+                data_block_free(map[e]);
+            }
+        }
+        data_block_put(ib, false);
+        release_block(ib);
+    } else {
+        data_block_put(ib, false);
+    }
+    return named;
+}
+
+/*
+ * Returns the entry naming the index-th block of a file, in a block map
+ * that can be changed: the indirect block is allocated if needed, and made
+ * private (see writable_map). An entry in the indirect block is only valid
+ * until the caller puts the block returned in map_block (-1 for a direct
+ * entry), as written (see data_block_put).
+ * Returns: the entry, or NULL if failed
+ */
+static int *writable_entry(inode_t *inode, size_t index, int *map_block) {
+    *map_block = -1;
+    if (index < INODE_DIRECT_BLOCKS) {
+        return &inode->i_data_blocks[index];
+    }
+    if (index >= INODE_DIRECT_BLOCKS + indirect_entries()) {
+        return NULL;
+    }
+    if (inode->i_indirect_block == -1) {
+        int ib = data_block_alloc();
+        int *map = data_block_get(ib);
+        if (map == NULL) {
+            data_block_free(ib);
+            return NULL;
+        }
+        for (size_t e = 0; e < indirect_entries(); e++) {
+            map[e] = -1;
+        }
+        data_block_put(ib, true);
+        inode->i_indirect_block = ib;
+    }
+    int ib = writable_map(inode);
+    int *map = data_block_get(ib);
+    if (map == NULL) {
+        return NULL;
+    }
+    *map_block = ib;
+    return map + (index - INODE_DIRECT_BLOCKS);
+}
+
+/*
+ * Returns the block holding the index-th block of a file, ready to be
+ * written: a hole is allocated (zeroed), along with the indirect block if
+ * needed, and a block shared with a snapshot is copied first.
+ * The caller holds the i-node's lock (or the global lock, for directories).
+ * Returns: block index if successful, -1 otherwise
+ */
+int inode_block_alloc(int inumber, size_t index) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+    inode_t *inode = &slot_of(inumber)->inode;
+    int map_block;
+    int *entry = writable_entry(inode, index, &map_block);
+    if (entry == NULL) {
+        return -1;
+    }
+
+    int b;
+    if (*entry != -1) {
+        b = unshare_block(entry);
+    } else {
+        b = data_block_alloc();
+        void *data = data_block_get(b);
+        if (data == NULL) {
+            data_block_free(b);
+            b = -1;
+        } else {
+            /* the parts not written must read as zeros, not as a former file */
+            memset(data, 0, params.block_size);
+            data_block_put(b, true);
+            *entry = b;
+            inode->i_block_count++;
+        }
+    }
+    data_block_put(map_block, true);
+    return b;
+}
+
+/*
+ * Takes a reference to a block in the deduplication index if it holds the
+ * given contents (see dedup_find).
+ */
+static bool share_if_equal(int block_number, void *data) {
+    void *contents = data_block_get(block_number);
+    if (contents == NULL) {
+        return false;
+    }
+    bool equal = memcmp(contents, data, params.block_size) == 0;
+    data_block_put(block_number, false);
+    if (!equal) {
+        return false;
+    }
+    /* a block whose last reference is being dropped is not revived */
+    unsigned int refs = atomic_load(&block_refs[block_number]);
+    do {
+        if (refs == 0) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak(&block_refs[block_number], &refs, refs + 1));
+    return true;
+}
+
+/*
+ * Writes a whole block of a file. With deduplication on (see tfs_params),
+ * a block already holding the same contents is shared instead, and a block
+ * stored is added to the index.
+ * The caller holds the i-node's lock.
+ * Returns: 0 if successful, -1 otherwise
+ */
+int inode_block_write(int inumber, size_t index, void const *data) {
+    if (!params.dedup) {
+        int b = inode_block_alloc(inumber, index);
+        void *block = data_block_get(b);
+        if (block == NULL) {
+            return -1;
+        }
+        memcpy(block, data, params.block_size);
+        return data_block_put(b, true);
+    }
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+
+    uint64_t hash = dedup_hash(data, params.block_size);
+    int shared = dedup_find(hash, share_if_equal, (void *)data);
+    if (shared == -1) {
+        int b = inode_block_alloc(inumber, index);
+        void *block = data_block_get(b);
+        if (block == NULL) {
+            return -1;
+        }
+        memcpy(block, data, params.block_size);
+        int r = data_block_put(b, true);
+        dedup_insert(hash, b);
+        metrics_count(METRIC_DEDUP_STORE, 1);
+        return r;
+    }
+
+    inode_t *inode = &slot_of(inumber)->inode;
+    int map_block;
+    int *entry = writable_entry(inode, index, &map_block);
+    if (entry == NULL) {
+        data_block_free(shared);
+        return -1;
+    }
+    int old = *entry;
+    *entry = shared;
+    data_block_put(map_block, true);
+    if (old == -1) {
+        inode->i_block_count++;
+    } else {
+        /* also drops the extra reference if the block already was this one */
+        data_block_free(old);
+    }
+    metrics_count(METRIC_DEDUP_HIT, 1);
+    return 0;
+}
+
+/*
+ * Frees the block named by an entry of a block map, if any, leaving a hole.
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int free_map_entry(inode_t *inode, int *entry) {
+    if (*entry == -1) {
+        return 0;
+    }
+    if (data_block_free(*entry) == -1) {
+        return -1;
+    }
+    *entry = -1;
+    inode->i_block_count--;
+    return 0;
+}
+
+/*
+ * Frees the blocks of a file from the first-th up to (excluding) the
+ * last-th, leaving holes; the indirect block is freed with the last block
+ * it names. The size of the file does not change.
+ * The caller holds the i-node's lock (or the global lock, for directories).
+ * Returns: 0 if successful, -1 otherwise
+ */
+int inode_punch_blocks(int inumber, size_t first, size_t last) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+    inode_t *inode = &slot_of(inumber)->inode;
+
+    for (size_t i = first; i < last && i < INODE_DIRECT_BLOCKS; i++) {
+        if (free_map_entry(inode, &inode->i_data_blocks[i]) == -1) {
+            return -1;
+        }
+    }
+    if (inode->i_indirect_block == -1 || last <= INODE_DIRECT_BLOCKS) {
+        return 0;
+    }
+
+    /* the whole indirect block goes at once, without copying it if shared */
+    if (first <= INODE_DIRECT_BLOCKS && last >= INODE_DIRECT_BLOCKS + indirect_entries()) {
+        inode->i_block_count -= drop_indirect(inode->i_indirect_block);
+        inode->i_indirect_block = -1;
+        return 0;
+    }
+
+    int ib = writable_map(inode);
+    int *map = data_block_get(ib);
+    if (map == NULL) {
+        return -1;
+    }
+    bool empty = true;
+    int r = 0;
+    for (size_t e = 0; e < indirect_entries() && r == 0; e++) {
+        size_t i = INODE_DIRECT_BLOCKS + e;
+        if (i >= first && i < last && free_map_entry(inode, &map[e]) == -1) {
+            r = -1;
+        }
+        empty = empty && map[e] == -1;
+    }
+    data_block_put(ib, true);
+    if (r == -1) {
+        return -1;
+    }
+    if (empty) {
+        if (data_block_free(inode->i_indirect_block) == -1) {
+            return -1;
+        }
+        inode->i_indirect_block = -1;
+    }
+    return 0;
+}
+
+/*
+ * Empties a file, freeing all of its blocks.
+ * The caller holds the i-node's lock.
+ * Returns: 0 if successful, -1 otherwise
+ */
+int inode_truncate(int inumber) {
+    if (inode_punch_blocks(inumber, 0, INODE_DIRECT_BLOCKS + indirect_entries()) == -1) {
+        return -1;
+    }
+    memset(inode_inline_data(inumber), 0, params.max_inline_size);
+    slot_of(inumber)->inode.i_size = 0;
+    return 0;
+}
+
+/*
+ * Locks an i-node, so that its size and contents can be changed by a
+ * thread not holding any other lock.
+ * Returns 0 if successful, -1 otherwise
+ */
+int inode_lock(int inumber) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+    return pthread_mutex_lock(&slot_of(inumber)->lock) == 0 ? 0 : -1;
+}
+
+void inode_unlock(int inumber) {
+    if (valid_inumber(inumber)) {
+        pthread_mutex_unlock(&slot_of(inumber)->lock);
+    }
+}
+
+/*
+ * Adds an entry to the i-node directory data.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - sub_inumber: identifier of the sub i-node entry
+ *  - sub_name: name of the sub i-node entry
+ * Returns: SUCCESS or FAIL
+ */
+int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
+    if (!valid_inumber(inumber) || !valid_inumber(sub_inumber)) {
+        return -1;
+    }
+
+    insert_delay(); // simulate storage access delay to i-node with inumber
+    if (slot_of(inumber)->inode.i_node_type != T_DIRECTORY) {
+        return -1;
+    }
+
+    if (strlen(sub_name) == 0) {
+        return -1;
+    }
+
+    /* Locates the block containing the directory's entries */
+    int b = unshare_block(&slot_of(inumber)->inode.i_data_blocks[0]);
+    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
+    if (dir_entry == NULL) {
+        return -1;
+    }
+
+    /* Takes the first entry of the list of empty ones */
+    int e = slot_of(inumber)->dir_free;
+    if (e == -1) {
+        data_block_put(b, false);
+        return -1;
+    }
+    memcpy(&slot_of(inumber)->dir_free, dir_entry[e].d_name, sizeof(int));
+    dir_entry[e].d_inumber = sub_inumber;
+    strncpy(dir_entry[e].d_name, sub_name, MAX_FILE_NAME - 1);
+    dir_entry[e].d_name[MAX_FILE_NAME - 1] = 0;
+    slot_of(inumber)->dir_prints[e] = name_fingerprint(dir_entry[e].d_name);
+    data_block_put(b, true);
+    return 0;
+}
+
+/*
+ * Locks the block of a directory's entries for changing one of them, which
+ * must be in use.
+ * Returns the directory's entries (to be put back with data_block_put), or
+ * NULL if there is no such entry
+ */
+static dir_entry_t *get_dir_entry(int inumber, int e, int *b) {
+    insert_delay(); // simulate storage access delay to i-node with inumber
+    if (!valid_inumber(inumber) || slot_of(inumber)->inode.i_node_type != T_DIRECTORY || e < 0 ||
+        e >= (int)MAX_DIR_ENTRIES) {
+        return NULL;
+    }
+    *b = unshare_block(&slot_of(inumber)->inode.i_data_blocks[0]);
+    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(*b);
+    if (dir_entry != NULL && dir_entry[e].d_inumber == -1) {
+        data_block_put(*b, false);
+        return NULL;
+    }
+    return dir_entry;
+}
+
+/*
+ * Removes an entry (found by find_entry_in_dir) from a directory.
+ * Input:
+ *  - inumber: identifier of the directory's i-node
+ *  - e: index of the entry
+ * Returns: SUCCESS or FAIL
+ */
+int clear_dir_entry(int inumber, int e) {
+    int b;
+    dir_entry_t *dir_entry = get_dir_entry(inumber, e, &b);
+    if (dir_entry == NULL) {
+        return -1;
+    }
+    free_dir_entry(inumber, dir_entry, e);
+    data_block_put(b, true);
+    return 0;
+}
+
+/*
+ * Renames an entry (found by find_entry_in_dir) of a directory, in place.
+ * Input:
+ *  - inumber: identifier of the directory's i-node
+ *  - e: index of the entry
+ *  - new_name: the entry's new name
+ * Returns: SUCCESS or FAIL
+ */
+int rename_dir_entry(int inumber, int e, char const *new_name) {
+    if (strlen(new_name) == 0) {
+        return -1;
+    }
+    int b;
+    dir_entry_t *dir_entry = get_dir_entry(inumber, e, &b);
+    if (dir_entry == NULL) {
+        return -1;
+    }
+    strncpy(dir_entry[e].d_name, new_name, MAX_FILE_NAME - 1);
+    dir_entry[e].d_name[MAX_FILE_NAME - 1] = 0;
+    slot_of(inumber)->dir_prints[e] = name_fingerprint(dir_entry[e].d_name);
+    data_block_put(b, true);
+    return 0;
+}
+
+/* Looks for a given name inside a directory
+ * Input:
+ * 	- parent directory's i-node number
+ * 	- name to search
+ * 	Returns i-number linked to the target name, -1 if not found
+ */
+int find_in_dir(int inumber, char const *sub_name) {
+    int e;
+    return find_entry_in_dir(inumber, sub_name, &e);
+}
+
+/* Looks for a given name inside a directory, as find_in_dir, also telling
+ * which entry names it (so it is removed or renamed without another search)
+ * Input:
+ * 	- parent directory's i-node number
+ * 	- name to search
+ * 	- where to store the index of the entry
+ * 	Returns i-number linked to the target name, -1 if not found
+ */
+int find_entry_in_dir(int inumber, char const *sub_name, int *entry) {
+    insert_delay(); // simulate storage access delay to i-node with inumber
+    if (!valid_inumber(inumber) ||
+        slot_of(inumber)->inode.i_node_type != T_DIRECTORY) {
+        return -1;
+    }
+
+    /* Only the entries whose fingerprint matches the target name's are
+     * compared in full: the block holding them is accessed on the first */
+    uint32_t const *prints = slot_of(inumber)->dir_prints;
+    uint32_t print = name_fingerprint(sub_name);
+    int b = slot_of(inumber)->inode.i_data_blocks[0];
+    dir_entry_t *dir_entry = NULL;
+    int found = -1;
+    for (int i = fingerprint_find(prints, MAX_DIR_ENTRIES, print, 0); i != -1 && found == -1;
+         i = fingerprint_find(prints, MAX_DIR_ENTRIES, print, (size_t)i + 1)) {
+        if (dir_entry == NULL && (dir_entry = (dir_entry_t *)data_block_get(b)) == NULL) {
+            return -1;
+        }
+        if ((dir_entry[i].d_inumber != -1) &&
+            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
+            found = dir_entry[i].d_inumber;
+            *entry = i;
+        }
+    }
+
+    if (dir_entry != NULL) {
+        data_block_put(b, false);
+    }
+    return found;
+}
+
+/*
+ * Copies a window of the entries of a directory (of MAX_DIR_ENTRIES, the
+ * free ones included).
+ * Input:
+ * 	- directory's i-node number
+ * 	- index of the first entry, and how many to copy at most
+ * 	- where to copy the entries
+ * Returns the number of entries copied (0 past the last one), or -1 in case
+ * of error
+ */
+ssize_t read_dir(int inumber, size_t first, size_t count, dir_entry_t *entries) {
+    insert_delay(); // simulate storage access delay to i-node with inumber
+    if (!valid_inumber(inumber) || slot_of(inumber)->inode.i_node_type != T_DIRECTORY) {
+        return -1;
+    }
+    if (first >= MAX_DIR_ENTRIES) {
+        return 0;
+    }
+    if (count > MAX_DIR_ENTRIES - first) {
+        count = MAX_DIR_ENTRIES - first;
+    }
+    int b = slot_of(inumber)->inode.i_data_blocks[0];
+    dir_entry_t const *dir_entry = data_block_get(b);
+    if (dir_entry == NULL) {
+        return -1;
+    }
+    memcpy(entries, dir_entry + first, count * sizeof(dir_entry_t));
+    data_block_put(b, false);
+    return (ssize_t)count;
+}
+
+/*
+ * Allocated a new data block
+ * Returns: block index if successful, -1 otherwise
+ */
+int data_block_alloc() {
+    int block = allocator_take(&block_allocator);
+    if (block != -1) {
+        atomic_store(&block_refs[block], 1);
+        metrics_count(METRIC_BLOCK_ALLOC, 1);
+    }
+    return block;
+}
+
+/*
+ * Drops a reference to a data block.
+ * Returns: 1 if it was the last one (the block is then the caller's, to be
+ * released), 0 if not, -1 if the block had no reference
+ */
+static int drop_ref(int block_number) {
+    unsigned int refs = atomic_load(&block_refs[block_number]);
+    do {
+        if (refs == 0) {
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak(&block_refs[block_number], &refs, refs - 1));
+    return refs == 1;
+}
+
+/* Frees a data block (drops a reference to it: a block shared with a
+ * snapshot is only freed with its last reference)
+ * Input
+ * 	- the block index
+ * Returns: 0 if success, -1 otherwise
+ */
+int data_block_free(int block_number) {
+    if (!valid_block_number(block_number)) {
+        return -1;
+    }
+    int last = drop_ref(block_number);
+    return last == 1 ? release_block(block_number) : last;
+}
+
+/*
+ * Hands a block with no references left back to the allocator.
+ * Returns: 0 if success, -1 otherwise
+ */
+static int release_block(int block_number) {
+    dedup_forget(block_number);
+    if (params.store_size > 0) {
+        block_cache_discard(block_number);
+    }
+    /* queued for the reclaimer; no storage access on this path */
+    pthread_mutex_lock(&reclaim.lock);
+    if (reclaim.count == params.max_block_count) {
+        /* only possible if blocks are freed twice */
+        pthread_mutex_unlock(&reclaim.lock);
+        return -1;
+    }
+    reclaim.queue[(reclaim.head + reclaim.count) % params.max_block_count] = block_number;
+    if (++reclaim.count == RECLAIM_BATCH) {
+        pthread_cond_signal(&reclaim.work);
+    }
+    pthread_mutex_unlock(&reclaim.lock);
+    metrics_count(METRIC_BLOCK_FREE, 1);
+    return 0;
+}
+
+/* Returns a pointer to the contents of a given block, valid until
+ * data_block_put is called for it (with compression on, the block is
+ * decompressed into the block cache, and pinned there; see tfs_params)
+ * Input:
+ * 	- Block's index
+ * Returns: pointer to the first byte of the block, NULL otherwise
+ */
+void *data_block_get(int block_number) {
+    if (!valid_block_number(block_number)) {
+        return NULL;
+    }
+
+    insert_delay(); // simulate storage access delay to block
+    if (params.store_size > 0) {
+        return block_cache_get(block_number);
+    }
+    return &fs_data[(size_t)block_number * params.block_size];
+}
+
+/* Ends the use of a block's contents (see data_block_get)
+ * Input:
+ * 	- Block's index (nothing is done for -1)
+ * 	- whether its contents were changed
+ * Returns: 0 if success, -1 if the changes could not be stored (with
+ * compression on, when the store is full; see block_cache_put)
+ */
+int data_block_put(int block_number, bool written) {
+    if (params.store_size > 0 && valid_block_number(block_number)) {
+        return block_cache_put(block_number, written);
+    }
+    return 0;
+}
+
+/* Add new entry to the open file table
+ * Inputs:
+ * 	- I-node number of the file to open
+ * 	- Initial offset
+ * Returns: file handle if successful, -1 otherwise
+ */
+int add_to_open_file_table(int inumber, size_t offset) {
+    for (int i = 0; (size_t)i < params.max_open_files_count; i++) {
+        if (free_open_file_entries[i] == FREE) {
+            free_open_file_entries[i] = TAKEN;
+            open_file_table[i].of_inumber = inumber;
+            open_file_table[i].of_offset = offset;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Frees an entry from the open file table
+ * Inputs:
+ * 	- file handle to free/close
+ * Returns 0 is success, -1 otherwise
+ */
+int remove_from_open_file_table(int fhandle) {
+    if (!valid_file_handle(fhandle) ||
+        free_open_file_entries[fhandle] != TAKEN) {
+        return -1;
+    }
+    free_open_file_entries[fhandle] = FREE;
+    return 0;
+}
+
+/* Returns pointer to a given entry in the open file table
+ * Inputs:
+ * 	 - file handle
+ * Returns: pointer to the entry if sucessful, NULL otherwise
+ */
+open_file_entry_t *get_open_file_entry(int fhandle) {
+    if (!valid_file_handle(fhandle)) {
+        return NULL;
+    }
+    return &open_file_table[fhandle];
+}
+
+/* Returns whether a file handle is open (the entry of a closed one is still
+ * returned by get_open_file_entry) */
+bool open_file_in_use(int fhandle) {
+    return valid_file_handle(fhandle) && free_open_file_entries[fhandle] == TAKEN;
+}
+
+/*
+ * Snapshot
+ * A frozen copy of the i-node table (the i-nodes and their inline data).
+ * The blocks it names are shared with the live FS, the snapshot holding a
+ * reference to each block named directly by an i-node (the blocks named by
+ * a shared indirect block are shared through it), so taking it costs
+ * O(i-nodes) and copies no data: the live FS copies a shared block before
+ * changing it (see unshare_block).
+ */
+static struct {
+    pthread_mutex_t lock; /* taken after the i-node locks */
+    pthread_cond_t unread;
+    bool exists;
+    int readers;
+    inode_t *inodes;
+    char *states;
+    char *inline_data;
+} snapshot = {.lock = PTHREAD_MUTEX_INITIALIZER, .unread = PTHREAD_COND_INITIALIZER};
+
+/*
+ * Takes a snapshot of the FS (see above). Must be called holding the lock
+ * that serializes i-node creation and deletion (the global lock in
+ * operations.c); it takes every i-node lock, so it also waits for reads
+ * and writes in progress.
+ * Returns 0 if successful, -1 otherwise (including when a snapshot exists)
+ */
+int state_snapshot() {
+    inode_t *inodes = malloc(params.max_inode_count * sizeof(inode_t));
+    char *states = malloc(params.max_inode_count);
+    char *inline_data = malloc(params.max_inode_count * params.max_inline_size + 1);
+    if (inodes == NULL || states == NULL || inline_data == NULL) {
+        free(inodes);
+        free(states);
+        free(inline_data);
+        return -1;
+    }
+
+    for (int i = 0; (size_t)i < params.max_inode_count; i++) {
+        pthread_mutex_lock(&slot_of(i)->lock);
+    }
+    pthread_mutex_lock(&snapshot.lock);
+    bool taken = !snapshot.exists;
+    if (taken) {
+        for (int i = 0; (size_t)i < params.max_inode_count; i++) {
+            inode_slot_t *slot = slot_of(i);
+            states[i] = slot->state;
+            if (slot->state == FREE) {
+                continue;
+            }
+            inodes[i] = slot->inode;
+            memcpy(inline_data + (size_t)i * params.max_inline_size, inode_inline_data(i), params.max_inline_size);
+            for (int d = 0; d < INODE_DIRECT_BLOCKS; d++) {
+                if (valid_block_number(inodes[i].i_data_blocks[d])) {
+                    atomic_fetch_add(&block_refs[inodes[i].i_data_blocks[d]], 1);
+                }
+            }
+            if (valid_block_number(inodes[i].i_indirect_block)) {
+                atomic_fetch_add(&block_refs[inodes[i].i_indirect_block], 1);
+            }
+        }
+        snapshot.inodes = inodes;
+        snapshot.states = states;
+        snapshot.inline_data = inline_data;
+        snapshot.exists = true;
+    }
+    pthread_mutex_unlock(&snapshot.lock);
+    for (int i = 0; (size_t)i < params.max_inode_count; i++) {
+        pthread_mutex_unlock(&slot_of(i)->lock);
+    }
+
+    if (!taken) {
+        free(inodes);
+        free(states);
+        free(inline_data);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Drops the snapshot, and its references to blocks, once no one reads it.
+ * Returns 0 if successful, -1 if there is no snapshot
+ */
+int state_snapshot_release() {
+    pthread_mutex_lock(&snapshot.lock);
+    while (snapshot.readers > 0) {
+        pthread_cond_wait(&snapshot.unread, &snapshot.lock);
+    }
+    if (!snapshot.exists) {
+        pthread_mutex_unlock(&snapshot.lock);
+        return -1;
+    }
+    for (size_t i = 0; i < params.max_inode_count; i++) {
+        if (snapshot.states[i] == FREE) {
+            continue;
+        }
+        for (int d = 0; d < INODE_DIRECT_BLOCKS; d++) {
+            data_block_free(snapshot.inodes[i].i_data_blocks[d]);
+        }
+        if (snapshot.inodes[i].i_indirect_block != -1) {
+            drop_indirect(snapshot.inodes[i].i_indirect_block);
+        }
+    }
+    free(snapshot.inodes);
+    free(snapshot.states);
+    free(snapshot.inline_data);
+    snapshot.exists = false;
+    pthread_mutex_unlock(&snapshot.lock);
+    return 0;
+}
+
+/*
+ * Starts reading the snapshot, which is not released until snapshot_put is
+ * called; reading needs no other lock.
+ * Returns 0 if successful, -1 if there is no snapshot
+ */
+int snapshot_get() {
+    pthread_mutex_lock(&snapshot.lock);
+    int r = snapshot.exists ? 0 : -1;
+    if (r == 0) {
+        snapshot.readers++;
+    }
+    pthread_mutex_unlock(&snapshot.lock);
+    return r;
+}
+
+void snapshot_put() {
+    pthread_mutex_lock(&snapshot.lock);
+    if (--snapshot.readers == 0) {
+        pthread_cond_broadcast(&snapshot.unread);
+    }
+    pthread_mutex_unlock(&snapshot.lock);
+}
+
+/*
+ * Copies the entries (MAX_DIR_ENTRIES) of the snapshot's root directory
+ * (see snapshot_get).
+ * Returns 0 if successful, -1 otherwise
+ */
+int snapshot_dir(dir_entry_t *entries) {
+    int b = snapshot.inodes[ROOT_DIR_INUM].i_data_blocks[0];
+    dir_entry_t const *dir_entry = data_block_get(b);
+    if (dir_entry == NULL) {
+        return -1;
+    }
+    memcpy(entries, dir_entry, MAX_DIR_ENTRIES * sizeof(dir_entry_t));
+    data_block_put(b, false);
+    return 0;
+}
+
+/*
+ * Looks for a file in the snapshot's root directory (see snapshot_get).
+ * Returns: the file's i-node number, or -1 if not found
+ */
+int snapshot_find(char const *sub_name) {
+    int b = snapshot.inodes[ROOT_DIR_INUM].i_data_blocks[0];
+    dir_entry_t const *dir_entry = data_block_get(b);
+    int found = -1;
+    for (int i = 0; dir_entry != NULL && i < MAX_DIR_ENTRIES && found == -1; i++) {
+        if (dir_entry[i].d_inumber != -1 && strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0) {
+            found = dir_entry[i].d_inumber;
+        }
+    }
+    if (dir_entry != NULL) {
+        data_block_put(b, false);
+    }
+    return found;
+}
+
+/*
+ * Returns the size of a file in the snapshot, or -1 if there is none with
+ * that i-node number (see snapshot_get).
+ */
+ssize_t snapshot_size(int inumber) {
+    if (!valid_inumber(inumber) || snapshot.states[inumber] == FREE) {
+        return -1;
+    }
+    return (ssize_t)snapshot.inodes[inumber].i_size;
+}
+
+/*
+ * Reads a file as it was when the snapshot was taken (see snapshot_get).
+ * Input:
+ *  - inumber: the file's i-node number
+ *  - offset: where to start reading
+ *  - buffer, len: the destination
+ * Returns: the number of bytes read (0 at the end of the file), or -1 if
+ * failed
+ */
+ssize_t snapshot_read(int inumber, size_t offset, void *buffer, size_t len) {
+    if (snapshot_size(inumber) == -1) {
+        return -1;
+    }
+    inode_t *inode = &snapshot.inodes[inumber];
+    if (offset >= inode->i_size) {
+        return 0;
+    }
+    if (len > inode->i_size - offset) {
+        len = inode->i_size - offset;
+    }
+
+    for (size_t done = 0; done < len;) {
+        size_t at = offset + done;
+        size_t in_block = at % params.block_size;
+        size_t chunk = params.block_size - in_block;
+        if (chunk > len - done) {
+            chunk = len - done;
+        }
+        int b = inode->i_block_count == 0 ? -1 : block_entry(inode, at / params.block_size);
+        char const *data = data_block_get(b);
+        if (b != -1 && data == NULL) {
+            return -1;
+        }
+        if (inode->i_block_count == 0 && at < params.max_inline_size) {
+            /* inline contents */
+            data = snapshot.inline_data + (size_t)inumber * params.max_inline_size;
+            in_block = at;
+            if (chunk > params.max_inline_size - at) {
+                chunk = params.max_inline_size - at;
+            }
+        }
+        if (data == NULL) {
+            memset((char *)buffer + done, 0, chunk); /* a hole */
+        } else {
+            memcpy((char *)buffer + done, data + in_block, chunk);
+        }
+        data_block_put(b, false);
+        done += chunk;
+    }
+    return (ssize_t)len;
+}
+
+/*
+ * Returns how many entries may name a block: its reference count, if taken.
+ */
+static unsigned int claimable(int b) {
+    unsigned int refs = atomic_load(&block_refs[b]);
+    return block_allocator.bitmap[b] == TAKEN && refs > 1 ? refs : 1;
+}
+
+/*
+ * Marks the block named by an entry of a block map as used (and counts
+ * it); an entry naming a block outside the FS, or more times than the
+ * block's reference count allows, is made a hole.
+ * Returns: false if the entry was damaged, true otherwise
+ */
+static bool claim_block(int *entry, unsigned int *block_seen, size_t *count) {
+    if (*entry == -1) {
+        return true;
+    }
+    int b = *entry;
+    if (!valid_block_number(b) || block_seen[b] >= claimable(b)) {
+        *entry = -1;
+        return false;
+    }
+    block_seen[b]++;
+    (*count)++;
+    return true;
+}
+
+/*
+ * Claims every block of an i-node (see claim_block), recounting them.
+ * The blocks named by an indirect block are claimed by its first holder.
+ * Returns: false if any entry was damaged, true otherwise
+ */
+static bool claim_blocks(inode_t *inode, unsigned int *block_seen) {
+    size_t count = 0;
+    bool intact = true;
+    for (int d = 0; d < INODE_DIRECT_BLOCKS; d++) {
+        intact &= claim_block(&inode->i_data_blocks[d], block_seen, &count);
+    }
+    size_t indirect = 0;
+    if (!claim_block(&inode->i_indirect_block, block_seen, &indirect)) {
+        intact = false;
+    } else if (indirect == 1) {
+        int *map = data_block_get(inode->i_indirect_block);
+        bool first = block_seen[inode->i_indirect_block] == 1;
+        for (size_t e = 0; map != NULL && e < indirect_entries(); e++) {
+            if (first) {
+                intact &= claim_block(&map[e], block_seen, &count);
+            } else {
+                count += map[e] != -1;
+            }
+        }
+        if (map != NULL) {
+            data_block_put(inode->i_indirect_block, first);
+        }
+    }
+    inode->i_block_count = count;
+    return intact;
+}
+
+/*
+ * Checks the consistency of the FS and repairs it. Must be called holding
+ * the lock that serializes i-node creation and deletion and the open file
+ * table (the global lock in operations.c); it takes every i-node lock, so it
+ * also waits for reads and writes in progress.
+ * Input:
+ *  - report: filled with what was found (and fixed)
+ * Returns 0 if successful, -1 otherwise
+ */
+int state_fsck(fsck_report_t *report) {
+    memset(report, 0, sizeof(*report));
+    unsigned int *block_seen = calloc(params.max_block_count, sizeof(unsigned int));
+    char *inode_used = calloc(params.max_inode_count, sizeof(char));
+    if (block_seen == NULL || inode_used == NULL) {
+        free(block_seen);
+        free(inode_used);
+        return -1;
+    }
+
+    for (int i = 0; (size_t)i < params.max_inode_count; i++) {
+        pthread_mutex_lock(&slot_of(i)->lock);
+    }
+    /* the snapshot's blocks are counted too, so no one may be reading it */
+    pthread_mutex_lock(&snapshot.lock);
+    while (snapshot.readers > 0) {
+        pthread_cond_wait(&snapshot.unread, &snapshot.lock);
+    }
+    /* the root directory is rewritten below: copied first if shared */
+    int root_block = unshare_block(&slot_of(ROOT_DIR_INUM)->inode.i_data_blocks[0]);
+    dir_entry_t *dir_entry = data_block_get(root_block);
+    /* the bitmaps become exact: no entry is left in a cache or queue */
+    flush_deferred_frees();
+    drain_caches(&block_allocator);
+    drain_caches(&inode_allocator);
+
+    /* i-nodes are reachable from the root directory or an open file */
+    inode_used[ROOT_DIR_INUM] = 1;
+    /* the list of empty entries is rebuilt as well */
+    slot_of(ROOT_DIR_INUM)->dir_free = -1;
+    for (int e = (int)MAX_DIR_ENTRIES - 1; dir_entry != NULL && e >= 0; e--) {
+        int sub = dir_entry[e].d_inumber;
+        if (sub != -1 && (!valid_inumber(sub) || slot_of(sub)->state == FREE)) {
+            report->dangling_entries++;
+            sub = -1;
+        }
+        if (sub == -1) {
+            free_dir_entry(ROOT_DIR_INUM, dir_entry, e);
+        } else {
+            inode_used[sub] = 1;
+            slot_of(ROOT_DIR_INUM)->dir_prints[e] = name_fingerprint(dir_entry[e].d_name);
+        }
+    }
+    for (size_t f = 0; f < params.max_open_files_count; f++) {
+        int inumber = open_file_table[f].of_inumber;
+        if (free_open_file_entries[f] == TAKEN && valid_inumber(inumber)) {
+            inode_used[inumber] = 1;
+        }
+    }
+
+    pthread_mutex_lock(&inode_allocator.lock);
+    insert_delay(); // simulate storage access delay to the i-node bitmap
+    for (int i = 0; (size_t)i < params.max_inode_count; i++) {
+        inode_slot_t *slot = slot_of(i);
+        if (slot->state == TAKEN && !inode_used[i]) {
+            /* its block, if any, is left unmarked and freed below */
+            slot->state = FREE;
+            inode_allocator.bitmap[i] = TAKEN;
+        }
+        if (slot->state == FREE) {
+            if (inode_allocator.bitmap[i] == TAKEN) {
+                return_to_bitmap(&inode_allocator, &i, 1);
+                report->orphan_inodes++;
+            }
+            continue;
+        }
+        inode_allocator.bitmap[i] = TAKEN;
+        if (!claim_blocks(&slot->inode, block_seen)) {
+            report->damaged_inodes++;
+        }
+    }
+    pthread_mutex_unlock(&inode_allocator.lock);
+    for (size_t i = 0; snapshot.exists && i < params.max_inode_count; i++) {
+        if (snapshot.states[i] != FREE && !claim_blocks(&snapshot.inodes[i], block_seen)) {
+            report->damaged_inodes++;
+        }
+    }
+
+    pthread_mutex_lock(&block_allocator.lock);
+    for (int b = 0; (size_t)b < params.max_block_count; b++) {
+        if ((size_t)b * sizeof(allocation_state_t) % params.block_size == 0) {
+            insert_delay(); // simulate storage access delay to the block bitmap
+        }
+        if (block_allocator.bitmap[b] == TAKEN && block_seen[b] == 0) {
+            dedup_forget(b);
+            if (params.store_size > 0) {
+                block_cache_discard(b);
+            }
+            atomic_store(&block_refs[b], 0);
+            return_to_bitmap(&block_allocator, &b, 1);
+            report->orphan_blocks++;
+        } else if (block_allocator.bitmap[b] == FREE && block_seen[b] > 0) {
+            atomic_store(&block_refs[b], block_seen[b]);
+            block_allocator.bitmap[b] = TAKEN;
+            report->lost_blocks++;
+        } else if (block_seen[b] > 0 && atomic_load(&block_refs[b]) != block_seen[b]) {
+            atomic_store(&block_refs[b], block_seen[b]);
+            report->bad_refcounts++;
+        }
+    }
+    pthread_mutex_unlock(&block_allocator.lock);
+    pthread_mutex_unlock(&snapshot.lock);
+    if (dir_entry != NULL) {
+        data_block_put(root_block, true);
+    }
+
+    for (int i = 0; (size_t)i < params.max_inode_count; i++) {
+        pthread_mutex_unlock(&slot_of(i)->lock);
+    }
+    free(block_seen);
+    free(inode_used);
+    return 0;
+}
@@ -1,62 +1,134 @@
-#ifndef STATE_H
-#define STATE_H
-
-#include "config.h"
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <sys/types.h>
-
-/*
- * Directory entry
- */
-typedef struct {
-    char d_name[MAX_FILE_NAME];
-    int d_inumber;
-} dir_entry_t;
-
-typedef enum { T_FILE, T_DIRECTORY } inode_type;
-
-/*
- * I-node
- */
-typedef struct {
-    inode_type i_node_type;
-    size_t i_size;
-    int i_data_block;
-    /* in a real FS, more fields would exist here */
-} inode_t;
-
-typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
-
-/*
- * Open file entry (in open file table)
- */
-typedef struct {
-    int of_inumber;
-    size_t of_offset;
-} open_file_entry_t;
-
-
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
-
-void state_init();
-void state_destroy();
-
-int inode_create(inode_type n_type);
-int inode_delete(int inumber);
-inode_t *inode_get(int inumber);
-
-int clear_dir_entry(int inumber, int sub_inumber);
-int add_dir_entry(int inumber, int sub_inumber, char const *sub_name);
-int find_in_dir(int inumber, char const *sub_name);
-
-int data_block_alloc();
-int data_block_free(int block_number);
-void *data_block_get(int block_number);
-
-int add_to_open_file_table(int inumber, size_t offset);
-int remove_from_open_file_table(int fhandle);
-open_file_entry_t *get_open_file_entry(int fhandle);
-
-#endif // STATE_H
+#ifndef STATE_H
+#define STATE_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/*
+ * Directory entry
+ */
+typedef struct {
+    char d_name[MAX_FILE_NAME];
+    int d_inumber;
+} dir_entry_t;
+
+typedef enum { T_FILE, T_DIRECTORY } inode_type;
+
+/*
+ * I-node
+ * The blocks of a file are named by a block map: the first
+ * INODE_DIRECT_BLOCKS by the i-node itself, the next ones by an indirect
+ * block (an array of block numbers). An entry of -1 is a hole, which takes
+ * no storage and reads as zeros, so files can be sparse.
+ * A file without any block (i_block_count == 0) keeps its contents inline,
+ * in the i-node itself (see inode_inline_data), as long as they fit in
+ * state_inline_size() bytes; the inline data is all zeros otherwise.
+ * i_generation counts the times the i-node was allocated, so that a file is
+ * told apart from an earlier one that had the same i-node.
+ */
+typedef struct {
+    inode_type i_node_type;
+    unsigned int i_generation;
+    size_t i_size;
+    size_t i_block_count; /* data blocks in the map (holes excluded) */
+    int i_data_blocks[INODE_DIRECT_BLOCKS];
+    int i_indirect_block; /* -1 if none */
+    /* in a real FS, more fields would exist here */
+} inode_t;
+
+typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
+
+/*
+ * FS geometry, fixed when the FS is initialized
+ */
+typedef struct {
+    size_t max_inode_count;
+    size_t max_block_count;
+    size_t max_open_files_count;
+    size_t block_size;
+    size_t max_inline_size; /* largest file kept inside its i-node (0: none) */
+    bool dedup;             /* share the blocks written with equal contents */
+    size_t store_size;      /* bytes of compressed block storage (0: none, blocks are kept as they are) */
+    size_t write_buffer_size; /* bytes of small sequential writes gathered per open file (0: none) */
+} tfs_params;
+
+/*
+ * Open file entry (in open file table)
+ * Padded to a cache line: the offsets of different files are updated by
+ * different threads.
+ */
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) int of_inumber;
+    size_t of_offset;
+} open_file_entry_t;
+
+
+/*
+ * Result of a consistency check (see state_fsck)
+ */
+typedef struct {
+    size_t orphan_blocks;    /* allocated but used by no i-node: freed */
+    size_t lost_blocks;      /* used by an i-node but marked free: taken */
+    size_t orphan_inodes;    /* allocated but neither named nor open: freed */
+    size_t dangling_entries; /* directory entries naming a free i-node: cleared */
+    size_t damaged_inodes;   /* pointing to invalid or shared blocks: made holes */
+    size_t bad_refcounts;    /* blocks whose reference count was wrong: fixed */
+} fsck_report_t;
+
+#define MAX_DIR_ENTRIES (state_block_size() / sizeof(dir_entry_t))
+
+tfs_params tfs_default_params();
+int state_init(tfs_params params);
+void state_destroy();
+size_t state_block_size();
+size_t state_inline_size();
+size_t state_max_file_size();
+int state_fsck(fsck_report_t *report);
+void state_set_delay(int iterations);
+int state_snapshot();
+int state_snapshot_release();
+
+int snapshot_get();
+void snapshot_put();
+int snapshot_dir(dir_entry_t *entries);
+int snapshot_find(char const *sub_name);
+ssize_t snapshot_size(int inumber);
+ssize_t snapshot_read(int inumber, size_t offset, void *buffer, size_t len);
+
+int inode_create(inode_type n_type);
+int inode_delete(int inumber);
+void inode_opened(int inumber);
+int inode_closed(int inumber);
+int inode_unlink(int inumber);
+inode_t *inode_get(int inumber);
+void *inode_inline_data(int inumber);
+int inode_block(int inumber, size_t index);
+int inode_block_alloc(int inumber, size_t index);
+int inode_block_write(int inumber, size_t index, void const *data);
+int inode_punch_blocks(int inumber, size_t first, size_t last);
+int inode_truncate(int inumber);
+int inode_lock(int inumber);
+void inode_unlock(int inumber);
+
+int clear_dir_entry(int inumber, int e);
+int rename_dir_entry(int inumber, int e, char const *new_name);
+int add_dir_entry(int inumber, int sub_inumber, char const *sub_name);
+int find_in_dir(int inumber, char const *sub_name);
+int find_entry_in_dir(int inumber, char const *sub_name, int *entry);
+ssize_t read_dir(int inumber, size_t first, size_t count, dir_entry_t *entries);
+
+int data_block_alloc();
+int data_block_free(int block_number);
+void *data_block_get(int block_number);
+int data_block_put(int block_number, bool written);
+
+int add_to_open_file_table(int inumber, size_t offset);
+int remove_from_open_file_table(int fhandle);
+open_file_entry_t *get_open_file_entry(int fhandle);
+bool open_file_in_use(int fhandle);
+
+#endif // STATE_H
@@ -1,65 +1,262 @@
 #include "operations.h"
+#include "buffer_pool.h"
+#include "block_cache.h"
+#include "dedup.h"
+#include "executor.h"
+#include "lease.h"
+#include "metrics.h"
+#include "scheduler.h"
 #include "fcntl.h"
 #include "unistd.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <stdlib.h>
 
-Session sessions[MAX_CLIENTS];
-static char free_sessions[MAX_CLIENTS];
-pthread_t workers[MAX_CLIENTS];
+/* per-session tables, sized by max_clients (see -c) */
+Session *sessions;
+static char *free_sessions;
 static pthread_mutex_t global_mutex;
-int aux_session_ids[MAX_CLIENTS];
-union Message client_messages[MAX_CLIENTS];
+static int max_clients = MAX_CLIENTS;
+
+/* the workers serving the sessions (see executor.h and -w; 0 for as many
+ * as there are processors), at least 2 since a shutdown keeps one waiting
+ * for the files to be closed by the others; and whether they take the
+ * sessions from a single shared queue instead (see -q) */
+pthread_t *workers;
+size_t *aux_worker_ids;
+static size_t n_workers = 0;
+static bool shared_queue = false;
 
 int failed = -1;
 int success = 0;
 
-int inform_failed_operation(unsigned int session_id) {
-    if (write(sessions[session_id].pipe, &failed, sizeof(int)) == -1) {
+/* periodic metrics dump (see -s and -i) */
+static char const *stats_path = NULL;
+static unsigned int stats_interval = 10;
+
+/* periodic online consistency check (see -f; 0 disables it) */
+static unsigned int fsck_interval = 0;
+
+/* shutdown (see destroy_os), guarded by the global mutex: while draining,
+ * mounts and opens are refused; once stopping, nothing uses the file system
+ * any more and queued requests are failed */
+static bool draining = false;
+static bool stopping = false;
+/* threads using the file system (serving a request or checking it) */
+static unsigned int busy = 0;
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;
+/* how long a shutdown waits for the open files to be closed (see -T) */
+static unsigned int drain_timeout = 30;
+static char const *pipename;
+
+/* the session each file handle was opened by (-1 if none), so that ending
+ * a session closes what it left open; guarded by the global mutex */
+static int *handle_owner;
+static size_t max_open_files;
+/* sessions not heard from in this many seconds are ended (see -t; 0
+ * disables it) */
+static unsigned int idle_timeout = 0;
+/* sessions ended because their client went away or was idle */
+static size_t expired_sessions = 0;
+
+/* requests executed at once (see scheduler.h and -W; 0 for twice as many
+ * as there are processors, as a request holds its slot while its reply is
+ * written too) */
+static size_t sched_slots = 0;
+
+static char const *const op_names[METRICS_OPS] = {
+    [TFS_OP_CODE_MOUNT] = "mount",
+    [TFS_OP_CODE_UNMOUNT] = "unmount",
+    [TFS_OP_CODE_OPEN] = "open",
+    [TFS_OP_CODE_CLOSE] = "close",
+    [TFS_OP_CODE_WRITE] = "write",
+    [TFS_OP_CODE_READ] = "read",
+    [TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED] = "shutdown",
+    [TFS_OP_CODE_COPY_OUT] = "copy_out",
+    [TFS_OP_CODE_COPY_IN] = "copy_in",
+    [TFS_OP_CODE_STATS] = "stats",
+    [TFS_OP_CODE_UNLINK] = "unlink",
+    [TFS_OP_CODE_RENAME] = "rename",
+    [TFS_OP_CODE_SEEK] = "seek",
+    [TFS_OP_CODE_PUNCH_HOLE] = "punch_hole",
+    [TFS_OP_CODE_FALLOCATE] = "fallocate",
+    [TFS_OP_CODE_SNAPSHOT] = "snapshot",
+    [TFS_OP_CODE_LEASE] = "lease",
+    [TFS_OP_CODE_STAT] = "stat",
+    [TFS_OP_CODE_FSTAT] = "fstat",
+    [TFS_OP_CODE_READDIR] = "readdir",
+    [TFS_OP_CODE_LOCK] = "lock",
+    [TFS_OP_CODE_UNLOCK] = "unlock",
+};
+
+/* time spent by this worker writing replies for the current request */
+static _Thread_local uint64_t reply_ns;
+
+static inline bool valid_session_id(unsigned int session_id) {
+    return session_id < (unsigned int)max_clients;
+}
+
+/*
+ * Reads exactly len bytes from a pipe.
+ * Returns 0 if successful, -1 otherwise
+ */
+static int read_all(int fd, void *buffer, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = read(fd, (char *)buffer + done, len - done);
+        if (r <= 0) {
+            return -1;
+        }
+        done += (size_t)r;
+    }
+    return 0;
+}
+
+/*
+ * Sends a reply to a session, in a single write so that it is never split.
+ * Input:
+ *  - session_id: the session to reply to
+ *  - seq: sequence number of the request being answered
+ *  - result: the request's result
+ *  - data: data following the header (may be NULL)
+ *  - len: length of data
+ * Returns 0 if successful, -1 otherwise
+ */
+static int send_reply(unsigned int session_id, unsigned int seq, ssize_t result, void const *data, size_t len) {
+    Reply header = {.seq = seq, .result = result};
+    struct iovec reply[2];
+    reply[0].iov_base = &header;
+    reply[0].iov_len = sizeof(Reply);
+    reply[1].iov_base = (void *)data;
+    reply[1].iov_len = data == NULL ? 0 : len;
+    uint64_t start = metrics_now();
+    ssize_t w = writev(sessions[session_id].pipe, reply, 2);
+    reply_ns += metrics_now() - start;
+    if (w == -1) {
         return -1;
     }
     return 0;
 }
 
+int inform_failed_operation(unsigned int session_id, unsigned int seq) {
+    return send_reply(session_id, seq, failed, NULL, 0);
+}
+
 int mount_pipe(struct Mount message) {
-    free_sessions[message.session_id] = TAKEN;
-    if ((sessions[message.session_id].pipe = open(message.client_pipe_path, O_WRONLY)) == -1) {
+    int pipe = open(message.client_pipe_path, O_WRONLY);
+    if (pipe == -1) {
         return -1;
     }
-    if (write(sessions[message.session_id].pipe, &message.session_id, sizeof(int)) == -1) {
+    struct stat st;
+    if (fstat(pipe, &st) == -1) {
+        close(pipe);
         return -1;
     }
-    return 0;
+    if (pthread_mutex_lock(&global_mutex) != 0) {
+        return -1;
+    }
+    sessions[message.session_id].pipe = pipe;
+    sessions[message.session_id].owner = st.st_uid;
+    if (pthread_mutex_unlock(&global_mutex) != 0) {
+        return -1;
+    }
+    if (message.options.read_cache) {
+        /* the client has its end open by now */
+        int lease_pipe = open(message.client_pipe_path, O_WRONLY | O_NONBLOCK);
+        pthread_mutex_lock(&global_mutex);
+        sessions[message.session_id].lease_pipe = lease_pipe;
+        pthread_mutex_unlock(&global_mutex);
+    }
+    scheduler_configure(message.session_id, &message.options);
+    return send_reply(message.session_id, 0, message.session_id, NULL, 0);
+}
+
+/*
+ * Ends the leases of a session (see lease.h), closing its pipe for recalls.
+ */
+static void end_leases(unsigned int session_id) {
+    lease_drop(session_id);
+    pthread_mutex_lock(&global_mutex);
+    int lease_pipe = sessions[session_id].lease_pipe;
+    sessions[session_id].lease_pipe = -1;
+    pthread_mutex_unlock(&global_mutex);
+    if (lease_pipe != -1) {
+        close(lease_pipe);
+    }
+}
+
+/*
+ * Closes the files a session left open.
+ */
+static void close_session_handles(unsigned int session_id) {
+    for (size_t h = 0; h < max_open_files; h++) {
+        pthread_mutex_lock(&global_mutex);
+        bool owned = handle_owner[h] == (int)session_id;
+        if (owned) {
+            handle_owner[h] = -1;
+        }
+        pthread_mutex_unlock(&global_mutex);
+        if (owned) {
+            tfs_close((int)h);
+        }
+    }
 }
 
 int unmount_pipe(struct Unmount message) {
-    if (write(sessions[message.session_id].pipe, &success, sizeof(success)) == -1) {
+    close_session_handles(message.session_id);
+    end_leases(message.session_id);
+    if (send_reply(message.session_id, message.seq, success, NULL, 0) == -1) {
         return -1;
     }
+    close(sessions[message.session_id].pipe);
+    if (pthread_mutex_lock(&global_mutex) != 0) {
+        return -1;
+    }
+    sessions[message.session_id].pipe = -1;
     free_sessions[message.session_id] = FREE;
+    if (pthread_mutex_unlock(&global_mutex) != 0) {
+        return -1;
+    }
     return 0;
 }
 
+/*
+ * Returns whether the server is shutting down (see destroy_os).
+ */
+static bool is_draining() {
+    pthread_mutex_lock(&global_mutex);
+    bool r = draining;
+    pthread_mutex_unlock(&global_mutex);
+    return r;
+}
+
 int open_file(struct Open message) {
     char *name = message.name;
     int flags = message.flags;
-    int fhandle;
-    if ((fhandle = tfs_open(name, flags)) == -1) {
-        if (inform_failed_operation(message.session_id) == -1) {
-            return -1;
-        }
+    /* no new handles while draining, so the open ones only go away */
+    int fhandle = is_draining() ? -1 : tfs_open(name, flags);
+    bool cached = false;
+    if (fhandle != -1) {
+        pthread_mutex_lock(&global_mutex);
+        handle_owner[fhandle] = (int)message.session_id;
+        cached = sessions[message.session_id].lease_pipe != -1;
+        pthread_mutex_unlock(&global_mutex);
     }
-    if (write(sessions[message.session_id].pipe, &fhandle, sizeof(int)) == -1){
-        if (inform_failed_operation(message.session_id) == -1) {
-            return -1;
-        }
+    /* a session caching reads is told which file it opened (see lease.h),
+     * so it can use what it cached of the file before */
+    LeaseGrant grant = {.leased = false};
+    if (cached) {
+        grant.inumber = tfs_handle_inumber(fhandle, &grant.generation);
     }
-    return 0;
+    return send_reply(message.session_id, message.seq, fhandle, cached ? &grant : NULL, sizeof(LeaseGrant));
 }
 
 int find_free_session_id() {
-    for (int i = 0; i < MAX_CLIENTS; i++) {
+    for (int i = 0; i < max_clients; i++) {
         if (free_sessions[i] == FREE) {
             return i;
         }
@@ -67,67 +264,701 @@ int find_free_session_id() {
     return -1;
 }
 
+/*
+ * Returns whether the handle is one the session opened (and has not closed):
+ * a session only gets to use its own handles.
+ */
+static bool session_owns(unsigned int session_id, int fhandle) {
+    pthread_mutex_lock(&global_mutex);
+    bool owned = fhandle >= 0 && (size_t)fhandle < max_open_files && handle_owner[fhandle] == (int)session_id;
+    pthread_mutex_unlock(&global_mutex);
+    return owned;
+}
+
 int close_file(struct Close message) {
     int fhandle = message.fhandle;
-    if (tfs_close(fhandle) == -1) {
-        if (inform_failed_operation(message.session_id) == -1) {
-            return -1;
-        }
+    if (!session_owns(message.session_id, fhandle) || tfs_close(fhandle) == -1) {
+        return inform_failed_operation(message.session_id, message.seq);
     }
-    if (write(sessions[message.session_id].pipe, &success, sizeof(int)) == -1) {
-        return -1;
+    pthread_mutex_lock(&global_mutex);
+    /* unless it was reopened by another session meanwhile */
+    if (handle_owner[fhandle] == (int)message.session_id) {
+        handle_owner[fhandle] = -1;
     }
-    return 0;
+    pthread_mutex_unlock(&global_mutex);
+    return send_reply(message.session_id, message.seq, success, NULL, 0);
 }
 
 int write_file(struct Write message, void const* buffer) {
     int fhandle = message.fhandle;
-    ssize_t len;
-    if ((len = tfs_write(fhandle, buffer, message.len)) == -1) {
-        if (inform_failed_operation(message.session_id) == -1) {
-            return -1;
+    ssize_t len = session_owns(message.session_id, fhandle) ? tfs_write(fhandle, buffer, message.len) : -1;
+    return send_reply(message.session_id, message.seq, len, NULL, 0);
+}
+
+/*
+ * Replies to a read with the number of bytes read followed by the data.
+ */
+int read_file(struct Read message) {
+    int fhandle = message.fhandle;
+    if (!session_owns(message.session_id, fhandle)) {
+        return inform_failed_operation(message.session_id, message.seq);
+    }
+    if (message.len > TFS_MAX_PAYLOAD) {
+        message.len = TFS_MAX_PAYLOAD;
+    }
+    void *buffer = buffer_pool_get(message.len);
+    ssize_t len = buffer == NULL ? -1 : tfs_read(fhandle, buffer, message.len);
+    int r = send_reply(message.session_id, message.seq, len, buffer, len > 0 ? (size_t)len : 0);
+    buffer_pool_put(buffer);
+    return r;
+}
+
+/*
+ * Replies to a lease request with a LeaseGrant and the block of the file
+ * at the offset, leasing the file to the session first (so a change made
+ * after the block is read is recalled) if the session takes recalls.
+ */
+int lease_block(struct Lease message) {
+    if (!session_owns(message.session_id, message.fhandle)) {
+        return inform_failed_operation(message.session_id, message.seq);
+    }
+    char *buffer = buffer_pool_get(sizeof(LeaseGrant) + TFS_LEASE_BLOCK_SIZE);
+    ssize_t len = -1;
+    LeaseGrant grant;
+    pthread_mutex_lock(&global_mutex);
+    grant.leased = sessions[message.session_id].lease_pipe != -1;
+    pthread_mutex_unlock(&global_mutex);
+    if (buffer != NULL) {
+        if (grant.leased) {
+            unsigned int generation;
+            lease_grant(tfs_handle_inumber(message.fhandle, &generation), message.session_id);
         }
+        len = tfs_read_at(message.fhandle, message.offset, buffer + sizeof(LeaseGrant), TFS_LEASE_BLOCK_SIZE,
+                          &grant.inumber, &grant.generation);
     }
-    if (write(sessions[message.session_id].pipe, &len, sizeof(ssize_t)) == -1) {
-        return -1;
+    if (len != -1) {
+        memcpy(buffer, &grant, sizeof(LeaseGrant));
+        len += (ssize_t)sizeof(LeaseGrant);
+    }
+    int r = send_reply(message.session_id, message.seq, len, buffer, len > 0 ? (size_t)len : 0);
+    buffer_pool_put(buffer);
+    return r;
+}
+
+static void schedule_session(unsigned int session_id);
+
+/*
+ * Tells a session to drop what it cached of a file, through its pipe for
+ * recalls (which never blocks, as the session's pipe is written by others
+ * meanwhile). It is called with the file's i-node locked, so it never waits
+ * either: a client that leaves no room in its pipe is taken as gone, and
+ * its session expired.
+ */
+static void recall_lease(unsigned int session_id, int inumber) {
+    Reply recall = {.seq = 0, .result = inumber};
+    pthread_mutex_lock(&global_mutex);
+    Session *session = &sessions[session_id];
+    if (session->lease_pipe != -1 && !session->expired &&
+        write(session->lease_pipe, &recall, sizeof(Reply)) != sizeof(Reply)) {
+        session->expired = true;
+        schedule_session(session_id);
+    }
+    pthread_mutex_unlock(&global_mutex);
+}
+
+/*
+ * Recalls the leases on a file about to change (see tfs_set_change_hook).
+ */
+static void recall_leases(int inumber) { lease_recall(inumber, recall_lease); }
+
+int seek_file(struct Seek message) {
+    if (!session_owns(message.session_id, message.fhandle) || tfs_seek(message.fhandle, message.offset) == -1) {
+        return inform_failed_operation(message.session_id, message.seq);
+    }
+    return send_reply(message.session_id, message.seq, success, NULL, 0);
+}
+
+int punch_hole(struct PunchHole message) {
+    if (!session_owns(message.session_id, message.fhandle) ||
+        tfs_punch_hole(message.fhandle, message.offset, message.len) == -1) {
+        return inform_failed_operation(message.session_id, message.seq);
+    }
+    return send_reply(message.session_id, message.seq, success, NULL, 0);
+}
+
+int fallocate_file(struct Fallocate message) {
+    if (!session_owns(message.session_id, message.fhandle) ||
+        tfs_fallocate(message.fhandle, message.offset, message.len) == -1) {
+        return inform_failed_operation(message.session_id, message.seq);
+    }
+    return send_reply(message.session_id, message.seq, success, NULL, 0);
+}
+
+/* a lock request waiting to be granted (see lock_file) */
+typedef struct {
+    unsigned int session_id;
+    unsigned int seq;
+} parked_lock_t;
+
+/* per session, the lock requests parked, by their slot in the client (seq
+ * % TFS_MAX_INFLIGHT, which the client does not reuse until replied to) */
+static parked_lock_t *parked_locks;
+
+/*
+ * Replies to a lock request that waited, once granted or cancelled (see
+ * tfs_lock_async). The session is still there: its handles, and so its
+ * requests, are done with before it ends (see close_session_handles).
+ */
+static void lock_done(int result, void *arg) {
+    parked_lock_t *parked = arg;
+    send_reply(parked->session_id, parked->seq, result == -1 ? failed : success, NULL, 0);
+}
+
+/*
+ * Locks a range of a file the session opened. A request that has to wait
+ * is parked, and replied to by the thread releasing what was in its way,
+ * so no worker waits for it and the session's next requests are served.
+ */
+int lock_file(struct Lock message) {
+    int r = -1;
+    if (session_owns(message.session_id, message.fhandle)) {
+        parked_lock_t *parked = &parked_locks[message.session_id * TFS_MAX_INFLIGHT + message.seq % TFS_MAX_INFLIGHT];
+        parked->session_id = message.session_id;
+        parked->seq = message.seq;
+        r = tfs_lock_async(message.fhandle, message.offset, message.len, message.flags, lock_done, parked);
+    }
+    if (r == 1) {
+        return 0;
+    }
+    if (r == -1) {
+        return inform_failed_operation(message.session_id, message.seq);
+    }
+    return send_reply(message.session_id, message.seq, success, NULL, 0);
+}
+
+int unlock_file(struct Unlock message) {
+    if (!session_owns(message.session_id, message.fhandle) ||
+        tfs_unlock(message.fhandle, message.offset, message.len) == -1) {
+        return inform_failed_operation(message.session_id, message.seq);
+    }
+    return send_reply(message.session_id, message.seq, success, NULL, 0);
+}
+
+static void dump_stats();
+
+/*
+ * Shuts the server down: from now on mounts and opens are refused, while
+ * the other sessions go on being served (in parallel) until every open
+ * file is closed, or for drain_timeout seconds at most. Then the requests
+ * in flight are let finish, the cache is written back, the metrics are
+ * dumped a last time and the file system is destroyed; the reply tells
+ * whether every file had been closed. The main loop is woken up to stop
+ * the workers and exit.
+ */
+int destroy_os(struct Shutdown message) {
+    pthread_mutex_lock(&global_mutex);
+    if (draining) {
+        pthread_mutex_unlock(&global_mutex);
+        return inform_failed_operation(message.session_id, message.seq);
+    }
+    draining = true;
+    pthread_mutex_unlock(&global_mutex);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (time_t)drain_timeout;
+    int r = tfs_wait_all_closed(&deadline);
+
+    pthread_mutex_lock(&global_mutex);
+    stopping = true;
+    /* this worker is the only one left using the file system */
+    while (busy > 1) {
+        pthread_cond_wait(&idle, &global_mutex);
+    }
+    pthread_mutex_unlock(&global_mutex);
+
+    tfs_flush_writes(0);
+    block_cache_flush();
+    if (stats_path != NULL) {
+        dump_stats();
+    }
+    tfs_destroy();
+    send_reply(message.session_id, message.seq, r == 0 ? success : failed, NULL, 0);
+
+    /* the main loop is waiting for a request */
+    int wake = open(pipename, O_WRONLY);
+    if (wake != -1) {
+        char op_code = 0;
+        if (write(wake, &op_code, sizeof(char)) == -1) {
+            perror("shutdown: could not wake up the server");
+        }
+        close(wake);
     }
     return 0;
 }
 
-int read_file(struct Read message) {
-    int fhandle = message.fhandle;
-    void* buffer = (void*) malloc(message.len);
-    if (tfs_read(fhandle, buffer, message.len) == -1) {
-        if (inform_failed_operation(message.session_id) == -1) {
-            return -1;
+int unlink_file(struct Unlink message) {
+    if (tfs_unlink(message.name) == -1) {
+        return inform_failed_operation(message.session_id, message.seq);
+    }
+    return send_reply(message.session_id, message.seq, success, NULL, 0);
+}
+
+int rename_file(struct Rename message) {
+    if (tfs_rename(message.old_name, message.new_name) == -1) {
+        return inform_failed_operation(message.session_id, message.seq);
+    }
+    return send_reply(message.session_id, message.seq, success, NULL, 0);
+}
+
+int stat_file(struct Stat message) {
+    tfs_stat_t st;
+    if (tfs_stat(message.name, &st) == -1) {
+        return inform_failed_operation(message.session_id, message.seq);
+    }
+    return send_reply(message.session_id, message.seq, sizeof(tfs_stat_t), &st, sizeof(tfs_stat_t));
+}
+
+int fstat_file(struct Fstat message) {
+    tfs_stat_t st;
+    if (!session_owns(message.session_id, message.fhandle) || tfs_fstat(message.fhandle, &st) == -1) {
+        return inform_failed_operation(message.session_id, message.seq);
+    }
+    return send_reply(message.session_id, message.seq, sizeof(tfs_stat_t), &st, sizeof(tfs_stat_t));
+}
+
+/*
+ * Replies with the files of a window of TFS_READDIR_SLOTS entry slots of
+ * the directory, after a DirChunk.
+ */
+int list_files(struct Readdir message) {
+    tfs_dirent_t entries[TFS_READDIR_SLOTS];
+    DirChunk chunk;
+    ssize_t n = tfs_readdir_slots(message.first, TFS_READDIR_SLOTS, entries, &chunk.slots);
+    if (n == -1) {
+        return inform_failed_operation(message.session_id, message.seq);
+    }
+    chunk.count = (size_t)n;
+    size_t len = sizeof(DirChunk) + chunk.count * sizeof(tfs_dirent_t);
+    char *buffer = buffer_pool_get(len);
+    if (buffer == NULL) {
+        return inform_failed_operation(message.session_id, message.seq);
+    }
+    memcpy(buffer, &chunk, sizeof(DirChunk));
+    memcpy(buffer + sizeof(DirChunk), entries, chunk.count * sizeof(tfs_dirent_t));
+    int r = send_reply(message.session_id, message.seq, (ssize_t)len, buffer, len);
+    buffer_pool_put(buffer);
+    return r;
+}
+
+/*
+ * Opens a path outside TecnicoFS given by a client. The server opens it with
+ * its own privileges but on the client's behalf, so it is confined to what
+ * the user the client acts as (the owner of its pipe) owns: the file must be
+ * in a directory of that user, and be a file of that user or one created
+ * now; a client cannot have the server read, truncate or overwrite anybody
+ * else's files. A symbolic link is not followed, and only a regular file is
+ * used, or a FIFO if fifo is true. A FIFO must be open by its reader already
+ * (the open does not wait for one) and is left non-blocking, so a reader
+ * that stalls fails the copy instead of holding the worker (see
+ * tfs_copy_to_fd). O_TRUNC is only applied once the file is checked.
+ * Returns the file descriptor, or -1 if the path cannot (or may not) be
+ * opened
+ */
+static int open_external(unsigned int session_id, char const *path, int flags, bool fifo) {
+    if (strnlen(path, MAX_FILE_NAME) == MAX_FILE_NAME) {
+        return -1;
+    }
+    char const *slash = strrchr(path, '/');
+    char const *name = slash == NULL ? path : slash + 1;
+    if (*name == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return -1;
+    }
+    char dir[MAX_FILE_NAME] = ".";
+    if (slash != NULL) {
+        size_t dir_len = slash == path ? 1 : (size_t)(slash - path);
+        memcpy(dir, path, dir_len);
+        dir[dir_len] = '\0';
+    }
+
+    pthread_mutex_lock(&global_mutex);
+    uid_t owner = sessions[session_id].owner;
+    pthread_mutex_unlock(&global_mutex);
+    struct stat st;
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd == -1) {
+        return -1;
+    }
+    int fd = -1;
+    bool created = false;
+    if (fstat(dir_fd, &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == owner) {
+        fd = openat(dir_fd, name, (flags & ~(O_CREAT | O_TRUNC)) | O_NOFOLLOW | O_NONBLOCK);
+        if (fd == -1 && errno == ENOENT && (flags & O_CREAT) != 0) {
+            fd = openat(dir_fd, name, (flags & ~O_TRUNC) | O_EXCL | O_NOFOLLOW | O_NONBLOCK, 0666);
+            created = fd != -1;
         }
     }
-    if (write(sessions[message.session_id].pipe, buffer, message.len) == -1) {
+    close(dir_fd);
+    if (fd == -1) {
         return -1;
     }
-    return 0;
+
+    bool allowed = fstat(fd, &st) == 0 && (created || st.st_uid == owner);
+    if (allowed && S_ISREG(st.st_mode)) {
+        int fl = fcntl(fd, F_GETFL);
+        allowed = fl != -1 && fcntl(fd, F_SETFL, fl & ~O_NONBLOCK) != -1 &&
+                  ((flags & O_TRUNC) == 0 || ftruncate(fd, 0) == 0);
+    } else {
+        allowed = allowed && fifo && S_ISFIFO(st.st_mode);
+    }
+    if (!allowed) {
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
-int destroy_os(struct Shutdown message) {
-    if (tfs_destroy_after_all_closed() == -1) {
-        if (inform_failed_operation(message.session_id) == -1) {
-            return -1;
+/*
+ * Streams a file to a path outside TecnicoFS given by the client (usually a
+ * FIFO the client reads from, see open_external), so a whole file costs a
+ * single request.
+ */
+int copy_out(struct CopyOut message) {
+    ssize_t total = -1;
+    int fd = open_external(message.session_id, message.external_path, O_WRONLY | O_CREAT | O_TRUNC, true);
+    if (fd != -1) {
+        total = tfs_copy_to_fd(message.name, fd);
+        close(fd);
+    }
+    return send_reply(message.session_id, message.seq, total, NULL, 0);
+}
+
+/*
+ * Ingests a regular file given by the client (see open_external) into
+ * TecnicoFS.
+ */
+int copy_in(struct CopyIn message) {
+    ssize_t total = -1;
+    int fd = open_external(message.session_id, message.external_path, O_RDONLY, false);
+    if (fd != -1) {
+        total = tfs_copy_from_fd(fd, message.name);
+        close(fd);
+    }
+    return send_reply(message.session_id, message.seq, total, NULL, 0);
+}
+
+/* a snapshot being written to an image (see snapshot_fs) */
+typedef struct {
+    int fd;
+    char external_path[sizeof(((Snapshot *)0)->external_path)];
+} snapshot_export_t;
+
+/*
+ * Writes the snapshot to an image and drops it (see snapshot_fs).
+ */
+static void *snapshot_exporter(void *arg) {
+    snapshot_export_t *export = arg;
+    if (tfs_snapshot_export_to_fd(export->fd) == -1 || close(export->fd) == -1) {
+        fprintf(stderr, "snapshot: export to %s failed\n", export->external_path);
+    }
+    tfs_snapshot_release();
+    free(export);
+    return NULL;
+}
+
+/*
+ * Takes a snapshot and replies as soon as it is taken; the image is written
+ * to the regular file given by the client (see open_external; not to a
+ * FIFO, which could hold the export up) in the background, while requests
+ * keep being served. Fails while a previous snapshot is still being written.
+ */
+int snapshot_fs(struct Snapshot message) {
+    pthread_t exporter;
+    snapshot_export_t *export = malloc(sizeof(snapshot_export_t));
+    if (export == NULL) {
+        return inform_failed_operation(message.session_id, message.seq);
+    }
+    memcpy(export->external_path, message.external_path, sizeof(export->external_path));
+    export->external_path[sizeof(export->external_path) - 1] = '\0';
+    if (tfs_snapshot() == -1) {
+        free(export);
+        return inform_failed_operation(message.session_id, message.seq);
+    }
+    export->fd = open_external(message.session_id, export->external_path, O_WRONLY | O_CREAT | O_TRUNC, false);
+    if (export->fd == -1) {
+        tfs_snapshot_release();
+        free(export);
+        return inform_failed_operation(message.session_id, message.seq);
+    }
+    if (pthread_create(&exporter, NULL, &snapshot_exporter, export) != 0) {
+        tfs_snapshot_release();
+        close(export->fd);
+        free(export);
+        return inform_failed_operation(message.session_id, message.seq);
+    }
+    pthread_detach(exporter);
+    return send_reply(message.session_id, message.seq, success, NULL, 0);
+}
+
+/*
+ * Writes the server's metrics report to a buffer.
+ * Returns the length of the report
+ */
+static size_t stats_report(char *buffer, size_t len) {
+    size_t used = metrics_report(buffer, len, op_names);
+    if (used + 1 < len) {
+        /* full blocks written per block stored */
+        uint64_t stored = metrics_counter(METRIC_DEDUP_STORE);
+        double dedup_ratio = stored == 0 ? 1.0 : (double)(stored + metrics_counter(METRIC_DEDUP_HIT)) / (double)stored;
+        /* bytes of blocks per byte of compressed store they take */
+        size_t logical = 0, physical = 0;
+        if (block_cache_enabled()) {
+            block_cache_usage(&logical, &physical);
+        }
+        double compression_ratio = physical == 0 ? 1.0 : (double)logical / (double)physical;
+        pthread_mutex_lock(&global_mutex);
+        size_t expired = expired_sessions;
+        pthread_mutex_unlock(&global_mutex);
+        int n = snprintf(buffer + used, len - used,
+                         "buffer_pool_malloc %zu\ndedup_ratio %.2f\ndedup_index_bytes %zu\ncompression_ratio %.2f\n"
+                         "store_bytes_used %zu\nsessions_expired %zu\n",
+                         buffer_pool_malloc_count(), dedup_ratio, dedup_memory(), compression_ratio, physical,
+                         expired);
+        if (n > 0) {
+            used += (size_t)n < len - used ? (size_t)n : len - used - 1;
         }
     }
-    if (write(sessions[message.session_id].pipe, &success, sizeof(int)) == -1) {
-        return -1;
+    return used;
+}
+
+/*
+ * Replies with the metrics report as data (truncated to the requested
+ * length and to the largest payload).
+ */
+int stats(struct Read message) {
+    if (message.len > TFS_MAX_PAYLOAD) {
+        message.len = TFS_MAX_PAYLOAD;
     }
-    return 0;
+    char *buffer = buffer_pool_get(message.len + 1);
+    ssize_t len = buffer == NULL ? -1 : (ssize_t)stats_report(buffer, message.len + 1);
+    int r = send_reply(message.session_id, message.seq, len, buffer, len > 0 ? (size_t)len : 0);
+    buffer_pool_put(buffer);
+    return r;
+}
+
+/*
+ * Counts a thread among those using the file system, unless the server is
+ * stopping.
+ * Must be called with the global mutex held.
+ * Returns whether it may use it
+ */
+static bool enter_fs() {
+    if (stopping) {
+        return false;
+    }
+    busy++;
+    return true;
+}
+
+/*
+ * Undoes enter_fs, waking up a shutdown waiting for the file system to be
+ * left alone.
+ * Must be called with the global mutex held.
+ */
+static void leave_fs() {
+    busy--;
+    if (stopping) {
+        pthread_cond_signal(&idle);
+    }
+}
+
+/*
+ * Rewrites the metrics file (through a temporary file, so readers never
+ * see a partial report).
+ */
+static void dump_stats() {
+    static char report[16 * 1024];
+    char tmp_path[PATH_MAX];
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", stats_path);
+    size_t len = stats_report(report, sizeof(report));
+    FILE *fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        return;
+    }
+    size_t written = fwrite(report, 1, len, fp);
+    if (fclose(fp) == 0 && written == len) {
+        rename(tmp_path, stats_path);
+    }
+}
+
+/*
+ * Dumps the metrics every stats_interval seconds, until the server stops.
+ */
+static void *stats_dumper(void *arg) {
+    (void)arg;
+    while (1) {
+        sleep(stats_interval);
+        pthread_mutex_lock(&global_mutex);
+        bool running = enter_fs();
+        pthread_mutex_unlock(&global_mutex);
+        if (!running) {
+            return NULL;
+        }
+        dump_stats();
+        pthread_mutex_lock(&global_mutex);
+        leave_fs();
+        pthread_mutex_unlock(&global_mutex);
+    }
+    return NULL;
+}
+
+/*
+ * Runs tfs_fsck every fsck_interval seconds, logging what it repaired,
+ * until the server stops.
+ */
+static void *fsck_runner(void *arg) {
+    (void)arg;
+    fsck_report_t report;
+    while (1) {
+        sleep(fsck_interval);
+        pthread_mutex_lock(&global_mutex);
+        bool running = enter_fs();
+        pthread_mutex_unlock(&global_mutex);
+        if (!running) {
+            return NULL;
+        }
+        int r = tfs_fsck(&report);
+        pthread_mutex_lock(&global_mutex);
+        leave_fs();
+        pthread_mutex_unlock(&global_mutex);
+        if (r == -1) {
+            fprintf(stderr, "fsck failed\n");
+            continue;
+        }
+        if (report.orphan_blocks + report.lost_blocks + report.orphan_inodes + report.dangling_entries +
+                report.damaged_inodes + report.bad_refcounts >
+            0) {
+            fprintf(stderr,
+                    "fsck: %zu orphan blocks, %zu lost blocks, %zu orphan i-nodes, %zu dangling entries, "
+                    "%zu damaged i-nodes, %zu bad reference counts\n",
+                    report.orphan_blocks, report.lost_blocks, report.orphan_inodes, report.dangling_entries,
+                    report.damaged_inodes, report.bad_refcounts);
+        }
+    }
+    return NULL;
 }
 
-void init_table(){
-    for (size_t i = 0; i < MAX_CLIENTS; i++) {
+/*
+ * Every WRITE_BUFFER_AGE_MS, writes the small writes gathered in the open
+ * files (see tfs_write) that have waited that long, until the server stops.
+ */
+static void *write_flusher(void *arg) {
+    (void)arg;
+    struct timespec interval = {.tv_sec = WRITE_BUFFER_AGE_MS / 1000,
+                                .tv_nsec = (WRITE_BUFFER_AGE_MS % 1000) * 1000000L};
+    while (1) {
+        nanosleep(&interval, NULL);
+        pthread_mutex_lock(&global_mutex);
+        bool running = enter_fs();
+        pthread_mutex_unlock(&global_mutex);
+        if (!running) {
+            return NULL;
+        }
+        tfs_flush_writes((uint64_t)WRITE_BUFFER_AGE_MS * 1000000);
+        pthread_mutex_lock(&global_mutex);
+        leave_fs();
+        pthread_mutex_unlock(&global_mutex);
+    }
+    return NULL;
+}
+
+/*
+ * Has a worker serve a session, unless one is already going to.
+ * Must be called with the global mutex held.
+ */
+static void schedule_session(unsigned int session_id) {
+    Session *session = &sessions[session_id];
+    if (!session->scheduled) {
+        session->scheduled = true;
+        executor_submit((int)session_id, session_id % n_workers);
+    }
+}
+
+/*
+ * Every SESSION_PROBE_INTERVAL seconds, expires the sessions whose client
+ * went away (closing its end of the pipe) or was idle for longer than
+ * idle_timeout, until the server stops. A session with requests queued is
+ * left alone: it finds out when replying.
+ */
+static void *session_reaper(void *arg) {
+    (void)arg;
+    while (1) {
+        sleep(SESSION_PROBE_INTERVAL);
+        pthread_mutex_lock(&global_mutex);
+        if (stopping) {
+            pthread_mutex_unlock(&global_mutex);
+            return NULL;
+        }
+        uint64_t now = metrics_now();
+        for (int i = 0; i < max_clients; i++) {
+            Session *session = &sessions[i];
+            if (free_sessions[i] == FREE || session->expired || session->count > 0 || session->pipe == -1) {
+                continue;
+            }
+            struct pollfd probe = {.fd = session->pipe, .events = POLLOUT};
+            bool gone = poll(&probe, 1, 0) == 1 && (probe.revents & (POLLERR | POLLHUP)) != 0;
+            bool quiet = idle_timeout > 0 && now - session->last_active > (uint64_t)idle_timeout * 1000000000;
+            if (gone || quiet) {
+                session->expired = true;
+                schedule_session((unsigned int)i);
+            }
+        }
+        pthread_mutex_unlock(&global_mutex);
+    }
+    return NULL;
+}
+
+/* offset of the arguments in a queued request frame (after op code and seq) */
+#define REQUEST_ARGS (sizeof(char) + sizeof(unsigned int))
+
+int init_table(){
+    size_t n = (size_t)max_clients;
+    sessions = calloc(n, sizeof(Session));
+    free_sessions = calloc(n, sizeof(char));
+    workers = calloc(n_workers, sizeof(pthread_t));
+    aux_worker_ids = calloc(n_workers, sizeof(size_t));
+    handle_owner = malloc(max_open_files * sizeof(int));
+    parked_locks = calloc(n * TFS_MAX_INFLIGHT, sizeof(parked_lock_t));
+    if (sessions == NULL || free_sessions == NULL || workers == NULL || aux_worker_ids == NULL ||
+        handle_owner == NULL || parked_locks == NULL) {
+        return -1;
+    }
+    for (size_t w = 0; w < n_workers; w++) {
+        aux_worker_ids[w] = w;
+    }
+    for (size_t h = 0; h < max_open_files; h++) {
+        handle_owner[h] = -1;
+    }
+    for (size_t i = 0; i < n; i++) {
         free_sessions[i] = FREE;
+        sessions[i].pipe = -1;
+        sessions[i].lease_pipe = -1;
+        sessions[i].head = 0;
+        sessions[i].count = 0;
+        sessions[i].scheduled = false;
     }
+    return 0;
 }
 
-void *create_worker(void* worker) {
-    unsigned int worker_id = *((unsigned int*) worker);
+/*
+ * Executes a queued request and replies to the client.
+ * Input:
+ *  - session_id: the session the request belongs to
+ *  - request: the request
+ * Returns 0 if successful, -1 if the reply could not be sent
+ */
+static int serve_request(unsigned int session_id, Request *request) {
     struct Mount m_message;
     struct Unmount u_message;
     struct Open o_message;
@@ -135,373 +966,683 @@ void *create_worker(void* worker) {
     struct Write w_message;
     struct Read r_message;
     struct Shutdown s_message;
-    
-    while (1) {
+    struct CopyOut co_message;
+    struct CopyIn ci_message;
+    struct Unlink ul_message;
+    struct Rename rn_message;
+    struct Seek sk_message;
+    struct PunchHole ph_message;
+    struct Fallocate fa_message;
+    struct Snapshot sn_message;
+    struct Lease ls_message;
+    struct Stat st_message;
+    struct Fstat fs_message;
+    struct Readdir rd_message;
+    struct Lock lk_message;
+    struct Unlock uk_message;
+    char op_code = request->buffer[0];
+    unsigned int seq;
+    char *args = request->buffer + REQUEST_ARGS;
+
+    memcpy(&seq, request->buffer + sizeof(char), sizeof(unsigned int));
+
+    switch (op_code) {
+        case TFS_OP_CODE_MOUNT:
+            m_message.session_id = session_id;
+            memcpy(&m_message.client_pipe_path, args, MAX_FILE_NAME);
+            m_message.client_pipe_path[MAX_FILE_NAME - 1] = '\0';
+            memcpy(&m_message.options, args + MAX_FILE_NAME, sizeof(tfs_session_options_t));
+            return mount_pipe(m_message);
+
+        case TFS_OP_CODE_UNMOUNT:
+            u_message.session_id = session_id;
+            u_message.seq = seq;
+            return unmount_pipe(u_message);
+
+        case TFS_OP_CODE_OPEN:
+            o_message.session_id = session_id;
+            o_message.seq = seq;
+            memcpy(&o_message.name, args, MAX_FILE_NAME);
+            o_message.name[MAX_FILE_NAME - 1] = '\0';
+            memcpy(&o_message.flags, args + MAX_FILE_NAME, sizeof(int));
+            return open_file(o_message);
+
+        case TFS_OP_CODE_CLOSE:
+            c_message.session_id = session_id;
+            c_message.seq = seq;
+            memcpy(&c_message.fhandle, args, sizeof(int));
+            return close_file(c_message);
+
+        case TFS_OP_CODE_WRITE:
+            w_message.session_id = session_id;
+            w_message.seq = seq;
+            memcpy(&w_message.fhandle, args, sizeof(int));
+            memcpy(&w_message.len, args + sizeof(int), sizeof(size_t));
+            return write_file(w_message, request->payload);
+
+        case TFS_OP_CODE_READ:
+            r_message.session_id = session_id;
+            r_message.seq = seq;
+            memcpy(&r_message.fhandle, args, sizeof(int));
+            memcpy(&r_message.len, args + sizeof(int), sizeof(size_t));
+            return read_file(r_message);
+
+        case TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED:
+            s_message.session_id = session_id;
+            s_message.seq = seq;
+            return destroy_os(s_message);
+
+        case TFS_OP_CODE_COPY_OUT:
+            co_message.session_id = session_id;
+            co_message.seq = seq;
+            memcpy(&co_message.name, args, MAX_FILE_NAME);
+            co_message.name[MAX_FILE_NAME - 1] = '\0';
+            memcpy(&co_message.external_path, args + MAX_FILE_NAME, MAX_FILE_NAME);
+            co_message.external_path[MAX_FILE_NAME - 1] = '\0';
+            return copy_out(co_message);
+
+        case TFS_OP_CODE_COPY_IN:
+            ci_message.session_id = session_id;
+            ci_message.seq = seq;
+            memcpy(&ci_message.external_path, args, MAX_FILE_NAME);
+            ci_message.external_path[MAX_FILE_NAME - 1] = '\0';
+            memcpy(&ci_message.name, args + MAX_FILE_NAME, MAX_FILE_NAME);
+            ci_message.name[MAX_FILE_NAME - 1] = '\0';
+            return copy_in(ci_message);
+
+        case TFS_OP_CODE_STATS:
+            r_message.session_id = session_id;
+            r_message.seq = seq;
+            memcpy(&r_message.len, args, sizeof(size_t));
+            return stats(r_message);
+
+        case TFS_OP_CODE_UNLINK:
+            ul_message.session_id = session_id;
+            ul_message.seq = seq;
+            memcpy(&ul_message.name, args, MAX_FILE_NAME);
+            ul_message.name[MAX_FILE_NAME - 1] = '\0';
+            return unlink_file(ul_message);
+
+        case TFS_OP_CODE_STAT:
+            st_message.session_id = session_id;
+            st_message.seq = seq;
+            memcpy(&st_message.name, args, MAX_FILE_NAME);
+            st_message.name[MAX_FILE_NAME - 1] = '\0';
+            return stat_file(st_message);
+
+        case TFS_OP_CODE_FSTAT:
+            fs_message.session_id = session_id;
+            fs_message.seq = seq;
+            memcpy(&fs_message.fhandle, args, sizeof(int));
+            return fstat_file(fs_message);
+
+        case TFS_OP_CODE_READDIR:
+            rd_message.session_id = session_id;
+            rd_message.seq = seq;
+            memcpy(&rd_message.first, args, sizeof(size_t));
+            return list_files(rd_message);
+
+        case TFS_OP_CODE_RENAME:
+            rn_message.session_id = session_id;
+            rn_message.seq = seq;
+            memcpy(&rn_message.old_name, args, MAX_FILE_NAME);
+            rn_message.old_name[MAX_FILE_NAME - 1] = '\0';
+            memcpy(&rn_message.new_name, args + MAX_FILE_NAME, MAX_FILE_NAME);
+            rn_message.new_name[MAX_FILE_NAME - 1] = '\0';
+            return rename_file(rn_message);
+
+        case TFS_OP_CODE_SEEK:
+            sk_message.session_id = session_id;
+            sk_message.seq = seq;
+            memcpy(&sk_message.fhandle, args, sizeof(int));
+            memcpy(&sk_message.offset, args + sizeof(int), sizeof(size_t));
+            return seek_file(sk_message);
+
+        case TFS_OP_CODE_PUNCH_HOLE:
+            ph_message.session_id = session_id;
+            ph_message.seq = seq;
+            memcpy(&ph_message.fhandle, args, sizeof(int));
+            memcpy(&ph_message.offset, args + sizeof(int), sizeof(size_t));
+            memcpy(&ph_message.len, args + sizeof(int) + sizeof(size_t), sizeof(size_t));
+            return punch_hole(ph_message);
+
+        case TFS_OP_CODE_FALLOCATE:
+            fa_message.session_id = session_id;
+            fa_message.seq = seq;
+            memcpy(&fa_message.fhandle, args, sizeof(int));
+            memcpy(&fa_message.offset, args + sizeof(int), sizeof(size_t));
+            memcpy(&fa_message.len, args + sizeof(int) + sizeof(size_t), sizeof(size_t));
+            return fallocate_file(fa_message);
+
+        case TFS_OP_CODE_SNAPSHOT:
+            sn_message.session_id = session_id;
+            sn_message.seq = seq;
+            memcpy(&sn_message.external_path, args, MAX_FILE_NAME);
+            sn_message.external_path[MAX_FILE_NAME - 1] = '\0';
+            return snapshot_fs(sn_message);
+
+        case TFS_OP_CODE_LEASE:
+            ls_message.session_id = session_id;
+            ls_message.seq = seq;
+            memcpy(&ls_message.fhandle, args, sizeof(int));
+            memcpy(&ls_message.offset, args + sizeof(int), sizeof(size_t));
+            return lease_block(ls_message);
+
+        case TFS_OP_CODE_LOCK:
+            lk_message.session_id = session_id;
+            lk_message.seq = seq;
+            memcpy(&lk_message.fhandle, args, sizeof(int));
+            memcpy(&lk_message.offset, args + sizeof(int), sizeof(size_t));
+            memcpy(&lk_message.len, args + sizeof(int) + sizeof(size_t), sizeof(size_t));
+            memcpy(&lk_message.flags, args + sizeof(int) + 2 * sizeof(size_t), sizeof(int));
+            return lock_file(lk_message);
+
+        case TFS_OP_CODE_UNLOCK:
+            uk_message.session_id = session_id;
+            uk_message.seq = seq;
+            memcpy(&uk_message.fhandle, args, sizeof(int));
+            memcpy(&uk_message.offset, args + sizeof(int), sizeof(size_t));
+            memcpy(&uk_message.len, args + sizeof(int) + sizeof(size_t), sizeof(size_t));
+            return unlock_file(uk_message);
+
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Ends an expired session (see session_reaper): the requests still queued
+ * are dropped, as there is no one to reply to, the files it left open are
+ * closed and its pipe too (so a client still there sees the session end),
+ * and the slot is freed for another client.
+ */
+static void end_session(unsigned int session_id) {
+    Session *session = &sessions[session_id];
+    pthread_mutex_lock(&global_mutex);
+    while (session->count > 0) {
+        buffer_pool_put(session->requests[session->head].payload);
+        session->requests[session->head].payload = NULL;
+        session->head = (session->head + 1) % SESSION_SLOTS;
+        session->count--;
+    }
+    bool use_fs = enter_fs();
+    pthread_mutex_unlock(&global_mutex);
+
+    if (use_fs) {
+        close_session_handles(session_id);
+    }
+    end_leases(session_id);
+    if (session->pipe != -1) {
+        close(session->pipe);
+    }
+
+    pthread_mutex_lock(&global_mutex);
+    if (use_fs) {
+        leave_fs();
+    }
+    session->pipe = -1;
+    session->expired = false;
+    free_sessions[session_id] = FREE;
+    expired_sessions++;
+    pthread_mutex_unlock(&global_mutex);
+}
+
+/*
+ * Returns what executing a request costs to the scheduler: the bytes it
+ * moves, on top of SCHED_REQUEST_COST; 0 for the requests not scheduled
+ * (those that do not use the file system, and a shutdown, which waits for
+ * the others).
+ */
+static size_t request_cost(Request const *request) {
+    size_t len;
+    switch (request->buffer[0]) {
+        case TFS_OP_CODE_MOUNT:
+        case TFS_OP_CODE_UNMOUNT:
+        case TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED:
+            return 0;
+        case TFS_OP_CODE_WRITE:
+        case TFS_OP_CODE_READ:
+            memcpy(&len, request->buffer + REQUEST_ARGS + sizeof(int), sizeof(size_t));
+            return SCHED_REQUEST_COST + len;
+        case TFS_OP_CODE_LEASE:
+            return SCHED_REQUEST_COST + TFS_LEASE_BLOCK_SIZE;
+        case TFS_OP_CODE_READDIR:
+            return SCHED_REQUEST_COST + TFS_MAX_PAYLOAD;
+        case TFS_OP_CODE_COPY_OUT:
+        case TFS_OP_CODE_COPY_IN:
+            /* the size of the file is not known in advance */
+            return SCHED_REQUEST_COST + COPY_CHUNK_SIZE;
+        default:
+            return SCHED_REQUEST_COST;
+    }
+}
+
+/*
+ * Serves a session's queued requests in order, up to SESSION_BATCH of them
+ * before letting the worker move on to other sessions (the session goes
+ * back behind them in the worker's deque).
+ * The request at the head of the queue stays in place while it is served,
+ * so the global mutex is only held to take it and to release its slot.
+ * Requests using the file system are executed when the scheduler lets them.
+ * A session whose client cannot be replied to is expired, and ended. Once
+ * the server is stopping, the requests left are failed.
+ */
+static void serve_session(size_t worker_id, unsigned int session_id) {
+    Session *session = &sessions[session_id];
+
+    for (unsigned int served = 0;; served++) {
         if (pthread_mutex_lock(&global_mutex) != 0) {
             exit(0);
         }
-        while (sessions[worker_id].buffer == NULL) {
-            pthread_cond_wait(&sessions[worker_id].sent_all, &global_mutex);
-        }
-        char op_code = sessions[worker_id].buffer[0];
-        
-        switch (op_code) {
-
-            case '1': // Mount
-                m_message.session_id = worker_id;
-                memset(&m_message.client_pipe_path, 0, MAX_FILE_NAME);
-                memcpy(&m_message.client_pipe_path, sessions[worker_id].buffer + sizeof(char), MAX_FILE_NAME);
-                if (mount_pipe(m_message) == -1) {
-                    if (pthread_mutex_unlock(&global_mutex) != 0) {
-                        exit(0);
-                    }
-                    return NULL;
-                }
-                if (pthread_mutex_unlock(&global_mutex) != 0) {
-                    exit(0);
-                }
-                break;
+        if (session->expired) {
+            pthread_mutex_unlock(&global_mutex);
+            scheduler_cancel(session_id);
+            end_session(session_id);
+            continue;
+        }
+        if (session->count == 0) {
+            session->scheduled = false;
+            pthread_mutex_unlock(&global_mutex);
+            return;
+        }
+        if (served == SESSION_BATCH) {
+            pthread_mutex_unlock(&global_mutex);
+            executor_yield(worker_id, (int)session_id);
+            return;
+        }
+        Request *request = &session->requests[session->head];
+        bool serve = enter_fs();
+        if (pthread_mutex_unlock(&global_mutex) != 0) {
+            exit(0);
+        }
 
-            case '2': // Unmount
-                u_message.session_id = worker_id;
-                if (unmount_pipe(u_message) == -1) {
-                    if (pthread_mutex_unlock(&global_mutex) != 0) {
-                        exit(0);
-                    }
-                    return NULL;
-                }
-                if (pthread_mutex_unlock(&global_mutex) != 0) {
-                    exit(0);
-                }
-                break;
+        int op_code = request->buffer[0];
+        int r = 0;
+        size_t cost = serve ? request_cost(request) : 0;
+        if (cost > 0) {
+            scheduler_acquire(session_id, cost);
+        } else {
+            /* it was put in line when the previous one was done */
+            scheduler_cancel(session_id);
+        }
+        if (serve) {
+            uint64_t start = metrics_now();
+            metrics_record(op_code, METRICS_QUEUE_WAIT, start - request->enqueued);
+            reply_ns = 0;
+            r = serve_request(session_id, request);
+            metrics_record(op_code, METRICS_EXEC, metrics_now() - start - reply_ns);
+            metrics_record(op_code, METRICS_REPLY, reply_ns);
+        } else if (op_code != TFS_OP_CODE_MOUNT) {
+            unsigned int seq;
+            memcpy(&seq, request->buffer + sizeof(char), sizeof(unsigned int));
+            r = inform_failed_operation(session_id, seq);
+        }
 
-            case '3': // Open 
-                o_message.session_id = worker_id;
-                memcpy(&o_message.name, sessions[worker_id].buffer + sizeof(char), MAX_FILE_NAME);
-                memcpy(&o_message.flags, sessions[worker_id].buffer + sizeof(char) + MAX_FILE_NAME, sizeof(int));
-                if (open_file(o_message) == -1) {
-                    if(inform_failed_operation(o_message.session_id) == -1) {
-                        if (pthread_mutex_unlock(&global_mutex) != 0) {
-                            exit(0);
-                        }
-                        return NULL;
-                    }
-                }
-                if (pthread_mutex_unlock(&global_mutex) != 0) {
-                    exit(0);
-                }
-                break;
-                
-            case '4': // Close
-                c_message.session_id = worker_id;
-                memcpy(&c_message.fhandle, sessions[worker_id].buffer + sizeof(char), sizeof(int));
-
-                if (close_file(c_message) == -1) {
-                    if (pthread_mutex_unlock(&global_mutex) != 0) {
-                        exit(0);
-                    }
-                    return NULL;
-                }
-                if (pthread_mutex_unlock(&global_mutex) != 0) {
-                    exit(0);
-                }
-                break;
+        if (pthread_mutex_lock(&global_mutex) != 0) {
+            exit(0);
+        }
+        if (serve) {
+            leave_fs();
+        }
+        buffer_pool_put(request->payload);
+        request->payload = NULL;
+        session->head = (session->head + 1) % SESSION_SLOTS;
+        session->count--;
+        if (r == -1) {
+            /* the client went away */
+            session->expired = true;
+        }
+        /* a session about to wait in a deque must not hold a slot of the
+         * scheduler, so it is only put in line while it stays here */
+        size_t next_cost = 0;
+        if (session->count > 0 && !session->expired && !stopping && served + 1 < SESSION_BATCH) {
+            next_cost = request_cost(&session->requests[session->head]);
+        }
+        if (pthread_mutex_unlock(&global_mutex) != 0) {
+            exit(0);
+        }
+        if (cost > 0) {
+            scheduler_release(session_id, next_cost);
+        }
+    }
+}
 
-            case '5': // Write
-                w_message.session_id = worker_id;
-                memcpy(&w_message.fhandle, sessions[worker_id].buffer + sizeof(char), sizeof(int));
-                memcpy(&w_message.len, sessions[worker_id].buffer + sizeof(char) + sizeof(int), sizeof(size_t));
-                char* temp_buffer = (char*) malloc(w_message.len * sizeof(char));
-                memcpy(temp_buffer, sessions[worker_id].buffer + sizeof(char) + sizeof(int) + sizeof(size_t), w_message.len);
-                if (write_file(w_message, temp_buffer) == -1) {
-                    if (pthread_mutex_unlock(&global_mutex) != 0) {
-                        exit(0);
-                    }
-                    return NULL;
-                }
-                free(temp_buffer);
-                if (pthread_mutex_unlock(&global_mutex) != 0) {
-                    exit(0);
-                }
-                break;
+/*
+ * Worker: serves the sessions the executor hands it, until the server
+ * stops and none is left.
+ */
+void *create_worker(void* worker) {
+    size_t worker_id = *((size_t*) worker);
+    int session_id;
 
-            case '6': // Read
-                r_message.session_id = worker_id;
-                memcpy(&r_message.fhandle, sessions[worker_id].buffer + sizeof(char), sizeof(int));
-                memcpy(&r_message.len, sessions[worker_id].buffer + sizeof(char) + sizeof(int), sizeof(size_t));
-                if (read_file(r_message) == -1) {
-                    if (pthread_mutex_unlock(&global_mutex) != 0) {
-                        exit(0);
-                    }
-                    return NULL;
-                }
-                if (pthread_mutex_unlock(&global_mutex) != 0) {
-                    exit(0);
-                }
-                break;
+    while ((session_id = executor_next(worker_id)) != -1) {
+        serve_session(worker_id, (unsigned int)session_id);
+    }
+    return NULL;
+}
+
+/*
+ * Reads the rest of a request from the server pipe, queues it in the
+ * session it belongs to and has a worker serve the session. A request that
+ * is malformed (or cannot be read whole) is dropped: a client never brings
+ * down the server nor the other sessions.
+ * Must be called with the global mutex held.
+ * Input:
+ *  - server_pipe: the server's pipe, positioned after the op code
+ *  - op_code: the request's op code
+ */
+static void receive_request(int server_pipe, char op_code) {
+    struct Mount m_message;
+    unsigned int session_id;
+    unsigned int seq = 0;
+    char args[TFS_REQUEST_HEADER_MAX];
+    size_t args_len = 0;
 
-            case '7': // Shutdown
-                s_message.session_id = worker_id;
-                if (destroy_os(s_message) == -1) { 
-                    if (pthread_mutex_unlock(&global_mutex) != 0) {
-                        exit(0);
-                    }
-                    return NULL;
+    switch (op_code) {
+        case TFS_OP_CODE_MOUNT:
+            memset(&m_message.client_pipe_path, 0, MAX_FILE_NAME);
+            if (read_all(server_pipe, &m_message.client_pipe_path, MAX_FILE_NAME) == -1 ||
+                read_all(server_pipe, &m_message.options, sizeof(tfs_session_options_t)) == -1) {
+                return;
+            }
+            m_message.client_pipe_path[MAX_FILE_NAME - 1] = '\0';
+            /* no new sessions while shutting down */
+            int session_id_aux = draining ? -1 : find_free_session_id();
+            if (session_id_aux == -1) {
+                int temp_pipe = open(m_message.client_pipe_path, O_WRONLY);
+                if (temp_pipe == -1) {
+                    return;
                 }
-                if (pthread_mutex_unlock(&global_mutex) != 0) {
-                    exit(0);
+                Reply refused = {.seq = 0, .result = failed};
+                if (write(temp_pipe, &refused, sizeof(Reply)) == -1) {
+                    /* the client is gone already */
                 }
-                break;
+                close(temp_pipe);
+                return;
+            }
+            session_id = (unsigned int)session_id_aux;
+            free_sessions[session_id] = TAKEN;
+            sessions[session_id].expired = false;
+            memcpy(args, &m_message.client_pipe_path, MAX_FILE_NAME);
+            memcpy(args + MAX_FILE_NAME, &m_message.options, sizeof(tfs_session_options_t));
+            args_len = MAX_FILE_NAME + sizeof(tfs_session_options_t);
+            break;
 
-            default:
-                if (pthread_mutex_unlock(&global_mutex) != 0) {
-                    exit(0);
-                }
-                break;
+        case TFS_OP_CODE_OPEN:
+            args_len = MAX_FILE_NAME + sizeof(int);
+            break;
+        case TFS_OP_CODE_CLOSE:
+        case TFS_OP_CODE_FSTAT:
+            args_len = sizeof(int);
+            break;
+        case TFS_OP_CODE_WRITE:
+        case TFS_OP_CODE_READ:
+        case TFS_OP_CODE_SEEK:
+        case TFS_OP_CODE_LEASE:
+            args_len = sizeof(int) + sizeof(size_t);
+            break;
+        case TFS_OP_CODE_PUNCH_HOLE:
+        case TFS_OP_CODE_FALLOCATE:
+        case TFS_OP_CODE_UNLOCK:
+            args_len = sizeof(int) + 2 * sizeof(size_t);
+            break;
+        case TFS_OP_CODE_LOCK:
+            args_len = 2 * sizeof(int) + 2 * sizeof(size_t);
+            break;
+        case TFS_OP_CODE_UNLINK:
+        case TFS_OP_CODE_SNAPSHOT:
+        case TFS_OP_CODE_STAT:
+            args_len = MAX_FILE_NAME;
+            break;
+        case TFS_OP_CODE_COPY_OUT:
+        case TFS_OP_CODE_COPY_IN:
+        case TFS_OP_CODE_RENAME:
+            args_len = 2 * MAX_FILE_NAME;
+            break;
+        case TFS_OP_CODE_STATS:
+        case TFS_OP_CODE_READDIR:
+            args_len = sizeof(size_t);
+            break;
+        case TFS_OP_CODE_UNMOUNT:
+        case TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED:
+            break;
+        default:
+            return;
+    }
+
+    if (op_code != TFS_OP_CODE_MOUNT) {
+        if (read_all(server_pipe, &session_id, sizeof(unsigned int)) == -1 ||
+            read_all(server_pipe, &seq, sizeof(unsigned int)) == -1 ||
+            read_all(server_pipe, args, args_len) == -1) {
+            return;
         }
-        free(sessions[worker_id].buffer);
-        sessions[worker_id].buffer = NULL;
     }
-    return NULL;
+
+    char *payload = NULL;
+    if (op_code == TFS_OP_CODE_WRITE) {
+        /* the data of a write never exceeds TFS_MAX_PAYLOAD (see common.h):
+         * a larger length is not read, as it was not sent in one frame */
+        size_t len;
+        memcpy(&len, args + sizeof(int), sizeof(size_t));
+        if (len > TFS_MAX_PAYLOAD) {
+            return;
+        }
+        payload = buffer_pool_get(len);
+        if (payload == NULL || read_all(server_pipe, payload, len) == -1) {
+            buffer_pool_put(payload);
+            return;
+        }
+    }
+
+    if (!valid_session_id(session_id)) {
+        buffer_pool_put(payload);
+        return;
+    }
+    Session *session = &sessions[session_id];
+    if (free_sessions[session_id] == TAKEN && !session->expired && session->count == SESSION_SLOTS) {
+        /* more requests in flight than allowed: the intake never waits for
+         * a session (nor replies, which could block), so the session is
+         * expired instead */
+        session->expired = true;
+        schedule_session(session_id);
+    }
+    if (free_sessions[session_id] == FREE || session->expired) {
+        /* nobody to reply to (or the session is ending); the request is
+         * dropped */
+        buffer_pool_put(payload);
+        return;
+    }
+    Request *request = &session->requests[(session->head + session->count) % SESSION_SLOTS];
+    request->buffer[0] = op_code;
+    memcpy(request->buffer + sizeof(char), &seq, sizeof(unsigned int));
+    memcpy(request->buffer + REQUEST_ARGS, args, args_len);
+    request->payload = payload;
+    request->enqueued = metrics_now();
+    session->last_active = request->enqueued;
+    session->count++;
+    schedule_session(session_id);
 }
 
 int main(int argc, char **argv) {
     char op_code = ' ';
-    struct Mount m_message;
-    struct Unmount u_message;
-    struct Open o_message;
-    struct Close c_message;
-    struct Write w_message;
-    struct Read r_message;
-    struct Shutdown s_message;
     int server_pipe;
-    
-    init_table();
-    if (pthread_mutex_init(&global_mutex, NULL) == -1) {
+    int opt;
+    tfs_params params = tfs_default_params();
+    params.write_buffer_size = WRITE_BUFFER_SIZE;
+
+    if (pthread_mutex_init(&global_mutex, NULL) != 0) {
         return -1;
     }
-    if (argc < 2) {
+    while ((opt = getopt(argc, argv, "s:i:f:b:B:I:O:L:c:dz:T:t:W:w:qa:")) != -1) {
+        switch (opt) {
+            case 's':
+                stats_path = optarg;
+                break;
+            case 'i':
+                stats_interval = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                fsck_interval = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                params.block_size = (size_t)strtoull(optarg, NULL, 10);
+                break;
+            case 'B':
+                params.max_block_count = (size_t)strtoull(optarg, NULL, 10);
+                break;
+            case 'I':
+                params.max_inode_count = (size_t)strtoull(optarg, NULL, 10);
+                break;
+            case 'O':
+                params.max_open_files_count = (size_t)strtoull(optarg, NULL, 10);
+                break;
+            case 'L':
+                params.max_inline_size = (size_t)strtoull(optarg, NULL, 10);
+                break;
+            case 'c':
+                max_clients = atoi(optarg);
+                break;
+            case 'd':
+                params.dedup = true;
+                break;
+            case 'z':
+                params.store_size = (size_t)strtoull(optarg, NULL, 10);
+                break;
+            case 'T':
+                drain_timeout = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                idle_timeout = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'W':
+                sched_slots = (size_t)strtoull(optarg, NULL, 10);
+                break;
+            case 'w':
+                n_workers = (size_t)strtoull(optarg, NULL, 10);
+                break;
+            case 'q':
+                shared_queue = true;
+                break;
+            case 'a':
+                params.write_buffer_size = (size_t)strtoull(optarg, NULL, 10);
+                break;
+            default:
+                printf("Usage: %s [-s stats_file] [-i seconds] [-f fsck_seconds] [-b block_size]\n"
+                       "          [-B blocks] [-I inodes] [-O open_files] [-L inline_size] [-c clients] [-d]\n"
+                       "          [-z store_bytes] [-T drain_seconds] [-t idle_seconds] [-W slots] [-w workers] [-q]\n"
+                       "          [-a write_buffer_bytes] pipe\n",
+                       argv[0]);
+                return 1;
+        }
+    }
+    max_open_files = params.max_open_files_count;
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_workers == 0) {
+        n_workers = processors > 0 ? (size_t)processors : 1;
+    }
+    if (n_workers < 2) {
+        n_workers = 2;
+    }
+    if (max_clients < 1 || init_table() == -1) {
+        printf("Invalid number of clients.\n");
+        return 1;
+    }
+    if (optind >= argc) {
         printf("Please specify the pathname of the server's pipe.\n");
         return 1;
     }
-    char *pipename = argv[1];
+    pipename = argv[optind];
+    /* a client that goes away must not take the server down with it */
+    signal(SIGPIPE, SIG_IGN);
     unlink(pipename);
     if (mkfifo(pipename, 0777) != 0) {
         return -1;
     }
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        pthread_create(&workers[i], NULL, &create_worker, (void*)&aux_session_ids[i]);
+    if (tfs_init(&params) == -1) {
+        printf("Could not initialize a file system with that geometry.\n");
+        return 1;
+    }
+    if (buffer_pool_init() == -1 || lease_init(params.max_inode_count, (size_t)max_clients) == -1) {
+        return -1;
+    }
+    tfs_set_change_hook(&recall_leases);
+    if (sched_slots == 0) {
+        sched_slots = 2 * (processors > 0 ? (size_t)processors : 1);
+    }
+    if (scheduler_init((size_t)max_clients, sched_slots) == -1) {
+        return -1;
+    }
+    if (executor_init(n_workers, (size_t)max_clients, shared_queue) == -1) {
+        return -1;
+    }
+    for (size_t w = 0; w < n_workers; w++) {
+        pthread_create(&workers[w], NULL, &create_worker, (void*)&aux_worker_ids[w]);
+    }
+    if (stats_path != NULL) {
+        if (stats_interval == 0) {
+            stats_interval = 1;
+        }
+        pthread_t dumper;
+        pthread_create(&dumper, NULL, &stats_dumper, NULL);
+        pthread_detach(dumper);
+    }
+    if (fsck_interval > 0) {
+        pthread_t checker;
+        pthread_create(&checker, NULL, &fsck_runner, NULL);
+        pthread_detach(checker);
+    }
+    pthread_t reaper;
+    pthread_create(&reaper, NULL, &session_reaper, NULL);
+    pthread_detach(reaper);
+    if (params.write_buffer_size > 0) {
+        pthread_t flusher;
+        pthread_create(&flusher, NULL, &write_flusher, NULL);
+        pthread_detach(flusher);
     }
 
     printf("Starting TecnicoFS server with pipe called %s\n", pipename);
     if ((server_pipe = open(pipename, O_RDONLY)) == -1) {
         return -1;
     }
-    tfs_init();
 
     while (1) {
-        if (read(server_pipe, &op_code, sizeof(char)) == -1) {
+        ssize_t r = read(server_pipe, &op_code, sizeof(char));
+        if (r == -1) {
             return -1;
         }
-        switch (op_code) {
-            case '1': // Mount
-                if (pthread_mutex_lock(&global_mutex) == -1) {
-                    return -1;
-                }
-                int session_id_aux;
-                memset(&m_message.client_pipe_path, 0, MAX_FILE_NAME);
-                if ((read(server_pipe, &m_message.client_pipe_path, MAX_FILE_NAME)) == -1) {
-                    if (pthread_mutex_unlock(&global_mutex) == -1) {
-                        return -1;
-                    }
-                    return -1;
-                }
-                session_id_aux = find_free_session_id();
-                if (session_id_aux != -1) {
-                    sessions[session_id_aux].buffer = (char*) malloc(sizeof(char) + sizeof(int) + MAX_FILE_NAME);
-                    memset(sessions[session_id_aux].buffer, 0, sizeof(char) + sizeof(int) + MAX_FILE_NAME);
-                    memcpy(sessions[session_id_aux].buffer, &op_code, sizeof(char));
-                    memcpy(sessions[session_id_aux].buffer + sizeof(char), &m_message.client_pipe_path, MAX_FILE_NAME);
-                    pthread_cond_signal(&sessions[session_id_aux].sent_all);
-                }
-                else {
-                    int temp_pipe = open(m_message.client_pipe_path, O_WRONLY);
-                    if (write(temp_pipe, &failed, sizeof(int)) == -1) {
-                        if (pthread_mutex_unlock(&global_mutex) == -1) {
-                            return -1;
-                        }
-                        return -1;
-                    }
-                    close(temp_pipe);
-                }
-                if (pthread_mutex_unlock(&global_mutex) == -1) {
-                    return -1;
-                }
-                break;
-
-            case '2': // Unmount
-                if (pthread_mutex_lock(&global_mutex) == -1) {
-                    return -1;
-                }
-                if (read(server_pipe, &u_message.session_id, sizeof(int))) {
-                    if (pthread_mutex_unlock(&global_mutex) == -1) {
-                        return -1;
-                    }
-                    return -1;
-                }
-                sessions[u_message.session_id].buffer = (char*) malloc(sizeof(char));
-                memcpy(sessions[u_message.session_id].buffer, &op_code, sizeof(char));
-                pthread_cond_signal(&sessions[u_message.session_id].sent_all);
-                if (pthread_mutex_unlock(&global_mutex) == -1) {
-                    return -1;
-                }
-                break;
-
-            case '3': // Open 
-                if (pthread_mutex_lock(&global_mutex) == -1) {
-                    return -1;
-                }
-                if (read(server_pipe, &o_message.session_id, sizeof(int)) == -1) {
-                    if (pthread_mutex_unlock(&global_mutex) == -1) {
-                        return -1;
-                    }
-                    return -1;
-                }
-                sessions[o_message.session_id].buffer = (char*) malloc(sizeof(char) + sizeof(int) + MAX_FILE_NAME);
-                memcpy(sessions[o_message.session_id].buffer, &op_code, sizeof(char));
-                if (read(server_pipe, sessions[o_message.session_id].buffer + sizeof(char), MAX_FILE_NAME) == -1) {
-                    if (pthread_mutex_unlock(&global_mutex) == -1) {
-                        return -1;
-                    }
-                    return -1;
-                }
-
-                if (read(server_pipe, &o_message.flags, sizeof(int)) == -1) {
-                    if (pthread_mutex_unlock(&global_mutex) == -1) {
-                        return -1;
-                    }
-                    return -1;
-                }
-                memcpy(sessions[o_message.session_id].buffer + sizeof(char) + MAX_FILE_NAME, &o_message.flags, sizeof(int));
-                pthread_cond_signal(&sessions[o_message.session_id].sent_all);
-                if (pthread_mutex_unlock(&global_mutex) == -1) {
-                    return -1;
-                }
-                break;
-                
-            case '4': // Close
-                if (pthread_mutex_lock(&global_mutex) == -1) {
-                    return -1;
-                }
-                if (read(server_pipe, &c_message.session_id, sizeof(int)) == -1) {
-                    if (pthread_mutex_unlock(&global_mutex) == -1) {
-                        return -1;
-                    }
-                    return -1;
-                }
-                sessions[c_message.session_id].buffer = (char*) malloc(sizeof(char) + sizeof(int));
-                memcpy(sessions[c_message.session_id].buffer, &op_code, sizeof(char));
-                if (read(server_pipe, sessions[c_message.session_id].buffer + sizeof(char), sizeof(int)) == -1) {
-                    if (pthread_mutex_unlock(&global_mutex) == -1) {
-                        return -1;
-                    }
-                    return -1;
-                }
-                pthread_cond_signal(&sessions[c_message.session_id].sent_all);
-                if (pthread_mutex_unlock(&global_mutex) == -1) {
-                    return -1;
-                }
-                break;
-
-            case '5': // Write
-                if (pthread_mutex_lock(&global_mutex) == -1) {
-                    return -1;
-                }
-                if (read(server_pipe, &w_message.session_id, sizeof(int)) == -1) {
-                    if (pthread_mutex_unlock(&global_mutex) == -1) {
-                        return -1;
-                    }
-                    return -1;
-                }
-                if (read(server_pipe, &w_message.fhandle, sizeof(int)) == -1) {
-                    if (pthread_mutex_unlock(&global_mutex) == -1) {
-                        return -1;
-                    }
-                    return -1;
-                }
-                if (read(server_pipe, &w_message.len, sizeof(size_t)) == -1) {
-                    if (pthread_mutex_unlock(&global_mutex) == -1) {
-                        return -1;
-                    }
-                    return -1;
-                }
-                sessions[w_message.session_id].buffer = (char*) malloc(sizeof(char) + sizeof(int) + w_message.len);
-                memcpy(sessions[w_message.session_id].buffer, &op_code, sizeof(char));
-                memcpy(sessions[w_message.session_id].buffer + sizeof(char), &w_message.fhandle, sizeof(int));
-                if (read(server_pipe, sessions[w_message.session_id].buffer + sizeof(char) + sizeof(int), w_message.len) == -1) {
-                    if (pthread_mutex_unlock(&global_mutex) == -1) {
-                        return -1;
-                    }
-                    return -1;
-                }
-                pthread_cond_signal(&sessions[w_message.session_id].sent_all);
-                if (pthread_mutex_unlock(&global_mutex) == -1) {
-                    return -1;
-                }
-                break;
-
-            case '6': // Read
-                if (pthread_mutex_lock(&global_mutex) == -1) {
-                    return -1;
-                }
-                if(read(server_pipe, &r_message.session_id, sizeof(int)) == -1) {
-                    if (pthread_mutex_unlock(&global_mutex) == -1) {
-                        return -1;
-                    }
-                    return -1;
-                }
-                sessions[r_message.session_id].buffer = (char*) malloc(sizeof(char) + sizeof(int) + sizeof(size_t));
-                memcpy(sessions[r_message.session_id].buffer, &op_code, sizeof(char));
-                if(read(server_pipe, sessions[r_message.session_id].buffer + sizeof(char), sizeof(int)) == -1){
-                    return -1;
-                }
-                if(read(server_pipe, sessions[r_message.session_id].buffer + sizeof(char) + sizeof(int), sizeof(size_t)) == -1){
-                    return -1;
-                }
-                pthread_cond_signal(&sessions[r_message.session_id].sent_all);
-                if (pthread_mutex_unlock(&global_mutex) == -1) {
-                    return -1;
-                }
-                break;
-
-            case '7': // Shutdown
-                if (pthread_mutex_lock(&global_mutex) == -1) {
-                    return -1;
-                }
-                if (read(server_pipe, &s_message.session_id, sizeof(int)) == -1) {
-                    if (pthread_mutex_unlock(&global_mutex) == -1) {
-                        return -1;
-                    }
-                    return -1;
-                }
-                sessions[s_message.session_id].buffer = (char*) malloc(sizeof(char));
-                memcpy(sessions[s_message.session_id].buffer, &op_code, sizeof(char));
-                pthread_cond_signal(&sessions[s_message.session_id].sent_all);
-                if (pthread_mutex_unlock(&global_mutex) == -1) {
-                    return -1;
-                }
-                break;
-
-            default:
-                break;
+        if (r == 0) {
+            /* every client closed the pipe; wait for the next one */
+            close(server_pipe);
+            if ((server_pipe = open(pipename, O_RDONLY)) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        if (pthread_mutex_lock(&global_mutex) != 0) {
+            return -1;
+        }
+        if (stopping) {
+            /* woken up by a shutdown (see destroy_os) */
+            pthread_mutex_unlock(&global_mutex);
+            break;
+        }
+        receive_request(server_pipe, op_code);
+        if (pthread_mutex_unlock(&global_mutex) != 0) {
+            return -1;
         }
     }
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        pthread_join(workers[i], NULL);
+    executor_stop();
+    for (size_t w = 0; w < n_workers; w++) {
+        pthread_join(workers[w], NULL);
     }
-    if (pthread_mutex_destroy(&global_mutex) == -1) {
+    if (pthread_mutex_destroy(&global_mutex) != 0) {
         return -1;
     }
+    executor_destroy();
+    scheduler_destroy();
+    lease_destroy();
+    buffer_pool_destroy();
     close(server_pipe);
+    unlink(pipename);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,58 @@
+#include "fs/buffer_pool.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Checks that, once the buffer pool is warmed up, serving requests of
+    every size class does not call malloc, and that buffers are recycled.
+*/
+
+#define ROUNDS (1000)
+#define IN_FLIGHT (BUFFER_POOL_SLAB_CHUNKS * 2)
+
+int main() {
+    size_t sizes[] = {1, 40, 64, 65, 500, 1024, 2000, 4096};
+    size_t n_sizes = sizeof(sizes) / sizeof(sizes[0]);
+    void *buffers[IN_FLIGHT];
+
+    assert(buffer_pool_init() != -1);
+
+    /* warm up: the pool grows until IN_FLIGHT buffers of each size fit */
+    for (size_t s = 0; s < n_sizes; s++) {
+        for (size_t i = 0; i < IN_FLIGHT; i++) {
+            buffers[i] = buffer_pool_get(sizes[s]);
+            assert(buffers[i] != NULL);
+            memset(buffers[i], 0xAB, sizes[s]);
+        }
+        for (size_t i = 0; i < IN_FLIGHT; i++) {
+            buffer_pool_put(buffers[i]);
+        }
+    }
+
+    size_t warm = buffer_pool_malloc_count();
+
+    for (int round = 0; round < ROUNDS; round++) {
+        for (size_t s = 0; s < n_sizes; s++) {
+            for (size_t i = 0; i < IN_FLIGHT; i++) {
+                buffers[i] = buffer_pool_get(sizes[s]);
+                assert(buffers[i] != NULL);
+            }
+            for (size_t i = 0; i < IN_FLIGHT; i++) {
+                buffer_pool_put(buffers[i]);
+            }
+        }
+    }
+    assert(buffer_pool_malloc_count() == warm);
+
+    /* oversized buffers bypass the pool (and are counted) */
+    void *big = buffer_pool_get(BUFFER_POOL_MAX_SIZE + 1);
+    assert(big != NULL);
+    assert(buffer_pool_malloc_count() == warm + 1);
+    buffer_pool_put(big);
+
+    buffer_pool_destroy();
+
+    printf("Successful test.\n");
+
+    return 0;
+}
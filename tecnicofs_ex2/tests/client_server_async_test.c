@@ -0,0 +1,126 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*  Keeps many requests in flight on one session: appends records to a file
+    with callbacks, then reads them back with concurrent read tickets, and
+    finally renames and unlinks the file; then works on a sparse file and
+    takes a snapshot. */
+
+#define RECORDS (TFS_MAX_INFLIGHT * 2)
+#define RECORD_SIZE (8)
+#define SNAPSHOT_IMAGE "/tmp/tfs_async_snapshot.img"
+#define SNAPSHOT_SCRATCH "/tmp/tfs_async_snapshot.scratch"
+
+static int completed = 0;
+
+static void on_write(tfs_ticket_t ticket, ssize_t result, void *arg) {
+    (void)ticket;
+    (void)arg;
+    assert(result == RECORD_SIZE);
+    completed++;
+}
+
+int main(int argc, char **argv) {
+    char *path = "/async";
+    char records[RECORDS][RECORD_SIZE];
+    char buffers[RECORDS][RECORD_SIZE];
+    tfs_ticket_t tickets[RECORDS];
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+
+    tfs_client_t *client = tfs_client_mount(argv[1], argv[2]);
+    assert(client != NULL);
+
+    int f = (int)tfs_wait(client, tfs_submit_open(client, path, TFS_O_CREAT | TFS_O_TRUNC, NULL, NULL));
+    assert(f != -1);
+
+    /* more writes than in-flight slots: submitting consumes replies */
+    for (int i = 0; i < RECORDS; i++) {
+        snprintf(records[i], RECORD_SIZE, "rec%04d", i);
+        assert(tfs_submit_write(client, f, records[i], RECORD_SIZE, on_write, NULL) != -1);
+    }
+    while (completed < RECORDS) {
+        assert(tfs_poll(client) != -1);
+    }
+    assert(tfs_wait(client, tfs_submit_close(client, f, NULL, NULL)) == 0);
+
+    /* requests are served in order, so the reads return consecutive records */
+    f = (int)tfs_wait(client, tfs_submit_open(client, path, 0, NULL, NULL));
+    assert(f != -1);
+    for (int i = 0; i < TFS_MAX_INFLIGHT; i++) {
+        tickets[i] = tfs_submit_read(client, f, buffers[i], RECORD_SIZE, NULL, NULL);
+        assert(tickets[i] != -1);
+    }
+    for (int i = TFS_MAX_INFLIGHT - 1; i >= 0; i--) {
+        assert(tfs_wait(client, tickets[i]) == RECORD_SIZE);
+        assert(memcmp(buffers[i], records[i], RECORD_SIZE) == 0);
+    }
+    assert(tfs_wait(client, tfs_submit_close(client, f, NULL, NULL)) == 0);
+
+    /* the file is renamed and then unlinked through the session */
+    assert(tfs_client_rename(client, path, "/async2") == 0);
+    assert(tfs_client_open(client, path, 0) == -1);
+    assert(tfs_client_unlink(client, "/async2") == 0);
+    assert(tfs_client_unlink(client, "/async2") == -1);
+
+    /* a sparse file: preallocated, written past a hole, then punched */
+    char hole[RECORD_SIZE] = {0};
+    f = tfs_client_open(client, "/sparse", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_client_fallocate(client, f, 0, RECORD_SIZE) == 0);
+    assert(tfs_client_seek(client, f, 2 * RECORD_SIZE) == 0);
+    assert(tfs_client_write(client, f, records[0], RECORD_SIZE) == RECORD_SIZE);
+    assert(tfs_client_punch_hole(client, f, 2 * RECORD_SIZE, 2) == 0);
+    assert(tfs_client_seek(client, f, 0) == 0);
+    assert(tfs_client_read(client, f, buffers[0], RECORD_SIZE) == RECORD_SIZE);
+    assert(tfs_client_read(client, f, buffers[1], RECORD_SIZE) == RECORD_SIZE);
+    assert(tfs_client_read(client, f, buffers[2], RECORD_SIZE) == RECORD_SIZE);
+    assert(memcmp(buffers[0], hole, RECORD_SIZE) == 0 && memcmp(buffers[1], hole, RECORD_SIZE) == 0);
+    assert(memcmp(buffers[2], hole, 2) == 0 && memcmp(buffers[2] + 2, records[0] + 2, RECORD_SIZE - 2) == 0);
+    assert(tfs_client_close(client, f) == 0);
+
+    /* a snapshot outlives the file; its image is written in the background
+     * (complete once the next snapshot can be taken) */
+    assert(tfs_client_snapshot(client, SNAPSHOT_IMAGE) == 0);
+    assert(tfs_client_unlink(client, "/sparse") == 0);
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 1000 * 1000};
+    for (int tries = 0; tfs_client_snapshot(client, SNAPSHOT_SCRATCH) == -1; tries++) {
+        assert(tries < 10000);
+        nanosleep(&pause, NULL);
+    }
+    static char image[4096];
+    FILE *fp = fopen(SNAPSHOT_IMAGE, "r");
+    assert(fp != NULL);
+    size_t image_len = fread(image, 1, sizeof(image) - 1, fp);
+    assert(fclose(fp) == 0);
+    image[image_len] = '\0';
+    assert(strncmp(image, "tfs-snapshot 1\n", 15) == 0);
+    char *entry = strstr(image, "/sparse 24\n");
+    assert(entry != NULL);
+    entry += strlen("/sparse 24\n");
+    assert(memcmp(entry + 2 * RECORD_SIZE + 2, records[0] + 2, RECORD_SIZE - 2) == 0);
+    remove(SNAPSHOT_IMAGE);
+    remove(SNAPSHOT_SCRATCH);
+
+    /* an image is only written to a regular file */
+    assert(tfs_client_snapshot(client, "/dev/null") == -1);
+
+    /* the server accounted for every request */
+    char stats[TFS_MAX_PAYLOAD];
+    assert(tfs_client_stats(client, stats, sizeof(stats)) > 0);
+    assert(strstr(stats, "write queue n=") != NULL);
+    assert(strstr(stats, "read exec n=") != NULL);
+
+    assert(tfs_client_unmount(client) == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*  A client process takes every session and every open file, and dies
+    without unmounting or closing them; the server notices, and they can
+    be used again. */
+
+#define SESSIONS (16)
+#define FILES (64)
+#define TRIES (500)
+
+static void take_everything(char const *client_pipe, char const *server_pipe) {
+    tfs_client_t *clients[SESSIONS];
+    char pipe_path[48];
+    char path[16];
+    int n = 0;
+    for (; n < SESSIONS; n++) {
+        snprintf(pipe_path, sizeof(pipe_path), "%s.%d", client_pipe, n);
+        if ((clients[n] = tfs_client_mount(pipe_path, server_pipe)) == NULL) {
+            break;
+        }
+    }
+    assert(n > 0);
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "/f%d", i);
+        if (tfs_client_open(clients[i % n], path, TFS_O_CREAT) == -1) {
+            break;
+        }
+    }
+    /* a new session is refused now */
+    snprintf(pipe_path, sizeof(pipe_path), "%s.x", client_pipe);
+    assert(tfs_client_mount(pipe_path, server_pipe) == NULL);
+}
+
+int main(int argc, char **argv) {
+    char client_pipe[40];
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 10 * 1000 * 1000};
+    int fhandles[FILES];
+    char path[16];
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+
+    pid_t child = fork();
+    assert(child != -1);
+    if (child == 0) {
+        snprintf(client_pipe, sizeof(client_pipe), "%s.dead", argv[1]);
+        take_everything(client_pipe, argv[2]);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(child, &status, 0) == child);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    /* the dead client's sessions are ended... */
+    tfs_client_t *client = NULL;
+    for (int tries = 0; client == NULL; tries++) {
+        assert(tries < TRIES);
+        nanosleep(&pause, NULL);
+        client = tfs_client_mount(argv[1], argv[2]);
+    }
+    /* ...and its files closed */
+    int opened = 0;
+    for (int tries = 0; opened == 0; tries++) {
+        assert(tries < TRIES);
+        for (; opened < FILES; opened++) {
+            snprintf(path, sizeof(path), "/f%d", opened);
+            if ((fhandles[opened] = tfs_client_open(client, path, 0)) == -1) {
+                break;
+            }
+        }
+        if (opened == 0) {
+            nanosleep(&pause, NULL);
+        }
+    }
+    assert(opened > 1);
+    for (int i = 0; i < opened; i++) {
+        assert(tfs_client_close(client, fhandles[i]) != -1);
+    }
+    /* the directory is left as it was */
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "/f%d", i);
+        tfs_client_unlink(client, path);
+    }
+    assert(tfs_client_unmount(client) == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,69 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Creates files of different sizes (as many as the directory holds, up to
+    FILES) and lists them with their attributes in a single call, which
+    match those got one at a time by name and by handle. */
+
+#define FILES (200)
+
+static tfs_dirent_t entries[4 * FILES];
+static char data[FILES];
+
+int main(int argc, char **argv) {
+    char path[40];
+    tfs_stat_t st;
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+    assert(tfs_mount(argv[1], argv[2]) == 0);
+
+    int created = 0;
+    for (; created < FILES; created++) {
+        snprintf(path, sizeof(path), "/ls%03d", created);
+        int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+        if (f == -1) {
+            break;
+        }
+        assert(tfs_write(f, data, (size_t)created) == created);
+        assert(tfs_fstat(f, &st) != -1);
+        assert(st.size == (size_t)created);
+        assert(tfs_close(f) != -1);
+    }
+    assert(created > 0);
+    assert(tfs_fstat(-1, &st) == -1);
+    assert(tfs_stat("/ls_missing", &st) == -1);
+
+    /* the listing holds every file created, with the attributes of a stat */
+    ssize_t n = tfs_readdir_plus(entries, sizeof(entries) / sizeof(entries[0]));
+    assert(n >= created);
+    int found = 0;
+    for (ssize_t i = 0; i < n; i++) {
+        int k;
+        if (sscanf(entries[i].name, "ls%03d", &k) != 1) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/%.38s", entries[i].name);
+        assert(tfs_stat(path, &st) != -1);
+        assert(st.inumber == entries[i].stat.inumber && st.size == entries[i].stat.size);
+        assert(st.size == (size_t)k);
+        found++;
+    }
+    assert(found == created);
+    assert(tfs_readdir_plus(entries, 1) == 1);
+
+    for (int i = 0; i < created; i++) {
+        snprintf(path, sizeof(path), "/ls%03d", i);
+        assert(tfs_unlink(path) != -1);
+    }
+    assert(tfs_unmount() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
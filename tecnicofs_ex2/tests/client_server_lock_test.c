@@ -0,0 +1,78 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*  Two sessions locking ranges of a file: a lock that has to wait is
+    answered once the lock in its way is released (or its handle closed),
+    and the session's other requests are served meanwhile; a request whose
+    handle is closed first fails, and so does any request on another
+    session's handle. */
+
+int main(int argc, char **argv) {
+    char pipe_a[40], pipe_b[40];
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+    snprintf(pipe_a, sizeof(pipe_a), "%s.a", argv[1]);
+    snprintf(pipe_b, sizeof(pipe_b), "%s.b", argv[1]);
+    tfs_client_t *a = tfs_client_mount(pipe_a, argv[2]);
+    tfs_client_t *b = tfs_client_mount(pipe_b, argv[2]);
+    assert(a != NULL && b != NULL);
+
+    int f = tfs_client_open(a, "/journal", TFS_O_CREAT | TFS_O_TRUNC);
+    int g = tfs_client_open(b, "/journal", 0);
+    assert(f != -1 && g != -1);
+    assert(tfs_client_lock(a, f, 0, 0, TFS_LOCK_EXCLUSIVE) == 0);
+    assert(tfs_client_lock(b, g, 100, 10, TFS_LOCK_SHARED | TFS_LOCK_NOWAIT) == -1);
+    assert(tfs_client_lock(b, f, 0, 10, TFS_LOCK_SHARED | TFS_LOCK_NOWAIT) == -1);
+    assert(tfs_client_write(b, f, "b", 1) == -1);
+    assert(tfs_client_seek(b, f, 0) == -1);
+    assert(tfs_client_close(b, f) == -1);
+
+    /* a lock waiting does not hold up the session */
+    tfs_ticket_t waiting = tfs_submit_lock(b, g, 0, 0, TFS_LOCK_EXCLUSIVE, NULL, NULL);
+    assert(waiting != -1);
+    assert(tfs_client_write(b, g, "bbbb", 4) == 4);
+    assert(tfs_client_seek(b, g, 0) != -1);
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 10 * 1000 * 1000};
+    nanosleep(&pause, NULL);
+    assert(tfs_poll(b) == 0);
+    assert(tfs_client_write(a, f, "aa", 2) == 2);
+    assert(tfs_client_unlock(a, f, 0, 0) != -1);
+    assert(tfs_wait(b, waiting) == 0);
+    assert(tfs_client_lock(a, f, 0, 10, TFS_LOCK_SHARED | TFS_LOCK_NOWAIT) == -1);
+
+    /* closing a handle releases its locks */
+    waiting = tfs_submit_lock(a, f, 0, 10, TFS_LOCK_SHARED, NULL, NULL);
+    assert(waiting != -1);
+    assert(tfs_client_close(b, g) != -1);
+    assert(tfs_wait(a, waiting) == 0);
+
+    /* and cancels its requests */
+    g = tfs_client_open(b, "/journal", 0);
+    assert(g != -1);
+    waiting = tfs_submit_lock(b, g, 5, 1, TFS_LOCK_EXCLUSIVE, NULL, NULL);
+    assert(waiting != -1);
+    assert(tfs_client_close(b, g) != -1);
+    assert(tfs_wait(b, waiting) == -1);
+
+    char buffer[4];
+    assert(tfs_client_seek(a, f, 0) != -1);
+    assert(tfs_client_read(a, f, buffer, sizeof(buffer)) == 4);
+    assert(memcmp(buffer, "aabb", 4) == 0);
+    assert(tfs_client_unlock(a, f, 0, 10) != -1);
+    assert(tfs_client_close(a, f) != -1);
+    assert(tfs_client_unlink(a, "/journal") != -1);
+
+    assert(tfs_client_unmount(a) == 0);
+    assert(tfs_client_unmount(b) == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
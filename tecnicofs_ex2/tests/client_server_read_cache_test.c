@@ -0,0 +1,131 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*  Two sessions caching their reads: blocks read again are not asked of the
+    server, yet every change made through the other session (a write, a
+    truncate, a punched hole) is seen, as is a file reusing the i-node of
+    one unlinked; a handle read through the cache writes, and is read
+    asynchronously, at its offset. */
+
+#define FILE_SIZE (3000)
+#define CHUNK (100)
+
+static char contents[FILE_SIZE];
+static char buffer[FILE_SIZE];
+
+/*
+ * Returns the number following a field of the server's metrics report.
+ */
+static unsigned long long reported(tfs_client_t *client, char const *field) {
+    static char stats[TFS_MAX_PAYLOAD];
+    assert(tfs_client_stats(client, stats, sizeof(stats)) > 0);
+    char const *at = strstr(stats, field);
+    return at == NULL ? 0 : strtoull(at + strlen(field), NULL, 10);
+}
+
+static void read_all_chunks(tfs_client_t *client, int f, size_t len) {
+    assert(tfs_client_seek(client, f, 0) != -1);
+    memset(buffer, 0, sizeof(buffer));
+    for (size_t done = 0; done < len; done += CHUNK) {
+        size_t n = len - done < CHUNK ? len - done : CHUNK;
+        assert(tfs_client_read(client, f, buffer + done, CHUNK) == (ssize_t)n);
+    }
+    assert(tfs_client_read(client, f, buffer, CHUNK) == 0);
+}
+
+int main(int argc, char **argv) {
+    char pipe_a[40], pipe_b[40];
+    tfs_session_options_t options = {.service_class = TFS_CLASS_NORMAL, .weight = 1, .read_cache = true};
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+    snprintf(pipe_a, sizeof(pipe_a), "%s.a", argv[1]);
+    snprintf(pipe_b, sizeof(pipe_b), "%s.b", argv[1]);
+    tfs_client_t *a = tfs_client_mount_with(pipe_a, argv[2], &options);
+    tfs_client_t *b = tfs_client_mount_with(pipe_b, argv[2], &options);
+    assert(a != NULL && b != NULL);
+
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        contents[i] = (char)('a' + i % 26);
+    }
+    int g = tfs_client_open(b, "/cached", TFS_O_CREAT | TFS_O_TRUNC);
+    assert(g != -1);
+    assert(tfs_client_write(b, g, contents, FILE_SIZE) == FILE_SIZE);
+
+    /* read again, the blocks are served by the cache */
+    int f = tfs_client_open(a, "/cached", 0);
+    assert(f != -1);
+    read_all_chunks(a, f, FILE_SIZE);
+    assert(memcmp(buffer, contents, FILE_SIZE) == 0);
+    unsigned long long leases = reported(a, "lease exec n=");
+    unsigned long long reads = reported(a, "read exec n=");
+    assert(leases > 0);
+    read_all_chunks(a, f, FILE_SIZE);
+    assert(memcmp(buffer, contents, FILE_SIZE) == 0);
+    assert(reported(a, "lease exec n=") == leases && reported(a, "read exec n=") == reads);
+
+    /* a write through the other session is seen */
+    assert(tfs_client_seek(b, g, 1500) != -1);
+    assert(tfs_client_write(b, g, "XXXX", 4) == 4);
+    memcpy(contents + 1500, "XXXX", 4);
+    read_all_chunks(a, f, FILE_SIZE);
+    assert(memcmp(buffer, contents, FILE_SIZE) == 0);
+    assert(reported(a, "lease_recall ") > 0);
+
+    /* so are a truncate and a punched hole */
+    int t = tfs_client_open(b, "/cached", TFS_O_TRUNC);
+    assert(t != -1);
+    assert(tfs_client_close(b, t) != -1);
+    read_all_chunks(a, f, 0);
+    assert(tfs_client_seek(b, g, 0) != -1);
+    assert(tfs_client_write(b, g, contents, 2048) == 2048);
+    read_all_chunks(a, f, 2048);
+    assert(memcmp(buffer, contents, 2048) == 0);
+    assert(tfs_client_punch_hole(b, g, 0, 1024) != -1);
+    read_all_chunks(a, f, 2048);
+    for (size_t i = 0; i < 1024; i++) {
+        assert(buffer[i] == '\0');
+    }
+    assert(memcmp(buffer + 1024, contents + 1024, 1024) == 0);
+    assert(tfs_client_close(b, g) != -1);
+
+    /* a handle read through the cache writes, and is read asynchronously,
+     * at its offset */
+    assert(tfs_client_seek(a, f, 1024) != -1);
+    assert(tfs_client_read(a, f, buffer, 10) == 10);
+    assert(tfs_client_write(a, f, "abc", 3) == 3);
+    assert(tfs_client_read(a, f, buffer, 4) == 4);
+    assert(memcmp(buffer, contents + 1037, 4) == 0);
+    assert(tfs_client_seek(a, f, 1030) != -1);
+    assert(tfs_client_read(a, f, buffer, 10) == 10);
+    assert(memcmp(buffer, contents + 1030, 4) == 0 && memcmp(buffer + 4, "abc", 3) == 0);
+    assert(tfs_wait(a, tfs_submit_read(a, f, buffer, 4, NULL, NULL)) == 4);
+    assert(memcmp(buffer, contents + 1040, 4) == 0);
+    assert(tfs_client_close(a, f) != -1);
+
+    /* a new file reusing the i-node of an unlinked one reads as itself */
+    assert(tfs_client_unlink(b, "/cached") != -1);
+    g = tfs_client_open(b, "/reused", TFS_O_CREAT);
+    assert(g != -1);
+    assert(tfs_client_write(b, g, "fresh", 5) == 5);
+    assert(tfs_client_close(b, g) != -1);
+    f = tfs_client_open(a, "/reused", 0);
+    assert(f != -1);
+    assert(tfs_client_read(a, f, buffer, CHUNK) == 5);
+    assert(memcmp(buffer, "fresh", 5) == 0);
+    assert(tfs_client_close(a, f) != -1);
+    assert(tfs_client_unlink(a, "/reused") != -1);
+
+    assert(tfs_client_unmount(a) == 0);
+    assert(tfs_client_unmount(b) == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*  Shuts the server down while another session still has a file open: the
+    server stops taking mounts and opens, goes on serving the open file, and
+    shuts down (removing its pipe) as soon as it is closed.
+    Note: the server is no longer running at the end of this test. */
+
+#define TRIES (500)
+
+static tfs_client_t *shutdown_client;
+static int shutdown_result;
+
+static void *fn_shutdown(void *arg) {
+    (void)arg;
+    shutdown_result = tfs_client_shutdown_after_all_closed(shutdown_client);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    char client_pipe[40];
+    char str[] = "written while draining";
+    pthread_t shutdown_thread;
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 10 * 1000 * 1000};
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+
+    snprintf(client_pipe, sizeof(client_pipe), "%s.0", argv[1]);
+    tfs_client_t *client = tfs_client_mount(client_pipe, argv[2]);
+    assert(client != NULL);
+    snprintf(client_pipe, sizeof(client_pipe), "%s.1", argv[1]);
+    shutdown_client = tfs_client_mount(client_pipe, argv[2]);
+    assert(shutdown_client != NULL);
+
+    int f = tfs_client_open(client, "/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(pthread_create(&shutdown_thread, NULL, fn_shutdown, NULL) == 0);
+
+    /* once the drain starts, files can no longer be opened */
+    int tries = 0;
+    int g;
+    while ((g = tfs_client_open(client, "/g", TFS_O_CREAT)) != -1) {
+        assert(tfs_client_close(client, g) != -1);
+        assert(++tries < TRIES);
+        nanosleep(&pause, NULL);
+    }
+    /* nor sessions mounted */
+    snprintf(client_pipe, sizeof(client_pipe), "%s.2", argv[1]);
+    assert(tfs_client_mount(client_pipe, argv[2]) == NULL);
+
+    /* the open file is still served, and closing it ends the drain */
+    assert(tfs_client_write(client, f, str, strlen(str)) == strlen(str));
+    assert(tfs_client_close(client, f) != -1);
+    assert(pthread_join(shutdown_thread, NULL) == 0);
+    assert(shutdown_result == 0);
+
+    /* the server exits */
+    for (tries = 0; access(argv[2], F_OK) == 0; tries++) {
+        assert(tries < TRIES);
+        nanosleep(&pause, NULL);
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
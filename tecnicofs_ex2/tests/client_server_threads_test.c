@@ -0,0 +1,80 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Drives the server from several threads of one client process: two
+    sessions are mounted, and each is shared by two threads working on
+    their own files. */
+
+#define SESSIONS (2)
+#define THREADS_PER_SESSION (2)
+#define ROUNDS (50)
+
+typedef struct {
+    tfs_client_t *client;
+    int id;
+} thread_arg_t;
+
+void *fn_thread(void *arg) {
+    thread_arg_t *t = (thread_arg_t *)arg;
+    char path[16];
+    char str[16];
+    char buffer[16];
+
+    snprintf(path, sizeof(path), "/t%d", t->id);
+    for (int round = 0; round < ROUNDS; round++) {
+        snprintf(str, sizeof(str), "t%d-r%d", t->id, round);
+
+        int f = tfs_client_open(t->client, path, TFS_O_CREAT | TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_client_write(t->client, f, str, strlen(str)) == strlen(str));
+        assert(tfs_client_close(t->client, f) != -1);
+
+        f = tfs_client_open(t->client, path, 0);
+        assert(f != -1);
+        ssize_t r = tfs_client_read(t->client, f, buffer, sizeof(buffer) - 1);
+        assert(r == strlen(str));
+        buffer[r] = '\0';
+        assert(strcmp(buffer, str) == 0);
+        assert(tfs_client_close(t->client, f) != -1);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    tfs_client_t *clients[SESSIONS];
+    pthread_t threads[SESSIONS * THREADS_PER_SESSION];
+    thread_arg_t args[SESSIONS * THREADS_PER_SESSION];
+    char client_pipe[40];
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+
+    for (int s = 0; s < SESSIONS; s++) {
+        snprintf(client_pipe, sizeof(client_pipe), "%s.%d", argv[1], s);
+        clients[s] = tfs_client_mount(client_pipe, argv[2]);
+        assert(clients[s] != NULL);
+    }
+
+    for (int i = 0; i < SESSIONS * THREADS_PER_SESSION; i++) {
+        args[i].client = clients[i % SESSIONS];
+        args[i].id = i;
+        assert(pthread_create(&threads[i], NULL, fn_thread, &args[i]) == 0);
+    }
+    for (int i = 0; i < SESSIONS * THREADS_PER_SESSION; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    for (int s = 0; s < SESSIONS; s++) {
+        assert(tfs_client_unmount(clients[s]) == 0);
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
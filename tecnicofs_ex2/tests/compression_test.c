@@ -0,0 +1,141 @@
+#include "fs/block_cache.h"
+#include "fs/codec.h"
+#include "fs/metrics.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Stores more text than the compressed store could hold uncompressed, and
+    reads it back through the block cache; data that does not compress
+    fills the store, and writes then fail without damaging what was there.
+    Note: This test uses TecnicoFS as a library. */
+
+#define TEXT_BLOCKS (150)
+#define STORE_SIZE (64 * BLOCK_SIZE)
+
+static char block[BLOCK_SIZE];
+static char buffer[BLOCK_SIZE];
+static char packed[BLOCK_SIZE];
+
+static void text_block(size_t i) {
+    size_t used = 0;
+    for (size_t line = 0; used < sizeof(block); line++) {
+        char text[64];
+        int n = snprintf(text, sizeof(text), "block %zu, line %zu: the quick brown fox\n", i, line);
+        size_t len = (size_t)n < sizeof(block) - used ? (size_t)n : sizeof(block) - used;
+        memcpy(block + used, text, len);
+        used += len;
+    }
+}
+
+static void random_block(uint64_t *state) {
+    for (size_t i = 0; i < sizeof(block); i++) {
+        *state ^= *state << 13;
+        *state ^= *state >> 7;
+        *state ^= *state << 17;
+        block[i] = (char)*state;
+    }
+}
+
+static void round_trip(size_t len) {
+    size_t clen = codec_compress(block, len, packed, sizeof(packed));
+    if (clen > 0) {
+        memset(buffer, 0, sizeof(buffer));
+        assert(codec_decompress(packed, clen, buffer, len) == 0);
+        assert(memcmp(buffer, block, len) == 0);
+        /* an input not expanding to the expected length is rejected */
+        assert(codec_decompress(packed, clen, buffer, len - 1) == -1);
+    }
+}
+
+static void assert_text(int f) {
+    assert(tfs_seek(f, 0) != -1);
+    for (size_t i = 0; i < TEXT_BLOCKS; i++) {
+        text_block(i);
+        assert(tfs_read(f, buffer, sizeof(buffer)) == BLOCK_SIZE);
+        assert(memcmp(buffer, block, sizeof(block)) == 0);
+    }
+}
+
+int main() {
+    /* the codec itself */
+    uint64_t state = 88172645463325252ULL;
+    text_block(7);
+    round_trip(sizeof(block));
+    assert(codec_compress(block, sizeof(block), packed, sizeof(packed)) < sizeof(block) / 2);
+    memset(block, 'z', sizeof(block));
+    round_trip(sizeof(block));
+    round_trip(3);
+    random_block(&state);
+    round_trip(sizeof(block));
+    assert(codec_compress(block, sizeof(block), packed, sizeof(block) - 1) == 0);
+
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 4 * TEXT_BLOCKS;
+    params.max_inline_size = 0;
+    params.store_size = STORE_SIZE;
+    assert(tfs_init(&params) != -1);
+
+    /* more text than the store holds uncompressed (and than the cache
+     * holds), read back */
+    int f = tfs_open("/text", TFS_O_CREAT);
+    assert(f != -1);
+    for (size_t i = 0; i < TEXT_BLOCKS; i++) {
+        text_block(i);
+        assert(tfs_write(f, block, sizeof(block)) == BLOCK_SIZE);
+    }
+    uint64_t decompressed = metrics_counter(METRIC_BLOCK_DECOMPRESS);
+    assert_text(f);
+    assert(metrics_counter(METRIC_BLOCK_DECOMPRESS) > decompressed);
+    size_t logical, physical;
+    block_cache_usage(&logical, &physical);
+    assert(logical > STORE_SIZE && physical <= STORE_SIZE);
+
+    /* a block read again is served by the cache */
+    assert(tfs_seek(f, 0) != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == BLOCK_SIZE);
+    decompressed = metrics_counter(METRIC_BLOCK_DECOMPRESS);
+    for (int i = 0; i < 8; i++) {
+        assert(tfs_seek(f, 0) != -1);
+        assert(tfs_read(f, buffer, sizeof(buffer)) == BLOCK_SIZE);
+    }
+    assert(metrics_counter(METRIC_BLOCK_DECOMPRESS) == decompressed);
+
+    /* random data fills the store: writes fail, the text is intact */
+    int g = tfs_open("/random", TFS_O_CREAT);
+    assert(g != -1);
+    size_t written = 0;
+    ssize_t w;
+    do {
+        random_block(&state);
+        w = tfs_write(g, block, sizeof(block));
+        written += w > 0 ? (size_t)w : 0;
+    } while (w == BLOCK_SIZE);
+    assert(written < state_max_file_size());
+    assert_text(f);
+
+    /* unlinking frees its segments */
+    assert(tfs_close(g) != -1);
+    assert(tfs_unlink("/random") != -1);
+    g = tfs_open("/more", TFS_O_CREAT);
+    assert(g != -1);
+    text_block(TEXT_BLOCKS);
+    for (int i = 0; i < 16; i++) {
+        assert(tfs_write(g, block, sizeof(block)) == BLOCK_SIZE);
+    }
+    assert(tfs_close(g) != -1);
+    assert_text(f);
+    assert(tfs_close(f) != -1);
+
+    fsck_report_t report;
+    assert(tfs_fsck(&report) != -1);
+    assert(report.orphan_blocks == 0 && report.lost_blocks == 0 && report.damaged_inodes == 0);
+    assert(report.bad_refcounts == 0);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
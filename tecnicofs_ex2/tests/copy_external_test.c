@@ -0,0 +1,49 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*  Copies a file out of TecnicoFS and back in, checking the contents on
+    both sides. Note: This test uses TecnicoFS as a library. */
+
+int main() {
+    char *str = "Hello, external world!";
+    char *path = "/f1";
+    char *path2 = "/f2";
+    char *external = "/tmp/tfs_copy_external_test";
+    char buffer[64];
+
+    assert(tfs_init(NULL) != -1);
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, str, strlen(str)) == strlen(str));
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_copy_to_external_fs(path, external) != -1);
+    FILE *fp = fopen(external, "r");
+    assert(fp != NULL);
+    size_t r = fread(buffer, 1, sizeof(buffer), fp);
+    assert(r == strlen(str));
+    assert(memcmp(buffer, str, r) == 0);
+    fclose(fp);
+
+    assert(tfs_copy_from_external_fs(external, path2) != -1);
+    f = tfs_open(path2, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == strlen(str));
+    assert(memcmp(buffer, str, strlen(str)) == 0);
+    assert(tfs_close(f) != -1);
+
+    /* missing source files */
+    assert(tfs_copy_to_external_fs("/missing", external) == -1);
+    assert(tfs_copy_from_external_fs("/tmp/tfs_missing_external_file", path2) == -1);
+
+    unlink(external);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,130 @@
+#include "fs/metrics.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Writes the same block to several files with deduplication on and off:
+    with it, they share one block, which is copied when one of them changes
+    it and freed with the last file; a freed block is never shared again
+    for its old contents. Note: This test uses TecnicoFS as a library. */
+
+#define BLOCKS (16)
+#define FILES (6)
+
+static char block[BLOCK_SIZE];
+static char other[BLOCK_SIZE];
+static char buffer[BLOCK_SIZE];
+
+/*
+ * Returns how many blocks can still be allocated (and frees them again).
+ */
+static int free_blocks() {
+    int taken[BLOCKS];
+    int n = 0;
+    while (n < BLOCKS && (taken[n] = data_block_alloc()) != -1) {
+        n++;
+    }
+    for (int i = 0; i < n; i++) {
+        assert(data_block_free(taken[i]) != -1);
+    }
+    return n;
+}
+
+static void write_file(char const *path, char const *data) {
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, data, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(tfs_close(f) != -1);
+}
+
+static void assert_contents(char const *path, char const *data) {
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == BLOCK_SIZE);
+    assert(memcmp(buffer, data, BLOCK_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+static void write_files(char const *data) {
+    char path[MAX_FILE_NAME];
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "/f%d", i);
+        write_file(path, data);
+    }
+}
+
+int main() {
+    memset(block, 'd', sizeof(block));
+    memset(other, 'o', sizeof(other));
+
+    /* without deduplication, every file takes a block */
+    tfs_params params = tfs_default_params();
+    params.max_block_count = BLOCKS;
+    params.max_inline_size = 0;
+    assert(tfs_init(&params) != -1);
+    write_files(block);
+    assert(free_blocks() == BLOCKS - 1 - FILES);
+    assert(tfs_destroy() != -1);
+
+    /* with it, they share one */
+    params.dedup = true;
+    assert(tfs_init(&params) != -1);
+    uint64_t hits = metrics_counter(METRIC_DEDUP_HIT);
+    uint64_t stores = metrics_counter(METRIC_DEDUP_STORE);
+    write_files(block);
+    assert(free_blocks() == BLOCKS - 2);
+    assert(metrics_counter(METRIC_DEDUP_HIT) == hits + FILES - 1);
+    assert(metrics_counter(METRIC_DEDUP_STORE) == stores + 1);
+    assert_contents("/f0", block);
+    assert_contents("/f5", block);
+
+    /* changing one file copies the block for it alone */
+    int f = tfs_open("/f0", 0);
+    assert(f != -1);
+    assert(tfs_write(f, "changed", 7) == 7);
+    assert(tfs_close(f) != -1);
+    assert(free_blocks() == BLOCKS - 3);
+    assert_contents("/f1", block);
+    f = tfs_open("/f0", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == BLOCK_SIZE);
+    assert(memcmp(buffer, "changed", 7) == 0 && memcmp(buffer + 7, block + 7, BLOCK_SIZE - 7) == 0);
+    assert(tfs_close(f) != -1);
+
+    /* writing the shared contents back shares the block again */
+    write_file("/f0", block);
+    assert(free_blocks() == BLOCKS - 2);
+
+    fsck_report_t report;
+    assert(tfs_fsck(&report) != -1);
+    assert(report.orphan_blocks == 0 && report.lost_blocks == 0 && report.damaged_inodes == 0);
+    assert(report.bad_refcounts == 0);
+
+    /* the block is freed with the last file, and reused for other contents
+     * without being shared for its old ones */
+    char path[MAX_FILE_NAME];
+    for (int i = 0; i < FILES - 1; i++) {
+        snprintf(path, sizeof(path), "/f%d", i);
+        assert(tfs_unlink(path) != -1);
+    }
+    assert(free_blocks() == BLOCKS - 2);
+    assert(tfs_unlink("/f5") != -1);
+    assert(free_blocks() == BLOCKS - 1);
+    for (int i = 0; i < BLOCKS - 1; i++) {
+        snprintf(path, sizeof(path), "/o%d", i % 4);
+        other[0] = (char)i; /* distinct contents, taking every block */
+        write_file(path, other);
+    }
+    write_file("/again", block);
+    assert_contents("/again", block);
+    assert(free_blocks() == BLOCKS - 6);
+
+    assert(tfs_fsck(&report) != -1);
+    assert(report.orphan_blocks == 0 && report.lost_blocks == 0 && report.bad_refcounts == 0);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include "fs/fingerprint.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Fills a large directory with names sharing long prefixes and looks them
+    up through the name fingerprints, as files are unlinked, renamed and
+    created again, and after the directory is rebuilt by a check.
+    Note: This test uses TecnicoFS as a library. */
+
+#define FILES (300)
+
+static void name_of(char *path, size_t len, int i) {
+    snprintf(path, len, "/a_rather_long_common_prefix_%05d", i);
+}
+
+static void assert_names(int first, int last, bool present) {
+    char path[MAX_FILE_NAME];
+    for (int i = first; i < last; i++) {
+        name_of(path, sizeof(path), i);
+        assert((tfs_lookup(path) != -1) == present);
+    }
+}
+
+int main() {
+    uint32_t prints[2 * FINGERPRINT_LANES] = {0};
+    /* matches are found from any index on, in the array only */
+    prints[3] = prints[9] = name_fingerprint("x");
+    assert(name_fingerprint("x") != 0 && name_fingerprint("") != 0);
+    assert(name_fingerprint("x") != name_fingerprint("y"));
+    assert(fingerprint_find(prints, 10, name_fingerprint("x"), 0) == 3);
+    assert(fingerprint_find(prints, 10, name_fingerprint("x"), 4) == 9);
+    assert(fingerprint_find(prints, 9, name_fingerprint("x"), 4) == -1);
+    assert(fingerprint_find(prints, 10, name_fingerprint("y"), 0) == -1);
+
+    tfs_params params = tfs_default_params();
+    params.block_size = 16 * 1024; /* room for FILES entries */
+    params.max_inode_count = FILES + 2;
+    assert(tfs_init(&params) != -1);
+
+    char path[MAX_FILE_NAME];
+    for (int i = 0; i < FILES; i++) {
+        name_of(path, sizeof(path), i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+    assert_names(0, FILES, true);
+    assert_names(FILES, 2 * FILES, false);
+    assert(tfs_lookup("/a_rather_long_common_prefix_") == -1);
+
+    /* unlinked and renamed entries are no longer found by their names */
+    for (int i = 0; i < FILES; i += 2) {
+        name_of(path, sizeof(path), i);
+        assert(tfs_unlink(path) != -1);
+    }
+    for (int i = 1; i < FILES; i += 4) {
+        char new_path[MAX_FILE_NAME];
+        name_of(path, sizeof(path), i);
+        name_of(new_path, sizeof(new_path), FILES + i);
+        assert(tfs_rename(path, new_path) != -1);
+    }
+    for (int i = 0; i < FILES; i++) {
+        name_of(path, sizeof(path), i);
+        assert((tfs_lookup(path) != -1) == (i % 4 == 3));
+        name_of(path, sizeof(path), FILES + i);
+        assert((tfs_lookup(path) != -1) == (i % 4 == 1));
+    }
+
+    /* freed entries are reused, and the check keeps the fingerprints */
+    for (int i = 0; i < FILES; i += 2) {
+        name_of(path, sizeof(path), i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+    fsck_report_t report;
+    assert(tfs_fsck(&report) != -1);
+    assert(report.dangling_entries == 0 && report.orphan_inodes == 0);
+    for (int i = 0; i < FILES; i++) {
+        name_of(path, sizeof(path), i);
+        assert((tfs_lookup(path) != -1) == (i % 4 != 1));
+    }
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Breaks the FS state in several ways through the state API, checks that
+    tfs_fsck finds and repairs each of them, and that churn (whose block
+    frees are deferred to the reclaimer) does not shrink the free pool.
+    Note: This test uses TecnicoFS as a library. */
+
+static int create_with_data(char const *path) {
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, "x", 1) == 1);
+    assert(tfs_close(f) != -1);
+    return tfs_lookup(path);
+}
+
+int main() {
+    fsck_report_t report;
+
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 8;
+    params.max_inode_count = 8;
+    params.max_inline_size = 0; /* every file takes a block */
+    assert(tfs_init(&params) != -1);
+
+    int a = create_with_data("/a");
+    int c = create_with_data("/c");
+
+    /* a block nobody points to */
+    assert(data_block_alloc() != -1);
+    /* i-nodes not named by the directory (one of them with a block) */
+    assert(inode_create(T_FILE) != -1);
+    int orphan = inode_create(T_FILE);
+    assert(orphan != -1);
+    inode_get(orphan)->i_data_blocks[0] = data_block_alloc();
+    inode_get(orphan)->i_block_count = 1;
+    inode_get(orphan)->i_size = 1;
+    /* two files sharing a block */
+    int d = tfs_open("/d", TFS_O_CREAT);
+    assert(d != -1);
+    assert(tfs_close(d) != -1);
+    d = tfs_lookup("/d");
+    inode_get(d)->i_data_blocks[0] = inode_get(c)->i_data_blocks[0];
+    inode_get(d)->i_block_count = 1;
+    inode_get(d)->i_size = 1;
+    /* a directory entry naming a deleted i-node */
+    int b = create_with_data("/b");
+    assert(inode_delete(b) != -1);
+
+    assert(tfs_fsck(&report) != -1);
+    assert(report.orphan_blocks == 2);
+    assert(report.orphan_inodes == 2);
+    assert(report.dangling_entries == 1);
+    assert(report.damaged_inodes == 1);
+    assert(report.lost_blocks == 0);
+    assert(tfs_lookup("/b") == -1);
+
+    assert(tfs_fsck(&report) != -1);
+    assert(report.orphan_blocks + report.orphan_inodes + report.dangling_entries + report.damaged_inodes +
+               report.lost_blocks ==
+           0);
+
+    /* churn: every round frees a block and allocates another */
+    for (int i = 0; i < 10000; i++) {
+        assert(create_with_data("/a") == a);
+    }
+
+    /* root, /a and /c hold blocks: every other block can be used */
+    char path[MAX_FILE_NAME];
+    for (int i = 0; i < 4; i++) {
+        snprintf(path, sizeof(path), "/new%d", i);
+        create_with_data(path);
+    }
+    assert(data_block_alloc() != -1);
+    assert(data_block_alloc() == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,63 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Initializes TecnicoFS with non-default geometries and checks that the
+    limits follow them. Note: This test uses TecnicoFS as a library. */
+
+int main() {
+    static char data[4096];
+    static char buffer[4096];
+    memset(data, 'g', sizeof(data));
+
+    /* invalid geometries are refused */
+    tfs_params params = tfs_default_params();
+    params.block_size = 0;
+    assert(tfs_init(&params) == -1);
+    params = tfs_default_params();
+    params.max_inode_count = 0;
+    assert(tfs_init(&params) == -1);
+
+    /* 4 KiB blocks, room for the root directory and two blocks of files */
+    params = tfs_default_params();
+    params.block_size = 4096;
+    params.max_block_count = 3;
+    params.max_inode_count = 3;
+    params.max_open_files_count = 2;
+    assert(tfs_init(&params) != -1);
+
+    int f1 = tfs_open("/f1", TFS_O_CREAT);
+    int f2 = tfs_open("/f2", TFS_O_CREAT);
+    assert(f1 != -1 && f2 != -1);
+    assert(tfs_open("/f1", 0) == -1); /* open file table full */
+    assert(tfs_write(f1, data, sizeof(data)) == sizeof(data));
+    assert(tfs_write(f1, data, sizeof(data)) == sizeof(data)); /* second block */
+    assert(tfs_write(f1, data, 1) == -1); /* no free block */
+    assert(tfs_close(f1) != -1);
+    assert(tfs_open("/f3", TFS_O_CREAT) == -1); /* i-node table full */
+
+    f1 = tfs_open("/f1", 0);
+    assert(f1 != -1);
+    assert(tfs_read(f1, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(buffer, data, sizeof(data)) == 0);
+    assert(tfs_close(f1) != -1);
+    assert(tfs_close(f2) != -1);
+    assert(tfs_destroy() != -1);
+
+    /* a larger volume (64 MiB, backed by huge pages where available) */
+    params = tfs_default_params();
+    params.block_size = 4096;
+    params.max_block_count = 16 * 1024;
+    params.max_inode_count = 100 * 1000;
+    assert(tfs_init(&params) != -1);
+    f1 = tfs_open("/big", TFS_O_CREAT);
+    assert(f1 != -1);
+    assert(tfs_write(f1, data, sizeof(data)) == sizeof(data));
+    assert(tfs_close(f1) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
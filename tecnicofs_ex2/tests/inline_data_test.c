@@ -0,0 +1,76 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Checks that small files are kept inside their i-nodes, taking no data
+    block, and that they move to a block when they grow past the inline
+    size. Note: This test uses TecnicoFS as a library. */
+
+#define FILES (8)
+
+int main() {
+    char path[MAX_FILE_NAME];
+    char data[300];
+    char buffer[300];
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (char)('a' + i % 26);
+    }
+
+    /* only the root directory's block and one more */
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 2;
+    params.max_inline_size = 128;
+    assert(tfs_init(&params) != -1);
+
+    /* more small files than there are blocks */
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "/small%d", i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, data, 100) == 100);
+        assert(tfs_write(f, data + 100, 28) == 28); /* exactly the inline size */
+        assert(tfs_close(f) != -1);
+    }
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "/small%d", i);
+        int f = tfs_open(path, 0);
+        assert(f != -1);
+        assert(tfs_read(f, buffer, sizeof(buffer)) == 128);
+        assert(memcmp(buffer, data, 128) == 0);
+        assert(tfs_close(f) != -1);
+    }
+
+    /* growing past the inline size moves the contents to the last block */
+    int f = tfs_open("/small0", TFS_O_APPEND);
+    assert(f != -1);
+    assert(tfs_write(f, data + 128, 172) == 172);
+    assert(tfs_close(f) != -1);
+    f = tfs_open("/small1", TFS_O_APPEND);
+    assert(f != -1);
+    assert(tfs_write(f, data + 128, 1) == -1); /* no block left */
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open("/small0", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 300);
+    assert(memcmp(buffer, data, 300) == 0);
+    assert(tfs_close(f) != -1);
+
+    /* truncating gives the block back and the file is inline again */
+    f = tfs_open("/small0", TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, data, 10) == 10);
+    assert(tfs_close(f) != -1);
+    f = tfs_open("/small1", TFS_O_APPEND);
+    assert(f != -1);
+    assert(tfs_write(f, data + 128, 172) == 172);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -35,7 +35,7 @@ void *fn_thread(void *arg) {
 
 int main() {
 
-    assert(tfs_init() != -1);
+    assert(tfs_init(NULL) != -1);
 
     pthread_t t;
     f = tfs_open("/f1", TFS_O_CREAT);
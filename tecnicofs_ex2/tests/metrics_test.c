@@ -0,0 +1,68 @@
+#include "fs/metrics.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Checks the accuracy of the latency histograms and that counters and
+    histograms updated concurrently by several threads add up. */
+
+#define THREADS (4)
+#define SAMPLES (100000)
+
+void *fn_thread(void *arg) {
+    (void)arg;
+    for (uint64_t i = 1; i <= SAMPLES; i++) {
+        metrics_record(1, METRICS_EXEC, i * 10);
+        metrics_count(METRIC_BLOCK_ALLOC, 1);
+    }
+    return NULL;
+}
+
+static void assert_close(uint64_t value, uint64_t expected) {
+    /* relative error is bounded by the sub-bucket resolution */
+    uint64_t error = value > expected ? value - expected : expected - value;
+    assert(error * METRICS_SUB_BUCKETS <= expected);
+}
+
+int main() {
+    pthread_t threads[THREADS];
+    char report[4096];
+
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_create(&threads[i], NULL, fn_thread, NULL) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    assert(metrics_counter(METRIC_BLOCK_ALLOC) == THREADS * SAMPLES);
+    assert(metrics_samples(1, METRICS_EXEC) == THREADS * SAMPLES);
+    assert(metrics_samples(1, METRICS_REPLY) == 0);
+
+    /* uniform over [10, 10 * SAMPLES] */
+    assert_close(metrics_percentile(1, METRICS_EXEC, 0.5), SAMPLES * 10 / 2);
+    assert_close(metrics_percentile(1, METRICS_EXEC, 0.99), SAMPLES * 10 * 99 / 100);
+    assert(metrics_percentile(2, METRICS_EXEC, 0.5) == 0);
+
+    /* small values are exact, huge ones are clamped */
+    metrics_record(3, METRICS_REPLY, 5);
+    assert(metrics_percentile(3, METRICS_REPLY, 0.5) == 5);
+    metrics_record(4, METRICS_REPLY, UINT64_MAX);
+    assert(metrics_percentile(4, METRICS_REPLY, 0.5) > 0);
+
+    char const *names[METRICS_OPS] = {[1] = "one"};
+    size_t len = metrics_report(report, sizeof(report), names);
+    assert(len == strlen(report));
+    assert(strstr(report, "block_alloc 400000\n") != NULL);
+    assert(strstr(report, "one exec n=400000") != NULL);
+    assert(strstr(report, "op3 reply n=1") != NULL);
+
+    /* truncation keeps the buffer terminated */
+    assert(metrics_report(report, 16, names) == 15);
+    assert(strlen(report) == 15);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Several threads repeatedly recreate, write and read back files of their
+    own (reads and writes only hold the file's i-node lock, and blocks come
+    from per-CPU caches), then one thread fills the whole FS to check that
+    no block is stranded in a cache. Note: This test uses TecnicoFS as a
+    library. */
+
+#define THREADS (4)
+#define ROUNDS (2000)
+
+void *fn_thread(void *arg) {
+    int id = *(int *)arg;
+    char path[MAX_FILE_NAME];
+    char data[100];
+    char buffer[100];
+
+    snprintf(path, sizeof(path), "/t%d", id);
+    for (int round = 0; round < ROUNDS; round++) {
+        memset(data, 'a' + (id + round) % 26, sizeof(data));
+        int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_write(f, data, sizeof(data)) == sizeof(data));
+        assert(tfs_close(f) != -1);
+
+        f = tfs_open(path, 0);
+        assert(f != -1);
+        assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+        assert(memcmp(buffer, data, sizeof(data)) == 0);
+        assert(tfs_close(f) != -1);
+    }
+    return NULL;
+}
+
+int main() {
+    pthread_t tid[THREADS];
+    int ids[THREADS];
+
+    tfs_params params = tfs_default_params();
+    params.max_inline_size = 0; /* every file takes a block */
+    params.max_block_count = 1 + THREADS + 8;
+    params.max_inode_count = 1 + THREADS + 8;
+    assert(tfs_init(&params) != -1);
+
+    for (int i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tid[i], NULL, fn_thread, &ids[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    /* every block not used by the root and the threads' files is free */
+    char path[MAX_FILE_NAME];
+    char data[1] = {'x'};
+    for (int i = 0; i < 8; i++) {
+        snprintf(path, sizeof(path), "/fill%d", i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, data, sizeof(data)) == sizeof(data));
+        assert(tfs_close(f) != -1);
+    }
+    assert(tfs_open("/one_too_many", TFS_O_CREAT) == -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include "fs/metrics.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+/*  Locks ranges of a file through several handles: shared locks overlap,
+    exclusive ones do not (but for the same handle), a lock waits for those
+    in its way and behind the conflicting ones requested before it, and a
+    handle closed releases its locks and cancels its requests.
+    Note: This test uses TecnicoFS as a library. */
+
+static atomic_int locked;
+
+static void *lock_exclusive(void *arg) {
+    int fhandle = *(int *)arg;
+    assert(tfs_lock(fhandle, 0, 100, TFS_LOCK_EXCLUSIVE) == 0);
+    atomic_store(&locked, 1);
+    return NULL;
+}
+
+/* results of tfs_lock_async's callbacks, -2 until called */
+static int results[2] = {-2, -2};
+
+static void granted(int result, void *arg) { *(int *)arg = result; }
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+    int f = tfs_open("/locked", TFS_O_CREAT);
+    int g = tfs_open("/locked", 0);
+    int h = tfs_open("/locked", 0);
+    assert(f != -1 && g != -1 && h != -1);
+
+    /* shared locks overlap; an exclusive one conflicts with those of other
+     * handles only */
+    assert(tfs_lock(f, 0, 100, TFS_LOCK_SHARED) == 0);
+    assert(tfs_lock(g, 50, 100, TFS_LOCK_SHARED) == 0);
+    assert(tfs_lock(g, 0, 10, TFS_LOCK_EXCLUSIVE | TFS_LOCK_NOWAIT) == -1);
+    assert(tfs_lock(f, 0, 10, TFS_LOCK_EXCLUSIVE | TFS_LOCK_NOWAIT) == 0);
+    assert(tfs_lock(g, 200, 100, TFS_LOCK_EXCLUSIVE | TFS_LOCK_NOWAIT) == 0);
+    assert(tfs_lock(h, 150, 60, TFS_LOCK_SHARED | TFS_LOCK_NOWAIT) == -1);
+    assert(tfs_lock(h, 150, 50, TFS_LOCK_SHARED | TFS_LOCK_NOWAIT) == 0);
+
+    /* a lock is released as locked */
+    assert(tfs_unlock(f, 0, 100) != -1);
+    assert(tfs_unlock(f, 0, 10) != -1);
+    assert(tfs_unlock(f, 0, 10) == -1);
+    assert(tfs_unlock(g, 200, 50) == -1);
+    assert(tfs_unlock(g, 200, 100) != -1);
+    assert(tfs_unlock(h, 150, 50) != -1);
+    assert(tfs_unlock(-1, 0, 10) == -1);
+
+    /* a length of 0 locks every byte from the offset on */
+    assert(tfs_lock(f, 1000, 0, TFS_LOCK_EXCLUSIVE) == 0);
+    assert(tfs_lock(h, (size_t)1 << 40, 1, TFS_LOCK_SHARED | TFS_LOCK_NOWAIT) == -1);
+    assert(tfs_lock(h, 900, 100, TFS_LOCK_SHARED | TFS_LOCK_NOWAIT) == 0);
+    assert(tfs_unlock(f, 1000, 0) != -1);
+    assert(tfs_unlock(h, 900, 100) != -1);
+
+    /* a lock in conflict waits until what was in its way is released */
+    uint64_t parked = metrics_counter(METRIC_RANGE_LOCK_PARK);
+    assert(tfs_lock(f, 0, 100, TFS_LOCK_SHARED) == 0);
+    pthread_t waiter;
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 10 * 1000 * 1000};
+    assert(pthread_create(&waiter, NULL, lock_exclusive, &g) == 0);
+    while (metrics_counter(METRIC_RANGE_LOCK_PARK) == parked) {
+        nanosleep(&pause, NULL);
+    }
+    nanosleep(&pause, NULL);
+    assert(atomic_load(&locked) == 0);
+    assert(tfs_unlock(f, 0, 100) != -1);
+    assert(pthread_join(waiter, NULL) == 0);
+    assert(atomic_load(&locked) == 1);
+    assert(tfs_unlock(g, 50, 100) != -1);
+    assert(tfs_unlock(g, 0, 100) != -1);
+
+    /* and requests are granted in order: a shared lock does not overtake
+     * an exclusive one waiting for the same bytes */
+    assert(tfs_lock(g, 0, 100, TFS_LOCK_SHARED) == 0);
+    assert(tfs_lock_async(f, 50, 10, TFS_LOCK_EXCLUSIVE, granted, &results[0]) == 1);
+    assert(tfs_lock(h, 55, 10, TFS_LOCK_SHARED | TFS_LOCK_NOWAIT) == -1);
+    assert(tfs_lock(h, 90, 10, TFS_LOCK_SHARED | TFS_LOCK_NOWAIT) == 0);
+    assert(results[0] == -2);
+    assert(tfs_unlock(g, 0, 100) != -1);
+    assert(results[0] == 0);
+    assert(tfs_unlock(f, 50, 10) != -1);
+    assert(tfs_unlock(h, 90, 10) != -1);
+
+    /* closing a handle releases its locks and cancels its requests */
+    assert(tfs_lock(f, 0, 0, TFS_LOCK_EXCLUSIVE) == 0);
+    results[0] = -2;
+    assert(tfs_lock_async(g, 0, 10, TFS_LOCK_SHARED, granted, &results[0]) == 1);
+    assert(tfs_lock_async(h, 20, 10, TFS_LOCK_SHARED, granted, &results[1]) == 1);
+    assert(tfs_close(h) != -1);
+    assert(results[1] == -1);
+    assert(tfs_close(f) != -1);
+    assert(results[0] == 0);
+    assert(tfs_lock(f, 0, 10, TFS_LOCK_SHARED) == -1);
+    assert(tfs_unlock(f, 0, 10) == -1);
+    assert(tfs_close(g) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,103 @@
+#include "fs/config.h"
+#include "fs/metrics.h"
+#include "fs/scheduler.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+/*  Runs sessions through a scheduler with a single slot: an interactive
+    session is let in before a batch one, a session sending small requests
+    is not held back by one sending large ones, and a rate limit spaces the
+    requests of a session out. */
+
+#define SMALL_REQUESTS (16)
+#define LARGE_REQUESTS (8)
+#define RATE (100 * 1000)
+
+typedef struct {
+    unsigned int session;
+    size_t cost;
+    int requests;
+    int done_at; /* requests served (of every session) until its last one */
+} session_arg_t;
+
+static atomic_int served;
+
+static void *fn_session(void *arg) {
+    session_arg_t *s = arg;
+    for (int i = 0; i < s->requests; i++) {
+        scheduler_acquire(s->session, s->cost);
+        s->done_at = ++served;
+        scheduler_release(s->session, i + 1 < s->requests ? s->cost : 0);
+    }
+    return NULL;
+}
+
+/*
+ * Waits until some other thread has queued up behind the slot held.
+ */
+static void settle() {
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 50 * 1000 * 1000};
+    nanosleep(&pause, NULL);
+}
+
+int main() {
+    pthread_t threads[2];
+    assert(scheduler_init(4, 1) != -1);
+
+    /* classes: with the slot taken, a batch request waits behind an
+     * interactive one that arrived later */
+    tfs_session_options_t batch = {.service_class = TFS_CLASS_BATCH, .weight = 1};
+    tfs_session_options_t interactive = {.service_class = TFS_CLASS_INTERACTIVE, .weight = 1};
+    scheduler_configure(1, &batch);
+    scheduler_configure(2, &interactive);
+    session_arg_t args[2] = {{.session = 1, .cost = SCHED_REQUEST_COST, .requests = 1},
+                             {.session = 2, .cost = SCHED_REQUEST_COST, .requests = 1}};
+    scheduler_acquire(0, SCHED_REQUEST_COST);
+    assert(pthread_create(&threads[0], NULL, fn_session, &args[0]) == 0);
+    settle();
+    assert(pthread_create(&threads[1], NULL, fn_session, &args[1]) == 0);
+    settle();
+    scheduler_release(0, 0);
+    for (int i = 0; i < 2; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    assert(args[1].done_at == 1 && args[0].done_at == 2);
+
+    /* deficit round robin: the small requests go in between the large
+     * ones, not after them */
+    tfs_session_options_t normal = {.service_class = TFS_CLASS_NORMAL, .weight = 1};
+    scheduler_configure(1, &normal);
+    scheduler_configure(2, &normal);
+    served = 0;
+    args[0] = (session_arg_t){.session = 1, .cost = 8 * SCHED_QUANTUM, .requests = LARGE_REQUESTS};
+    args[1] = (session_arg_t){.session = 2, .cost = SCHED_QUANTUM / 2, .requests = SMALL_REQUESTS};
+    scheduler_acquire(0, SCHED_REQUEST_COST);
+    for (int i = 0; i < 2; i++) {
+        assert(pthread_create(&threads[i], NULL, fn_session, &args[i]) == 0);
+    }
+    settle();
+    scheduler_release(0, 0);
+    for (int i = 0; i < 2; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    assert(args[1].done_at <= SMALL_REQUESTS + 3);
+
+    /* a rate limit: a second's worth goes at once, and the rest at the
+     * rate */
+    tfs_session_options_t limited = {.service_class = TFS_CLASS_NORMAL, .weight = 1, .rate = RATE};
+    scheduler_configure(3, &limited);
+    session_arg_t limited_arg = {.session = 3, .cost = RATE / 2, .requests = 5};
+    uint64_t start = metrics_now();
+    fn_session(&limited_arg);
+    uint64_t elapsed = metrics_now() - start;
+    assert(elapsed >= 900 * 1000 * 1000ULL && elapsed < 3 * 1000 * 1000 * 1000ULL);
+
+    scheduler_destroy();
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,136 @@
+#include "fs/metrics.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Takes a snapshot and keeps changing the FS: the snapshot keeps the old
+    contents, blocks are only copied when first written after it, and the
+    blocks only the snapshot uses are freed with it. Also exports it as an
+    image and checks it with tfs_fsck. Note: This test uses TecnicoFS as a
+    library. */
+
+#define BLOCKS (16)
+#define IMAGE_PATH "/tmp/tfs_snapshot_test.img"
+
+static char block[BLOCK_SIZE];
+static char buffer[2 * BLOCK_SIZE];
+
+/*
+ * Returns how many blocks can still be allocated (and frees them again).
+ */
+static int free_blocks() {
+    int taken[BLOCKS];
+    int n = 0;
+    while (n < BLOCKS && (taken[n] = data_block_alloc()) != -1) {
+        n++;
+    }
+    for (int i = 0; i < n; i++) {
+        assert(data_block_free(taken[i]) != -1);
+    }
+    return n;
+}
+
+static void assert_clean() {
+    fsck_report_t report;
+    assert(tfs_fsck(&report) != -1);
+    assert(report.orphan_blocks == 0 && report.lost_blocks == 0 && report.orphan_inodes == 0);
+    assert(report.dangling_entries == 0 && report.damaged_inodes == 0 && report.bad_refcounts == 0);
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_block_count = BLOCKS;
+    assert(tfs_init(&params) != -1);
+    assert(tfs_snapshot_release() == -1);
+    assert(tfs_snapshot_read("/a", 0, buffer, sizeof(buffer)) == -1);
+
+    /* a file of two blocks and an inline one */
+    memset(block, 'a', sizeof(block));
+    int f = tfs_open("/a", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, block, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(tfs_write(f, "tail", 4) == 4);
+    int g = tfs_open("/small", TFS_O_CREAT);
+    assert(g != -1);
+    assert(tfs_write(g, "tiny", 4) == 4);
+    assert(tfs_close(g) != -1);
+
+    /* taking the snapshot copies no block */
+    int before = free_blocks();
+    assert(tfs_snapshot() != -1);
+    assert(tfs_snapshot() == -1); /* one at a time */
+    assert(free_blocks() == before);
+
+    /* the first write to a shared block copies it, the next ones do not */
+    uint64_t cow = metrics_counter(METRIC_BLOCK_COW);
+    memset(block, 'b', sizeof(block));
+    assert(tfs_seek(f, 0) != -1);
+    assert(tfs_write(f, block, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(metrics_counter(METRIC_BLOCK_COW) == cow + 1);
+    assert(free_blocks() == before - 1);
+    assert(tfs_seek(f, 0) != -1);
+    assert(tfs_write(f, "bb", 2) == 2);
+    assert(metrics_counter(METRIC_BLOCK_COW) == cow + 1);
+    assert(tfs_seek(f, 0) != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == BLOCK_SIZE + 4);
+    assert(buffer[0] == 'b' && buffer[BLOCK_SIZE - 1] == 'b');
+
+    /* the snapshot still has the old contents */
+    assert(tfs_snapshot_read("/a", 0, buffer, sizeof(buffer)) == BLOCK_SIZE + 4);
+    assert(buffer[0] == 'a' && buffer[BLOCK_SIZE - 1] == 'a');
+    assert(memcmp(buffer + BLOCK_SIZE, "tail", 4) == 0);
+    assert(tfs_snapshot_read("/a", BLOCK_SIZE + 2, buffer, sizeof(buffer)) == 2);
+    assert(tfs_snapshot_read("/a", BLOCK_SIZE + 4, buffer, sizeof(buffer)) == 0);
+
+    /* and outlives truncation, unlinking and new files */
+    assert(tfs_close(f) != -1);
+    assert(tfs_unlink("/a") != -1);
+    g = tfs_open("/small", TFS_O_TRUNC);
+    assert(g != -1);
+    assert(tfs_write(g, "new", 3) == 3);
+    assert(tfs_close(g) != -1);
+    g = tfs_open("/later", TFS_O_CREAT);
+    assert(g != -1);
+    assert(tfs_close(g) != -1);
+    assert(tfs_snapshot_read("/later", 0, buffer, sizeof(buffer)) == -1);
+    assert(tfs_snapshot_read("/small", 0, buffer, sizeof(buffer)) == 4);
+    assert(memcmp(buffer, "tiny", 4) == 0);
+    assert(tfs_snapshot_read("/a", BLOCK_SIZE, buffer, sizeof(buffer)) == 4);
+    assert(memcmp(buffer, "tail", 4) == 0);
+    /* only the copied block was freed with /a (the root directory was
+     * copied when changed) */
+    assert(free_blocks() == before - 1);
+    assert_clean();
+
+    /* the image has a line per file followed by its contents */
+    ssize_t size = tfs_snapshot_export(IMAGE_PATH);
+    char expected[3 * BLOCK_SIZE];
+    int n = snprintf(expected, sizeof(expected), SNAPSHOT_MAGIC "/a %d\n", BLOCK_SIZE + 4);
+    memset(expected + n, 'a', BLOCK_SIZE);
+    n += BLOCK_SIZE;
+    n += snprintf(expected + n, sizeof(expected) - (size_t)n, "tail/small 4\ntiny");
+    assert(size == n);
+    static char image[3 * BLOCK_SIZE];
+    FILE *fp = fopen(IMAGE_PATH, "r");
+    assert(fp != NULL);
+    assert(fread(image, 1, sizeof(image), fp) == (size_t)n);
+    assert(fclose(fp) == 0);
+    assert(memcmp(image, expected, (size_t)n) == 0);
+    remove(IMAGE_PATH);
+
+    /* releasing it frees the blocks only it used */
+    assert(tfs_snapshot_release() != -1);
+    assert(tfs_snapshot_release() == -1);
+    assert(tfs_snapshot_read("/small", 0, buffer, sizeof(buffer)) == -1);
+    assert(free_blocks() == BLOCKS - 1);
+    assert_clean();
+
+    /* a snapshot left behind is released with the FS */
+    assert(tfs_snapshot() != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
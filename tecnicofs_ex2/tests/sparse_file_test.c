@@ -0,0 +1,157 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Writes a file out of order after seeking past its end, checking that
+    the holes read as zeros and take no blocks, then punches holes in it
+    and preallocates ranges, watching the free blocks. Note: This test uses
+    TecnicoFS as a library. */
+
+#define BLOCKS (8)
+
+static char block[BLOCK_SIZE];
+static char buffer[BLOCK_SIZE];
+
+/*
+ * Returns how many blocks can still be allocated (and frees them again).
+ */
+static int free_blocks() {
+    int taken[BLOCKS];
+    int n = 0;
+    while (n < BLOCKS && (taken[n] = data_block_alloc()) != -1) {
+        n++;
+    }
+    for (int i = 0; i < n; i++) {
+        assert(data_block_free(taken[i]) != -1);
+    }
+    return n;
+}
+
+static int is_zero(char const *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_block_count = BLOCKS;
+    assert(tfs_init(&params) != -1);
+    assert(free_blocks() == BLOCKS - 1); /* the root directory's */
+    memset(block, 'z', sizeof(block));
+
+    /* a block near the end of the largest file: the block and the indirect
+     * block naming it are the only ones taken */
+    int f = tfs_open("/sparse", TFS_O_CREAT);
+    assert(f != -1);
+    size_t far = state_max_file_size() - BLOCK_SIZE;
+    assert(tfs_seek(f, far) != -1);
+    assert(tfs_write(f, block, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(tfs_write(f, block, 1) == 0); /* largest file size reached */
+    assert(tfs_seek(f, state_max_file_size() + 1) == -1);
+    assert(free_blocks() == BLOCKS - 3);
+
+    /* then one in the middle, out of order, and a small one at the start */
+    assert(tfs_seek(f, 3 * BLOCK_SIZE + 10) != -1);
+    assert(tfs_write(f, "mid", 3) == 3);
+    assert(tfs_seek(f, 0) != -1);
+    assert(tfs_write(f, "start", 5) == 5);
+    assert(free_blocks() == BLOCKS - 5);
+
+    /* holes read as zeros, around the data */
+    assert(tfs_seek(f, 0) != -1);
+    assert(tfs_read(f, buffer, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(memcmp(buffer, "start", 5) == 0 && is_zero(buffer + 5, BLOCK_SIZE - 5));
+    assert(tfs_read(f, buffer, BLOCK_SIZE) == BLOCK_SIZE && is_zero(buffer, BLOCK_SIZE));
+    assert(tfs_seek(f, 3 * BLOCK_SIZE) != -1);
+    assert(tfs_read(f, buffer, 16) == 16);
+    assert(is_zero(buffer, 10) && memcmp(buffer + 10, "mid", 3) == 0 && is_zero(buffer + 13, 3));
+    assert(tfs_seek(f, far - 4) != -1);
+    assert(tfs_read(f, buffer, 8) == 8);
+    assert(is_zero(buffer, 4) && memcmp(buffer + 4, block, 4) == 0);
+    assert(tfs_read(f, buffer, BLOCK_SIZE) == BLOCK_SIZE - 4);
+    assert(tfs_read(f, buffer, BLOCK_SIZE) == 0);
+
+    /* punching the last block frees it and the indirect block; the size
+     * does not change */
+    assert(tfs_punch_hole(f, far, BLOCK_SIZE) != -1);
+    assert(free_blocks() == BLOCKS - 3);
+    assert(tfs_seek(f, far) != -1);
+    assert(tfs_read(f, buffer, BLOCK_SIZE) == BLOCK_SIZE && is_zero(buffer, BLOCK_SIZE));
+
+    /* part of a block is zeroed, the block is kept */
+    assert(tfs_punch_hole(f, 1, 3) != -1);
+    assert(free_blocks() == BLOCKS - 3);
+    assert(tfs_seek(f, 0) != -1);
+    assert(tfs_read(f, buffer, 5) == 5 && memcmp(buffer, "s\0\0\0t", 5) == 0);
+
+    /* preallocation takes the blocks of the range (only the missing ones)
+     * and extends the file */
+    int g = tfs_open("/pre", TFS_O_CREAT);
+    assert(g != -1);
+    assert(tfs_fallocate(g, 0, 3 * BLOCK_SIZE) != -1);
+    assert(free_blocks() == BLOCKS - 6);
+    assert(tfs_fallocate(g, BLOCK_SIZE, BLOCK_SIZE) != -1);
+    assert(free_blocks() == BLOCKS - 6);
+    assert(tfs_read(g, buffer, BLOCK_SIZE) == BLOCK_SIZE && is_zero(buffer, BLOCK_SIZE));
+    /* no room for the whole range (the blocks taken are kept) */
+    assert(tfs_fallocate(g, 3 * BLOCK_SIZE, 3 * BLOCK_SIZE) == -1);
+    assert(free_blocks() == 0);
+    /* filled out of order without running out of space */
+    for (int i = 2; i >= 0; i--) {
+        assert(tfs_seek(g, (size_t)i * BLOCK_SIZE) != -1);
+        assert(tfs_write(g, block, BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    assert(tfs_close(g) != -1);
+
+    /* a hole punched in an inline file */
+    g = tfs_open("/small", TFS_O_CREAT);
+    assert(g != -1);
+    assert(tfs_write(g, "abcdef", 6) == 6);
+    assert(tfs_punch_hole(g, 2, 2) != -1);
+    assert(tfs_seek(g, 0) != -1);
+    assert(tfs_read(g, buffer, sizeof(buffer)) == 6 && memcmp(buffer, "ab\0\0ef", 6) == 0);
+    assert(tfs_close(g) != -1);
+
+    /* truncation frees every block */
+    assert(tfs_close(f) != -1);
+    f = tfs_open("/sparse", TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_unlink("/pre") != -1);
+
+    /* a file whose blocks were all punched out keeps its first bytes
+     * inline, and they are kept when it gets a block again */
+    f = tfs_open("/regrow", TFS_O_CREAT);
+    assert(f != -1);
+    for (size_t done = 0; done < 5000; done += BLOCK_SIZE) {
+        size_t n = 5000 - done < BLOCK_SIZE ? 5000 - done : BLOCK_SIZE;
+        assert(tfs_write(f, block, n) == (ssize_t)n);
+    }
+    assert(tfs_punch_hole(f, 0, 5000) != -1);
+    assert(free_blocks() == BLOCKS - 1);
+    assert(tfs_seek(f, 0) != -1);
+    assert(tfs_write(f, "abc", 3) == 3);
+    assert(tfs_seek(f, 3000) != -1);
+    assert(tfs_write(f, "x", 1) == 1);
+    assert(tfs_seek(f, 0) != -1);
+    assert(tfs_read(f, buffer, 4) == 4 && memcmp(buffer, "abc\0", 4) == 0);
+    assert(tfs_seek(f, 3000) != -1);
+    assert(tfs_read(f, buffer, 1) == 1 && buffer[0] == 'x');
+    assert(tfs_close(f) != -1);
+    assert(tfs_unlink("/regrow") != -1);
+
+    fsck_report_t report;
+    assert(tfs_fsck(&report) != -1);
+    assert(report.orphan_blocks == 0 && report.lost_blocks == 0 && report.damaged_inodes == 0);
+    assert(free_blocks() == BLOCKS - 1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
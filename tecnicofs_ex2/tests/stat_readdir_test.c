@@ -0,0 +1,126 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Gets the attributes of files of every kind (empty, inline, with blocks
+    and holes, with small writes still gathered) by name and by handle, and
+    lists the directory with them, whole and a window of slots at a time,
+    as files are unlinked and renamed (and a directory too large to be read
+    at once).
+    Note: This test uses TecnicoFS as a library. */
+
+#define FILES (16)
+
+static char block[BLOCK_SIZE];
+
+static tfs_dirent_t const *find(tfs_dirent_t const *entries, ssize_t n, char const *name) {
+    for (ssize_t i = 0; i < n; i++) {
+        if (strcmp(entries[i].name, name) == 0) {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.write_buffer_size = WRITE_BUFFER_SIZE;
+    assert(tfs_init(&params) != -1);
+    tfs_stat_t st;
+
+    /* empty, inline, sparse with blocks */
+    int f = tfs_open("/empty", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_fstat(f, &st) != -1);
+    assert(st.size == 0 && st.blocks == 0 && st.inumber == tfs_lookup("/empty"));
+    assert(tfs_close(f) != -1);
+    f = tfs_open("/small", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "tiny", 4) == 4);
+    assert(tfs_close(f) != -1);
+    assert(tfs_stat("/small", &st) != -1);
+    assert(st.size == 4 && st.blocks == 0);
+    f = tfs_open("/sparse", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, block, sizeof(block)) == sizeof(block));
+    assert(tfs_seek(f, 3 * BLOCK_SIZE) != -1);
+    assert(tfs_write(f, block, 1) == 1);
+    assert(tfs_fstat(f, &st) != -1);
+    assert(st.size == 3 * BLOCK_SIZE + 1 && st.blocks == 2);
+
+    /* small writes still gathered are counted */
+    assert(tfs_write(f, "abc", 3) == 3);
+    assert(tfs_stat("/sparse", &st) != -1);
+    assert(st.size == 3 * BLOCK_SIZE + 4);
+    assert(tfs_close(f) != -1);
+    assert(tfs_stat("/missing", &st) == -1 && tfs_stat("/", &st) == -1);
+    assert(tfs_fstat(-1, &st) == -1);
+
+    /* the whole directory, with the attributes */
+    char path[MAX_FILE_NAME];
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "/f%02d", i);
+        f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, block, (size_t)i) == i);
+        assert(tfs_close(f) != -1);
+    }
+    static tfs_dirent_t entries[256];
+    ssize_t n = tfs_readdir_plus(entries, 256);
+    assert(n == FILES + 3);
+    tfs_dirent_t const *sparse = find(entries, n, "sparse");
+    tfs_dirent_t const *empty = find(entries, n, "empty");
+    assert(sparse != NULL && sparse->stat.size == 3 * BLOCK_SIZE + 4 && sparse->stat.blocks == 2);
+    assert(empty != NULL && empty->stat.size == 0);
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "f%02d", i);
+        tfs_dirent_t const *e = find(entries, n, path);
+        assert(e != NULL && e->stat.size == (size_t)i && e->stat.inumber != -1);
+    }
+    assert(tfs_readdir_plus(entries, 5) == 5);
+
+    /* a window at a time, as the entries are unlinked and renamed */
+    assert(tfs_unlink("/f03") != -1);
+    assert(tfs_rename("/f04", "/renamed") != -1);
+    size_t slots;
+    ssize_t listed = 0;
+    for (size_t first = 0;; first += 4) {
+        ssize_t got = tfs_readdir_slots(first, 4, entries + listed, &slots);
+        assert(got >= 0 && got <= 4);
+        listed += got;
+        if (first + 4 >= slots) {
+            break;
+        }
+    }
+    assert(slots == MAX_DIR_ENTRIES);
+    assert(listed == FILES + 2);
+    assert(find(entries, listed, "f03") == NULL && find(entries, listed, "f04") == NULL);
+    tfs_dirent_t const *renamed = find(entries, listed, "renamed");
+    assert(renamed != NULL && renamed->stat.size == 4);
+    assert(tfs_readdir_slots(slots, 4, entries, &slots) == 0);
+    assert(tfs_destroy() != -1);
+
+    /* a directory of more entries than a listing reads at once */
+    params.block_size = 4096;
+    params.max_inode_count = 4 * LIST_DIR_BATCH;
+    assert(tfs_init(&params) != -1);
+    int files = 2 * LIST_DIR_BATCH + 8;
+    for (int i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "/g%03d", i);
+        f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1 && tfs_close(f) != -1);
+    }
+    assert(tfs_readdir_plus(entries, 256) == files);
+    n = tfs_readdir_slots(LIST_DIR_BATCH / 2, LIST_DIR_BATCH + 3, entries, &slots);
+    assert(n == LIST_DIR_BATCH + 3);
+    for (ssize_t i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "g%03d", (int)i + LIST_DIR_BATCH / 2);
+        assert(strcmp(entries[i].name, path) == 0);
+    }
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Unlinks and renames files: an unlinked file stays readable through the
+    handles already open and is freed with the last one, freed directory
+    entries and i-nodes are reused, and a rename replaces an existing file.
+    Note: This test uses TecnicoFS as a library. */
+
+int main() {
+    char buffer[16];
+
+    tfs_params params = tfs_default_params();
+    params.max_inline_size = 0; /* every written file takes a block */
+    params.max_inode_count = 4;
+    params.max_block_count = 4;
+    assert(tfs_init(&params) != -1);
+
+    /* unknown names */
+    assert(tfs_unlink("/none") == -1);
+    assert(tfs_rename("/none", "/other") == -1);
+
+    /* an open file outlives its name */
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "hello", 5) == 5);
+    int g = tfs_open("/f", 0);
+    assert(g != -1);
+    assert(tfs_unlink("/f") != -1);
+    assert(tfs_lookup("/f") == -1);
+    assert(tfs_open("/f", 0) == -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_read(g, buffer, sizeof(buffer)) == 5);
+    assert(memcmp(buffer, "hello", 5) == 0);
+
+    /* while /f is still open, its i-node and block are taken */
+    int a = tfs_open("/a", TFS_O_CREAT);
+    int b = tfs_open("/b", TFS_O_CREAT);
+    assert(a != -1 && b != -1);
+    assert(tfs_write(a, "a", 1) == 1);
+    assert(tfs_write(b, "b", 1) == 1);
+    assert(tfs_open("/c", TFS_O_CREAT) == -1);
+    assert(tfs_close(g) != -1);
+    int c = tfs_open("/c", TFS_O_CREAT);
+    assert(c != -1);
+    assert(tfs_write(c, "c", 1) == 1);
+    assert(tfs_close(a) != -1 && tfs_close(b) != -1 && tfs_close(c) != -1);
+
+    /* a rename replaces the existing file, freeing it */
+    assert(tfs_rename("/a", "/a") != -1);
+    assert(tfs_rename("/a", "/b") != -1);
+    assert(tfs_lookup("/a") == -1);
+    f = tfs_open("/b", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 1 && buffer[0] == 'a');
+    assert(tfs_close(f) != -1);
+    f = tfs_open("/d", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "d", 1) == 1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_rename("/d", "/") == -1);
+
+    /* creating and unlinking many more files than fit at once */
+    char path[MAX_FILE_NAME];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(path, sizeof(path), "/churn%d", i);
+        assert(tfs_unlink("/d") != -1);
+        f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, "x", 1) == 1);
+        assert(tfs_close(f) != -1);
+        assert(tfs_rename(path, "/d") != -1);
+    }
+
+    fsck_report_t report;
+    assert(tfs_fsck(&report) != -1);
+    assert(report.orphan_blocks == 0 && report.orphan_inodes == 0 && report.dangling_entries == 0);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
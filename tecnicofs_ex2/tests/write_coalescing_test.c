@@ -0,0 +1,118 @@
+#include "fs/metrics.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Appends many small records and checks that they are written together,
+    yet read back, appended to and truncated as if written one by one; the
+    writes through two handles of a file apply in order, and gathered writes
+    that find the FS full fail the handle's next write or close.
+    Note: This test uses TecnicoFS as a library. */
+
+#define RECORDS (1000)
+#define RECORD_SIZE (16)
+#define LOG_SIZE (RECORDS * RECORD_SIZE)
+
+static char buffer[2 * LOG_SIZE];
+
+static void record(char *to, int i) {
+    char text[RECORD_SIZE + 1];
+    snprintf(text, sizeof(text), "record %07d\n", i);
+    memcpy(to, text, RECORD_SIZE);
+}
+
+static void assert_contents(char const *path, char const *expected, size_t len) {
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    memset(buffer, 0, sizeof(buffer));
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)len);
+    assert(memcmp(buffer, expected, len) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.write_buffer_size = WRITE_BUFFER_SIZE;
+    params.max_block_count = 32;
+    assert(tfs_init(&params) != -1);
+
+    /* small appends are gathered, and read back as written */
+    static char expected[LOG_SIZE + 8];
+    uint64_t flushes = metrics_counter(METRIC_WRITE_FLUSH);
+    uint64_t coalesced = metrics_counter(METRIC_WRITE_COALESCED);
+    int f = tfs_open("/log", TFS_O_CREAT | TFS_O_APPEND);
+    assert(f != -1);
+    for (int i = 0; i < RECORDS; i++) {
+        record(expected + i * RECORD_SIZE, i);
+        assert(tfs_write(f, expected + i * RECORD_SIZE, RECORD_SIZE) == RECORD_SIZE);
+    }
+    assert(metrics_counter(METRIC_WRITE_COALESCED) - coalesced == RECORDS);
+    assert(metrics_counter(METRIC_WRITE_FLUSH) - flushes <= LOG_SIZE / WRITE_BUFFER_SIZE);
+    assert_contents("/log", expected, LOG_SIZE);
+
+    /* appending through another handle starts after the gathered writes */
+    assert(tfs_write(f, "tail", 4) == 4);
+    int g = tfs_open("/log", TFS_O_APPEND);
+    assert(g != -1);
+    assert(tfs_write(g, "more", 4) == 4);
+    assert(tfs_close(g) != -1);
+    assert(tfs_close(f) != -1);
+    memcpy(expected + LOG_SIZE, "tailmore", 8);
+    assert_contents("/log", expected, sizeof(expected));
+
+    /* overlapping writes through two handles apply in order */
+    f = tfs_open("/order", TFS_O_CREAT);
+    g = tfs_open("/order", 0);
+    assert(f != -1 && g != -1);
+    assert(tfs_write(f, "aaaa", 4) == 4);
+    assert(tfs_seek(g, 2) != -1);
+    assert(tfs_write(g, "bb", 2) == 2);
+    assert(tfs_write(f, "cc", 2) == 2);
+    assert(tfs_close(g) != -1);
+    assert_contents("/order", "aabbcc", 6);
+
+    /* gathered writes wait until old enough, or are dropped by a truncate */
+    flushes = metrics_counter(METRIC_WRITE_FLUSH);
+    assert(tfs_write(f, "dd", 2) == 2);
+    assert(tfs_flush_writes(UINT64_MAX) != -1);
+    assert(metrics_counter(METRIC_WRITE_FLUSH) == flushes);
+    assert(tfs_flush_writes(0) != -1);
+    assert(metrics_counter(METRIC_WRITE_FLUSH) == flushes + 1);
+    assert(tfs_write(f, "ee", 2) == 2);
+    g = tfs_open("/order", TFS_O_TRUNC);
+    assert(g != -1);
+    assert(tfs_close(g) != -1);
+    assert(tfs_close(f) != -1);
+    assert_contents("/order", "", 0);
+
+    /* with the FS full, gathered writes fail the handle's next write or
+     * close */
+    static char block[BLOCK_SIZE];
+    f = tfs_open("/filler", TFS_O_CREAT);
+    assert(f != -1);
+    while (tfs_write(f, block, sizeof(block)) == sizeof(block)) {
+    }
+    assert(tfs_close(f) != -1);
+    f = tfs_open("/full", TFS_O_CREAT);
+    assert(f != -1);
+    for (int i = 0; i < 64; i++) {
+        assert(tfs_write(f, expected, RECORD_SIZE) == RECORD_SIZE);
+    }
+    assert(tfs_flush_writes(0) == -1);
+    assert(tfs_write(f, expected, RECORD_SIZE) == -1);
+    for (int i = 0; i < 64; i++) {
+        assert(tfs_write(f, expected, RECORD_SIZE) == RECORD_SIZE);
+    }
+    assert(tfs_close(f) == -1);
+
+    fsck_report_t report;
+    assert(tfs_fsck(&report) != -1);
+    assert(report.orphan_blocks == 0 && report.lost_blocks == 0 && report.damaged_inodes == 0);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}